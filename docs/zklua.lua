@@ -186,7 +186,7 @@ function acl_completion(rc, acl, stat, data) end
 --triggered this function will be invoked.
 --@param recv_timeout the recv timeout.
 --@param clientid the id of a previously established session that this
---client will be reconnecting to. Pass 0 if not reconnecting to a previous
+--client will be reconnecting to. Pass nil if not reconnecting to a previous
 --session. Clients can access the session id of an established, valid,
 --connection by calling  client_id. If the session corresponding to
 --the specified clientid has expired, or if the clientid is invalid for
@@ -223,9 +223,34 @@ function close(zh) end
 
 ---return the client session id.
 --only valid if the connections is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE).
+--@return a table with client_id (the session id as a number, which may lose
+--precision), session_id (the exact session id as a hex string) and passwd
+--(the 16-byte session password, may contain NUL bytes). The table can be
+--passed to  init as clientid.
 function client_id(zh) end
 
 
+---save the session of the current connection to a file.
+--The session id and password are stored in a binary-safe record, written to
+--a temporary file readable by the owner only, synced to disk and renamed into
+--place. Anyone able to read the file can take the session over. A restarted process can pass
+--the result of  load_session to  init to reattach to the session before it
+--expires, keeping its ephemeral nodes and watches alive.
+--@param zh the zookeeper handle obtained by a call to  init
+--@param filename the file to write.
+--@return ZOK on success, ZINVALIDSTATE if there is no established session yet,
+--ZSYSTEMERROR if the file could not be written.
+function save_session(zh, filename) end
+
+
+---load a session saved by  save_session.
+--@param filename the file to read.
+--@return a clientid table to pass to  init, or nil and an error message if
+--the file is missing or invalid. Wrap the call in parentheses when passing it
+--to  init directly, e.g. zklua.init(host, fn, timeout, (zklua.load_session(f))).
+function load_session(filename) end
+
+
 ---return the timeout for this session.
 --only valid if the connections is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE).
 --This value may change after a server re-connect.
@@ -263,6 +288,9 @@ function get_connected_host(zh) end
 --separating ancestors of the node.
 --@param value The data to be stored in the node.
 --@param acl The initial ACL of the node. The ACL must not be null or empty.
+--A table of {perms, scheme, id} entries, or an ACL returned by  acl or one of
+--ZOO_OPEN_ACL_UNSAFE, ZOO_READ_ACL_UNSAFE and ZOO_CREATOR_ALL_ACL, which
+--are not parsed again.
 --@param flags this parameter can be set to 0 for normal create or an OR
 --of the Create Flags.
 --@param string_completion the routine to invoke when the request completes. The completion
@@ -480,12 +508,16 @@ function aget_children(zh, path, watch, strings_completion, data) end
 --ZNOAUTH the client does not have permission.
 --@param data the data that will be passed to the completion routine when
 --the function completes.
+--@param snapshot an optional children snapshot (see  children_snapshot). If
+--given, the listing is diffed against it in C and the completion is called as
+--strings_completion(rc, added, removed, data) with the names added and
+--removed since the snapshot, which then holds the new listing.
 --@return ZOK on success or one of the following errcodes on failure:
 --ZBADARGUMENTS - invalid input parameters
 --ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
 --ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
 --
-function awget_children(zh, path, watcher_fn, watcherctx, strings_completion, data) end
+function awget_children(zh, path, watcher_fn, watcherctx, strings_completion, data, snapshot) end
 --
 --
 ---lists the children of a node, and get the parent stat.
@@ -589,6 +621,9 @@ function aget_acl(zh, path, acl_completion, data) end
 --separating ancestors of the node.
 --@param version the expected version of the path.
 --@param acl the acl to be set on the path.
+--A table of {perms, scheme, id} entries, or an ACL returned by  acl or one of
+--ZOO_OPEN_ACL_UNSAFE, ZOO_READ_ACL_UNSAFE and ZOO_CREATOR_ALL_ACL, which
+--are not parsed again.
 --@param void_completion the routine to invoke when the request completes. The completion
 --will be triggered with one of the following codes passed in as the rc argument:
 --ZOK operation completed successfully
@@ -608,7 +643,8 @@ function aset_acl(zh, path, version, acl, void_completion, data) end
 
 ---return an error string.
 --
---@param c return code
+--@param c return code, either a zookeeper error or a zklua one such as
+--ZKLUA_THROTTLED
 --@return string corresponding to the return code
 --
 function zerror(c) end
@@ -691,6 +727,9 @@ function deterministic_conn_order(yesorno) end
 --@param path The name of the node. Expressed as a file name with slashes
 --separating ancestors of the node.
 --@param acl The initial ACL of the node. The ACL must not be null or empty.
+--A table of {perms, scheme, id} entries, or an ACL returned by  acl or one of
+--ZOO_OPEN_ACL_UNSAFE, ZOO_READ_ACL_UNSAFE and ZOO_CREATOR_ALL_ACL, which
+--are not parsed again.
 --@param flags this parameter can be set to 0 for normal create or an OR
 --of the Create Flags
 --@return 1).one of the following codes are returned, 2) path buffer of the node:
@@ -873,8 +912,19 @@ function set2(zh, path, buffer, version) end
 --separating ancestors of the node.
 --@param watch if nonzero, a watch will be set at the server to notify.
 --the client if the node changes.
---@param strings return value of children paths.
---@return the return code of the function.
+--@param opts an optional table selecting the children returned, applied in
+--C so that only those become lua strings: prefix keeps the names starting
+--with it, pattern the names matching the shell pattern (see fnmatch), sort
+--orders them by the 10 digit sequence suffix ("sequence") or by name
+--("name"), offset skips that many of them and limit returns at most that
+--many. A slice of the first few children in order is selected in one pass,
+--e.g. {sort = "sequence", limit = 1} gives the lowest sequence node.
+--With lazy set to true the children are returned as a userdata keeping the
+--listing in C instead of a table: #children is the number of children,
+--children[i] the i-th child and children:iter() iterates over them like
+--ipairs. Lua strings are only created for the children accessed, and the
+--listing is freed when the userdata is garbage collected.
+--@return the return code of the function and the array of the children.
 --ZOK operation completed successfully.
 --ZNONODE the node does not exist.
 --ZNOAUTH the client does not have permission.
@@ -882,7 +932,7 @@ function set2(zh, path, buffer, version) end
 --ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE.
 --ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
 --
-function get_children(zh, path, watch, strings) end
+function get_children(zh, path, watch, opts) end
 
 
 ---lists the children of a node synchronously.
@@ -898,6 +948,18 @@ function get_children(zh, path, watch, strings) end
 --@param watcherctx user specific data, will be passed to the watcher callback.
 --Unlike the global context set by  init, this watcher context
 --is associated with the given instance of the watcher only.
+--@param opts an optional table selecting the children returned, applied in
+--C so that only those become lua strings: prefix keeps the names starting
+--with it, pattern the names matching the shell pattern (see fnmatch), sort
+--orders them by the 10 digit sequence suffix ("sequence") or by name
+--("name"), offset skips that many of them and limit returns at most that
+--many. A slice of the first few children in order is selected in one pass,
+--e.g. {sort = "sequence", limit = 1} gives the lowest sequence node.
+--With lazy set to true the children are returned as a userdata keeping the
+--listing in C instead of a table: #children is the number of children,
+--children[i] the i-th child and children:iter() iterates over them like
+--ipairs. Lua strings are only created for the children accessed, and the
+--listing is freed when the userdata is garbage collected.
 --@return 1): the return code of the function, 2): value of children paths.
 --ZOK operation completed successfully.
 --ZNONODE the node does not exist.
@@ -906,7 +968,7 @@ function get_children(zh, path, watch, strings) end
 --ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE.
 --ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
 --
-function wget_children(zh, path, watcher_fn, watcherctx) end
+function wget_children(zh, path, watcher_fn, watcherctx, opts) end
 
 
 ---lists the children of a node and get its stat synchronously.
@@ -918,6 +980,18 @@ function wget_children(zh, path, watcher_fn, watcherctx) end
 --separating ancestors of the node.
 --@param watch if nonzero, a watch will be set at the server to notify
 --the client if the node changes.
+--@param opts an optional table selecting the children returned, applied in
+--C so that only those become lua strings: prefix keeps the names starting
+--with it, pattern the names matching the shell pattern (see fnmatch), sort
+--orders them by the 10 digit sequence suffix ("sequence") or by name
+--("name"), offset skips that many of them and limit returns at most that
+--many. A slice of the first few children in order is selected in one pass,
+--e.g. {sort = "sequence", limit = 1} gives the lowest sequence node.
+--With lazy set to true the children are returned as a userdata keeping the
+--listing in C instead of a table: #children is the number of children,
+--children[i] the i-th child and children:iter() iterates over them like
+--ipairs. Lua strings are only created for the children accessed, and the
+--listing is freed when the userdata is garbage collected.
 --@return 1): the return code of the function, 2): value of children paths, 3): value of node stat.
 --ZOK operation completed successfully.
 --ZNONODE the node does not exist.
@@ -926,7 +1000,7 @@ function wget_children(zh, path, watcher_fn, watcherctx) end
 --ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE.
 --ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
 --
-function get_children2(zh, path, watch) end
+function get_children2(zh, path, watch, opts) end
 
 
 ---lists the children of a node and get its stat synchronously.
@@ -944,6 +1018,18 @@ function get_children2(zh, path, watch) end
 --@param watcherctx user specific data, will be passed to the watcher callback.
 --Unlike the global context set by  init, this watcher context
 --is associated with the given instance of the watcher only.
+--@param opts an optional table selecting the children returned, applied in
+--C so that only those become lua strings: prefix keeps the names starting
+--with it, pattern the names matching the shell pattern (see fnmatch), sort
+--orders them by the 10 digit sequence suffix ("sequence") or by name
+--("name"), offset skips that many of them and limit returns at most that
+--many. A slice of the first few children in order is selected in one pass,
+--e.g. {sort = "sequence", limit = 1} gives the lowest sequence node.
+--With lazy set to true the children are returned as a userdata keeping the
+--listing in C instead of a table: #children is the number of children,
+--children[i] the i-th child and children:iter() iterates over them like
+--ipairs. Lua strings are only created for the children accessed, and the
+--listing is freed when the userdata is garbage collected.
 --@return 1): the return code of the function, 2): value of children paths, 3): value of node stat.
 --ZOK operation completed successfully.
 --ZNONODE the node does not exist.
@@ -952,7 +1038,7 @@ function get_children2(zh, path, watch) end
 --ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE.
 --ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
 --
-function wget_children2(zh, path, watcher_fn , watcherctx) end
+function wget_children2(zh, path, watcher_fn , watcherctx, opts) end
 
 
 ---gets the acl associated with a node synchronously.
@@ -978,6 +1064,9 @@ function get_acl(zh, path) end
 --separating ancestors of the node.
 --@param version the expected version of the path.
 --@param acl the acl to be set on the path.
+--A table of {perms, scheme, id} entries, or an ACL returned by  acl or one of
+--ZOO_OPEN_ACL_UNSAFE, ZOO_READ_ACL_UNSAFE and ZOO_CREATOR_ALL_ACL, which
+--are not parsed again.
 --@return the return code for the function call.
 --ZOK operation completed successfully.
 --ZNONODE the node does not exist.
@@ -989,3 +1078,682 @@ function get_acl(zh, path) end
 --ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
 --
 function set_acl(zh, path, version, acl) end
+
+
+---stores a value larger than the znode limit synchronously.
+--
+--The value is split into chunk children of path and path itself holds a small
+--manifest describing the current generation. Chunks of the new generation are
+--written first with pipelined creates under names no reader knows about yet,
+--then a single set switches the manifest (checked against the version that
+--was read), so readers see either the old or the new value, never a mix of
+--both. The chunks of the previous generation are deleted afterwards, on a
+--best effort basis. When the switch gets no reply the manifest is read again
+--to tell whether it was applied, the new chunks are only deleted if not.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the name of the manifest node, created if it does not exist.
+--@param value the value to store, may be of any size.
+--@param acl the acl used for the manifest node (when created) and the chunks.
+--A table of {perms, scheme, id} entries, or an ACL returned by  acl or one of
+--ZOO_OPEN_ACL_UNSAFE, ZOO_READ_ACL_UNSAFE and ZOO_CREATOR_ALL_ACL, which
+--are not parsed again.
+--@param chunk_size optional size of each chunk, defaults to 512KB and must
+--stay below the server jute.maxbuffer.
+--@return the return code of the function call.
+--ZOK operation completed successfully.
+--ZBADVERSION the manifest was updated concurrently, nothing was changed.
+--ZNOAUTH the client does not have permission.
+--ZBADARGUMENTS - invalid input parameters.
+--ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE.
+--ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
+--
+function put_large(zh, path, value, acl, chunk_size) end
+
+
+---gets a value stored by put_large synchronously.
+--
+--The chunks of the generation named by the manifest are fetched in parallel
+--with pipelined gets and reassembled. If a newer generation is committed while
+--reading, the read starts over with the new manifest. Nodes that do not hold a
+--manifest are returned as is, like  get would.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the name of the manifest node.
+--@return 1): return value of the function call, 2): the whole value, 3): stat
+--of the manifest node, its dataLength is set to the length of the whole value.
+--ZOK operation completed successfully.
+--ZNONODE the node does not exist, or kept changing while reading.
+--ZNOAUTH the client does not have permission.
+--ZBADARGUMENTS - invalid input parameters
+--ZINVALIDSTATE - zhandle state is either in ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE.
+--ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory.
+--
+function get_large(zh, path) end
+
+
+---exports a subtree into a snapshot file synchronously.
+--
+--The subtree is walked level by level, each level being one round of
+--pipelined gets and children listings. The file holds a header, an index of
+--every node sorted by path (with its stat) and the paths and data, laid out so
+--that  import_tree can map it and serve lookups without parsing. Integers are
+--stored in host byte order, a file is only valid on hosts with the same
+--byte order. The file is written to filename..".tmp" and renamed into place.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param root the root of the subtree to export.
+--@param filename the snapshot file to write.
+--@return 1): return value of the function call, 2): number of nodes exported.
+--ZOK operation completed successfully.
+--ZNONODE the root does not exist.
+--ZNOAUTH the client does not have permission.
+--ZSYSTEMERROR the file could not be written.
+--
+function export_tree(zh, root, filename) end
+
+
+---maps a snapshot file written by  export_tree.
+--
+--Reads are served from the mapped file right away, so startup does not depend
+--on zookeeper round trips. tree:sync(zh) then catches up with the server in
+--the background: every node is checked with pipelined exists requests, nodes
+--whose mzxid changed are fetched again, deleted nodes are hidden and nodes
+--created since the export are discovered through their parent's pzxid. The
+--changes are kept in memory on top of the file.
+--
+--The returned object has the following methods:
+--tree:get(path) returns the same results as  get.
+--tree:exists(path) returns the same results as  exists.
+--tree:get_children(path) returns the same results as  get_children.
+--tree:sync(zh) starts catching up with the server and returns ZOK.
+--tree:pending() returns the number of catch-up requests still in flight.
+--tree:count() returns the number of nodes stored in the file.
+--tree:close() waits for pending catch-up requests and unmaps the file, it
+--is also called when the object is garbage collected.
+--
+--@param filename the snapshot file to map.
+--@return the tree object, or nil and an error message.
+function import_tree(filename) end
+
+
+---creates a shared-memory config cache owned by the calling process.
+--
+--One owner process holds the zookeeper session and the watches and publishes
+--znode values into a POSIX shared-memory region. Every other process on the
+--host attaches with  shm_attach and reads the region without any lock: each
+--slot is protected by a sequence counter (seqlock) that readers check before
+--and after copying, retrying if the owner wrote the slot meanwhile. Reads are a
+--memory lookup and the ensemble only sees one session and one watch per path.
+--
+--The returned object has the following methods:
+--shm:get(path) returns the value and its version (mzxid), or nil if the
+--path has not been published or has been deleted.
+--shm:generation() returns a counter bumped on every publish, readers can
+--compare it to skip lookups when nothing changed.
+--shm:publish(path, value, version) publishes a value by hand, value nil marks
+--the path deleted. Owner only.
+--shm:watch(zh, path) reads path with a watch and republishes it on every
+--change, entirely in C. Owner only.
+--shm:close() detaches from the region, it is also called when the object is
+--garbage collected.
+--
+--A watched path is set again after a connection loss or a timeout. When its
+--watch stops for good (session expired, other errors) the path is marked
+--deleted, so readers miss rather than read a value that is no longer kept up
+--to date.
+--
+--If the region already exists with the same layout, e.g. left by an owner
+--that restarted, it is taken over without being cleared and attached readers
+--keep their values. A region with another layout is an error.
+--
+--@param name the shared memory name, e.g. "/zklua-config".
+--@param slots optional number of slots (distinct paths), defaults to 1024.
+--@param slot_size optional maximum value size in bytes, defaults to 4096.
+--Larger values are rejected with ZBADARGUMENTS.
+--@return the cache object, or nil and an error message.
+function shm_create(name, slots, slot_size) end
+
+
+---attaches read-only to a shared-memory cache created by  shm_create.
+--@param name the shared memory name used by the owner.
+--@return the cache object, or nil and an error message.
+function shm_attach(name) end
+
+
+---bounds the number of async requests in flight on a handle.
+--
+--Without a window every a* call is sent right away and a burst can pile up
+--thousands of requests on the client and the server. With a window the a*
+--calls share an in-flight limit that adapts to the observed latency (AIMD):
+--it grows by about one slot per window of completions and is halved, at most
+--once per round trip, when the smoothed latency goes over target_latency or a
+--request fails with ZCONNECTIONLOSS or ZOPERATIONTIMEOUT.
+--
+--When the window is full, mode decides what an a* call does:
+--"wait" blocks until a slot is free. Calls made from a completion or a
+--watcher never block and are admitted over the limit.
+--"queue" keeps the request in a bounded queue and sends it as soon as a slot
+--is free, the call returns ZOK. A queued request that can not be sent then
+--completes with the error of the send, and requests still queued when the
+--handle is closed complete with ZCLOSING.
+--"fail" returns ZKLUA_THROTTLED without sending the request. A queue that is
+--full also returns ZKLUA_THROTTLED.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param opts a table with the optional fields mode (default "wait"), initial
+--(64), min (4), max (1024), target_latency in milliseconds (100) and
+--queue_size (1024), or nil to remove the limit.
+--@return ZOK
+function set_inflight_window(zh, opts) end
+
+
+---returns the state of the in-flight window of a handle.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@return nil if no window is set, otherwise a table with the fields window
+--(current limit), inflight, queued, latency (smoothed completion latency in
+--milliseconds) and throttled (number of requests rejected so far).
+function inflight_stats(zh) end
+
+
+---shares one server round trip between identical async reads.
+--
+--While an  aexists,  aget,  aget_children or  aget_children2 request is in
+--flight, later calls with the same path, the same function and the same
+--watch flag do not go to the server: they wait for the reply of the first one
+--and every completion is called with it, each with its own data. Writes sent
+--on the handle (sync or async) end the sharing for their path and for the
+--children of its parent, so a read issued after a write never gets a reply
+--that may predate it. The aw* variants are never shared.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param enabled true to turn coalescing on, false to turn it off.
+--@return ZOK
+function set_read_coalescing(zh, enabled) end
+
+
+---merges async writes to the same path into multi-op batches.
+--
+--Once enabled,  aset calls with version -1 are not sent right away. For each
+--path only the last value written during the flush window is kept (last
+--writer wins), then a background thread sends every dirty path in one
+--zoo_amulti request of at most max_batch writes. Every aset caller still gets
+--its own completion: callers whose value was overwritten by a later aset on
+--the same path get the result of the write that was actually sent. If the
+--server rejects one write of a batch, the others are sent again one by one so
+--that each path reports its own result.
+--
+--Writes with an explicit version are never merged. Any other request on a
+--path, async or sync, first sends the write held for that path, so it can not
+--overtake it. Merged writes take their slot in the in-flight window (see
+--set_inflight_window) when aset is called, like any other request. Calling the
+--function again or closing the handle first sends the pending writes.
+--
+--Completions always run on the thread that runs the other completions. A
+--write the client refuses to send (e.g. the session expired) is reported from
+--there, or when the combiner is turned off or the handle closed.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param opts a table with the optional fields window, the flush window in
+--milliseconds (default 5), and max_batch (default 128), or nil to turn the
+--combiner off.
+--@return ZOK, or ZSYSTEMERROR if the flusher thread could not be started.
+function set_write_combining(zh, opts) end
+
+
+---sets a deadline on the synchronous calls made with a handle.
+--
+--By default  create,  delete,  exists,  get,  set,  get_children,  get_acl,
+--set_acl and their variants block until the zookeeper client answers, which
+--can take a whole session timeout while it reconnects. With a deadline they
+--are sent through the async API instead and give up after timeout
+--milliseconds, returning ZKLUA_TIMEDOUT. The request may still be applied by
+--the server, its late reply is dropped.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param timeout the deadline in milliseconds, 0 or nil to wait forever.
+--@return ZOK
+function set_timeout(zh, timeout) end
+
+
+---closes a zookeeper handle without blocking.
+--
+--zookeeper_close is run on a thread of its own, so the call returns at once.
+--The handle can not be used any more. Requests still in flight complete in C
+--and their completions are no longer called, the same goes for the global
+--watcher.
+--
+--The returned object has the following methods:
+--closer:done() returns false while the session is being closed, then true and
+--the result of zookeeper_close.
+--closer:wait() blocks until the session is closed and returns the result of
+--zookeeper_close.
+--The object waits for the close to finish when it is garbage collected.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@return the closer object.
+function aclose(zh) end
+
+
+---closes a list of zookeeper handles in parallel.
+--
+--Every handle is closed as by  aclose, then the call waits for all of them,
+--so the whole teardown takes about as long as the slowest session.
+--
+--@param handles an array of zookeeper handles.
+--@return an array with the result of zookeeper_close for each handle, in
+--order, or ZBADARGUMENTS for a handle that was already closed.
+function close_all(handles) end
+
+
+---creates a lock manager holding named locks on one session.
+--
+--Each lock name maps to root/name, under which waiters create ephemeral
+--sequential nodes. Acquiring pipelines the create and the get_children of the
+--lock directory, the server answers both in order, so an uncontended acquire
+--takes one round trip. A contended waiter watches only the node right before
+--its own, so a release wakes a single waiter instead of all of them. The
+--watches of every lock on the session share one C watcher and never call into
+--lua, the manager scales to thousands of locks.
+--
+--Lock node names carry the session id and a serial number. When a create
+--fails with a connection loss the directory is listed again and the node is
+--found by that prefix, so a create whose reply was lost is not left behind.
+--Requests failing with a connection loss are retried until the timeout of
+--the call, which then returns ZKLUA_TIMEDOUT; releases are retried for a
+--second. A node that could not be found or deleted in time is deleted
+--before the next acquire on the session.
+--
+--The returned object has the following methods:
+--locks:lock(name, timeout) acquires the lock, waiting at most timeout
+--milliseconds (forever if nil). Returns ZOK, ZKLUA_TIMEDOUT, ZNODEEXISTS if
+--the manager already holds it, ZSESSIONEXPIRED, or another zookeeper error.
+--locks:trylock(name) is locks:lock(name, 0).
+--locks:rlock(name, timeout) acquires the lock shared, with a read- node. A
+--reader only waits for the nearest exclusive node ahead of it, so readers do
+--not contend with each other and an uncontended reader takes one round trip.
+--locks:wlock(name, timeout) acquires the lock exclusive with a write- node,
+--waiting for the node right before its own like locks:lock, with which it is
+--interchangeable. Both return what locks:lock returns, a timeout of 0 only
+--tries.
+--locks:unlock(name) releases the lock, shared or not, returns ZOK or ZNONODE if it is not
+--held. On another error, ZKLUA_TIMEDOUT included, the lock is still held.
+--locks:held(name) tells whether the manager holds the lock, without any
+--request to the server.
+--locks:count() returns the number of locks held.
+--locks:close() releases every lock, it is also called when the object is
+--garbage collected.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param root the parent path of the lock directories, created as needed.
+--@return the lock manager.
+function lock_manager(zh, root) end
+
+
+---creates a leader election candidate.
+--
+--Candidates are ephemeral sequential nodes under path. The candidate with the
+--lowest sequence number is the leader, every other one watches only the
+--candidate right before it, so a leader change wakes a single candidate. The
+--leadership state is kept in memory and updated by the watches: is_leader() is
+--a local read and never sends a request. Candidate names carry the session id
+--and a serial number, like lock nodes, so several candidates of one session
+--under the same path each find their own node after a connection loss.
+--
+--Leadership is lost when the session expires, and the candidate enters again
+--by itself if its node is deleted while the session lives. After an expiry,
+--election:enter(zh) joins again with a new handle.
+--
+--The returned object has the following methods:
+--election:enter(zh) starts running for leadership, on the handle the
+--election was created with or on zh if given. Returns ZOK or the error of the
+--create request.
+--election:leave() withdraws from the election and deletes the candidate node.
+--election:is_leader() returns true while this candidate is the leader.
+--election:node() returns the path of the candidate node, or nil.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the election path, created if needed.
+--@param opts an optional table with the fields on_gain and on_loss, functions
+--called with the election path when leadership is gained or lost, and data,
+--the value stored in the candidate node.
+--@return the election object, or nil and the error creating path.
+function election(zh, path, opts) end
+
+
+---creates a distributed queue object.
+--
+--Items are persistent sequential children of path. The item list is cached
+--sorted by sequence number and watched: it is only listed again once the
+--watch fires, so polling an empty queue sends no request at all.
+--
+--The returned object has the following methods:
+--queue:offer(value) adds an item, returns rc and the path of the item.
+--queue:offer_many(values) adds the strings of the array values with pipelined
+--creates, in order. Returns ZOK or the first error, and an array with the
+--path of each item, or false for the items that could not be created.
+--queue:take_batch(n, timeout) takes up to n items (default 1) from the head of
+--the queue. Each item is read and deleted with pipelined requests and is only
+--returned if the delete succeeded, items taken by another consumer meanwhile
+--are skipped. If the queue is empty the call waits up to timeout
+--milliseconds (default 0) for items. Returns rc and an array of payloads, in
+--queue order.
+--queue:size() returns the number of items in the cached list.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the queue path, created if needed.
+--@return the queue object, or nil and the error creating path.
+function queue(zh, path) end
+
+
+---creates a barrier object.
+--
+--The barrier is up while the node path exists.
+--
+--The returned object has the following methods:
+--barrier:hold() creates the barrier node, the parents are created if needed.
+--Returns ZOK, also if the barrier was already up.
+--barrier:release() deletes the barrier node. Returns ZOK, also if the barrier
+--was already down.
+--barrier:wait(timeout) waits up to timeout milliseconds (default -1, forever)
+--for the barrier node to be deleted, with a single watched exists request.
+--Returns ZOK, ZKLUA_TIMEDOUT or the error of the request.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the barrier node.
+--@return the barrier object.
+function barrier(zh, path) end
+
+
+---creates a double barrier object.
+--
+--Participants are ephemeral sequential children of path. The last one to
+--enter creates the node path/ready and the last one to leave deletes it, the
+--others watch it. Creating or deleting the participant node, reading the
+--number of children of path and watching the ready node are pipelined, so
+--entering and leaving take one round trip whatever the number of participants.
+--Participant nodes are named and recovered after a connection loss like the
+--nodes of  lock_manager.
+--
+--The returned object has the following methods:
+--dbarrier:enter(timeout) enters the barrier and waits up to timeout
+--milliseconds (default -1, forever) until size participants have entered. On
+--failure the participant node is deleted. Returns ZOK, ZKLUA_TIMEDOUT or the
+--error of the requests.
+--dbarrier:leave(timeout) leaves the barrier and waits up to timeout
+--milliseconds (default -1, forever) until every participant has left. The
+--number of participants is read again every second, so participants whose
+--session expired do not block the others. Returns ZOK, ZKLUA_TIMEDOUT or the
+--error of the requests.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the barrier path, created if needed.
+--@param size the number of participants.
+--@return the double barrier object, or nil and the error creating path.
+function double_barrier(zh, path, size) end
+
+
+---updates the data of a node with an optimistic read-modify-write.
+--
+--The node is read, transformed and written back with zklua.set2 guarded by
+--the version read. On ZBADVERSION the node is read again and the transform
+--re-run after a random backoff, so concurrent writers spread out. The whole
+--loop runs in C, the transform is the only call back into lua.
+--
+--If fn is a number the node holds a decimal counter and fn is added to it
+--without calling into lua at all, a node without data counts as 0.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the node to update.
+--@param fn a function(value, stat) returning the new value, or nil to leave
+--the node unchanged, or the number to add to a counter. For a missing node
+--created with opts.create fn is called with nil, nil.
+--@param opts an optional table with the fields:
+--retries, the number of retries after a conflict (default 16, -1 forever),
+--backoff and max_backoff, the base and the cap in milliseconds of the random
+--sleep before a retry (default 5 and 500, doubled on each retry),
+--create, true to create the node if it does not exist,
+--value and version, the data and version of the node if already known (e.g.
+--from a previous update), the first attempt then skips the read.
+--@return rc, the value written (a number for counters) or read if fn
+--returned nil, and the stat of the node. On failure only rc is returned,
+--ZBADVERSION once the retries are exhausted and ZBADARGUMENTS if a counter
+--node does not hold a number.
+function update(zh, path, fn, opts) end
+
+
+---creates a counting semaphore.
+--
+--Each permit taken is a lease, an ephemeral sequential child of path whose
+--name carries the time the lease expires at. The first permits live leases,
+--in sequence order, hold a permit. Acquiring pipelines the create of the lease
+--and the listing of path, so a free permit takes one round trip, and a
+--release is a single delete. Only the first waiter watches the children of
+--path, the watch being set by that same listing; every other waiter watches
+--the lease right before its own, and a waiter that gets its permit writes
+--"held" to its lease, so a release or an expiry wakes a single waiter. An
+--expired lease is deleted by the waiter right behind it, or by the first
+--waiter if it is among the holders, so a worker that hangs with its session
+--alive gives its permit back after its ttl. Lease expiry compares wall clocks, which should be kept in sync.
+--Leases are named and recovered after a connection loss like the nodes of
+-- lock_manager.
+--
+--The returned object has the following methods:
+--semaphore:acquire(timeout, ttl) takes a permit, waiting at most timeout
+--milliseconds (forever if nil, 0 only tries). The lease expires after ttl
+--milliseconds, never if nil or 0. Returns ZOK and the name of the lease, or
+--ZKLUA_TIMEDOUT, ZNONODE if the lease expired while waiting, or another
+--zookeeper error.
+--semaphore:release(lease) gives back the permit of the lease named lease.
+--Returns ZOK, ZNONODE if the lease had expired already, or ZBADARGUMENTS if
+--the lease is not held by this object.
+--semaphore:held() returns the number of leases held by this object.
+--semaphore:close() releases every lease, it is also called when the object
+--is garbage collected.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param path the semaphore path, created as needed.
+--@param permits the number of permits.
+--@return the semaphore object.
+function semaphore(zh, path, permits) end
+
+
+---creates a service discovery registry.
+--
+--Endpoints of the service name are ephemeral sequential children of
+--root/name holding their weight and payload. The endpoint list of a service
+--is fetched on first use and cached along with the payloads. Children and
+--data watches only mark the cache stale, it is brought up to date on the next
+--use with one listing and pipelined gets of the new or changed endpoints only.
+--While the server is unreachable the last known list keeps being served.
+--
+--The returned object has the following methods:
+--discovery:register(name, payload, weight) registers an endpoint of the
+--service name, removed when the session ends. weight defaults to 1. Returns
+--rc and the path of the endpoint node.
+--discovery:unregister(node) deletes the endpoint node returned by register.
+--discovery:pick(name, strategy) returns the payload of an endpoint of the
+--service, or nil if it has none. strategy is "round_robin" (the default),
+--"weighted" for a random pick proportional to the weights, or "lru" for the
+--endpoint picked least recently. Unless the cache is stale, picking makes
+--no request and allocates nothing.
+--discovery:endpoints(name) returns rc and an array of tables with the fields
+--node, payload and weight, one for each cached endpoint.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param root the parent path of the services.
+--@return the discovery object.
+function discovery(zh, root) end
+
+
+---creates a children snapshot.
+--
+--The snapshot keeps a children listing as a hash set, to find the children
+--that joined and left between two listings without comparing them in lua.
+--
+--The returned object has the following methods:
+--snapshot:diff(listing) replaces the listing kept by listing, an array of
+--names or a lazy listing returned by  get_children, and returns two arrays:
+--the names added and the names removed. It costs one hash lookup per name.
+--snapshot:count() returns the number of names kept.
+--snapshot:contains(name) tells whether name is in the listing kept.
+--A snapshot passed to  awget_children is updated by the completion.
+--
+--@param listing an optional initial listing.
+--@return the snapshot object.
+function children_snapshot(listing) end
+
+
+---parses an ACL once.
+--
+--Every call taking an ACL table parses and copies it again. The returned
+--object is parsed once and immutable, and is passed as is to the zookeeper
+--client by  create,  acreate,  set_acl,  aset_acl and  put_large. The
+--constants ZOO_OPEN_ACL_UNSAFE, ZOO_READ_ACL_UNSAFE and ZOO_CREATOR_ALL_ACL
+--are such objects for the ACLs of the same name. An entry whose perms is not
+--a combination of the ZOO_PERM_* bits, or whose scheme or id is not a string,
+--raises an error, here as in every call taking an ACL table.
+--
+--The returned object has the following methods:
+--acl:totable() returns the ACL as a table of {perms, scheme, id} entries.
+--#acl is the number of entries.
+--
+--@param acls a table of {perms, scheme, id} entries, or the entries as
+--separate arguments.
+--@return the ACL object.
+function acl(acls) end
+
+
+---waits for all the futures in a list.
+--
+--Every asynchronous call (acreate, adelete, aexists, awexists, aget,
+--awget, aset, aget_children, awget_children, aget_children2,
+--awget_children2, async, aget_acl, aset_acl) and add_auth called without a
+--completion returns a future after its return code. Calls given a
+--completion only return the return code and allocate no future.
+--The future is settled with the arguments the completion would have been
+--called with, without the trailing data.
+--
+--The future has the following methods:
+--future:wait([timeout]) waits at most timeout milliseconds, or forever,
+--and returns the results. It returns ZKLUA_TIMEDOUT if the future is still
+--pending, and ZKLUA_CANCELLED if it was cancelled.
+--future:then(fn) returns a future settled with what fn returns. fn is
+--called with the results of this future, right away if it is settled.
+--future:cancel() drops the delivery of the result: the then callbacks are
+--not called. It returns true if the future was pending.
+--future:done() tells whether the future is settled or cancelled.
+--
+--Completions and then callbacks run on the completion thread, which
+--must not wait on a future.
+--
+--@param futures a list of futures.
+--@param timeout the wait in milliseconds, forever by default.
+--@return ZOK, or ZKLUA_TIMEDOUT if a future is still pending, and a list
+--with what future:wait returns for each future, as a list.
+function wait_all(futures, timeout) end
+
+
+---waits for any of the futures in a list.
+--
+--@param futures a list of futures, see  wait_all.
+--@param timeout the wait in milliseconds, forever by default.
+--@return the index of the first settled future in the list and what
+--future:wait returns for it, or nil and ZKLUA_TIMEDOUT.
+function wait_any(futures, timeout) end
+
+
+---encodes and decodes the zookeeper wire protocol.
+--
+--zklua.jute is a codec for the jute packets of the zookeeper client
+--protocol, for drivers that run the session over their own non-blocking
+--sockets (for instance ngx.socket.tcp) instead of the threaded client.
+--It holds no state and starts no thread.
+--
+--zklua.jute.connect([opts]) encodes the handshake. opts may hold
+--protocol_version, last_zxid, timeout (10000 by default), session_id,
+--passwd and read_only.
+--zklua.jute.request(op, xid, ...) encodes a request. op is "create",
+--"delete", "exists", "get", "set", "get_children", "get_children2",
+--"sync", "check", "multi", "ping" or "close". The arguments after xid are
+--those of the synchronous call of the same name, without the handle. For
+--"multi" the argument is a list of operations, each one a list of "create",
+--"delete", "set" or "check" and its arguments. A ping without an xid uses
+--the ping xid, -2.
+--zklua.jute.frame(buffer, [pos]) returns the packet starting at pos in
+--the received bytes and the position after it, or nil while the packet
+--is incomplete, or nil and ZMARSHALLINGERROR if its length is too large.
+--zklua.jute.decode(packet, op) decodes a packet returned by frame. With
+--"connect" it returns the protocol version, the timeout, the session id,
+--the password and the read-only flag. Otherwise it returns the xid, the
+--zxid and the rc, followed when rc is ZOK by the results of the
+--asynchronous completion of op: a path for "create" and "sync", a stat for
+--"exists" and "set", a value and a stat for "get", a children list for
+--"get_children", a children list and a stat for "get_children2", and for
+--"multi" a list of {rc, path} or {rc, stat} tables. A packet with xid -1
+--is a watcher event, which is followed by its type, state and path. A
+--truncated packet returns nil and ZMARSHALLINGERROR.
+--
+--Requests get their own xids and are answered in order, so a driver
+--keeps the op of every xid it sent to decode the replies.
+function jute() end
+
+
+---opens a snapshot file of a zookeeper data dir.
+--
+--The file is mapped and read front to back without a zookeeper server, to
+--load a cache or audit data from a backup at disk speed.
+--
+--The returned reader has the following methods:
+--reader:next() returns the path, data, stat and ACL of the next node, in
+--the shapes of  get and  get_acl, or nil at the end of the snapshot, or
+--nil and an error message. Parents come before their children, so the
+--stat has no numChildren.
+--reader:iter() iterates over the nodes in a generic for.
+--reader:header() returns "snapshot", the file version and the dbid.
+--reader:sessions() returns a table of session id to session timeout.
+--reader:close() unmaps the file.
+--
+--@param filename the path of a snapshot.* file.
+--@return the reader, or nil and an error message.
+function read_snapshot(filename) end
+
+
+---opens a transaction log file of a zookeeper data dir.
+--
+--The returned reader has the methods of the one returned by
+--read_snapshot, except sessions. reader:next() returns the next
+--transaction as a table with session_id, cxid, zxid, time and type, the
+--opcode. The other fields depend on the type: path, data, acl and
+--parent_cversion for creates, with ephemeral for plain creates and ttl for
+--ttl creates; path for deletes; path, data and
+--version for set; path, acl and version for set_acl; path and version for
+--check; timeout for a new session; err for an error; and ops, a list of
+--transactions, for multi. Record checksums are verified. The log ends at
+--the first empty or incomplete record.
+--
+--@param filename the path of a log.* file.
+--@return the reader, or nil and an error message.
+function read_txnlog(filename) end
+
+
+---merges duplicate watch events delivered to the same watcher.
+--
+--Once enabled, watchers set on the handle afterwards do not get their events
+--right away. Events of the same type on the same path for the same watcher
+--function and watcher context are held for the window and delivered once,
+--with the state of the last one, and the watcher is called with a sixth
+--argument: the number of events merged. Session events are never held. Events
+--are still delivered on the thread that runs the watchers, not on a background
+--one. While the connection is down the events held wait for it to come back;
+--once the session has expired they are dropped.
+--
+--Calling the function again or closing the handle first delivers the events
+--held.
+--
+--@param zh the zookeeper handle obtained by a call to  init
+--@param opts a table with the optional field window, the coalescing window in
+--milliseconds (default 50), or nil to turn coalescing off.
+--@return ZOK, or ZSYSTEMERROR if the flusher thread could not be started.
+function set_watch_coalescing(zh, opts) end
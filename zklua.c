@@ -20,12 +20,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #ifndef WIN32
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
-_
+
 #include "zklua.h"
 
 static FILE *zklua_log_stream = NULL;
@@ -50,6 +56,29 @@ static int _zklua_build_acls(lua_State *L, const struct ACL_vector *acls);
 
 static int _zklua_unref(lua_State *L, int ref);
 
+static void _zklua_window_complete(zklua_completion_data_t *cdata, int rc);
+
+static void _zklua_window_finish(zklua_completion_data_t *cdata, int rc,
+        int on_completion_thread);
+
+static void _zklua_completion_data_fini(zklua_completion_data_t *cdata);
+
+static void _zklua_flight_land(zklua_completion_data_t *cdata);
+
+static int _zklua_completion_dropped(zklua_completion_data_t *cdata);
+
+static void _zklua_completion_call(zklua_completion_data_t *cdata, int nargs);
+
+static uint64_t _zklua_now_us(void);
+
+static int _zklua_watch_coalesce(zklua_local_watcher_context_t *wrapper,
+        int type, int state, const char *path);
+
+static void _zklua_watch_coalescer_release(zklua_watch_coalescer_t *coalescer);
+
+static int _zklua_snapshot_diff(lua_State *L, zklua_snapshot_t *snap,
+        char **names, int count);
+
 void watcher_dispatch(zhandle_t *zh, int type, int state,
         const char *path, void *watcherctx)
 {
@@ -83,6 +112,8 @@ void local_watcher_dispatch(zhandle_t *zh, int type, int state,
     int zhref = wrapper->zhref;
     int cbref = wrapper->cbref;
 
+    if (wrapper->coalescer != NULL
+            && _zklua_watch_coalesce(wrapper, type, state, path)) return;
     /** push lua watcher_fn onto the stack. */
     lua_rawgeti(L, LUA_REGISTRYINDEX, cbref);
     /* push zklua_handle_t onto the stack. */
@@ -105,65 +136,99 @@ void void_completion_dispatch(int rc, const void *data)
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
     lua_State *L = wrapper->L;
     const char *real_data = wrapper->data;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
     lua_pushinteger(L, rc);
     lua_pushstring(L, real_data);
-    lua_call(L, 2, 0);
-    free(wrapper);
+    _zklua_completion_call(wrapper, 2);
+    _zklua_completion_data_fini(wrapper);
 }
 
 void stat_completion_dispatch(int rc, const struct Stat *stat,
         const void *data)
 {
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
-    lua_State *L = wrapper->L;
-    const char *real_data = wrapper->data;
-    lua_pushinteger(L, rc);
-    _zklua_build_stat(L, stat);
-    lua_pushstring(L, real_data);
-    lua_call(L, 3, 0);
-    free(wrapper);
+    zklua_completion_data_t *next = NULL;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
+    _zklua_flight_land(wrapper);
+    do {
+        next = wrapper->next;
+        lua_pushinteger(wrapper->L, rc);
+        _zklua_build_stat(wrapper->L, stat);
+        lua_pushstring(wrapper->L, wrapper->data);
+        _zklua_completion_call(wrapper, 3);
+        _zklua_completion_data_fini(wrapper);
+    } while ((wrapper = next) != NULL);
 }
 
 void data_completion_dispatch(int rc, const char *value, int value_len,
         const struct Stat *stat, const void *data)
 {
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
-    lua_State *L = wrapper->L;
-    const char *real_data = wrapper->data;
-    lua_pushinteger(L, rc);
-    lua_pushlstring(L, value, value_len);
-    _zklua_build_stat(L, stat);
-    lua_pushstring(L, real_data);
-    lua_call(L, 4, 0);
-    free(wrapper);
+    zklua_completion_data_t *next = NULL;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
+    _zklua_flight_land(wrapper);
+    do {
+        next = wrapper->next;
+        lua_pushinteger(wrapper->L, rc);
+        /* value is NULL and value_len -1 for errors and nodes without data. */
+        if (value != NULL && value_len > 0) {
+            lua_pushlstring(wrapper->L, value, value_len);
+        } else {
+            lua_pushlstring(wrapper->L, "", 0);
+        }
+        _zklua_build_stat(wrapper->L, stat);
+        lua_pushstring(wrapper->L, wrapper->data);
+        _zklua_completion_call(wrapper, 4);
+        _zklua_completion_data_fini(wrapper);
+    } while ((wrapper = next) != NULL);
 }
 
 void strings_completion_dispatch(int rc, const struct String_vector *strings,
         const void *data)
 {
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
-    lua_State *L = wrapper->L;
-    const char *real_data = wrapper->data;
-    lua_pushinteger(L, rc);
-    _zklua_build_string_vector(L, strings);
-    lua_pushstring(L, real_data);
-    lua_call(L, 3, 0);
-    free(wrapper);
+    zklua_completion_data_t *next = NULL;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
+    _zklua_flight_land(wrapper);
+    do {
+        next = wrapper->next;
+        lua_pushinteger(wrapper->L, rc);
+        if (wrapper->snapshot == NULL) {
+            _zklua_build_string_vector(wrapper->L, strings);
+        } else if (rc == ZOK) {
+            _zklua_snapshot_diff(wrapper->L, wrapper->snapshot,
+                    strings->data, strings->count);
+        } else {
+            lua_newtable(wrapper->L);
+            lua_newtable(wrapper->L);
+        }
+        lua_pushstring(wrapper->L, wrapper->data);
+        _zklua_completion_call(wrapper, (wrapper->snapshot != NULL) ? 4 : 3);
+        _zklua_completion_data_fini(wrapper);
+    } while ((wrapper = next) != NULL);
 }
 
 void strings_stat_completion_dispatch(int rc, const struct String_vector *strings,
         const struct Stat *stat, const void *data)
 {
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
-    lua_State *L = wrapper->L;
-    const char *real_data = wrapper->data;
-    lua_pushinteger(L, rc);
-    _zklua_build_string_vector(L, strings);
-    _zklua_build_stat(L, stat);
-    lua_pushstring(L, real_data);
-    lua_call(L, 4, 0);
-    free(wrapper);
-
+    zklua_completion_data_t *next = NULL;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
+    _zklua_flight_land(wrapper);
+    do {
+        next = wrapper->next;
+        lua_pushinteger(wrapper->L, rc);
+        _zklua_build_string_vector(wrapper->L, strings);
+        _zklua_build_stat(wrapper->L, stat);
+        lua_pushstring(wrapper->L, wrapper->data);
+        _zklua_completion_call(wrapper, 4);
+        _zklua_completion_data_fini(wrapper);
+    } while ((wrapper = next) != NULL);
 }
 
 void string_completion_dispatch(int rc, const char *value, const void *data)
@@ -171,11 +236,13 @@ void string_completion_dispatch(int rc, const char *value, const void *data)
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
     lua_State *L = wrapper->L;
     const char *real_data = wrapper->data;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
     lua_pushinteger(L, rc);
     lua_pushstring(L, value);
     lua_pushstring(L, real_data);
-    lua_call(L, 3, 0);
-    free(wrapper);
+    _zklua_completion_call(wrapper, 3);
+    _zklua_completion_data_fini(wrapper);
 }
 
 void acl_completion_dispatch(int rc, struct ACL_vector *acl,
@@ -184,12 +251,14 @@ void acl_completion_dispatch(int rc, struct ACL_vector *acl,
     zklua_completion_data_t *wrapper = (zklua_completion_data_t *)data;
     lua_State *L = wrapper->L;
     const char *real_data = wrapper->data;
+    if (_zklua_completion_dropped(wrapper)) return;
+    _zklua_window_complete(wrapper, rc);
     lua_pushinteger(L, rc);
     _zklua_build_acls(L, acl);
     _zklua_build_stat(L, stat);
     lua_pushstring(L, real_data);
-    lua_call(L, 3, 0);
-    free(wrapper);
+    _zklua_completion_call(wrapper, 4);
+    _zklua_completion_data_fini(wrapper);
 }
 
 /**
@@ -278,19 +347,454 @@ static int _zklua_build_stat(lua_State *L, const struct Stat *stat)
     return 1;
 }
 
+/**
+ * FNV-1a hash of a NUL terminated string.
+ **/
+static unsigned int _zklua_hash_string(const char *s)
+{
+    unsigned int hash = 2166136261u;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * sequence number of a sequential node, the last 10 digits of its name.
+ **/
+static long long _zklua_node_sequence(const char *name)
+{
+    size_t len = strlen(name);
+    return (len >= 10) ? atoll(name + len - 10) : -1;
+}
+
+static int _zklua_sequence_cmp(const void *a, const void *b)
+{
+    long long sa = _zklua_node_sequence(*(char * const *)a);
+    long long sb = _zklua_node_sequence(*(char * const *)b);
+    return (sa > sb) - (sa < sb);
+}
+
+static int _zklua_string_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
 static int _zklua_build_string_vector(lua_State *L, const struct String_vector *sv)
 {
     int i;
-    lua_newtable(L);
+    lua_createtable(L, (sv != NULL) ? sv->count : 0, 0);
     if (sv != NULL) {
         for (i = 0; i < sv->count; ++i) {
             lua_pushstring(L, sv->data[i]);
-            lua_rawseti(L, -2, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * read the number field @name@ of the optional table at @index@.
+ **/
+static lua_Number _zklua_opt_number_field(lua_State *L, int index,
+        const char *name, lua_Number def)
+{
+    lua_Number value = def;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, name);
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isnumber(L, -1)) {
+                luaL_error(L, "invalid arguments: %s must be a number.", name);
+            }
+            value = lua_tonumber(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return value;
+}
+
+/**
+ * read the string field @name@ of the optional table at @index@,
+ * the string stays valid as long as the table does.
+ **/
+static const char *_zklua_opt_string_field(lua_State *L, int index,
+        const char *name, const char *def)
+{
+    const char *value = def;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, name);
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isstring(L, -1)) {
+                luaL_error(L, "invalid arguments: %s must be a string.", name);
+            }
+            value = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return value;
+}
+
+/**
+ * read the optional get_children option table at @index@ into @opts@:
+ * prefix, pattern (fnmatch), sort ("sequence" or "name"), offset, limit
+ * and lazy. raises an error on a bad option, so call it before sending
+ * the request whose result would leak.
+ **/
+static void _zklua_check_children_options(lua_State *L, int index,
+        zklua_children_options_t *opts)
+{
+    const char *sort = NULL;
+
+    memset(opts, 0, sizeof(zklua_children_options_t));
+    opts->limit = -1;
+    if (!lua_istable(L, index)) return;
+    opts->prefix = _zklua_opt_string_field(L, index, "prefix", NULL);
+    opts->pattern = _zklua_opt_string_field(L, index, "pattern", NULL);
+    sort = _zklua_opt_string_field(L, index, "sort", NULL);
+    opts->offset = (int)_zklua_opt_number_field(L, index, "offset", 0);
+    opts->limit = (int)_zklua_opt_number_field(L, index, "limit", -1);
+    if (sort == NULL) {
+        opts->cmp = NULL;
+    } else if (strcmp(sort, "sequence") == 0) {
+        opts->cmp = _zklua_sequence_cmp;
+    } else if (strcmp(sort, "name") == 0) {
+        opts->cmp = _zklua_string_cmp;
+    } else {
+        luaL_error(L, "invalid arguments: sort must be "
+                "\"sequence\" or \"name\".");
+    }
+    if (opts->offset < 0) opts->offset = 0;
+    lua_getfield(L, index, "lazy");
+    opts->lazy = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+}
+
+/**
+ * reduce the children @sv@ in place to the ones selected by @opts@. the
+ * children dropped are freed. a small slice of a sorted listing is
+ * selected in one pass instead of sorting the whole listing.
+ **/
+static void _zklua_select_children(struct String_vector *sv,
+        const zklua_children_options_t *opts)
+{
+    int (*cmp)(const void *, const void *) = opts->cmp;
+    const char *prefix = opts->prefix;
+    const char *pattern = opts->pattern;
+    size_t prefix_len = 0;
+    char *c = NULL;
+    int offset = opts->offset, limit = opts->limit;
+    int n = 0, m = 0, k = 0, i, j;
+
+    if (sv->count == 0) return;
+    if (prefix != NULL) prefix_len = strlen(prefix);
+
+    for (i = 0; i < sv->count; ++i) {
+        if ((prefix != NULL && strncmp(sv->data[i], prefix, prefix_len) != 0)
+                || (pattern != NULL && fnmatch(pattern, sv->data[i], 0) != 0)) {
+            free(sv->data[i]);
+            continue;
+        }
+        sv->data[n++] = sv->data[i];
+    }
+    sv->count = n;
+    k = (limit >= 0) ? offset + limit : n;
+    if (k > n) k = n;
+    if (cmp != NULL && k < n && k <= ZKLUA_CHILDREN_PARTIAL_SORT) {
+        /* keep the k smallest in order at the front, the evicted one
+         * takes the slot of the newcomer. */
+        for (i = 0, m = 0; i < n && k > 0; ++i) {
+            c = sv->data[i];
+            if (m == k && cmp(&c, &sv->data[k - 1]) >= 0) continue;
+            if (m < k) {
+                j = m++;
+            } else {
+                j = k - 1;
+                sv->data[i] = sv->data[j];
+            }
+            for (; j > 0 && cmp(&c, &sv->data[j - 1]) < 0; --j) {
+                sv->data[j] = sv->data[j - 1];
+            }
+            sv->data[j] = c;
+        }
+    } else if (cmp != NULL) {
+        qsort(sv->data, n, sizeof(char *), cmp);
+    }
+    if (offset > k) offset = k;
+    for (i = 0; i < offset; ++i) free(sv->data[i]);
+    for (i = k; i < n; ++i) free(sv->data[i]);
+    memmove(sv->data, sv->data + offset, (k - offset) * sizeof(char *));
+    sv->count = k - offset;
+}
+
+/**
+ * push the children @sv@ selected by @opts@, as an array or, with the
+ * option lazy, as a children userdata taking the vector over. the caller
+ * still deallocates @sv@.
+ **/
+static int _zklua_build_children(lua_State *L, struct String_vector *sv,
+        const zklua_children_options_t *opts)
+{
+    zklua_children_t *children = NULL;
+
+    _zklua_select_children(sv, opts);
+    if (!opts->lazy) return _zklua_build_string_vector(L, sv);
+    children = (zklua_children_t *)lua_newuserdata(L, sizeof(zklua_children_t));
+    children->strings = *sv;
+    sv->count = 0;
+    sv->data = NULL;
+    luaL_getmetatable(L, ZKLUA_CHILDREN_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    return 0;
+}
+
+static int zklua_children_len(lua_State *L)
+{
+    zklua_children_t *children = (zklua_children_t *)luaL_checkudata(L, 1,
+            ZKLUA_CHILDREN_METATABLE_NAME);
+    lua_pushinteger(L, children->strings.count);
+    return 1;
+}
+
+/**
+ * children[i] is the i-th child, created as a lua string on access;
+ * other keys are the methods.
+ **/
+static int zklua_children_index(lua_State *L)
+{
+    int i = 0;
+    zklua_children_t *children = (zklua_children_t *)luaL_checkudata(L, 1,
+            ZKLUA_CHILDREN_METATABLE_NAME);
+
+    if (lua_type(L, 2) != LUA_TNUMBER) {
+        lua_getmetatable(L, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        return 1;
+    }
+    i = (int)lua_tointeger(L, 2);
+    if (i >= 1 && i <= children->strings.count) {
+        lua_pushstring(L, children->strings.data[i - 1]);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int _zklua_children_next(lua_State *L)
+{
+    int i = 0;
+    zklua_children_t *children = (zklua_children_t *)luaL_checkudata(L, 1,
+            ZKLUA_CHILDREN_METATABLE_NAME);
+
+    i = luaL_checkint(L, 2) + 1;
+    if (i < 1 || i > children->strings.count) return 0;
+    lua_pushinteger(L, i);
+    lua_pushstring(L, children->strings.data[i - 1]);
+    return 2;
+}
+
+/**
+ * for i, name in children:iter() do ... end, like ipairs.
+ **/
+static int zklua_children_iter(lua_State *L)
+{
+    luaL_checkudata(L, 1, ZKLUA_CHILDREN_METATABLE_NAME);
+    lua_pushcfunction(L, _zklua_children_next);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+static int zklua_children_gc(lua_State *L)
+{
+    zklua_children_t *children = (zklua_children_t *)luaL_checkudata(L, 1,
+            ZKLUA_CHILDREN_METATABLE_NAME);
+    deallocate_String_vector(&children->strings);
+    children->strings.count = 0;
+    children->strings.data = NULL;
+    return 0;
+}
+
+static const luaL_Reg zklua_children_methods[] =
+{
+    {"iter", zklua_children_iter},
+    {"__len", zklua_children_len},
+    {"__index", zklua_children_index},
+    {"__gc", zklua_children_gc},
+    {NULL, NULL}
+};
+
+static zklua_snapshot_entry_t *_zklua_snapshot_slot(zklua_snapshot_entry_t *entries,
+        int capacity, const char *name, unsigned int hash)
+{
+    int i = (int)(hash & (capacity - 1));
+    while (entries[i].name != NULL && (entries[i].hash != hash
+                || strcmp(entries[i].name, name) != 0)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+/**
+ * replace the listing of @snap@ by @names@, pushing an array of the names
+ * added and an array of the names removed. one hash lookup per name, the
+ * names kept move to the new set without a copy. on allocation failure
+ * @snap@ is left as is, two empty arrays are pushed and -1 returned.
+ **/
+static int _zklua_snapshot_diff(lua_State *L, zklua_snapshot_t *snap,
+        char **names, int count)
+{
+    zklua_snapshot_entry_t *entries = NULL, *e = NULL, *slot = NULL;
+    unsigned int hash = 0;
+    int capacity = 16, added = 0, removed = 0, n = 0, i;
+
+    while (capacity < count * 2) capacity <<= 1;
+    lua_newtable(L);
+    if ((entries = (zklua_snapshot_entry_t *)calloc(capacity,
+                    sizeof(zklua_snapshot_entry_t))) == NULL) {
+        lua_newtable(L);
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        hash = _zklua_hash_string(names[i]);
+        slot = _zklua_snapshot_slot(entries, capacity, names[i], hash);
+        if (slot->name != NULL) continue;
+        e = (snap->entries != NULL) ? _zklua_snapshot_slot(snap->entries,
+                snap->capacity, names[i], hash) : NULL;
+        if (e != NULL && e->name != NULL) {
+            e->seen = 1;
+            slot->name = e->name;
+        } else if ((slot->name = strdup(names[i])) != NULL) {
+            lua_pushstring(L, names[i]);
+            lua_rawseti(L, -2, ++added);
+        } else {
+            continue;
+        }
+        slot->hash = hash;
+        n++;
+    }
+    lua_newtable(L);
+    for (i = 0; i < snap->capacity; ++i) {
+        e = &snap->entries[i];
+        if (e->name == NULL || e->seen) continue;
+        lua_pushstring(L, e->name);
+        lua_rawseti(L, -2, ++removed);
+        free(e->name);
+    }
+    free(snap->entries);
+    snap->entries = entries;
+    snap->capacity = capacity;
+    snap->count = n;
+    return 0;
+}
+
+/**
+ * collect the names of the listing at @index@, a table or a lazy children
+ * userdata, into *@names@ (to be freed), valid while the listing is.
+ **/
+static int _zklua_listing_names(lua_State *L, int index, char ***names)
+{
+    zklua_children_t *children = NULL;
+    int count = 0, i;
+
+    if (lua_isuserdata(L, index)) {
+        children = (zklua_children_t *)luaL_checkudata(L, index,
+                ZKLUA_CHILDREN_METATABLE_NAME);
+        *names = children->strings.data;
+        return children->strings.count;
+    }
+    luaL_checktype(L, index, LUA_TTABLE);
+    count = (int)lua_objlen(L, index);
+    *names = (char **)malloc((count > 0 ? count : 1) * sizeof(char *));
+    if (*names == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    for (i = 0; i < count; ++i) {
+        lua_rawgeti(L, index, i + 1);
+        (*names)[i] = (char *)lua_tostring(L, -1);
+        lua_pop(L, 1);
+        if ((*names)[i] == NULL) {
+            free(*names);
+            return luaL_error(L, "invalid arguments: listing must hold "
+                    "strings.");
         }
     }
+    return count;
+}
+
+static int zklua_snapshot_diff(lua_State *L)
+{
+    char **names = NULL;
+    int count = 0;
+    zklua_snapshot_t *snap = (zklua_snapshot_t *)luaL_checkudata(L, 1,
+            ZKLUA_SNAPSHOT_METATABLE_NAME);
+
+    count = _zklua_listing_names(L, 2, &names);
+    _zklua_snapshot_diff(L, snap, names, count);
+    if (!lua_isuserdata(L, 2)) free(names);
+    return 2;
+}
+
+static int zklua_children_snapshot(lua_State *L)
+{
+    zklua_snapshot_t *snap = (zklua_snapshot_t *)lua_newuserdata(L,
+            sizeof(zklua_snapshot_t));
+    memset(snap, 0, sizeof(zklua_snapshot_t));
+    luaL_getmetatable(L, ZKLUA_SNAPSHOT_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    if (!lua_isnoneornil(L, 1)) {
+        lua_pushcfunction(L, zklua_snapshot_diff);
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, 1);
+        lua_call(L, 2, 0);
+    }
+    return 1;
+}
+
+static int zklua_snapshot_count(lua_State *L)
+{
+    zklua_snapshot_t *snap = (zklua_snapshot_t *)luaL_checkudata(L, 1,
+            ZKLUA_SNAPSHOT_METATABLE_NAME);
+    lua_pushinteger(L, snap->count);
+    return 1;
+}
+
+static int zklua_snapshot_contains(lua_State *L)
+{
+    const char *name = NULL;
+    zklua_snapshot_t *snap = (zklua_snapshot_t *)luaL_checkudata(L, 1,
+            ZKLUA_SNAPSHOT_METATABLE_NAME);
+    name = luaL_checkstring(L, 2);
+    lua_pushboolean(L, snap->entries != NULL && _zklua_snapshot_slot(
+                snap->entries, snap->capacity, name,
+                _zklua_hash_string(name))->name != NULL);
+    return 1;
+}
+
+static int zklua_snapshot_gc(lua_State *L)
+{
+    int i;
+    zklua_snapshot_t *snap = (zklua_snapshot_t *)luaL_checkudata(L, 1,
+            ZKLUA_SNAPSHOT_METATABLE_NAME);
+    for (i = 0; i < snap->capacity; ++i) free(snap->entries[i].name);
+    free(snap->entries);
+    snap->entries = NULL;
+    snap->capacity = 0;
+    snap->count = 0;
     return 0;
 }
 
+static const luaL_Reg zklua_snapshot_methods[] =
+{
+    {"diff", zklua_snapshot_diff},
+    {"count", zklua_snapshot_count},
+    {"contains", zklua_snapshot_contains},
+    {"__gc", zklua_snapshot_gc},
+    {NULL, NULL}
+};
+
 static int _zklua_build_acls(lua_State *L, const struct ACL_vector *acls)
 {
     int i;
@@ -314,14 +818,34 @@ static int _zklua_build_acls(lua_State *L, const struct ACL_vector *acls)
 }
 
 /**
- * parse an ACL_vector struct from the given acceptable index.
- * return 1 if the parsing is successful, otherwise 0 returned.
+ * parse an ACL_vector struct from the given acceptable index, raising an
+ * argument error on an entry without numeric perms and string scheme and
+ * id. return 1 if the parsing is successful, otherwise 0 returned.
  **/
 static int _zklua_parse_acls(lua_State *L, int index, struct ACL_vector *acls)
 {
-    int count = 0, i = 0, j = 0;
+    int count = 0, i = 0, valid = 0;
     luaL_checktype(L, index, LUA_TTABLE);
     count = lua_objlen(L, index);
+    /* check every entry first, nothing is allocated yet. */
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(L, index, i);
+        valid = lua_istable(L, -1);
+        if (valid) {
+            lua_getfield(L, -1, "perms");
+            lua_getfield(L, -2, "scheme");
+            lua_getfield(L, -3, "id");
+            valid = lua_isnumber(L, -3) && lua_isstring(L, -2)
+                && lua_isstring(L, -1)
+                && (lua_tointeger(L, -3) & ~ZOO_PERM_ALL) == 0;
+            lua_pop(L, 3);
+        }
+        lua_pop(L, 1);
+        if (!valid) {
+            lua_pushfstring(L, "invalid ACL format at entry %d.", i);
+            return luaL_argerror(L, index, lua_tostring(L, -1));
+        }
+    }
     acls->count = count;
     acls->data = (struct ACL *)calloc(count, sizeof(struct ACL));
     if (acls->data == NULL) {
@@ -366,1306 +890,10265 @@ static int _zklua_free_acls(struct ACL_vector *acls)
         free(acls->data[i].id.scheme);
     }
     free(acls->data);
+    /* the vector may be freed again by its owner, e.g. a failed copy. */
+    acls->count = 0;
+    acls->data = NULL;
     return 1;
 }
 
-static int _zklua_check_handle(lua_State *L, zklua_handle_t *handle)
+/**
+ * the ACL at @index@: a parsed acl userdata as is, or a table parsed
+ * into @buffer@, which the caller frees when it is the returned vector.
+ * NULL if the table can not be parsed.
+ **/
+static const struct ACL_vector *_zklua_check_acls(lua_State *L, int index,
+        struct ACL_vector *buffer)
 {
-    if (handle->zh) {
-        return 1;
-    } else {
-        luaL_error(L, "invalid zookeeper handle.");
-        return 0;
+    zklua_acl_t *acl = NULL;
+    if (lua_isuserdata(L, index)) {
+        acl = (zklua_acl_t *)luaL_checkudata(L, index, ZKLUA_ACL_METATABLE_NAME);
+        return &acl->acls;
     }
+    return _zklua_parse_acls(L, index, buffer) ? buffer : NULL;
 }
 
-static int _zklua_ref(lua_State *L, int index)
+static void _zklua_push_acl(lua_State *L, struct ACL_vector *acls, int owned)
 {
-    lua_pushvalue(L, index);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    return ref;
+    zklua_acl_t *acl = (zklua_acl_t *)lua_newuserdata(L, sizeof(zklua_acl_t));
+    acl->acls = *acls;
+    acl->owned = owned;
+    luaL_getmetatable(L, ZKLUA_ACL_METATABLE_NAME);
+    lua_setmetatable(L, -2);
 }
 
-static int _zklua_unref(lua_State *L, int ref)
+/**
+ * zklua.acl(acls) or zklua.acl(acl1, acl2, ...): parse an ACL once for
+ * all the calls taking one.
+ **/
+static int zklua_acl(lua_State *L)
 {
-    luaL_unref(L, LUA_REGISTRYINDEX, ref);
-    return 0;
+    struct ACL_vector acls;
+    int top = lua_gettop(L), i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "perms");
+    if (!lua_isnil(L, -1)) {
+        /* the entries are the arguments. */
+        lua_pop(L, 1);
+        lua_createtable(L, top, 0);
+        for (i = 1; i <= top; ++i) {
+            lua_pushvalue(L, i);
+            lua_rawseti(L, -2, i);
+        }
+    } else {
+        lua_pop(L, 1);
+        lua_pushvalue(L, 1);
+    }
+    _zklua_parse_acls(L, lua_gettop(L), &acls);
+    _zklua_push_acl(L, &acls, 1);
+    return 1;
 }
 
-static zklua_global_watcher_context_t *_zklua_global_watcher_context_init(
-        lua_State *L, void *data)
+static int zklua_acl_totable(lua_State *L)
 {
-    zklua_global_watcher_context_t *wrapper = (zklua_global_watcher_context_t *)malloc(
-        sizeof(zklua_global_watcher_context_t));
-    if (wrapper == NULL) {
-        luaL_error(L, "out of memory when zklua trys to "
-                "alloc an internal object.");
-    }
-    wrapper->L = L;
-    wrapper->context = data;
-    return wrapper;
+    zklua_acl_t *acl = (zklua_acl_t *)luaL_checkudata(L, 1,
+            ZKLUA_ACL_METATABLE_NAME);
+    _zklua_build_acls(L, &acl->acls);
+    return 1;
 }
 
-static zklua_local_watcher_context_t *_zklua_local_watcher_context_init(
-        lua_State *L, void *data, int zhref, int cbref)
+static int zklua_acl_len(lua_State *L)
 {
-    zklua_local_watcher_context_t *wrapper = (zklua_local_watcher_context_t *)malloc(
-        sizeof(zklua_local_watcher_context_t));
-    if (wrapper == NULL) {
-        luaL_error(L, "out of memory when zklua trys to "
-                "alloc an internal object.");
-    }
-    wrapper->L = L;
-    wrapper->context = data;
-    wrapper->zhref = zhref;
-    wrapper->cbref = cbref;
-    return wrapper;
+    zklua_acl_t *acl = (zklua_acl_t *)luaL_checkudata(L, 1,
+            ZKLUA_ACL_METATABLE_NAME);
+    lua_pushinteger(L, acl->acls.count);
+    return 1;
 }
 
-/**
- * save watcher_fn into LUA_REGISTRYINDEX, and @index@ is the index in lua_State
- * where the lua watcher_fn resides.
- **/
-static void _zklua_save_watcherfn(lua_State *L, int index)
+static int zklua_acl_gc(lua_State *L)
 {
-    lua_pushlightuserdata(L, (void *)&watcher_fn_key);
-    lua_pushvalue(L, index);
-    lua_settable(L, LUA_REGISTRYINDEX);
+    zklua_acl_t *acl = (zklua_acl_t *)luaL_checkudata(L, 1,
+            ZKLUA_ACL_METATABLE_NAME);
+    if (acl->owned) {
+        _zklua_free_acls(&acl->acls);
+        acl->acls.count = 0;
+        acl->acls.data = NULL;
+        acl->owned = 0;
+    }
+    return 0;
 }
 
-/**
- * save zklua_handle_t *zh into LUA_REGISTRYINDEX, and @index@ is
- * the index in lua_State where the lua watcher_fn resides.
- **/
-static void _zklua_save_zklua_handle(lua_State *L, int index)
+static const luaL_Reg zklua_acl_methods[] =
 {
-    lua_pushlightuserdata(L, (void *)&zklua_handle_key);
-    lua_pushvalue(L, index);
-    lua_settable(L, LUA_REGISTRYINDEX);
-}
+    {"totable", zklua_acl_totable},
+    {"__len", zklua_acl_len},
+    {"__gc", zklua_acl_gc},
+    {NULL, NULL}
+};
 
-/**
- * remove zklua_handle_t *zh from LUA_REGISTRYINDEX.
- **/
-static void _zklua_remove_zklua_handle(lua_State *L)
+static void _zklua_batch_init(zklua_batch_t *batch)
 {
-    lua_pushlightuserdata(L, (void *)&zklua_handle_key);
-    lua_pushnil(L);
-    lua_settable(L, LUA_REGISTRYINDEX);
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    batch->pending = 0;
 }
 
-/**
- * initialize C clientid_t struct from lua table.
- **/
-static clientid_t *_zklua_clientid_init(
-        lua_State *L, int index)
+static void _zklua_batch_fini(zklua_batch_t *batch)
 {
-    size_t passwd_len = 0;
-    const char *clientid_passwd = NULL;
-    clientid_t *clientid = NULL;
-    clientid = (clientid_t *)malloc(sizeof(clientid_t));
-    if (clientid == NULL) {
-        luaL_error(L, "out of memory when zklua trys to "
-                "alloc an internal object.");
-    }
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->lock);
+}
 
-    luaL_checktype(L, index, LUA_TTABLE);
-    lua_getfield(L, index, "client_id");
-    clientid->client_id =  luaL_checkint(L, -1);
-    lua_pop(L, 1);
-    lua_getfield(L, index, "passwd");
-    clientid_passwd = luaL_checklstring(L, -1, &passwd_len);
-    memset(clientid->passwd, 0, 16);
-    memcpy(clientid->passwd, clientid_passwd, passwd_len);
-    lua_pop(L, 1);
+static void _zklua_batch_add(zklua_batch_t *batch, int n)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->pending += n;
+    pthread_mutex_unlock(&batch->lock);
+}
 
-    return  clientid;
+static void _zklua_batch_done(zklua_batch_t *batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->pending == 0) pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
 }
 
-static void _zklua_clientid_fini(clientid_t **clientid)
+/**
+ * block until every request added to @batch@ has completed.
+ **/
+static void _zklua_batch_wait(zklua_batch_t *batch)
 {
-    if (*clientid != NULL) {
-        free(*clientid);
-        *clientid = NULL;
+    pthread_mutex_lock(&batch->lock);
+    while (batch->pending > 0) {
+        pthread_cond_wait(&batch->cond, &batch->lock);
     }
+    pthread_mutex_unlock(&batch->lock);
 }
 
 /**
- * initialize a zookeeper handle.
+ * gets the whole data of a node synchronously, growing the buffer when the
+ * node is larger than ZKLUA_DEFAULT_BUFFER_SIZE. on success *@value@ must be
+ * freed by the caller.
  **/
-static int zklua_init(lua_State *L)
+static int _zklua_get_alloc(zhandle_t *zh, const char *path,
+        char **value, int *value_len, struct Stat *stat)
 {
-    int top = lua_gettop(L);
-    size_t host_len = 0;
-    const char *host = NULL;
-    int recv_timeout = 0;
-    clientid_t *clientid = NULL;
-    size_t real_context_len = 0;
-    char *real_watcher_context = NULL;
-    int flags = 0;
-    zklua_global_watcher_context_t *wrapper = NULL;
-
-    zklua_handle_t *handle = (zklua_handle_t *)lua_newuserdata(L,
-            sizeof(zklua_handle_t));
-    luaL_getmetatable(L, ZKLUA_METATABLE_NAME);
-    lua_setmetatable(L, -2);
-    _zklua_save_zklua_handle(L, -1);
+    int buffer_len = ZKLUA_DEFAULT_BUFFER_SIZE;
+    char *buffer = NULL;
+    int len = 0;
+    int ret = -1;
 
-    host = luaL_checklstring(L, 1, &host_len);
-    if (!_zklua_check_host(host)) {
-        return luaL_error(L, "invalid arguments:"
-                "host must be a string with format:\n"
-                "127.0.0.1:2081,127.0.0.1:2082");
-    }
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    _zklua_save_watcherfn(L, 2);
-    recv_timeout = luaL_checkint(L, 3);
-    switch(top) {
-        case 3:
-            wrapper = _zklua_global_watcher_context_init(L, NULL);
-            handle->zh = zookeeper_init(host, watcher_dispatch,
-                    recv_timeout, 0, wrapper, 0);
-            break;
-        case 4:
-            luaL_checktype(L, 4, LUA_TTABLE);
-            clientid = _zklua_clientid_init(L, 4);
-            wrapper = _zklua_global_watcher_context_init(L, NULL);
-            handle->zh = zookeeper_init(host, watcher_dispatch,
-                    recv_timeout, clientid, wrapper, 0);
-            _zklua_clientid_fini(&clientid);
-            break;
-        case 5:
-            luaL_checktype(L, 4, LUA_TTABLE);
-            clientid = _zklua_clientid_init(L, 4);
-            real_watcher_context = (char *)luaL_checklstring(L, 5, &real_context_len);
-            wrapper = _zklua_global_watcher_context_init(L, real_watcher_context);
-            handle->zh = zookeeper_init(host, watcher_dispatch,
-                    recv_timeout, clientid, wrapper, 0);
-            _zklua_clientid_fini(&clientid);
-            break;
-        case 6:
-            luaL_checktype(L, 4, LUA_TTABLE);
-            clientid = _zklua_clientid_init(L, 4);
-            real_watcher_context = (char *)luaL_checklstring(L, 5, &real_context_len);
-            wrapper = _zklua_global_watcher_context_init(L, real_watcher_context);
-            flags = luaL_checkint(L, 6);
-            handle->zh = zookeeper_init(host, watcher_dispatch,
-                    recv_timeout, clientid, wrapper, flags);
-            _zklua_clientid_fini(&clientid);
-            break;
-        default:
-            break;
+    for (;;) {
+        char *tmp = (char *)realloc(buffer, buffer_len);
+        if (tmp == NULL) {
+            free(buffer);
+            return ZSYSTEMERROR;
+        }
+        buffer = tmp;
+        len = buffer_len;
+        ret = zoo_get(zh, path, 0, buffer, &len, stat);
+        if (ret != ZOK) {
+            free(buffer);
+            return ret;
+        }
+        if (stat->dataLength <= buffer_len) break;
+        buffer_len = stat->dataLength;
     }
-    return 1;
+    *value = buffer;
+    *value_len = (len < 0) ? 0 : len;
+    return ZOK;
 }
 
-static int zklua_close(lua_State *L)
+static pthread_mutex_t zklua_future_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zklua_future_cond;
+static pthread_once_t zklua_future_once = PTHREAD_ONCE_INIT;
+
+/**
+ * futures are waited on with one monotonic condition variable, broadcast
+ * whenever a future is settled or cancelled.
+ **/
+static void _zklua_future_init(void)
 {
-    int ret = 0;
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (handle->zh != NULL) {
-        /* close zookeeper handle. */
-        ret = zookeeper_close(handle->zh);
-        handle->zh = NULL;
-        /* remove zookeeper handle from LUA_REGISTRYINDEX. */
-        _zklua_remove_zklua_handle(L);
-    } else {
-        return luaL_error(L, "unable to close the zookeeper handle.");
-    }
-    /* close log stream. */
-    if (zklua_log_stream != NULL) fclose(zklua_log_stream);
-    /* push ret code of zookeeper_close() onto stack. */
-    lua_pushinteger(L, ret);
-    return 1;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&zklua_future_cond, &attr);
+    pthread_condattr_destroy(&attr);
 }
 
 /**
- * return clientid_t of the current connection.
+ * push a new future userdata whose results are kept on the lua thread
+ * anchored by @threadref@, or on a new thread for LUA_NOREF.
  **/
-static int zklua_client_id(lua_State *L)
+static zklua_future_t *_zklua_future_new(lua_State *L, int threadref)
 {
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        const clientid_t *clientid = zoo_client_id(handle->zh);
-        lua_newtable(L);
-        lua_pushstring(L, "client_id");
-        lua_pushnumber(L, clientid->client_id);
-        lua_settable(L, -3);
-        lua_pushstring(L, "passwd");
-        lua_pushstring(L, clientid->passwd);
-        lua_settable(L, -3);
-        return 1;
+    zklua_future_t **fh = NULL;
+    zklua_future_t *f = NULL;
+
+    fh = (zklua_future_t **)lua_newuserdata(L, sizeof(zklua_future_t *));
+    *fh = NULL;
+    luaL_getmetatable(L, ZKLUA_FUTURE_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    f = (zklua_future_t *)calloc(1, sizeof(zklua_future_t));
+    if (f == NULL) {
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    if (threadref == LUA_NOREF) {
+        lua_newthread(L);
     } else {
-        return luaL_error(L, "unable to get client id.");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, threadref);
     }
+    f->L = lua_tothread(L, -1);
+    f->threadref = luaL_ref(L, LUA_REGISTRYINDEX);
+    f->refs = 1;
+    f->state = ZKLUA_FUTURE_PENDING;
+    *fh = f;
+    return f;
 }
 
-static int zklua_recv_timeout(lua_State *L)
+static zklua_future_t *_zklua_check_future(lua_State *L, int idx)
 {
-    int recv_timeout = 0;
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        recv_timeout = zoo_recv_timeout(handle->zh);
-        lua_pushinteger(L, recv_timeout);
-        return 1;
-    } else {
-        return luaL_error(L, "unable to get recv_timeout.");
-    }
-
+    zklua_future_t **fh = (zklua_future_t **)luaL_checkudata(L, idx,
+            ZKLUA_FUTURE_METATABLE_NAME);
+    if (*fh == NULL) luaL_error(L, "invalid zklua future.");
+    return *fh;
 }
 
-static int zklua_get_context(lua_State *L)
+static void _zklua_future_release(zklua_future_t *f)
 {
-    const char *context = NULL;
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        context = zoo_get_context(handle->zh);
-        lua_pushstring(L, context);
-        return 1;
-    } else {
-        return luaL_error(L, "unable to get zookeeper handle context.");
-    }
+    int refs = 0;
+    pthread_mutex_lock(&zklua_future_lock);
+    refs = --f->refs;
+    pthread_mutex_unlock(&zklua_future_lock);
+    if (refs == 0) free(f);
 }
 
-static int zklua_set_context(lua_State *L)
+/**
+ * mark @f@ and the futures chained on it by then as cancelled, with the
+ * future lock held. returns 1 if @f@ was still pending.
+ **/
+static int _zklua_future_cancel(zklua_future_t *f)
 {
-    size_t context_len = 0;
-    char *context = NULL;
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        context = (char *)luaL_checklstring(L, -1, &context_len);
-        zoo_set_context(handle->zh, context);
-        return 0;
-    } else {
-        return luaL_error(L, "unable to get zookeeper handle context.");
-    }
+    zklua_then_t *t = NULL;
+    if (f->state != ZKLUA_FUTURE_PENDING) return 0;
+    f->state = ZKLUA_FUTURE_CANCELLED;
+    for (t = f->thens; t != NULL; t = t->next) _zklua_future_cancel(t->future);
+    return 1;
 }
 
-static int zklua_set_watcher(lua_State *L)
+static void _zklua_future_settle(zklua_future_t *f, lua_State *L,
+        int nresults);
+
+/**
+ * run the then callback @t@ with copies of the @nresults@ values on top
+ * of @L@ and settle its future with what it returns, then free @t@. a
+ * cancelled future, or a negative @nresults@, skips the callback.
+ **/
+static void _zklua_then_run(lua_State *L, zklua_then_t *t, int nresults)
 {
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        lua_pushlightuserdata(L, (void *)&watcher_fn_key);
-        lua_gettable(L, LUA_REGISTRYINDEX);
-        luaL_checktype(L, 2, LUA_TFUNCTION);
-        _zklua_save_watcherfn(L, 2);
-        return 1;
+    int top = lua_gettop(L);
+    int state = 0;
+    int i = 0;
+
+    pthread_mutex_lock(&zklua_future_lock);
+    state = t->future->state;
+    pthread_mutex_unlock(&zklua_future_lock);
+    if (nresults >= 0 && state == ZKLUA_FUTURE_PENDING) {
+        luaL_checkstack(L, nresults + 1, "too many results");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, t->fnref);
+        for (i = 0; i < nresults; ++i) {
+            lua_pushvalue(L, top - nresults + 1 + i);
+        }
+        lua_call(L, nresults, LUA_MULTRET);
+        _zklua_future_settle(t->future, L, lua_gettop(L) - top);
     } else {
-        return luaL_error(L, "unable to set zookeeper new watcher_fn.");
+        /* frees the thens of a cancelled future. */
+        _zklua_future_settle(t->future, L, 0);
     }
+    luaL_unref(L, LUA_REGISTRYINDEX, t->fnref);
+    _zklua_future_release(t->future);
+    free(t);
 }
 
-static int zklua_get_connected_host(lua_State *L)
+/**
+ * settle @f@ with the @nresults@ values on top of @L@, which are popped.
+ * then callbacks registered so far run first, on @L@; the values are
+ * moved to the thread of @f@ unless it is @L@ already. a cancelled
+ * future drops the values and its then callbacks.
+ **/
+static void _zklua_future_settle(zklua_future_t *f, lua_State *L,
+        int nresults)
 {
-    unsigned short port = 0;
-
-    struct sockaddr *paddr = NULL;
-    struct sockaddr saddr;
-    socklen_t socklen = 0;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        paddr = zookeeper_get_connected_host(handle->zh, &saddr, &socklen);
-        if (paddr != NULL) {
-            if (socklen == sizeof(struct sockaddr_in)) {
-                char addrstr[INET_ADDRSTRLEN] = {0};
-                port = ntohs(((struct sockaddr_in *)paddr)->sin_port);
-                inet_ntop(AF_INET, &(((struct sockaddr_in *)paddr)->sin_addr), addrstr, INET_ADDRSTRLEN);
-                lua_pushstring(L, addrstr);
-                lua_pushinteger(L, port);
-                return 2;
-            } else if (socklen == sizeof(struct sockaddr_in6)) {
-                char addr6str[INET6_ADDRSTRLEN] = {0};
-                port = ntohs(((struct sockaddr_in6 *)paddr)->sin6_port);
-                inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)paddr)->sin6_addr), addr6str, INET6_ADDRSTRLEN);
-                lua_pushstring(L, addr6str);
-                lua_pushinteger(L, port);
-                return 2;
+    zklua_then_t *thens = NULL;
+    zklua_then_t *next = NULL;
+    int state = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&zklua_future_lock);
+        thens = f->thens;
+        f->thens = NULL;
+        state = f->state;
+        if (thens == NULL && state == ZKLUA_FUTURE_PENDING) {
+            if (f->L == NULL) {
+                lua_pop(L, nresults);
             } else {
-                return luaL_error(L, "unsupported network sockaddr type.");
+                if (f->L != L) {
+                    lua_checkstack(f->L, nresults);
+                    lua_xmove(L, f->L, nresults);
+                }
+                f->base = lua_gettop(f->L) - nresults + 1;
+                f->nresults = nresults;
             }
+            f->state = ZKLUA_FUTURE_DONE;
+            pthread_cond_broadcast(&zklua_future_cond);
+            pthread_mutex_unlock(&zklua_future_lock);
+            return;
+        }
+        pthread_mutex_unlock(&zklua_future_lock);
+        for (; thens != NULL; thens = next) {
+            next = thens->next;
+            _zklua_then_run(L, thens,
+                    (state == ZKLUA_FUTURE_PENDING) ? nresults : -1);
+        }
+        if (state != ZKLUA_FUTURE_PENDING) {
+            lua_pop(L, nresults);
+            return;
         }
-    } else {
-        return luaL_error(L, "unable to get connected host.");
     }
-    return 0;
 }
 
 /**
- * TODO: implement zklua_interest later.
+ * remember @ref@ to be unref'd on the lua thread once aclose returns,
+ * with close->lock held.
  **/
-static int zklua_interest(lua_State *L)
+static void _zklua_close_orphan(zklua_close_t *close, int ref)
 {
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    return 0;
+    int *orphans = NULL;
+
+    if (close->norphans == close->orphans_size) {
+        orphans = (int *)realloc(close->orphans,
+                (close->orphans_size * 2 + 16) * sizeof(int));
+        if (orphans != NULL) {
+            close->orphans = orphans;
+            close->orphans_size = close->orphans_size * 2 + 16;
+        }
+    }
+    /* without memory the reference stays anchored, a leak at worst. */
+    if (close->norphans < close->orphans_size) {
+        close->orphans[close->norphans++] = ref;
+    }
 }
 
 /**
- * TODO: implement zklua_process later.
+ * cancel @f@ without calling into lua, from the closing thread: its then
+ * callbacks are left to @close@ to unref. close->lock is held.
  **/
-static int zklua_process(lua_State *L)
+static void _zklua_future_drop(zklua_future_t *f, zklua_close_t *close)
 {
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    return 0;
+    zklua_then_t *t = NULL;
+    zklua_then_t *next = NULL;
+
+    pthread_mutex_lock(&zklua_future_lock);
+    if (_zklua_future_cancel(f)) pthread_cond_broadcast(&zklua_future_cond);
+    t = f->thens;
+    f->thens = NULL;
+    pthread_mutex_unlock(&zklua_future_lock);
+    for (; t != NULL; t = next) {
+        next = t->next;
+        _zklua_close_orphan(close, t->fnref);
+        _zklua_future_drop(t->future, close);
+        _zklua_future_release(t->future);
+        free(t);
+    }
 }
 
-static int zklua_state(lua_State *L)
+/**
+ * deliver the @nargs@ completion arguments on top of the stack of
+ * @cdata@: to the lua completion under them, unless there is none or
+ * the future was cancelled, then to the future. the trailing data
+ * argument is not part of the results.
+ **/
+static void _zklua_completion_call(zklua_completion_data_t *cdata, int nargs)
 {
-    int ret = 0;
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        ret = zoo_state(handle->zh);
-        lua_pushinteger(L, ret);
-        return 1;
+    lua_State *L = cdata->L;
+    int fn = lua_gettop(L) - nargs;
+    int state = ZKLUA_FUTURE_PENDING;
+    int i = 0;
+
+    if (cdata->future != NULL) {
+        pthread_mutex_lock(&zklua_future_lock);
+        state = cdata->future->state;
+        pthread_mutex_unlock(&zklua_future_lock);
+    }
+    if (!lua_isnil(L, fn) && state != ZKLUA_FUTURE_CANCELLED) {
+        luaL_checkstack(L, nargs + 1, "too many arguments");
+        for (i = 0; i <= nargs; ++i) lua_pushvalue(L, fn + i);
+        lua_call(L, nargs, 0);
+    }
+    lua_pop(L, 1);
+    lua_remove(L, fn);
+    if (cdata->future != NULL) {
+        _zklua_future_settle(cdata->future, L, nargs - 1);
     } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+        lua_pop(L, nargs - 1);
     }
 }
 
 /**
- * create a node asynchronously.
+ * settle the future of a request that was not sent with @rc@.
  **/
-static int zklua_acreate(lua_State *L)
+static void _zklua_completion_abort(zklua_completion_data_t *cdata, int rc)
 {
-    size_t path_len = 0, value_len=0;
-    const char *path = NULL;
-    const char *value = NULL;
-    const char *data = NULL;
-    struct ACL_vector acl;
-    zklua_completion_data_t *cdata = NULL;
-    int flags = 0;
-    int ret = -1;
+    if (cdata->future == NULL) return;
+    lua_pushinteger(cdata->L, rc);
+    _zklua_future_settle(cdata->future, cdata->L, 1);
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        value = luaL_checklstring(L, 3, &value_len);
-        if (!_zklua_parse_acls(L, 4, &acl)) return luaL_error(L,
-                "invalid ACL format.");
-        flags = luaL_checkint(L, 5);
-        luaL_checktype(L, 6, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 7);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 6);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_acreate(handle->zh, path, value, value_len,
-                (const struct ACL_vector *)&acl, flags,
-                string_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        _zklua_free_acls(&acl);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+/**
+ * wait, with the future lock held, until all (or, unless @all@, any) of
+ * the @n@ futures in @fs@ are settled, for at most @timeout@ ms; a
+ * negative @timeout@ waits forever. returns the number still pending.
+ **/
+static int _zklua_futures_block(zklua_future_t **fs, int n, int all,
+        int timeout)
+{
+    struct timespec ts;
+    uint64_t deadline = 0;
+    int expired = 0;
+    int pending = 0;
+    int i = 0;
+
+    deadline = _zklua_now_us() + (uint64_t)((timeout > 0) ? timeout : 0) * 1000;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    for (;;) {
+        for (pending = 0, i = 0; i < n; ++i) {
+            if (fs[i]->state == ZKLUA_FUTURE_PENDING) pending++;
+        }
+        if (pending == 0 || (!all && pending < n) || timeout == 0 || expired) {
+            return pending;
+        }
+        if (timeout < 0) {
+            pthread_cond_wait(&zklua_future_cond, &zklua_future_lock);
+        } else if (pthread_cond_timedwait(&zklua_future_cond,
+                    &zklua_future_lock, &ts) != 0
+                && _zklua_now_us() >= deadline) {
+            expired = 1;
+        }
     }
 }
 
 /**
- * delete a node asynchronously.
+ * push what waiting on @f@ returns, @state@ being its state when the
+ * wait ended: the results of a settled future, ZKLUA_TIMEDOUT or
+ * ZKLUA_CANCELLED. results of a settled future never change, so they are
+ * copied without the future lock, which lua allocations must not hold.
  **/
-static int zklua_adelete(lua_State *L)
+static int _zklua_future_push(lua_State *L, zklua_future_t *f, int state)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int version = -1;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
+    int i = 0;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        version = luaL_checkint(L, 3);
-        luaL_checktype(L, 4, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 5);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 4);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_adelete(handle->zh, path, version, void_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        // printf("zklua_adelete: %s\n", lua_typename(L, lua_type(L, 1)));
-        lua_pushnumber(L, ret);
+    if (state == ZKLUA_FUTURE_PENDING) {
+        lua_pushinteger(L, ZKLUA_TIMEDOUT);
+        return 1;
+    } else if (state == ZKLUA_FUTURE_CANCELLED) {
+        lua_pushinteger(L, ZKLUA_CANCELLED);
         return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
     }
+    luaL_checkstack(L, f->nresults, "too many results");
+    for (i = 0; i < f->nresults; ++i) {
+        lua_pushvalue(f->L, f->base + i);
+        lua_xmove(f->L, L, 1);
+    }
+    return f->nresults;
 }
 
 /**
- * checks the existence of a node in zookeeper.
+ * collect the futures of the list at @idx@ into a userdata array pushed
+ * on the stack, so that a lua error does not leak it.
  **/
-static int zklua_aexists(lua_State *L)
+static zklua_future_t **_zklua_check_futures(lua_State *L, int idx, int *n)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        luaL_checktype(L, 4, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 5);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 4);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aexists(handle->zh, path, watch,
-                stat_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    zklua_future_t **fs = NULL;
+    int i = 0;
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+    *n = lua_objlen(L, idx);
+    fs = (zklua_future_t **)lua_newuserdata(L,
+            (*n > 0 ? *n : 1) * sizeof(zklua_future_t *));
+    for (i = 0; i < *n; ++i) {
+        lua_rawgeti(L, idx, i + 1);
+        fs[i] = _zklua_check_future(L, -1);
+        lua_pop(L, 1);
     }
+    return fs;
 }
 
 /**
- * checks the existence of a node in zookeeper.
+ * future:wait([timeout]), returns the results of the future, which are
+ * the arguments of its completion without the trailing data, or
+ * ZKLUA_TIMEDOUT or ZKLUA_CANCELLED.
  **/
-static int zklua_awexists(lua_State *L)
+static int zklua_future_wait(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        luaL_checktype(L, 5, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 6);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 5);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_awexists(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, stat_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
-    }
+    zklua_future_t *f = _zklua_check_future(L, 1);
+    int timeout = luaL_optint(L, 2, -1);
+    int state = 0;
+
+    pthread_mutex_lock(&zklua_future_lock);
+    _zklua_futures_block(&f, 1, 1, timeout);
+    state = f->state;
+    pthread_mutex_unlock(&zklua_future_lock);
+    return _zklua_future_push(L, f, state);
 }
 
 /**
- * gets the data associated with a node.
+ * future:then(fn), returns a future settled with what fn returns when it
+ * is called with the results of this one.
  **/
-static int zklua_aget(lua_State *L)
+static int zklua_future_then(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
+    zklua_future_t *f = _zklua_check_future(L, 1);
+    zklua_future_t *child = NULL;
+    zklua_then_t *t = NULL;
+    zklua_then_t **tail = NULL;
+    int state = 0;
+    int n = 0;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        luaL_checktype(L, 4, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 5);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 4);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aget(handle->zh, path, watch,
-                data_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    child = _zklua_future_new(L, LUA_NOREF);
+    t = (zklua_then_t *)malloc(sizeof(zklua_then_t));
+    if (t == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
     }
+    t->future = child;
+    child->refs++;
+    t->next = NULL;
+    lua_pushvalue(L, 2);
+    t->fnref = luaL_ref(L, LUA_REGISTRYINDEX);
+    pthread_mutex_lock(&zklua_future_lock);
+    state = f->state;
+    if (state == ZKLUA_FUTURE_PENDING) {
+        for (tail = &f->thens; *tail != NULL; tail = &(*tail)->next);
+        *tail = t;
+    } else if (state == ZKLUA_FUTURE_CANCELLED) {
+        _zklua_future_cancel(t->future);
+    }
+    pthread_mutex_unlock(&zklua_future_lock);
+    if (state != ZKLUA_FUTURE_PENDING) {
+        n = _zklua_future_push(L, f, state);
+        _zklua_then_run(L, t, (state == ZKLUA_FUTURE_DONE) ? n : -1);
+        lua_pop(L, n);
+    }
+    return 1;
 }
 
-static int zklua_awget(lua_State *L)
+/**
+ * future:cancel(), drops the delivery of the result: the completion and
+ * then callbacks are not called and waiters get ZKLUA_CANCELLED. returns
+ * true if the future was still pending.
+ **/
+static int zklua_future_cancel(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        luaL_checktype(L, 5, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 6);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 5);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_awget(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, data_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
-    }
+    zklua_future_t *f = _zklua_check_future(L, 1);
+    int cancelled = 0;
+
+    pthread_mutex_lock(&zklua_future_lock);
+    cancelled = _zklua_future_cancel(f);
+    if (cancelled) pthread_cond_broadcast(&zklua_future_cond);
+    pthread_mutex_unlock(&zklua_future_lock);
+    lua_pushboolean(L, cancelled);
+    return 1;
 }
 
-static int zklua_aset(lua_State *L)
+static int zklua_future_done(lua_State *L)
 {
-    size_t path_len = 0;
-    size_t buffer_len = 0;
-    const char *path = NULL;
-    const char *buffer = NULL;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int version = 0;
-    int ret = -1;
+    zklua_future_t *f = _zklua_check_future(L, 1);
+    int state = 0;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        buffer = luaL_checklstring(L, 3, &buffer_len);
-        version = luaL_checkint(L, 4);
-        luaL_checktype(L, 5, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 6);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 5);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aset(handle->zh, path, buffer, buffer_len, version,
-                stat_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
-    }
+    pthread_mutex_lock(&zklua_future_lock);
+    state = f->state;
+    pthread_mutex_unlock(&zklua_future_lock);
+    lua_pushboolean(L, state != ZKLUA_FUTURE_PENDING);
+    return 1;
 }
 
-static int zklua_aget_children(lua_State *L)
+static int zklua_future_gc(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
+    zklua_future_t **fh = (zklua_future_t **)luaL_checkudata(L, 1,
+            ZKLUA_FUTURE_METATABLE_NAME);
+    zklua_future_t *f = *fh;
+
+    if (f == NULL) return 0;
+    pthread_mutex_lock(&zklua_future_lock);
+    f->L = NULL;
+    pthread_mutex_unlock(&zklua_future_lock);
+    luaL_unref(L, LUA_REGISTRYINDEX, f->threadref);
+    _zklua_future_release(f);
+    *fh = NULL;
+    return 0;
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        luaL_checktype(L, 4, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 5);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 4);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aget_children(handle->zh, path, watch,
-                strings_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+/**
+ * zklua.wait_all(futures, [timeout]), returns ZOK, or ZKLUA_TIMEDOUT if
+ * some future is still pending, and a list holding what future:wait
+ * returns for each future, as a list.
+ **/
+static int zklua_wait_all(lua_State *L)
+{
+    zklua_future_t **fs = NULL;
+    int timeout = luaL_optint(L, 2, -1);
+    int *states = NULL;
+    int pending = 0;
+    int n = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    fs = _zklua_check_futures(L, 1, &n);
+    states = (int *)lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(int));
+    pthread_mutex_lock(&zklua_future_lock);
+    pending = _zklua_futures_block(fs, n, 1, timeout);
+    for (i = 0; i < n; ++i) states[i] = fs[i]->state;
+    pthread_mutex_unlock(&zklua_future_lock);
+    lua_pushinteger(L, (pending > 0) ? ZKLUA_TIMEDOUT : ZOK);
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; ++i) {
+        lua_newtable(L);
+        k = _zklua_future_push(L, fs[i], states[i]);
+        for (j = k; j >= 1; --j) lua_rawseti(L, -1 - j, j);
+        lua_rawseti(L, -2, i + 1);
     }
+    return 2;
 }
 
-static int zklua_aget_children2(lua_State *L)
+/**
+ * zklua.wait_any(futures, [timeout]), returns the index of the first
+ * settled future in the list followed by what future:wait returns for
+ * it, or nil and ZKLUA_TIMEDOUT.
+ **/
+static int zklua_wait_any(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        luaL_checktype(L, 4, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 5);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 4);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aget_children2(handle->zh, path, watch,
-                strings_stat_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    zklua_future_t **fs = NULL;
+    int timeout = luaL_optint(L, 2, -1);
+    int state = ZKLUA_FUTURE_PENDING;
+    int n = 0;
+    int i = 0;
+
+    fs = _zklua_check_futures(L, 1, &n);
+    pthread_mutex_lock(&zklua_future_lock);
+    _zklua_futures_block(fs, n, 0, timeout);
+    for (i = 0; i < n; ++i) {
+        if ((state = fs[i]->state) != ZKLUA_FUTURE_PENDING) break;
+    }
+    pthread_mutex_unlock(&zklua_future_lock);
+    if (i == n) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ZKLUA_TIMEDOUT);
+        return 2;
     }
+    lua_pushinteger(L, i + 1);
+    return 1 + _zklua_future_push(L, fs[i], state);
 }
 
-static int zklua_awget_children(lua_State *L)
+static const luaL_Reg zklua_future_methods[] =
+{
+    {"wait", zklua_future_wait},
+    {"then", zklua_future_then},
+    {"cancel", zklua_future_cancel},
+    {"done", zklua_future_done},
+    {"__gc", zklua_future_gc},
+    {NULL, NULL}
+};
+
+/**
+ * allocate the completion data of an async call: the lua completion at
+ * @fnindex@ is moved onto a new thread (anchored in LUA_REGISTRYINDEX until
+ * the completion is delivered) and the string at @dataindex@ is copied,
+ * since the call may outlive it. both are optional. without a completion
+ * the caller gets a future instead, settled by the completion, its results
+ * kept on the same thread; it is left on top of the stack, or nil.
+ **/
+static zklua_completion_data_t *_zklua_completion_data_init(
+        lua_State *L, int fnindex, int dataindex)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    int watch = 0;
     const char *data = NULL;
-    zklua_local_watcher_context_t *wrapper = NULL;
     zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        luaL_checktype(L, 5, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 6);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 5);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_awget_children(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, strings_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    if (!lua_isnoneornil(L, fnindex)) luaL_checktype(L, fnindex, LUA_TFUNCTION);
+    data = luaL_optstring(L, dataindex, "");
+    cdata = (zklua_completion_data_t *)calloc(1, sizeof(zklua_completion_data_t));
+    if (cdata == NULL || (cdata->data = strdup(data)) == NULL) {
+        free(cdata);
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    cdata->L = lua_newthread(L);
+    cdata->threadref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, fnindex);
+    lua_xmove(L, cdata->L, 1);
+    if (!lua_isnoneornil(L, fnindex)) {
+        lua_pushnil(L);
+        return cdata;
     }
+    cdata->future = _zklua_future_new(L, cdata->threadref);
+    cdata->future->refs++;
+    return cdata;
 }
 
-static int zklua_awget_children2(lua_State *L)
+/**
+ * return values of the zklua.a* functions: @ret@, followed by the future
+ * left on top of the stack by _zklua_completion_data_init if any.
+ **/
+static int _zklua_push_submitted(lua_State *L, int ret)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        luaL_checktype(L, 5, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 6);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 5);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_awget_children2(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, strings_stat_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
         lua_pushinteger(L, ret);
         return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
     }
+    lua_pushinteger(L, ret);
+    lua_insert(L, -2);
+    return 2;
 }
 
-static int zklua_async(lua_State *L)
+static void _zklua_completion_data_fini(zklua_completion_data_t *cdata)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int watch = 0;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 4);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 3);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_async(handle->zh, path,
-                string_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    zklua_future_t *f = cdata->future;
+
+    if (f != NULL) {
+        /* a future that was never settled is cancelled. */
+        pthread_mutex_lock(&zklua_future_lock);
+        if (_zklua_future_cancel(f)) pthread_cond_broadcast(&zklua_future_cond);
+        pthread_mutex_unlock(&zklua_future_lock);
+        _zklua_future_settle(f, cdata->L, 0);
+        _zklua_future_release(f);
     }
+    luaL_unref(cdata->L, LUA_REGISTRYINDEX, cdata->threadref);
+    free(cdata->data);
+    free(cdata);
 }
 
-static int zklua_aget_acl(lua_State *L)
+/**
+ * return 1 if the handle that sent @cdata@ is being closed by aclose, in
+ * which case @cdata@ and the requests chained on it are dropped without
+ * calling into lua: this runs on the closing thread.
+ **/
+static int _zklua_completion_dropped(zklua_completion_data_t *cdata)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
+    zklua_close_t *close = cdata->close;
+    zklua_completion_data_t *next = NULL;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 4);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 3);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aget_acl(handle->zh, path,
-                acl_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    if (close == NULL || !__atomic_load_n(&close->closing, __ATOMIC_ACQUIRE)) {
+        return 0;
     }
+    _zklua_flight_land(cdata);
+    pthread_mutex_lock(&close->lock);
+    for (; cdata != NULL; cdata = next) {
+        next = cdata->next;
+        if (cdata->future != NULL) {
+            _zklua_future_drop(cdata->future, close);
+            _zklua_future_release(cdata->future);
+        }
+        _zklua_close_orphan(close, cdata->threadref);
+        free(cdata->data);
+        free(cdata);
+    }
+    pthread_mutex_unlock(&close->lock);
+    return 1;
 }
 
-static int zklua_aset_acl(lua_State *L)
+static uint64_t _zklua_now_us(void)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    const char *data = NULL;
-    struct ACL_vector acl;
-    zklua_completion_data_t *cdata = NULL;
-    int version = 0;
-    int ret = -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        version = luaL_checkint(L, 3);
-        if (!_zklua_parse_acls(L, 4, &acl)) return luaL_error(L,
-                "invalid ACL format.");
-        luaL_checktype(L, 5, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 6);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 5);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_aset_acl(handle->zh, path, version, &acl,
-                void_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        _zklua_free_acls(&acl);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+static uint64_t _zklua_wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void _zklua_request_init(zklua_request_t *req, int op)
+{
+    memset(req, 0, sizeof(zklua_request_t));
+    req->op = op;
+    req->version = -1;
+}
+
+/**
+ * copy a String_vector handed to a completion, which is freed
+ * by the zookeeper client once the completion returns.
+ **/
+static int _zklua_copy_string_vector(struct String_vector *dst,
+        const struct String_vector *src)
+{
+    int i;
+    dst->count = 0;
+    dst->data = NULL;
+    if (src == NULL || src->count <= 0) return 1;
+    dst->data = (char **)calloc(src->count, sizeof(char *));
+    if (dst->data == NULL) return 0;
+    for (i = 0; i < src->count; ++i) {
+        dst->data[i] = strdup(src->data[i]);
+        if (dst->data[i] == NULL) {
+            deallocate_String_vector(dst);
+            return 0;
+        }
+        dst->count++;
     }
+    return 1;
 }
 
-static int zklua_error(lua_State *L)
+/**
+ * deep copy an ACL_vector, return 1 on success.
+ **/
+static int _zklua_copy_acls(struct ACL_vector *dst, const struct ACL_vector *src)
 {
-    int code = luaL_checkint(L, -1);
-    const char *errstr = zerror(code);
-    lua_pushstring(L, errstr);
+    int i;
+    dst->count = 0;
+    dst->data = (struct ACL *)calloc(src->count > 0 ? src->count : 1,
+            sizeof(struct ACL));
+    if (dst->data == NULL) return 0;
+    for (i = 0; i < src->count; ++i) {
+        dst->data[i].perms = src->data[i].perms;
+        dst->data[i].id.scheme = strdup(src->data[i].id.scheme);
+        dst->data[i].id.id = strdup(src->data[i].id.id);
+        dst->count++;
+        if (dst->data[i].id.scheme == NULL || dst->data[i].id.id == NULL) {
+            _zklua_free_acls(dst);
+            return 0;
+        }
+    }
     return 1;
 }
 
-static int zklua_add_auth(lua_State *L)
+/**
+ * copy a request built on the stack, so that it can be submitted later.
+ **/
+static zklua_request_t *_zklua_request_copy(const zklua_request_t *req)
 {
-    size_t cert_len = 0;
-    const char *scheme = NULL;
-    const char *cert = NULL;
-    const char *data = NULL;
-    zklua_completion_data_t *cdata = NULL;
-    int ret = -1;
+    zklua_request_t *copy = (zklua_request_t *)malloc(sizeof(zklua_request_t));
+    char *path = NULL, *value = NULL;
+    struct ACL_vector *acl = NULL;
+
+    if (copy == NULL) return NULL;
+    *copy = *req;
+    copy->next = NULL;
+    path = strdup(req->path);
+    if (req->value != NULL) {
+        value = (char *)malloc(req->value_len > 0 ? req->value_len : 1);
+        if (value != NULL && req->value_len > 0) {
+            memcpy(value, req->value, req->value_len);
+        }
+    }
+    if (req->acl != NULL) {
+        acl = (struct ACL_vector *)malloc(sizeof(struct ACL_vector));
+        if (acl != NULL && !_zklua_copy_acls(acl, req->acl)) {
+            free(acl);
+            acl = NULL;
+        }
+    }
+    if (path == NULL || (req->value != NULL && value == NULL)
+            || (req->acl != NULL && acl == NULL)) {
+        free(path);
+        free(value);
+        free(acl);
+        free(copy);
+        return NULL;
+    }
+    copy->path = path;
+    copy->value = value;
+    copy->acl = acl;
+    return copy;
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        scheme = luaL_checkstring(L, 2);
-        cert = luaL_checklstring(L, 3, &cert_len);
-        luaL_checktype(L, 4, LUA_TFUNCTION);
-        data = luaL_checkstring(L, 5);
-        cdata = (zklua_completion_data_t *)malloc(sizeof(zklua_completion_data_t));
-        cdata->L = lua_newthread(L);
-        cdata->data= data;
-        lua_pushvalue(L, 4);
-        lua_xmove(L, cdata->L, 1);
-        ret = zoo_add_auth(handle->zh, scheme, cert, cert_len,
-                void_completion_dispatch, cdata);
-        lua_pop(L, 1); // popup the thread.
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+static void _zklua_request_free(zklua_request_t *req)
+{
+    free((char *)req->path);
+    free((char *)req->value);
+    if (req->acl != NULL) {
+        _zklua_free_acls((struct ACL_vector *)req->acl);
+        free((struct ACL_vector *)req->acl);
     }
+    free(req);
 }
 
-static int zklua_is_unrecoverable(lua_State *L)
+/**
+ * hand @req@ to the zookeeper client.
+ **/
+static int _zklua_request_submit(zhandle_t *zh, zklua_request_t *req)
 {
-    int ret = 0;
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (handle->zh != NULL) {
-        ret = is_unrecoverable(handle->zh);
-        lua_pushinteger(L, ret);
-        return 1;
+    switch (req->op) {
+        case ZKLUA_OP_CREATE:
+            return zoo_acreate(zh, req->path, req->value, req->value_len,
+                    req->acl, req->flags, string_completion_dispatch, req->cdata);
+        case ZKLUA_OP_DELETE:
+            return zoo_adelete(zh, req->path, req->version,
+                    void_completion_dispatch, req->cdata);
+        case ZKLUA_OP_EXISTS:
+            return zoo_aexists(zh, req->path, req->watch,
+                    stat_completion_dispatch, req->cdata);
+        case ZKLUA_OP_WEXISTS:
+            return zoo_awexists(zh, req->path, local_watcher_dispatch,
+                    req->watcherctx, stat_completion_dispatch, req->cdata);
+        case ZKLUA_OP_GET:
+            return zoo_aget(zh, req->path, req->watch,
+                    data_completion_dispatch, req->cdata);
+        case ZKLUA_OP_WGET:
+            return zoo_awget(zh, req->path, local_watcher_dispatch,
+                    req->watcherctx, data_completion_dispatch, req->cdata);
+        case ZKLUA_OP_SET:
+            return zoo_aset(zh, req->path, req->value, req->value_len,
+                    req->version, stat_completion_dispatch, req->cdata);
+        case ZKLUA_OP_GET_CHILDREN:
+            return zoo_aget_children(zh, req->path, req->watch,
+                    strings_completion_dispatch, req->cdata);
+        case ZKLUA_OP_WGET_CHILDREN:
+            return zoo_awget_children(zh, req->path, local_watcher_dispatch,
+                    req->watcherctx, strings_completion_dispatch, req->cdata);
+        case ZKLUA_OP_GET_CHILDREN2:
+            return zoo_aget_children2(zh, req->path, req->watch,
+                    strings_stat_completion_dispatch, req->cdata);
+        case ZKLUA_OP_WGET_CHILDREN2:
+            return zoo_awget_children2(zh, req->path, local_watcher_dispatch,
+                    req->watcherctx, strings_stat_completion_dispatch, req->cdata);
+        case ZKLUA_OP_SYNC:
+            return zoo_async(zh, req->path,
+                    string_completion_dispatch, req->cdata);
+        case ZKLUA_OP_GET_ACL:
+            return zoo_aget_acl(zh, req->path,
+                    acl_completion_dispatch, req->cdata);
+        case ZKLUA_OP_SET_ACL:
+            return zoo_aset_acl(zh, req->path, req->version,
+                    (struct ACL_vector *)req->acl,
+                    void_completion_dispatch, req->cdata);
+        default:
+            return ZBADARGUMENTS;
+    }
+}
+
+/**
+ * free the watcher context of @req@, whose watch was never set. on the
+ * thread closing the handle its references are left to the close state.
+ **/
+static void _zklua_request_release_watcher(zklua_request_t *req)
+{
+    zklua_local_watcher_context_t *wrapper =
+        (zklua_local_watcher_context_t *)req->watcherctx;
+    zklua_close_t *close = req->cdata->close;
+
+    if (wrapper == NULL) return;
+    req->watcherctx = NULL;
+    if (close != NULL && __atomic_load_n(&close->closing, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&close->lock);
+        _zklua_close_orphan(close, wrapper->zhref);
+        _zklua_close_orphan(close, wrapper->cbref);
+        pthread_mutex_unlock(&close->lock);
     } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+        _zklua_unref(wrapper->L, wrapper->zhref);
+        _zklua_unref(wrapper->L, wrapper->cbref);
     }
+    _zklua_watch_coalescer_release(wrapper->coalescer);
+    free(wrapper);
 }
 
-static int zklua_set_debug_level(lua_State *L)
+/**
+ * deliver @rc@ to the completion of a request that was accepted
+ * but could not be handed to the zookeeper client.
+ **/
+static void _zklua_request_fail(zklua_request_t *req, int rc)
 {
-    int level = luaL_checkint(L, -1);
-    switch(level) {
-        case ZOO_LOG_LEVEL_ERROR:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+    _zklua_request_release_watcher(req);
+    switch (req->op) {
+        case ZKLUA_OP_CREATE:
+        case ZKLUA_OP_SYNC:
+            string_completion_dispatch(rc, NULL, req->cdata);
             break;
-        case ZOO_LOG_LEVEL_WARN:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+        case ZKLUA_OP_DELETE:
+        case ZKLUA_OP_SET_ACL:
+            void_completion_dispatch(rc, req->cdata);
             break;
-        case ZOO_LOG_LEVEL_INFO:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
+        case ZKLUA_OP_EXISTS:
+        case ZKLUA_OP_WEXISTS:
+        case ZKLUA_OP_SET:
+            stat_completion_dispatch(rc, NULL, req->cdata);
             break;
-        case ZOO_LOG_LEVEL_DEBUG:
-            zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
+        case ZKLUA_OP_GET:
+        case ZKLUA_OP_WGET:
+            data_completion_dispatch(rc, NULL, -1, NULL, req->cdata);
+            break;
+        case ZKLUA_OP_GET_CHILDREN:
+        case ZKLUA_OP_WGET_CHILDREN:
+            strings_completion_dispatch(rc, NULL, req->cdata);
+            break;
+        case ZKLUA_OP_GET_CHILDREN2:
+        case ZKLUA_OP_WGET_CHILDREN2:
+            strings_stat_completion_dispatch(rc, NULL, NULL, req->cdata);
             break;
+        case ZKLUA_OP_GET_ACL:
+            acl_completion_dispatch(rc, NULL, NULL, req->cdata);
+            break;
+    }
+}
+
+/**
+ * return 1 if @req@ is a read that identical requests may share.
+ * reads leaving a watcher of their own are never shared.
+ **/
+static int _zklua_flight_eligible(const zklua_request_t *req)
+{
+    switch (req->op) {
+        case ZKLUA_OP_EXISTS:
+        case ZKLUA_OP_GET:
+        case ZKLUA_OP_GET_CHILDREN:
+        case ZKLUA_OP_GET_CHILDREN2:
+            return 1;
         default:
-            return luaL_error(L, "invalid arguments: "
-                    "unsupported log level specified.");
+            return 0;
     }
-    return 0;
 }
 
-static int zklua_set_log_stream(lua_State *L)
+/**
+ * unlink @flight@ from its bucket, the caller holds flights->lock.
+ **/
+static void _zklua_flight_detach(zklua_flight_t *flight)
 {
-    size_t stream_len = 0;
-    const char *stream = luaL_checklstring(L, -1, &stream_len);
-    zklua_log_stream = fopen(stream, "w+");
-    if (zklua_log_stream == NULL) return luaL_error(L,
-            "unable to open the specified file %s.", stream);
-    zoo_set_log_stream(zklua_log_stream);
-    return 0;
+    zklua_flight_t **link = NULL;
+    zklua_flights_t *flights = flight->flights;
+
+    if (flight->detached) return;
+    link = &flights->buckets[flight->hash % ZKLUA_FLIGHT_BUCKETS];
+    while (*link != flight) link = &(*link)->next;
+    *link = flight->next;
+    flight->next = NULL;
+    flight->detached = 1;
 }
 
-static int zklua_deterministic_conn_order(lua_State *L)
+/**
+ * attach @req@ to an identical read in flight. return 1 if it was attached
+ * and must not be submitted, 0 if it now carries a new flight.
+ **/
+static int _zklua_flight_join(zklua_flights_t *flights, zklua_request_t *req)
 {
-    size_t yesorno_len = 0;
-    const char *yesorno = luaL_checklstring(L, 1, &yesorno_len);
-    if (strcasecmp(yesorno, "yes") || strcasecmp(yesorno, "true")) {
-        zoo_deterministic_conn_order(1);
-    } else if (strcasecmp(yesorno, "no") || strcasecmp(yesorno, "false")) {
-        zoo_deterministic_conn_order(0);
+    unsigned int hash = 0;
+    zklua_flight_t *flight = NULL;
+
+    if (!_zklua_flight_eligible(req)) return 0;
+    hash = _zklua_hash_string(req->path);
+    pthread_mutex_lock(&flights->lock);
+    if (!flights->enabled) {
+        pthread_mutex_unlock(&flights->lock);
+        return 0;
+    }
+    for (flight = flights->buckets[hash % ZKLUA_FLIGHT_BUCKETS];
+            flight != NULL; flight = flight->next) {
+        if (flight->hash == hash && flight->op == req->op
+                && flight->watch == req->watch
+                && strcmp(flight->path, req->path) == 0) {
+            if (flight->waiters_tail != NULL) {
+                flight->waiters_tail->next = req->cdata;
+            } else {
+                flight->waiters = req->cdata;
+            }
+            flight->waiters_tail = req->cdata;
+            flights->coalesced++;
+            pthread_mutex_unlock(&flights->lock);
+            return 1;
+        }
+    }
+    /* no flight yet: this request carries one, if memory allows. */
+    flight = (zklua_flight_t *)calloc(1, sizeof(zklua_flight_t));
+    if (flight != NULL && (flight->path = strdup(req->path)) != NULL) {
+        flight->op = req->op;
+        flight->watch = req->watch;
+        flight->hash = hash;
+        flight->flights = flights;
+        flight->next = flights->buckets[hash % ZKLUA_FLIGHT_BUCKETS];
+        flights->buckets[hash % ZKLUA_FLIGHT_BUCKETS] = flight;
+        req->cdata->flight = flight;
     } else {
-        return luaL_error(L, "invalid argument: please choose "
-                "(yes, no) or (true, false).");
+        free(flight);
     }
+    pthread_mutex_unlock(&flights->lock);
     return 0;
 }
 
-static int zklua_create(lua_State *L)
+/**
+ * end the flight carried by @cdata@, if any: the requests attached to it
+ * are chained on @cdata@->next so that they get the same reply.
+ **/
+static void _zklua_flight_land(zklua_completion_data_t *cdata)
 {
-    size_t path_len = 0, value_len=0;
-    const char *path = NULL;
-    const char *value = NULL;
-    const char *data = NULL;
-    char path_buffer[ZKLUA_MAX_PATH_BUFFER_SIZE] = {0};
-    struct ACL_vector acl;
-    int flags = 0;
-    int ret = -1;
+    zklua_flight_t *flight = cdata->flight;
+    zklua_flights_t *flights = NULL;
+
+    if (flight == NULL) return;
+    cdata->flight = NULL;
+    flights = flight->flights;
+    pthread_mutex_lock(&flights->lock);
+    _zklua_flight_detach(flight);
+    cdata->next = flight->waiters;
+    pthread_mutex_unlock(&flights->lock);
+    free(flight->path);
+    free(flight);
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        value = luaL_checklstring(L, 3, &value_len);
-        if (!_zklua_parse_acls(L, 4, &acl)) return luaL_error(L,
-                "invalid ACL format.");
-        flags = luaL_checkint(L, 5);
-        ret = zoo_create(handle->zh, path, value, value_len,
-                (const struct ACL_vector *)&acl, flags,
-                path_buffer, ZKLUA_MAX_PATH_BUFFER_SIZE);
-        lua_pushinteger(L, ret);
-        lua_pushstring(L, path_buffer);
-        _zklua_free_acls(&acl);
-        return 2;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+/**
+ * a write to @path@ is about to be sent: reads of @path@, or of the
+ * children of its parent, issued from now on must not reuse a reply
+ * that may predate the write.
+ **/
+static void _zklua_flight_forget(zklua_handle_t *handle, const char *path)
+{
+    int i;
+    size_t parent_len = 0;
+    const char *slash = NULL;
+    zklua_flight_t *flight = NULL, *next = NULL;
+    zklua_flights_t *flights = handle->flights;
+
+    if (flights == NULL || path == NULL) return;
+    slash = strrchr(path, '/');
+    parent_len = (slash == NULL || slash == path) ? 1 : (size_t)(slash - path);
+    pthread_mutex_lock(&flights->lock);
+    for (i = 0; i < ZKLUA_FLIGHT_BUCKETS; ++i) {
+        for (flight = flights->buckets[i]; flight != NULL; flight = next) {
+            next = flight->next;
+            if (strcmp(flight->path, path) == 0
+                    || (strlen(flight->path) == parent_len
+                        && strncmp(flight->path, path, parent_len) == 0)) {
+                _zklua_flight_detach(flight);
+            }
+        }
     }
+    pthread_mutex_unlock(&flights->lock);
 }
 
-static int zklua_delete(lua_State *L)
+/**
+ * free the flight table of a closed handle, every flight has landed.
+ **/
+static void _zklua_flights_fini(zklua_flights_t *flights)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int version = 0;
-    int ret = -1;
+    if (flights == NULL) return;
+    pthread_mutex_destroy(&flights->lock);
+    free(flights);
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        version = luaL_checkint(L, 3);
-        ret = zoo_delete(handle->zh, path, version);
-        lua_pushinteger(L, ret);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+/**
+ * drop a request that was not sent. requests that attached to its flight
+ * meanwhile were told ZOK, so they still get a completion with @rc@.
+ **/
+static void _zklua_submit_abort(zklua_request_t *req, int rc)
+{
+    zklua_request_t waiters;
+
+    _zklua_request_release_watcher(req);
+    _zklua_flight_land(req->cdata);
+    if (req->cdata->next != NULL) {
+        _zklua_request_init(&waiters, req->op);
+        waiters.cdata = req->cdata->next;
+        _zklua_request_fail(&waiters, rc);
     }
+    _zklua_completion_abort(req->cdata, rc);
+    _zklua_completion_data_fini(req->cdata);
 }
 
-static int zklua_exists(lua_State *L)
+static void _zklua_combine_entry_free(zklua_combine_entry_t *entry)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int watch = 0;
-    struct Stat stat;
-    int ret = -1;
+    free(entry->path);
+    free(entry->value);
+    free(entry);
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        ret = zoo_exists(handle->zh, path, watch, &stat);
-        lua_pushinteger(L, ret);
-        _zklua_build_stat(L, &stat);
-        return 2;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+/**
+ * completion of a write sent on its own, every caller chained on the
+ * entry gets the result.
+ **/
+static void _zklua_combine_single_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_combine_entry_t *entry = (zklua_combine_entry_t *)data;
+    zklua_completion_data_t *cdata = NULL;
+
+    /* every caller holds a window slot, the dispatch only releases the
+     * one of the first. */
+    if (!_zklua_completion_dropped(entry->waiters)) {
+        for (cdata = entry->waiters->next; cdata != NULL; cdata = cdata->next) {
+            _zklua_window_complete(cdata, rc);
+        }
+        stat_completion_dispatch(rc, stat, entry->waiters);
     }
+    _zklua_combine_entry_free(entry);
 }
 
-static int zklua_wexists(lua_State *L)
+/**
+ * completion of the aexists sent by the flusher to report the writes of
+ * its failed list, chained on dirty_next, on the completion thread.
+ **/
+static void _zklua_combine_kick_completion(int rc, const struct Stat *stat,
+        const void *data)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    int watch = 0;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    struct Stat stat;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
+    zklua_combine_entry_t *entry = (zklua_combine_entry_t *)data;
+    zklua_combine_entry_t *next = NULL;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
+    for (; entry != NULL; entry = next) {
+        next = entry->dirty_next;
+        _zklua_combine_single_completion(entry->rc, NULL, entry);
+    }
+}
+
+/**
+ * send @entry@ on its own. if the client refuses it, its callers are told
+ * at once on the completion thread (@combiner@ NULL), otherwise the entry
+ * goes to the failed list of @combiner@, whose lock is held.
+ **/
+static void _zklua_combine_send_single(zklua_combiner_t *combiner,
+        zklua_combine_entry_t *entry)
+{
+    int ret = zoo_aset(entry->zh, entry->path, entry->value, entry->value_len,
+            -1, _zklua_combine_single_completion, entry);
+    if (ret == ZOK) return;
+    if (combiner == NULL) {
+        _zklua_combine_single_completion(ret, NULL, entry);
+        return;
+    }
+    entry->rc = ret;
+    entry->dirty_next = NULL;
+    if (combiner->failed_tail != NULL) {
+        combiner->failed_tail->dirty_next = entry;
+    } else {
+        combiner->failed_head = entry;
+    }
+    combiner->failed_tail = entry;
+    pthread_cond_signal(&combiner->cond);
+}
+
+static void _zklua_combine_batch_free(zklua_combine_batch_t *batch)
+{
+    free(batch->entries);
+    free(batch->ops);
+    free(batch->results);
+    free(batch->stats);
+    free(batch);
+}
+
+/**
+ * completion of a batch. a multi is all or nothing, so when one write is
+ * rejected (e.g. ZNONODE) the others are sent again one by one and every
+ * caller gets the result of its own path.
+ **/
+static void _zklua_combine_batch_completion(int rc, const void *data)
+{
+    int i;
+    zklua_combine_batch_t *batch = (zklua_combine_batch_t *)data;
+
+    for (i = 0; i < batch->count; ++i) {
+        if (rc == ZOK) {
+            _zklua_combine_single_completion(batch->results[i].err,
+                    &batch->stats[i], batch->entries[i]);
+        } else if (rc <= ZAPIERROR) {
+            _zklua_combine_send_single(NULL, batch->entries[i]);
+        } else {
+            _zklua_combine_single_completion(rc, NULL, batch->entries[i]);
+        }
+    }
+    _zklua_combine_batch_free(batch);
+}
+
+/**
+ * send @count@ entries chained on dirty_next, as one multi if possible.
+ * the caller holds combiner->lock.
+ **/
+static void _zklua_combine_flush(zklua_combiner_t *combiner,
+        zklua_combine_entry_t *entries, int count)
+{
+    int i, ret = -1;
+    zklua_combine_entry_t *entry = NULL, *next = NULL;
+    zklua_combine_batch_t *batch = NULL;
+
+    if (count > 1) {
+        batch = (zklua_combine_batch_t *)calloc(1, sizeof(zklua_combine_batch_t));
+    }
+    if (batch != NULL) {
+        batch->entries = (zklua_combine_entry_t **)calloc(count,
+                sizeof(zklua_combine_entry_t *));
+        batch->ops = (zoo_op_t *)calloc(count, sizeof(zoo_op_t));
+        batch->results = (zoo_op_result_t *)calloc(count, sizeof(zoo_op_result_t));
+        batch->stats = (struct Stat *)calloc(count, sizeof(struct Stat));
+        if (batch->entries == NULL || batch->ops == NULL
+                || batch->results == NULL || batch->stats == NULL) {
+            _zklua_combine_batch_free(batch);
+            batch = NULL;
+        }
+    }
+    if (batch != NULL) {
+        batch->count = count;
+        for (i = 0, entry = entries; i < count; ++i, entry = entry->dirty_next) {
+            batch->entries[i] = entry;
+            zoo_set_op_init(&batch->ops[i], entry->path, entry->value,
+                    entry->value_len, -1, &batch->stats[i]);
+        }
+        ret = zoo_amulti(entries->zh, count, batch->ops, batch->results,
+                _zklua_combine_batch_completion, batch);
+        if (ret == ZOK) return;
+        _zklua_combine_batch_free(batch);
+    }
+    for (entry = entries; entry != NULL && count-- > 0; entry = next) {
+        next = entry->dirty_next;
+        _zklua_combine_send_single(combiner, entry);
+    }
+}
+
+/**
+ * flusher thread: waits for the flush window of the oldest dirty path to
+ * end, then sends the dirty paths in batches of at most max_batch. the
+ * failed list is handed to an aexists, or kept a window longer if that
+ * is refused too (e.g. the session expired), _zklua_combiner_fini
+ * reports what is left.
+ **/
+static void *_zklua_combiner_run(void *arg)
+{
+    int count = 0;
+    int ret = -1;
+    uint64_t now = 0, deadline = 0;
+    struct timespec ts;
+    zklua_combine_entry_t *entries = NULL, *entry = NULL, **link = NULL;
+    zklua_combine_entry_t *failed_tail = NULL;
+    zklua_combiner_t *combiner = (zklua_combiner_t *)arg;
+
+    pthread_mutex_lock(&combiner->lock);
+    for (;;) {
+        now = _zklua_now_us();
+        if (combiner->failed_head != NULL && now >= combiner->retry_us) {
+            entries = combiner->failed_head;
+            failed_tail = combiner->failed_tail;
+            combiner->failed_head = NULL;
+            combiner->failed_tail = NULL;
+            ret = zoo_aexists(combiner->zh, "/", 0,
+                    _zklua_combine_kick_completion, entries);
+            if (ret != ZOK) {
+                combiner->failed_head = entries;
+                combiner->failed_tail = failed_tail;
+                combiner->retry_us = now + ((combiner->window_us > 1000) ?
+                        combiner->window_us : 1000);
+            }
+            continue;
+        }
+        if (combiner->dirty_head != NULL && (combiner->stop
+                    || now >= combiner->first_dirty_us + combiner->window_us)) {
+            /* later writes to these paths start new entries. */
+            entries = combiner->dirty_head;
+            for (count = 0, entry = entries; entry != NULL
+                    && count < combiner->max_batch; entry = entry->dirty_next) {
+                link = &combiner->buckets[entry->hash % ZKLUA_COMBINE_BUCKETS];
+                while (*link != entry) link = &(*link)->next;
+                *link = entry->next;
+                combiner->dirty_head = entry->dirty_next;
+                count++;
+            }
+            /* paths left over by max_batch are overdue already. */
+            if (combiner->dirty_head == NULL) combiner->dirty_tail = NULL;
+            _zklua_combine_flush(combiner, entries, count);
+            continue;
+        }
+        if (combiner->stop) break;
+        deadline = 0;
+        if (combiner->dirty_head != NULL) {
+            deadline = combiner->first_dirty_us + combiner->window_us;
+        }
+        if (combiner->failed_head != NULL
+                && (deadline == 0 || combiner->retry_us < deadline)) {
+            deadline = combiner->retry_us;
+        }
+        if (deadline == 0) {
+            pthread_cond_wait(&combiner->cond, &combiner->lock);
+        } else {
+            ts.tv_sec = deadline / 1000000;
+            ts.tv_nsec = (deadline % 1000000) * 1000;
+            pthread_cond_timedwait(&combiner->cond, &combiner->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&combiner->lock);
+    return NULL;
+}
+
+/**
+ * send the write pending for @path@ right away: a request on @path@
+ * issued next must not overtake it. called on the lua thread.
+ **/
+static void _zklua_combiner_flush_path(zklua_handle_t *handle,
+        const char *path)
+{
+    unsigned int hash = 0;
+    zklua_combiner_t *combiner = handle->combiner;
+    zklua_combine_entry_t *entry = NULL, *prev = NULL, **link = NULL;
+
+    if (combiner == NULL || path == NULL) return;
+    hash = _zklua_hash_string(path);
+    pthread_mutex_lock(&combiner->lock);
+    link = &combiner->buckets[hash % ZKLUA_COMBINE_BUCKETS];
+    while (*link != NULL && ((*link)->hash != hash
+                || strcmp((*link)->path, path) != 0)) {
+        link = &(*link)->next;
+    }
+    if ((entry = *link) != NULL) {
+        *link = entry->next;
+        while (prev == NULL ? combiner->dirty_head != entry
+                : prev->dirty_next != entry) {
+            prev = (prev == NULL) ? combiner->dirty_head : prev->dirty_next;
+        }
+        if (prev != NULL) {
+            prev->dirty_next = entry->dirty_next;
+        } else {
+            combiner->dirty_head = entry->dirty_next;
+        }
+        if (combiner->dirty_tail == entry) combiner->dirty_tail = prev;
+        _zklua_combine_send_single(combiner, entry);
+    }
+    pthread_mutex_unlock(&combiner->lock);
+}
+
+/**
+ * record the write @req@ in the combiner, replacing any value pending for
+ * the same path. return ZOK, or -1 if @req@ must be sent as is.
+ **/
+static int _zklua_combiner_add(zklua_combiner_t *combiner, zklua_request_t *req)
+{
+    unsigned int hash = _zklua_hash_string(req->path);
+    char *value = NULL;
+    zklua_combine_entry_t *entry = NULL;
+
+    value = (char *)malloc(req->value_len > 0 ? req->value_len : 1);
+    if (value == NULL) return -1;
+    if (req->value_len > 0) memcpy(value, req->value, req->value_len);
+    pthread_mutex_lock(&combiner->lock);
+    for (entry = combiner->buckets[hash % ZKLUA_COMBINE_BUCKETS];
+            entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->path, req->path) == 0) break;
+    }
+    if (entry == NULL) {
+        entry = (zklua_combine_entry_t *)calloc(1, sizeof(zklua_combine_entry_t));
+        if (entry == NULL || (entry->path = strdup(req->path)) == NULL) {
+            pthread_mutex_unlock(&combiner->lock);
+            free(entry);
+            free(value);
+            return -1;
+        }
+        entry->hash = hash;
+        entry->zh = combiner->zh;
+        entry->next = combiner->buckets[hash % ZKLUA_COMBINE_BUCKETS];
+        combiner->buckets[hash % ZKLUA_COMBINE_BUCKETS] = entry;
+        if (combiner->dirty_tail != NULL) {
+            combiner->dirty_tail->dirty_next = entry;
+        } else {
+            combiner->dirty_head = entry;
+            combiner->first_dirty_us = _zklua_now_us();
+            pthread_cond_signal(&combiner->cond);
+        }
+        combiner->dirty_tail = entry;
+    }
+    /* last writer wins. */
+    free(entry->value);
+    entry->value = value;
+    entry->value_len = req->value_len;
+    if (entry->waiters_tail != NULL) {
+        entry->waiters_tail->next = req->cdata;
+    } else {
+        entry->waiters = req->cdata;
+    }
+    entry->waiters_tail = req->cdata;
+    pthread_mutex_unlock(&combiner->lock);
+    return ZOK;
+}
+
+/**
+ * stop the flusher of @handle@ after it has sent every pending write.
+ * the writes the client refused are reported here, on the lua thread.
+ **/
+static void _zklua_combiner_fini(zklua_handle_t *handle)
+{
+    zklua_combiner_t *combiner = handle->combiner;
+    zklua_combine_entry_t *entry = NULL, *next = NULL;
+    zklua_completion_data_t *cdata = NULL;
+
+    if (combiner == NULL) return;
+    pthread_mutex_lock(&combiner->lock);
+    combiner->stop = 1;
+    pthread_cond_signal(&combiner->cond);
+    pthread_mutex_unlock(&combiner->lock);
+    pthread_join(combiner->thread, NULL);
+    handle->combiner = NULL;
+    for (entry = combiner->failed_head; entry != NULL; entry = next) {
+        next = entry->dirty_next;
+        for (cdata = entry->waiters; cdata != NULL; cdata = cdata->next) {
+            _zklua_window_finish(cdata, entry->rc, 0);
+        }
+        _zklua_combine_single_completion(entry->rc, NULL, entry);
+    }
+    pthread_cond_destroy(&combiner->cond);
+    pthread_mutex_destroy(&combiner->lock);
+    free(combiner);
+}
+
+static void _zklua_watch_coalescer_release(zklua_watch_coalescer_t *coalescer)
+{
+    if (__atomic_sub_fetch(&coalescer->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    pthread_cond_destroy(&coalescer->cond);
+    pthread_mutex_destroy(&coalescer->lock);
+    free(coalescer);
+}
+
+/**
+ * call the lua watcher of @event@ as local_watcher_dispatch does, with
+ * the number of events merged as a last argument, then free @event@ and
+ * its watcher contexts.
+ **/
+static void _zklua_watch_deliver(zklua_watch_event_t *event)
+{
+    zklua_local_watcher_context_t *wrapper = event->wrappers;
+    zklua_local_watcher_context_t *next = NULL;
+    lua_State *L = wrapper->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, wrapper->cbref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, wrapper->zhref);
+    lua_pushinteger(L, event->type);
+    lua_pushinteger(L, event->state);
+    lua_pushstring(L, event->path);
+    lua_pushstring(L, wrapper->context);
+    lua_pushinteger(L, event->count);
+    lua_call(L, 6, 0);
+    for (; wrapper != NULL; wrapper = next) {
+        next = wrapper->next;
+        _zklua_unref(L, wrapper->zhref);
+        _zklua_unref(L, wrapper->cbref);
+        _zklua_watch_coalescer_release(wrapper->coalescer);
+        free(wrapper);
+    }
+    free(event->path);
+    free(event);
+}
+
+/**
+ * free @event@ without calling into lua, from the thread closing the
+ * handle or the flusher of an expired one: the references of its watcher
+ * contexts are left to @close@, whose lock is held.
+ **/
+static void _zklua_watch_drop(zklua_watch_event_t *event, zklua_close_t *close)
+{
+    zklua_local_watcher_context_t *wrapper = NULL;
+    zklua_local_watcher_context_t *next = NULL;
+
+    for (wrapper = event->wrappers; wrapper != NULL; wrapper = next) {
+        next = wrapper->next;
+        _zklua_close_orphan(close, wrapper->zhref);
+        _zklua_close_orphan(close, wrapper->cbref);
+        _zklua_watch_coalescer_release(wrapper->coalescer);
+        free(wrapper);
+    }
+    free(event->path);
+    free(event);
+}
+
+static int _zklua_watch_same_context(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * hold the event of @wrapper@ in its coalescer, merged into a pending
+ * event of the same path, type, lua watcher and watcher context, the one
+ * delivered. return 0 if it must be
+ * delivered at once: session events, or coalescing turned off since the
+ * watch was set.
+ **/
+static int _zklua_watch_coalesce(zklua_local_watcher_context_t *wrapper,
+        int type, int state, const char *path)
+{
+    zklua_watch_coalescer_t *coalescer = wrapper->coalescer;
+    zklua_watch_event_t *event = NULL;
+    unsigned int hash = 0;
+
+    if (type == ZOO_SESSION_EVENT || path == NULL) goto deliver;
+    hash = _zklua_hash_string(path);
+    pthread_mutex_lock(&coalescer->lock);
+    if (coalescer->stop) {
+        pthread_mutex_unlock(&coalescer->lock);
+        goto deliver;
+    }
+    for (event = coalescer->buckets[hash % ZKLUA_WATCH_COALESCE_BUCKETS];
+            event != NULL; event = event->next) {
+        if (event->hash == hash && event->type == type
+                && event->wrappers->fn == wrapper->fn
+                && _zklua_watch_same_context(
+                    (const char *)event->wrappers->context,
+                    (const char *)wrapper->context)
+                && strcmp(event->path, path) == 0) break;
+    }
+    if (event == NULL) {
+        event = (zklua_watch_event_t *)calloc(1, sizeof(zklua_watch_event_t));
+        if (event == NULL || (event->path = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&coalescer->lock);
+            free(event);
+            goto deliver;
+        }
+        event->hash = hash;
+        event->type = type;
+        event->first_us = _zklua_now_us();
+        event->wrappers = wrapper;
+        event->next = coalescer->buckets[hash % ZKLUA_WATCH_COALESCE_BUCKETS];
+        coalescer->buckets[hash % ZKLUA_WATCH_COALESCE_BUCKETS] = event;
+        if (coalescer->pending_tail != NULL) {
+            coalescer->pending_tail->order_next = event;
+        } else {
+            coalescer->pending_head = event;
+            pthread_cond_signal(&coalescer->cond);
+        }
+        coalescer->pending_tail = event;
+    } else {
+        event->wrappers_tail->next = wrapper;
+    }
+    wrapper->next = NULL;
+    event->wrappers_tail = wrapper;
+    event->state = state;
+    event->count++;
+    pthread_mutex_unlock(&coalescer->lock);
+    return 1;
+
+deliver:
+    wrapper->coalescer = NULL;
+    _zklua_watch_coalescer_release(coalescer);
+    return 0;
+}
+
+/**
+ * completion of the aexists sent by the flusher, run on the completion
+ * thread like the watchers: deliver the due events, or drop them when
+ * aclose runs it.
+ **/
+static void _zklua_watch_kick_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_watch_coalescer_t *coalescer = (zklua_watch_coalescer_t *)data;
+    zklua_close_t *close = coalescer->close;
+    zklua_watch_event_t *events = NULL;
+    zklua_watch_event_t *next = NULL;
+
+    pthread_mutex_lock(&coalescer->lock);
+    events = coalescer->due_head;
+    coalescer->due_head = NULL;
+    coalescer->due_tail = NULL;
+    coalescer->kicking = 0;
+    pthread_cond_signal(&coalescer->cond);
+    pthread_mutex_unlock(&coalescer->lock);
+    if (close != NULL && __atomic_load_n(&close->closing, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&close->lock);
+        for (; events != NULL; events = next) {
+            next = events->order_next;
+            _zklua_watch_drop(events, close);
+        }
+        pthread_mutex_unlock(&close->lock);
+    } else {
+        for (; events != NULL; events = next) {
+            next = events->order_next;
+            _zklua_watch_deliver(events);
+        }
+    }
+    _zklua_watch_coalescer_release(coalescer);
+}
+
+/**
+ * flusher thread: moves the events whose window ended to the due list
+ * and has them delivered by the completion of an aexists, one at a time.
+ * a kick that can not be sent is retried a window later, unless the
+ * session is lost for good: no completion will ever run, and the due
+ * events are dropped, their references left to the close state.
+ **/
+static void *_zklua_watch_coalescer_run(void *arg)
+{
+    zklua_watch_coalescer_t *coalescer = (zklua_watch_coalescer_t *)arg;
+    zklua_watch_event_t *event = NULL;
+    zklua_watch_event_t *next = NULL;
+    zklua_watch_event_t **link = NULL;
+    struct timespec ts;
+    uint64_t now = 0;
+    uint64_t deadline = 0;
+    uint64_t retry = 0;
+    int state = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&coalescer->lock);
+    while (!coalescer->stop) {
+        now = _zklua_now_us();
+        while ((event = coalescer->pending_head) != NULL
+                && event->first_us + coalescer->window_us <= now) {
+            /* later events of this path start a new window. */
+            link = &coalescer->buckets[event->hash % ZKLUA_WATCH_COALESCE_BUCKETS];
+            while (*link != event) link = &(*link)->next;
+            *link = event->next;
+            coalescer->pending_head = event->order_next;
+            if (coalescer->pending_head == NULL) coalescer->pending_tail = NULL;
+            event->order_next = NULL;
+            if (coalescer->due_tail != NULL) {
+                coalescer->due_tail->order_next = event;
+            } else {
+                coalescer->due_head = event;
+            }
+            coalescer->due_tail = event;
+        }
+        if (coalescer->due_head != NULL && !coalescer->kicking && now >= retry) {
+            coalescer->kicking = 1;
+            __atomic_add_fetch(&coalescer->refs, 1, __ATOMIC_ACQ_REL);
+            pthread_mutex_unlock(&coalescer->lock);
+            rc = zoo_aexists(coalescer->zh, "/", 0,
+                    _zklua_watch_kick_completion, coalescer);
+            pthread_mutex_lock(&coalescer->lock);
+            if (rc != ZOK) {
+                /* the handle keeps its reference, refs stays above 0. */
+                coalescer->kicking = 0;
+                __atomic_sub_fetch(&coalescer->refs, 1, __ATOMIC_ACQ_REL);
+                retry = now + ((coalescer->window_us > 1000) ?
+                        coalescer->window_us : 1000);
+                state = zoo_state(coalescer->zh);
+                if (coalescer->close != NULL && (rc == ZINVALIDSTATE
+                            || state == ZOO_EXPIRED_SESSION_STATE
+                            || state == ZOO_AUTH_FAILED_STATE)) {
+                    event = coalescer->due_head;
+                    coalescer->due_head = NULL;
+                    coalescer->due_tail = NULL;
+                    pthread_mutex_unlock(&coalescer->lock);
+                    pthread_mutex_lock(&coalescer->close->lock);
+                    for (; event != NULL; event = next) {
+                        next = event->order_next;
+                        _zklua_watch_drop(event, coalescer->close);
+                    }
+                    pthread_mutex_unlock(&coalescer->close->lock);
+                    pthread_mutex_lock(&coalescer->lock);
+                }
+            }
+            continue;
+        }
+        deadline = 0;
+        if (coalescer->pending_head != NULL) {
+            deadline = coalescer->pending_head->first_us + coalescer->window_us;
+        }
+        if (coalescer->due_head != NULL && !coalescer->kicking
+                && (deadline == 0 || retry < deadline)) {
+            deadline = retry;
+        }
+        if (deadline == 0) {
+            pthread_cond_wait(&coalescer->cond, &coalescer->lock);
+        } else {
+            ts.tv_sec = deadline / 1000000;
+            ts.tv_nsec = (deadline % 1000000) * 1000;
+            pthread_cond_timedwait(&coalescer->cond, &coalescer->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&coalescer->lock);
+    return NULL;
+}
+
+/**
+ * stop coalescing the watch events of @handle@. the events held are
+ * delivered now, but those a kick in flight will deliver.
+ **/
+static void _zklua_watch_coalescer_fini(zklua_handle_t *handle)
+{
+    zklua_watch_coalescer_t *coalescer = handle->watch_coalescer;
+    zklua_watch_event_t *events = NULL;
+    zklua_watch_event_t *next = NULL;
+
+    if (coalescer == NULL) return;
+    pthread_mutex_lock(&coalescer->lock);
+    coalescer->stop = 1;
+    pthread_cond_signal(&coalescer->cond);
+    pthread_mutex_unlock(&coalescer->lock);
+    pthread_join(coalescer->thread, NULL);
+    handle->watch_coalescer = NULL;
+
+    pthread_mutex_lock(&coalescer->lock);
+    events = coalescer->pending_head;
+    if (!coalescer->kicking && coalescer->due_head != NULL) {
+        coalescer->due_tail->order_next = events;
+        events = coalescer->due_head;
+        coalescer->due_head = NULL;
+        coalescer->due_tail = NULL;
+    }
+    coalescer->pending_head = NULL;
+    coalescer->pending_tail = NULL;
+    memset(coalescer->buckets, 0, sizeof(coalescer->buckets));
+    pthread_mutex_unlock(&coalescer->lock);
+    for (; events != NULL; events = next) {
+        next = events->order_next;
+        _zklua_watch_deliver(events);
+    }
+    _zklua_watch_coalescer_release(coalescer);
+}
+
+/**
+ * hand @req@ to the write combiner if @combine@ is set and it takes it,
+ * to the zookeeper client otherwise.
+ **/
+static int _zklua_request_send(zklua_handle_t *handle, zklua_request_t *req,
+        int combine)
+{
+    if (combine && _zklua_combiner_add(handle->combiner, req) == ZOK) {
+        return ZOK;
+    }
+    return _zklua_request_submit(handle->zh, req);
+}
+
+/**
+ * take a window slot for @cdata@ and send @req@ (see _zklua_request_send),
+ * the caller holds window->lock, which is released. a combined write
+ * keeps its slot until the write is sent and completed.
+ **/
+static int _zklua_window_start(zklua_handle_t *handle, zklua_request_t *req,
+        int combine)
+{
+    int ret = -1;
+    zklua_window_t *window = handle->window;
+
+    window->inflight++;
+    pthread_mutex_unlock(&window->lock);
+    req->cdata->handle = handle;
+    req->cdata->start_us = _zklua_now_us();
+    ret = _zklua_request_send(handle, req, combine);
+    if (ret != ZOK) {
+        req->cdata->handle = NULL;
+        pthread_mutex_lock(&window->lock);
+        window->inflight--;
+        pthread_cond_broadcast(&window->cond);
+        pthread_mutex_unlock(&window->lock);
+    }
+    return ret;
+}
+
+/**
+ * submit an async request through the in-flight window of @handle@.
+ * on failure the completion data of @req@ is freed and the completion
+ * is not called.
+ **/
+static int _zklua_submit(zklua_handle_t *handle, zklua_request_t *req)
+{
+    int ret = -1;
+    int on_completion_thread = 0;
+    int combine = 0;
+    zklua_request_t *copy = NULL;
+    zklua_window_t *window = handle->window;
+
+    req->cdata->close = handle->close;
+    if (handle->flights != NULL) {
+        if (_zklua_flight_eligible(req)) {
+            if (_zklua_flight_join(handle->flights, req)) return ZOK;
+        } else if (req->op != ZKLUA_OP_GET_ACL) {
+            _zklua_flight_forget(handle, req->path);
+        }
+    }
+    /* conditional writes must not be merged, and a write still held for
+     * the path must reach the server before any other request on it. */
+    combine = (handle->combiner != NULL && req->op == ZKLUA_OP_SET
+            && req->version == -1);
+    if (!combine) _zklua_combiner_flush_path(handle, req->path);
+    if (window == NULL) {
+        ret = _zklua_request_send(handle, req, combine);
+        if (ret != ZOK) _zklua_submit_abort(req, ret);
+        return ret;
+    }
+    pthread_mutex_lock(&window->lock);
+    on_completion_thread = window->has_completion_thread
+        && pthread_equal(window->completion_thread, pthread_self());
+    if (window->mode == ZKLUA_WINDOW_OFF
+            || window->inflight < (int)window->limit) {
+        ret = _zklua_window_start(handle, req, combine);
+    } else if (window->mode == ZKLUA_WINDOW_WAIT) {
+        /* waiting on the completion thread would never wake up. */
+        while (!on_completion_thread && window->inflight >= (int)window->limit) {
+            pthread_cond_wait(&window->cond, &window->lock);
+        }
+        ret = _zklua_window_start(handle, req, combine);
+    } else if (window->mode == ZKLUA_WINDOW_QUEUE
+            && window->queued < window->queue_size
+            && (copy = _zklua_request_copy(req)) != NULL) {
+        /* queued writes are sent as is from the completion thread, the
+         * one held for the path goes first. */
+        if (combine) _zklua_combiner_flush_path(handle, req->path);
+        if (window->queue_tail != NULL) {
+            window->queue_tail->next = copy;
+        } else {
+            window->queue_head = copy;
+        }
+        window->queue_tail = copy;
+        window->queued++;
+        pthread_mutex_unlock(&window->lock);
+        return ZOK;
+    } else {
+        window->throttled++;
+        pthread_mutex_unlock(&window->lock);
+        ret = ZKLUA_THROTTLED;
+    }
+    if (ret != ZOK) _zklua_submit_abort(req, ret);
+    return ret;
+}
+
+/**
+ * release the window slot held by @cdata@, adapt the window to the
+ * observed latency and start queued requests that now fit.
+ **/
+static void _zklua_window_complete(zklua_completion_data_t *cdata, int rc)
+{
+    _zklua_window_finish(cdata, rc, 1);
+}
+
+/**
+ * see _zklua_window_complete, @on_completion_thread@ is 0 when a reply
+ * is reported from the lua thread.
+ **/
+static void _zklua_window_finish(zklua_completion_data_t *cdata, int rc,
+        int on_completion_thread)
+{
+    zklua_handle_t *handle = cdata->handle;
+    zklua_window_t *window = NULL;
+    zklua_request_t *req = NULL;
+    uint64_t now = 0, latency = 0;
+    int ret = ZOK;
+
+    if (handle == NULL || handle->window == NULL) return;
+    cdata->handle = NULL;
+    window = handle->window;
+    now = _zklua_now_us();
+    latency = now - cdata->start_us;
+
+    pthread_mutex_lock(&window->lock);
+    if (on_completion_thread) {
+        window->completion_thread = pthread_self();
+        window->has_completion_thread = 1;
+    }
+    window->inflight--;
+    window->latency_us = (window->latency_us == 0) ? latency
+        : (7 * window->latency_us + latency) / 8;
+    if (latency > window->target_us || rc == ZOPERATIONTIMEOUT
+            || rc == ZCONNECTIONLOSS) {
+        /* multiplicative decrease, at most once per round trip. */
+        if (now - window->last_decrease_us > window->latency_us) {
+            window->limit /= 2;
+            if (window->limit < window->min) window->limit = window->min;
+            window->last_decrease_us = now;
+        }
+    } else {
+        /* additive increase, about one slot per window of completions. */
+        window->limit += 1.0 / window->limit;
+        if (window->limit > window->max) window->limit = window->max;
+    }
+    while (window->queue_head != NULL && window->inflight < (int)window->limit) {
+        req = window->queue_head;
+        window->queue_head = req->next;
+        if (window->queue_head == NULL) window->queue_tail = NULL;
+        window->queued--;
+        if ((ret = _zklua_window_start(handle, req, 0)) != ZOK) {
+            _zklua_request_fail(req, ret);
+        }
+        _zklua_request_free(req);
+        pthread_mutex_lock(&window->lock);
+    }
+    pthread_cond_broadcast(&window->cond);
+    pthread_mutex_unlock(&window->lock);
+}
+
+/**
+ * free the window of a closed handle, queued requests are failed
+ * with ZCLOSING.
+ **/
+static void _zklua_window_fini(zklua_window_t *window)
+{
+    zklua_request_t *req = NULL;
+
+    if (window == NULL) return;
+    while ((req = window->queue_head) != NULL) {
+        window->queue_head = req->next;
+        _zklua_request_fail(req, ZCLOSING);
+        _zklua_request_free(req);
+    }
+    pthread_cond_destroy(&window->cond);
+    pthread_mutex_destroy(&window->lock);
+    free(window);
+}
+
+static zklua_call_t *_zklua_call_new(void)
+{
+    pthread_condattr_t attr;
+    zklua_call_t *call = (zklua_call_t *)calloc(1, sizeof(zklua_call_t));
+    if (call == NULL) return NULL;
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&call->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return call;
+}
+
+static void _zklua_call_free(zklua_call_t *call)
+{
+    free(call->value);
+    deallocate_String_vector(&call->strings);
+    _zklua_free_acls(&call->acl);
+    pthread_cond_destroy(&call->cond);
+    pthread_mutex_destroy(&call->lock);
+    free(call);
+}
+
+/**
+ * hand the reply to the waiting caller, or drop it if the caller
+ * gave up on it.
+ **/
+static void _zklua_call_finish(zklua_call_t *call, int rc)
+{
+    pthread_mutex_lock(&call->lock);
+    if (call->abandoned) {
+        pthread_mutex_unlock(&call->lock);
+        _zklua_call_free(call);
+        return;
+    }
+    call->rc = rc;
+    call->done = 1;
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+}
+
+static void _zklua_call_void_completion(int rc, const void *data)
+{
+    _zklua_call_finish((zklua_call_t *)data, rc);
+}
+
+static void _zklua_call_stat_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_call_t *call = (zklua_call_t *)data;
+    if (stat != NULL) call->stat = *stat;
+    _zklua_call_finish(call, rc);
+}
+
+static void _zklua_call_data_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_call_t *call = (zklua_call_t *)data;
+    call->value_len = -1;
+    if (value != NULL && value_len >= 0) {
+        call->value = (char *)malloc(value_len > 0 ? value_len : 1);
+        if (call->value != NULL) {
+            memcpy(call->value, value, value_len);
+            call->value_len = value_len;
+        } else if (rc == ZOK) {
+            rc = ZSYSTEMERROR;
+        }
+    }
+    if (stat != NULL) call->stat = *stat;
+    _zklua_call_finish(call, rc);
+}
+
+static void _zklua_call_strings_stat_completion(int rc,
+        const struct String_vector *strings, const struct Stat *stat,
+        const void *data)
+{
+    zklua_call_t *call = (zklua_call_t *)data;
+    if (!_zklua_copy_string_vector(&call->strings, strings) && rc == ZOK) {
+        rc = ZSYSTEMERROR;
+    }
+    if (stat != NULL) call->stat = *stat;
+    _zklua_call_finish(call, rc);
+}
+
+static void _zklua_call_strings_completion(int rc,
+        const struct String_vector *strings, const void *data)
+{
+    _zklua_call_strings_stat_completion(rc, strings, NULL, data);
+}
+
+static void _zklua_call_string_completion(int rc, const char *value,
+        const void *data)
+{
+    zklua_call_t *call = (zklua_call_t *)data;
+    if (value != NULL) {
+        call->value = strdup(value);
+        call->value_len = (call->value != NULL) ? (int)strlen(value) : -1;
+    }
+    _zklua_call_finish(call, rc);
+}
+
+static void _zklua_call_acl_completion(int rc, struct ACL_vector *acl,
+        struct Stat *stat, const void *data)
+{
+    zklua_call_t *call = (zklua_call_t *)data;
+    if (acl != NULL && !_zklua_copy_acls(&call->acl, acl) && rc == ZOK) {
+        rc = ZSYSTEMERROR;
+    }
+    if (stat != NULL) call->stat = *stat;
+    _zklua_call_finish(call, rc);
+}
+
+/**
+ * wait for the reply of *@call@, sent with return code @ret@, until
+ * @deadline@, or the deadline of @handle@ for _zklua_call_wait. *@call@
+ * is set to NULL when it must not be used any more: it was not sent, or
+ * the deadline passed and ZKLUA_TIMEDOUT is returned.
+ **/
+static int _zklua_call_wait_until(zklua_call_t **call, int ret,
+        uint64_t deadline)
+{
+    struct timespec ts;
+    zklua_call_t *c = *call;
+
+    if (ret != ZOK) {
+        _zklua_call_free(c);
+        *call = NULL;
+        return ret;
+    }
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    pthread_mutex_lock(&c->lock);
+    while (!c->done) {
+        if (pthread_cond_timedwait(&c->cond, &c->lock, &ts) != 0
+                && _zklua_now_us() >= deadline) break;
+    }
+    if (!c->done) {
+        /* the completion frees it when the reply shows up. */
+        c->abandoned = 1;
+        pthread_mutex_unlock(&c->lock);
+        *call = NULL;
+        return ZKLUA_TIMEDOUT;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return c->rc;
+}
+
+static int _zklua_call_wait(zklua_handle_t *handle, zklua_call_t **call,
+        int ret)
+{
+    return _zklua_call_wait_until(call, ret,
+            _zklua_now_us() + (uint64_t)handle->timeout * 1000);
+}
+
+/**
+ * the _zklua_call_* functions have the signature of the zoo_* sync calls
+ * they replace and honour the deadline set by set_timeout.
+ **/
+static int _zklua_call_create(zklua_handle_t *handle, const char *path,
+        const char *value, int value_len, const struct ACL_vector *acl,
+        int flags, char *path_buffer, int path_buffer_len)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_create(handle->zh, path, value, value_len, acl, flags,
+                path_buffer, path_buffer_len);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_acreate(handle->zh, path,
+                value, value_len, acl, flags, _zklua_call_string_completion,
+                call));
+    if (call == NULL) return ret;
+    if (ret == ZOK && call->value != NULL && path_buffer_len > 0) {
+        strncpy(path_buffer, call->value, path_buffer_len - 1);
+        path_buffer[path_buffer_len - 1] = '\0';
+    }
+    _zklua_call_free(call);
+    return ret;
+}
+
+static int _zklua_call_delete(zklua_handle_t *handle, const char *path,
+        int version)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_delete(handle->zh, path, version);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_adelete(handle->zh, path,
+                version, _zklua_call_void_completion, call));
+    if (call != NULL) _zklua_call_free(call);
+    return ret;
+}
+
+/**
+ * copy the stat of a finished call and free it.
+ **/
+static int _zklua_call_stat_result(zklua_call_t *call, int ret,
+        struct Stat *stat)
+{
+    if (call == NULL) return ret;
+    if (stat != NULL) *stat = call->stat;
+    _zklua_call_free(call);
+    return ret;
+}
+
+static int _zklua_call_exists(zklua_handle_t *handle, const char *path,
+        int watch, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_exists(handle->zh, path, watch, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aexists(handle->zh, path,
+                watch, _zklua_call_stat_completion, call));
+    return _zklua_call_stat_result(call, ret, stat);
+}
+
+static int _zklua_call_wexists(zklua_handle_t *handle, const char *path,
+        watcher_fn watcher, void *watcherctx, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_wexists(handle->zh, path, watcher, watcherctx, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_awexists(handle->zh, path,
+                watcher, watcherctx, _zklua_call_stat_completion, call));
+    return _zklua_call_stat_result(call, ret, stat);
+}
+
+/**
+ * copy the data of a finished call the way zoo_get does: at most
+ * *@buffer_len@ bytes, *@buffer_len@ is set to the copied length
+ * or -1 for a node without data.
+ **/
+static int _zklua_call_data_result(zklua_call_t *call, int ret,
+        char *buffer, int *buffer_len, struct Stat *stat)
+{
+    int len = 0;
+
+    if (call == NULL) return ret;
+    if (ret == ZOK) {
+        len = call->value_len;
+        if (len > *buffer_len) len = *buffer_len;
+        if (len > 0) memcpy(buffer, call->value, len);
+        *buffer_len = len;
+        if (stat != NULL) *stat = call->stat;
+    }
+    _zklua_call_free(call);
+    return ret;
+}
+
+static int _zklua_call_get(zklua_handle_t *handle, const char *path,
+        int watch, char *buffer, int *buffer_len, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_get(handle->zh, path, watch, buffer, buffer_len, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aget(handle->zh, path,
+                watch, _zklua_call_data_completion, call));
+    return _zklua_call_data_result(call, ret, buffer, buffer_len, stat);
+}
+
+static int _zklua_call_wget(zklua_handle_t *handle, const char *path,
+        watcher_fn watcher, void *watcherctx, char *buffer, int *buffer_len,
+        struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_wget(handle->zh, path, watcher, watcherctx,
+                buffer, buffer_len, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_awget(handle->zh, path,
+                watcher, watcherctx, _zklua_call_data_completion, call));
+    return _zklua_call_data_result(call, ret, buffer, buffer_len, stat);
+}
+
+static int _zklua_call_set2(zklua_handle_t *handle, const char *path,
+        const char *buffer, int buffer_len, int version, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_set2(handle->zh, path, buffer, buffer_len, version, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aset(handle->zh, path,
+                buffer, buffer_len, version, _zklua_call_stat_completion, call));
+    return _zklua_call_stat_result(call, ret, stat);
+}
+
+static int _zklua_call_set(zklua_handle_t *handle, const char *path,
+        const char *buffer, int buffer_len, int version)
+{
+    return _zklua_call_set2(handle, path, buffer, buffer_len, version, NULL);
+}
+
+/**
+ * move the children (and stat) of a finished call to the caller,
+ * who owns them as if zoo_get_children2 had filled them.
+ **/
+static int _zklua_call_strings_result(zklua_call_t *call, int ret,
+        struct String_vector *strings, struct Stat *stat)
+{
+    if (call == NULL) {
+        strings->count = 0;
+        strings->data = NULL;
+        return ret;
+    }
+    *strings = call->strings;
+    call->strings.count = 0;
+    call->strings.data = NULL;
+    if (stat != NULL) *stat = call->stat;
+    _zklua_call_free(call);
+    return ret;
+}
+
+static int _zklua_call_get_children2(zklua_handle_t *handle, const char *path,
+        int watch, struct String_vector *strings, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_get_children2(handle->zh, path, watch, strings, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aget_children2(handle->zh,
+                path, watch, _zklua_call_strings_stat_completion, call));
+    return _zklua_call_strings_result(call, ret, strings, stat);
+}
+
+static int _zklua_call_get_children(zklua_handle_t *handle, const char *path,
+        int watch, struct String_vector *strings)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_get_children(handle->zh, path, watch, strings);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aget_children(handle->zh,
+                path, watch, _zklua_call_strings_completion, call));
+    return _zklua_call_strings_result(call, ret, strings, NULL);
+}
+
+static int _zklua_call_wget_children2(zklua_handle_t *handle,
+        const char *path, watcher_fn watcher, void *watcherctx,
+        struct String_vector *strings, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_wget_children2(handle->zh, path, watcher, watcherctx,
+                strings, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_awget_children2(handle->zh,
+                path, watcher, watcherctx,
+                _zklua_call_strings_stat_completion, call));
+    return _zklua_call_strings_result(call, ret, strings, stat);
+}
+
+static int _zklua_call_wget_children(zklua_handle_t *handle,
+        const char *path, watcher_fn watcher, void *watcherctx,
+        struct String_vector *strings)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_wget_children(handle->zh, path, watcher, watcherctx,
+                strings);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_awget_children(handle->zh,
+                path, watcher, watcherctx,
+                _zklua_call_strings_completion, call));
+    return _zklua_call_strings_result(call, ret, strings, NULL);
+}
+
+static int _zklua_call_get_acl(zklua_handle_t *handle, const char *path,
+        struct ACL_vector *acl, struct Stat *stat)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_get_acl(handle->zh, path, acl, stat);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aget_acl(handle->zh, path,
+                _zklua_call_acl_completion, call));
+    if (call == NULL) {
+        acl->count = 0;
+        acl->data = NULL;
+        return ret;
+    }
+    *acl = call->acl;
+    call->acl.count = 0;
+    call->acl.data = NULL;
+    *stat = call->stat;
+    _zklua_call_free(call);
+    return ret;
+}
+
+static int _zklua_call_set_acl(zklua_handle_t *handle, const char *path,
+        int version, const struct ACL_vector *acl)
+{
+    int ret = -1;
+    zklua_call_t *call = NULL;
+
+    _zklua_combiner_flush_path(handle, path);
+    if (handle->timeout <= 0 || (call = _zklua_call_new()) == NULL) {
+        return zoo_set_acl(handle->zh, path, version, acl);
+    }
+    ret = _zklua_call_wait(handle, &call, zoo_aset_acl(handle->zh, path,
+                version, (struct ACL_vector *)acl,
+                _zklua_call_void_completion, call));
+    if (call != NULL) _zklua_call_free(call);
+    return ret;
+}
+
+static int _zklua_check_handle(lua_State *L, zklua_handle_t *handle)
+{
+    if (handle->zh) {
+        return 1;
+    } else {
+        luaL_error(L, "invalid zookeeper handle.");
+        return 0;
+    }
+}
+
+static int _zklua_ref(lua_State *L, int index)
+{
+    lua_pushvalue(L, index);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return ref;
+}
+
+static int _zklua_unref(lua_State *L, int ref)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return 0;
+}
+
+static zklua_global_watcher_context_t *_zklua_global_watcher_context_init(
+        lua_State *L, void *data)
+{
+    zklua_global_watcher_context_t *wrapper = (zklua_global_watcher_context_t *)malloc(
+        sizeof(zklua_global_watcher_context_t));
+    if (wrapper == NULL) {
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    wrapper->L = L;
+    wrapper->context = data;
+    return wrapper;
+}
+
+static zklua_local_watcher_context_t *_zklua_local_watcher_context_init(
+        lua_State *L, void *data, int zhref, int cbref)
+{
+    zklua_handle_t *handle = NULL;
+    zklua_local_watcher_context_t *wrapper = (zklua_local_watcher_context_t *)malloc(
+        sizeof(zklua_local_watcher_context_t));
+    if (wrapper == NULL) {
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    wrapper->L = L;
+    wrapper->context = data;
+    wrapper->zhref = zhref;
+    wrapper->cbref = cbref;
+    wrapper->coalescer = NULL;
+    wrapper->next = NULL;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cbref);
+    wrapper->fn = lua_topointer(L, -1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, zhref);
+    handle = (zklua_handle_t *)lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    if (handle != NULL && handle->watch_coalescer != NULL) {
+        wrapper->coalescer = handle->watch_coalescer;
+        __atomic_add_fetch(&wrapper->coalescer->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    return wrapper;
+}
+
+/**
+ * save watcher_fn into LUA_REGISTRYINDEX, and @index@ is the index in lua_State
+ * where the lua watcher_fn resides.
+ **/
+static void _zklua_save_watcherfn(lua_State *L, int index)
+{
+    lua_pushlightuserdata(L, (void *)&watcher_fn_key);
+    lua_pushvalue(L, index);
+    lua_settable(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * save zklua_handle_t *zh into LUA_REGISTRYINDEX, and @index@ is
+ * the index in lua_State where the lua watcher_fn resides.
+ **/
+static void _zklua_save_zklua_handle(lua_State *L, int index)
+{
+    lua_pushlightuserdata(L, (void *)&zklua_handle_key);
+    lua_pushvalue(L, index);
+    lua_settable(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * remove zklua_handle_t *zh from LUA_REGISTRYINDEX.
+ **/
+static void _zklua_remove_zklua_handle(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *)&zklua_handle_key);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * push a 64-bit session id as a "0x%016llx" string, lua numbers can not
+ * hold every session id exactly.
+ **/
+static void _zklua_push_session_id(lua_State *L, int64_t session_id)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "0x%016llx", (unsigned long long)session_id);
+    lua_pushstring(L, buffer);
+}
+
+/**
+ * read a session id from @index@, either a number or a string
+ * produced by _zklua_push_session_id.
+ **/
+static int64_t _zklua_check_session_id(lua_State *L, int index)
+{
+    if (lua_type(L, index) == LUA_TSTRING) {
+        const char *session_id = lua_tostring(L, index);
+        char *end = NULL;
+        unsigned long long value = strtoull(session_id, &end, 16);
+        if (end == session_id || *end != '\0') {
+            luaL_error(L, "invalid session id: %s.", session_id);
+        }
+        return (int64_t)value;
+    }
+    return (int64_t)luaL_checknumber(L, index);
+}
+
+/**
+ * initialize C clientid_t struct from lua table.
+ **/
+static clientid_t *_zklua_clientid_init(
+        lua_State *L, int index)
+{
+    size_t passwd_len = 0;
+    const char *clientid_passwd = NULL;
+    clientid_t *clientid = NULL;
+
+    luaL_checktype(L, index, LUA_TTABLE);
+    clientid = (clientid_t *)malloc(sizeof(clientid_t));
+    if (clientid == NULL) {
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+
+    /* prefer the exact hex session id over the lossy number. */
+    lua_getfield(L, index, "session_id");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_getfield(L, index, "client_id");
+    }
+    clientid->client_id = _zklua_check_session_id(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, index, "passwd");
+    clientid_passwd = luaL_checklstring(L, -1, &passwd_len);
+    if (passwd_len > sizeof(clientid->passwd)) {
+        passwd_len = sizeof(clientid->passwd);
+    }
+    memset(clientid->passwd, 0, sizeof(clientid->passwd));
+    memcpy(clientid->passwd, clientid_passwd, passwd_len);
+    lua_pop(L, 1);
+
+    return  clientid;
+}
+
+/**
+ * like _zklua_clientid_init, but nil means no previous session.
+ **/
+static clientid_t *_zklua_opt_clientid_init(
+        lua_State *L, int index)
+{
+    if (lua_isnil(L, index)) return NULL;
+    return _zklua_clientid_init(L, index);
+}
+
+static void _zklua_clientid_fini(clientid_t **clientid)
+{
+    if (*clientid != NULL) {
+        free(*clientid);
+        *clientid = NULL;
+    }
+}
+
+/**
+ * initialize a zookeeper handle.
+ **/
+static int zklua_init(lua_State *L)
+{
+    int top = lua_gettop(L);
+    size_t host_len = 0;
+    const char *host = NULL;
+    int recv_timeout = 0;
+    clientid_t *clientid = NULL;
+    size_t real_context_len = 0;
+    char *real_watcher_context = NULL;
+    int flags = 0;
+    zklua_global_watcher_context_t *wrapper = NULL;
+
+    zklua_handle_t *handle = (zklua_handle_t *)lua_newuserdata(L,
+            sizeof(zklua_handle_t));
+    memset(handle, 0, sizeof(zklua_handle_t));
+    handle->close = (zklua_close_t *)calloc(1, sizeof(zklua_close_t));
+    if (handle->close == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    pthread_mutex_init(&handle->close->lock, NULL);
+    luaL_getmetatable(L, ZKLUA_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    _zklua_save_zklua_handle(L, -1);
+
+    host = luaL_checklstring(L, 1, &host_len);
+    if (!_zklua_check_host(host)) {
+        return luaL_error(L, "invalid arguments:"
+                "host must be a string with format:\n"
+                "127.0.0.1:2081,127.0.0.1:2082");
+    }
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    _zklua_save_watcherfn(L, 2);
+    recv_timeout = luaL_checkint(L, 3);
+    switch(top) {
+        case 3:
+            wrapper = _zklua_global_watcher_context_init(L, NULL);
+            handle->zh = zookeeper_init(host, watcher_dispatch,
+                    recv_timeout, 0, wrapper, 0);
+            break;
+        case 4:
+            clientid = _zklua_opt_clientid_init(L, 4);
+            wrapper = _zklua_global_watcher_context_init(L, NULL);
+            handle->zh = zookeeper_init(host, watcher_dispatch,
+                    recv_timeout, clientid, wrapper, 0);
+            _zklua_clientid_fini(&clientid);
+            break;
+        case 5:
+            clientid = _zklua_opt_clientid_init(L, 4);
+            real_watcher_context = (char *)luaL_checklstring(L, 5, &real_context_len);
+            wrapper = _zklua_global_watcher_context_init(L, real_watcher_context);
+            handle->zh = zookeeper_init(host, watcher_dispatch,
+                    recv_timeout, clientid, wrapper, 0);
+            _zklua_clientid_fini(&clientid);
+            break;
+        case 6:
+            clientid = _zklua_opt_clientid_init(L, 4);
+            real_watcher_context = (char *)luaL_checklstring(L, 5, &real_context_len);
+            wrapper = _zklua_global_watcher_context_init(L, real_watcher_context);
+            flags = luaL_checkint(L, 6);
+            handle->zh = zookeeper_init(host, watcher_dispatch,
+                    recv_timeout, clientid, wrapper, flags);
+            _zklua_clientid_fini(&clientid);
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+/**
+ * release the lua threads of the completions dropped while closing,
+ * must run on the lua side.
+ **/
+static void _zklua_close_release(lua_State *L, zklua_close_t *close)
+{
+    int i;
+    pthread_mutex_lock(&close->lock);
+    for (i = 0; i < close->norphans; ++i) {
+        luaL_unref(L, LUA_REGISTRYINDEX, close->orphans[i]);
+    }
+    close->norphans = 0;
+    pthread_mutex_unlock(&close->lock);
+}
+
+static void _zklua_close_free(lua_State *L, zklua_close_t *close)
+{
+    _zklua_close_release(L, close);
+    pthread_mutex_destroy(&close->lock);
+    free(close->orphans);
+    free(close);
+}
+
+static zklua_waits_t *_zklua_waits_new(void)
+{
+    pthread_condattr_t attr;
+    zklua_waits_t *waits = (zklua_waits_t *)calloc(1, sizeof(zklua_waits_t));
+    if (waits == NULL) return NULL;
+    pthread_mutex_init(&waits->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waits->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return waits;
+}
+
+static void _zklua_sub_retain(zklua_sub_t *sub)
+{
+    __atomic_add_fetch(&sub->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+static void _zklua_sub_release(zklua_sub_t *sub)
+{
+    if (__atomic_sub_fetch(&sub->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        sub->release(sub);
+    }
+}
+
+/**
+ * start telling @sub@ about the events of the shared watcher, the
+ * subscription holds a reference on it.
+ **/
+static void _zklua_waits_subscribe(zklua_waits_t *waits, zklua_sub_t *sub)
+{
+    _zklua_sub_retain(sub);
+    pthread_mutex_lock(&waits->lock);
+    sub->next = waits->subs;
+    waits->subs = sub;
+    pthread_mutex_unlock(&waits->lock);
+}
+
+static void _zklua_waits_unsubscribe(zklua_waits_t *waits, zklua_sub_t *sub)
+{
+    zklua_sub_t **link = NULL;
+
+    pthread_mutex_lock(&waits->lock);
+    for (link = &waits->subs; *link != NULL && *link != sub;
+            link = &(*link)->next);
+    if (*link == NULL) {
+        pthread_mutex_unlock(&waits->lock);
+        return;
+    }
+    *link = sub->next;
+    pthread_mutex_unlock(&waits->lock);
+    _zklua_sub_release(sub);
+}
+
+/**
+ * register @wait@ for events on @path@, before the request that sets
+ * the watch so that no event can be missed.
+ **/
+static void _zklua_waits_add(zklua_waits_t *waits, zklua_lock_wait_t *wait,
+        const char *path)
+{
+    wait->path = path;
+    wait->fired = 0;
+    pthread_mutex_lock(&waits->lock);
+    wait->next = waits->head;
+    waits->head = wait;
+    pthread_mutex_unlock(&waits->lock);
+}
+
+static void _zklua_waits_remove(zklua_waits_t *waits, zklua_lock_wait_t *wait)
+{
+    zklua_lock_wait_t **link = NULL;
+
+    pthread_mutex_lock(&waits->lock);
+    for (link = &waits->head; *link != wait; link = &(*link)->next);
+    *link = wait->next;
+    pthread_mutex_unlock(&waits->lock);
+}
+
+static void _zklua_lost_free(zklua_lost_node_t *lost)
+{
+    zklua_lost_node_t *next = NULL;
+    for (; lost != NULL; lost = next) {
+        next = lost->next;
+        free(lost->dir);
+        free(lost->prefix);
+        free(lost);
+    }
+}
+
+/**
+ * free the waits of a closed session, no waiter is left and the
+ * subscriptions still there are dropped.
+ **/
+static void _zklua_waits_fini(zklua_waits_t *waits)
+{
+    zklua_sub_t *sub = NULL;
+
+    if (waits == NULL) return;
+    while ((sub = waits->subs) != NULL) {
+        waits->subs = sub->next;
+        _zklua_sub_release(sub);
+    }
+    _zklua_lost_free(waits->lost);
+    pthread_cond_destroy(&waits->cond);
+    pthread_mutex_destroy(&waits->lock);
+    free(waits);
+}
+
+/**
+ * shared watcher of the lock nodes of a session: wake the waits on @path@,
+ * or every wait on a session event so that they check the session state.
+ **/
+static void _zklua_waits_watcher(zhandle_t *zh, int type, int state,
+        const char *path, void *watcherctx)
+{
+    zklua_waits_t *waits = (zklua_waits_t *)watcherctx;
+    zklua_lock_wait_t *wait = NULL;
+    zklua_sub_t *sub = NULL, **subs = NULL;
+    int i, nsubs = 0;
+
+    pthread_mutex_lock(&waits->lock);
+    for (wait = waits->head; wait != NULL; wait = wait->next) {
+        if (type == ZOO_SESSION_EVENT || strcmp(wait->path, path) == 0) {
+            wait->fired = 1;
+        }
+    }
+    pthread_cond_broadcast(&waits->cond);
+    /* subscribers are notified without the lock, they may resubscribe. */
+    for (sub = waits->subs; sub != NULL; sub = sub->next) nsubs++;
+    if (nsubs > 0 && (subs = (zklua_sub_t **)malloc(
+                    nsubs * sizeof(zklua_sub_t *))) != NULL) {
+        for (i = 0, sub = waits->subs; sub != NULL; sub = sub->next) {
+            _zklua_sub_retain(sub);
+            subs[i++] = sub;
+        }
+    }
+    pthread_mutex_unlock(&waits->lock);
+    for (i = 0; subs != NULL && i < nsubs; ++i) {
+        subs[i]->notify(subs[i], type, state, path);
+        _zklua_sub_release(subs[i]);
+    }
+    free(subs);
+}
+
+/**
+ * free the per-handle state once zookeeper_close has returned.
+ **/
+static void _zklua_handle_fini(lua_State *L, zklua_handle_t *handle)
+{
+    _zklua_window_fini(handle->window);
+    handle->window = NULL;
+    _zklua_flights_fini(handle->flights);
+    handle->flights = NULL;
+    _zklua_waits_fini(handle->waits);
+    handle->waits = NULL;
+    if (handle->close != NULL) {
+        _zklua_close_free(L, handle->close);
+        handle->close = NULL;
+    }
+}
+
+static void _zklua_closed_watcher(zhandle_t *zh, int type, int state,
+        const char *path, void *watcherctx)
+{
+}
+
+static void *_zklua_close_run(void *arg)
+{
+    int rc = 0;
+    zklua_close_t *close = (zklua_close_t *)arg;
+
+    rc = zookeeper_close(close->zh);
+    /* queued requests are failed here, and dropped. */
+    _zklua_window_fini(close->window);
+    _zklua_flights_fini(close->flights);
+    _zklua_waits_fini(close->waits);
+    pthread_mutex_lock(&close->lock);
+    close->rc = rc;
+    close->done = 1;
+    pthread_mutex_unlock(&close->lock);
+    return NULL;
+}
+
+/**
+ * detach the close state from @handle@ and start closing it on its own
+ * thread, the handle can not be used any more.
+ **/
+static zklua_close_t *_zklua_close_start(lua_State *L, zklua_handle_t *handle)
+{
+    zklua_close_t *close = handle->close;
+
+    _zklua_combiner_fini(handle);
+    _zklua_watch_coalescer_fini(handle);
+    close->zh = handle->zh;
+    close->window = handle->window;
+    close->flights = handle->flights;
+    close->waits = handle->waits;
+    handle->zh = NULL;
+    handle->window = NULL;
+    handle->flights = NULL;
+    handle->waits = NULL;
+    handle->close = NULL;
+    __atomic_store_n(&close->closing, 1, __ATOMIC_RELEASE);
+    zoo_set_watcher(close->zh, _zklua_closed_watcher);
+    _zklua_remove_zklua_handle(L);
+    if (pthread_create(&close->thread, NULL, _zklua_close_run, close) == 0) {
+        close->started = 1;
+    } else {
+        _zklua_close_run(close);
+    }
+    return close;
+}
+
+/**
+ * wait for the closing thread, return its zookeeper_close result.
+ **/
+static int _zklua_close_join(lua_State *L, zklua_close_t *close)
+{
+    if (close->started) {
+        pthread_join(close->thread, NULL);
+        close->started = 0;
+    }
+    _zklua_close_release(L, close);
+    return close->rc;
+}
+
+static int zklua_aclose(lua_State *L)
+{
+    zklua_closer_t *closer = NULL;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        closer = (zklua_closer_t *)lua_newuserdata(L, sizeof(zklua_closer_t));
+        closer->close = NULL;
+        luaL_getmetatable(L, ZKLUA_CLOSER_METATABLE_NAME);
+        lua_setmetatable(L, -2);
+        closer->close = _zklua_close_start(L, handle);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_close_all(lua_State *L)
+{
+    int i, n;
+    zklua_handle_t *handle = NULL;
+    zklua_close_t **closes = NULL;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int)lua_objlen(L, 1);
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 1, i);
+        luaL_checkudata(L, -1, ZKLUA_METATABLE_NAME);
+        lua_pop(L, 1);
+    }
+    closes = (zklua_close_t **)lua_newuserdata(L,
+            (n > 0 ? n : 1) * sizeof(zklua_close_t *));
+    for (i = 0; i < n; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        handle = (zklua_handle_t *)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        closes[i] = (handle->zh != NULL) ? _zklua_close_start(L, handle) : NULL;
+    }
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; ++i) {
+        if (closes[i] != NULL) {
+            lua_pushinteger(L, _zklua_close_join(L, closes[i]));
+            _zklua_close_free(L, closes[i]);
+        } else {
+            lua_pushinteger(L, ZBADARGUMENTS);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static zklua_closer_t *_zklua_check_closer(lua_State *L, int index)
+{
+    zklua_closer_t *closer = (zklua_closer_t *)luaL_checkudata(L, index,
+            ZKLUA_CLOSER_METATABLE_NAME);
+    if (closer->close == NULL) luaL_error(L, "invalid closer.");
+    return closer;
+}
+
+static int zklua_closer_done(lua_State *L)
+{
+    int done = 0;
+    zklua_closer_t *closer = _zklua_check_closer(L, 1);
+
+    pthread_mutex_lock(&closer->close->lock);
+    done = closer->close->done;
+    pthread_mutex_unlock(&closer->close->lock);
+    if (!done) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, 1);
+    lua_pushinteger(L, _zklua_close_join(L, closer->close));
+    return 2;
+}
+
+static int zklua_closer_wait(lua_State *L)
+{
+    zklua_closer_t *closer = _zklua_check_closer(L, 1);
+    lua_pushinteger(L, _zklua_close_join(L, closer->close));
+    return 1;
+}
+
+static int zklua_closer_gc(lua_State *L)
+{
+    zklua_closer_t *closer = (zklua_closer_t *)luaL_checkudata(L, 1,
+            ZKLUA_CLOSER_METATABLE_NAME);
+    if (closer->close != NULL) {
+        _zklua_close_join(L, closer->close);
+        _zklua_close_free(L, closer->close);
+        closer->close = NULL;
+    }
+    return 0;
+}
+
+static int zklua_close(lua_State *L)
+{
+    int ret = 0;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (handle->zh != NULL) {
+        /* send the writes still held by the combiner. */
+        _zklua_combiner_fini(handle);
+        /* deliver the watch events still held. */
+        _zklua_watch_coalescer_fini(handle);
+        /* close zookeeper handle. */
+        ret = zookeeper_close(handle->zh);
+        handle->zh = NULL;
+        /* no completion can run any more. */
+        _zklua_handle_fini(L, handle);
+        /* remove zookeeper handle from LUA_REGISTRYINDEX. */
+        _zklua_remove_zklua_handle(L);
+    } else {
+        return luaL_error(L, "unable to close the zookeeper handle.");
+    }
+    /* close log stream. */
+    if (zklua_log_stream != NULL) fclose(zklua_log_stream);
+    /* push ret code of zookeeper_close() onto stack. */
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+/**
+ * push a lua table describing @clientid@, suitable for init.
+ **/
+static void _zklua_build_clientid(lua_State *L, const clientid_t *clientid)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "client_id");
+    lua_pushnumber(L, clientid->client_id);
+    lua_settable(L, -3);
+    lua_pushstring(L, "session_id");
+    _zklua_push_session_id(L, clientid->client_id);
+    lua_settable(L, -3);
+    lua_pushstring(L, "passwd");
+    lua_pushlstring(L, clientid->passwd, sizeof(clientid->passwd));
+    lua_settable(L, -3);
+}
+
+/**
+ * return clientid_t of the current connection.
+ **/
+static int zklua_client_id(lua_State *L)
+{
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        const clientid_t *clientid = zoo_client_id(handle->zh);
+        _zklua_build_clientid(L, clientid);
+        return 1;
+    } else {
+        return luaL_error(L, "unable to get client id.");
+    }
+}
+
+static void _zklua_put_uint64(unsigned char *buffer, uint64_t value)
+{
+    int i;
+    for (i = 7; i >= 0; --i) {
+        buffer[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static uint64_t _zklua_get_uint64(const unsigned char *buffer)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+/**
+ * save the session of the current connection to a file so that a restarted
+ * process can reattach to it with init before it expires.
+ **/
+static int zklua_save_session(lua_State *L)
+{
+    size_t filename_len = 0;
+    const char *filename = NULL;
+    char tmpname[ZKLUA_MAX_PATH_BUFFER_SIZE] = {0};
+    unsigned char record[ZKLUA_SESSION_FILE_SIZE] = {0};
+    const clientid_t *clientid = NULL;
+    int fd = -1;
+    int ret = ZOK;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        filename = luaL_checklstring(L, 2, &filename_len);
+        clientid = zoo_client_id(handle->zh);
+        if (clientid->client_id == 0) {
+            /* not connected yet, there is no session to save. */
+            lua_pushinteger(L, ZINVALIDSTATE);
+            return 1;
+        }
+        memcpy(record, ZKLUA_SESSION_FILE_MAGIC, 4);
+        record[4] = ZKLUA_SESSION_FILE_VERSION;
+        _zklua_put_uint64(record + 8, (uint64_t)clientid->client_id);
+        memcpy(record + 16, clientid->passwd, sizeof(clientid->passwd));
+
+        /* write a temporary file, synced to disk, and rename it, so a
+         * crash never leaves a truncated session file behind. the password
+         * grants the session: only the owner may read it. */
+        snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+        fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) return luaL_error(L,
+                "unable to open the specified file %s.", tmpname);
+        if (fchmod(fd, 0600) != 0
+                || write(fd, record, sizeof(record)) != (ssize_t)sizeof(record)
+                || fsync(fd) != 0) {
+            ret = ZSYSTEMERROR;
+        }
+        if (close(fd) != 0) ret = ZSYSTEMERROR;
+        if (ret == ZOK && rename(tmpname, filename) != 0) ret = ZSYSTEMERROR;
+        if (ret != ZOK) remove(tmpname);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "unable to save session.");
+    }
+}
+
+/**
+ * load a session saved by save_session, return a clientid table
+ * that can be passed to init, or nil and an error message.
+ **/
+static int zklua_load_session(lua_State *L)
+{
+    size_t filename_len = 0;
+    const char *filename = luaL_checklstring(L, 1, &filename_len);
+    unsigned char record[ZKLUA_SESSION_FILE_SIZE] = {0};
+    clientid_t clientid;
+    FILE *fp = NULL;
+    size_t nread = 0;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to open the specified file %s.", filename);
+        return 2;
+    }
+    nread = fread(record, 1, sizeof(record), fp);
+    fclose(fp);
+    if (nread != sizeof(record) || memcmp(record, ZKLUA_SESSION_FILE_MAGIC, 4) != 0
+            || record[4] != ZKLUA_SESSION_FILE_VERSION) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "invalid session file %s.", filename);
+        return 2;
+    }
+    clientid.client_id = (int64_t)_zklua_get_uint64(record + 8);
+    memcpy(clientid.passwd, record + 16, sizeof(clientid.passwd));
+    _zklua_build_clientid(L, &clientid);
+    return 1;
+}
+
+static int zklua_recv_timeout(lua_State *L)
+{
+    int recv_timeout = 0;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        recv_timeout = zoo_recv_timeout(handle->zh);
+        lua_pushinteger(L, recv_timeout);
+        return 1;
+    } else {
+        return luaL_error(L, "unable to get recv_timeout.");
+    }
+
+}
+
+static int zklua_get_context(lua_State *L)
+{
+    const char *context = NULL;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        context = zoo_get_context(handle->zh);
+        lua_pushstring(L, context);
+        return 1;
+    } else {
+        return luaL_error(L, "unable to get zookeeper handle context.");
+    }
+}
+
+static int zklua_set_context(lua_State *L)
+{
+    size_t context_len = 0;
+    char *context = NULL;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        context = (char *)luaL_checklstring(L, -1, &context_len);
+        zoo_set_context(handle->zh, context);
+        return 0;
+    } else {
+        return luaL_error(L, "unable to get zookeeper handle context.");
+    }
+}
+
+static int zklua_set_watcher(lua_State *L)
+{
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        lua_pushlightuserdata(L, (void *)&watcher_fn_key);
+        lua_gettable(L, LUA_REGISTRYINDEX);
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        _zklua_save_watcherfn(L, 2);
+        return 1;
+    } else {
+        return luaL_error(L, "unable to set zookeeper new watcher_fn.");
+    }
+}
+
+static int zklua_get_connected_host(lua_State *L)
+{
+    unsigned short port = 0;
+
+    struct sockaddr *paddr = NULL;
+    struct sockaddr saddr;
+    socklen_t socklen = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        paddr = zookeeper_get_connected_host(handle->zh, &saddr, &socklen);
+        if (paddr != NULL) {
+            if (socklen == sizeof(struct sockaddr_in)) {
+                char addrstr[INET_ADDRSTRLEN] = {0};
+                port = ntohs(((struct sockaddr_in *)paddr)->sin_port);
+                inet_ntop(AF_INET, &(((struct sockaddr_in *)paddr)->sin_addr), addrstr, INET_ADDRSTRLEN);
+                lua_pushstring(L, addrstr);
+                lua_pushinteger(L, port);
+                return 2;
+            } else if (socklen == sizeof(struct sockaddr_in6)) {
+                char addr6str[INET6_ADDRSTRLEN] = {0};
+                port = ntohs(((struct sockaddr_in6 *)paddr)->sin6_port);
+                inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)paddr)->sin6_addr), addr6str, INET6_ADDRSTRLEN);
+                lua_pushstring(L, addr6str);
+                lua_pushinteger(L, port);
+                return 2;
+            } else {
+                return luaL_error(L, "unsupported network sockaddr type.");
+            }
+        }
+    } else {
+        return luaL_error(L, "unable to get connected host.");
+    }
+    return 0;
+}
+
+/**
+ * TODO: implement zklua_interest later.
+ **/
+static int zklua_interest(lua_State *L)
+{
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    return 0;
+}
+
+/**
+ * TODO: implement zklua_process later.
+ **/
+static int zklua_process(lua_State *L)
+{
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    return 0;
+}
+
+static int zklua_state(lua_State *L)
+{
+    int ret = 0;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        ret = zoo_state(handle->zh);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * create a node asynchronously.
+ **/
+static int zklua_acreate(lua_State *L)
+{
+    size_t path_len = 0, value_len=0;
+    struct ACL_vector acl;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_CREATE);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.value = luaL_checklstring(L, 3, &value_len);
+        req.value_len = value_len;
+        if ((req.acl = _zklua_check_acls(L, 4, &acl)) == NULL) {
+            return luaL_error(L, "invalid ACL format.");
+        }
+        req.flags = luaL_checkint(L, 5);
+        req.cdata = _zklua_completion_data_init(L, 6, 7);
+        ret = _zklua_submit(handle, &req);
+        if (req.acl == &acl) _zklua_free_acls(&acl);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * delete a node asynchronously.
+ **/
+static int zklua_adelete(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_DELETE);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.version = luaL_checkint(L, 3);
+        req.cdata = _zklua_completion_data_init(L, 4, 5);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * checks the existence of a node in zookeeper.
+ **/
+static int zklua_aexists(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_EXISTS);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.watch = luaL_checkint(L, 3);
+        req.cdata = _zklua_completion_data_init(L, 4, 5);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * checks the existence of a node in zookeeper.
+ **/
+static int zklua_awexists(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    zklua_request_t req;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_WEXISTS);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        req.watcherctx = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        req.cdata = _zklua_completion_data_init(L, 5, 6);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * gets the data associated with a node.
+ **/
+static int zklua_aget(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_GET);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.watch = luaL_checkint(L, 3);
+        req.cdata = _zklua_completion_data_init(L, 4, 5);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_awget(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    zklua_request_t req;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_WGET);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        req.watcherctx = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        req.cdata = _zklua_completion_data_init(L, 5, 6);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_aset(lua_State *L)
+{
+    size_t path_len = 0;
+    size_t buffer_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_SET);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.value = luaL_checklstring(L, 3, &buffer_len);
+        req.value_len = buffer_len;
+        req.version = luaL_checkint(L, 4);
+        req.cdata = _zklua_completion_data_init(L, 5, 6);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_aget_children(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_GET_CHILDREN);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.watch = luaL_checkint(L, 3);
+        req.cdata = _zklua_completion_data_init(L, 4, 5);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_aget_children2(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_GET_CHILDREN2);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.watch = luaL_checkint(L, 3);
+        req.cdata = _zklua_completion_data_init(L, 4, 5);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_awget_children(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    zklua_request_t req;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_WGET_CHILDREN);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        req.watcherctx = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        req.cdata = _zklua_completion_data_init(L, 5, 6);
+        if (!lua_isnoneornil(L, 7)) {
+            /* anchored on the completion thread, under the function. */
+            req.cdata->snapshot = (zklua_snapshot_t *)luaL_checkudata(L, 7,
+                    ZKLUA_SNAPSHOT_METATABLE_NAME);
+            lua_pushvalue(L, 7);
+            lua_xmove(L, req.cdata->L, 1);
+            lua_insert(req.cdata->L, -2);
+        }
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_awget_children2(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    zklua_request_t req;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_WGET_CHILDREN2);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        req.watcherctx = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        req.cdata = _zklua_completion_data_init(L, 5, 6);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_async(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_SYNC);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.cdata = _zklua_completion_data_init(L, 3, 4);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_aget_acl(lua_State *L)
+{
+    size_t path_len = 0;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_GET_ACL);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.cdata = _zklua_completion_data_init(L, 3, 4);
+        ret = _zklua_submit(handle, &req);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_aset_acl(lua_State *L)
+{
+    size_t path_len = 0;
+    struct ACL_vector acl;
+    zklua_request_t req;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        _zklua_request_init(&req, ZKLUA_OP_SET_ACL);
+        req.path = luaL_checklstring(L, 2, &path_len);
+        req.version = luaL_checkint(L, 3);
+        if ((req.acl = _zklua_check_acls(L, 4, &acl)) == NULL) {
+            return luaL_error(L, "invalid ACL format.");
+        }
+        req.cdata = _zklua_completion_data_init(L, 5, 6);
+        ret = _zklua_submit(handle, &req);
+        if (req.acl == &acl) _zklua_free_acls(&acl);
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_set_inflight_window(lua_State *L)
+{
+    int mode = ZKLUA_WINDOW_WAIT;
+    const char *mode_name = NULL;
+    lua_Number initial, min, max, target, queue_size;
+    zklua_window_t *window = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    if (lua_isnoneornil(L, 2)) {
+        /* requests in flight still release their slot, so keep the window. */
+        if (handle->window != NULL) {
+            pthread_mutex_lock(&handle->window->lock);
+            handle->window->mode = ZKLUA_WINDOW_OFF;
+            pthread_cond_broadcast(&handle->window->cond);
+            pthread_mutex_unlock(&handle->window->lock);
+        }
+        lua_pushinteger(L, ZOK);
+        return 1;
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    mode_name = _zklua_opt_string_field(L, 2, "mode", "wait");
+    if (strcmp(mode_name, "wait") == 0) {
+        mode = ZKLUA_WINDOW_WAIT;
+    } else if (strcmp(mode_name, "fail") == 0) {
+        mode = ZKLUA_WINDOW_FAIL;
+    } else if (strcmp(mode_name, "queue") == 0) {
+        mode = ZKLUA_WINDOW_QUEUE;
+    } else {
+        return luaL_error(L, "invalid arguments: mode must be "
+                "\"wait\", \"fail\" or \"queue\".");
+    }
+    initial = _zklua_opt_number_field(L, 2, "initial",
+            ZKLUA_WINDOW_DEFAULT_INITIAL);
+    min = _zklua_opt_number_field(L, 2, "min", ZKLUA_WINDOW_DEFAULT_MIN);
+    max = _zklua_opt_number_field(L, 2, "max", ZKLUA_WINDOW_DEFAULT_MAX);
+    target = _zklua_opt_number_field(L, 2, "target_latency",
+            ZKLUA_WINDOW_DEFAULT_TARGET_LATENCY);
+    queue_size = _zklua_opt_number_field(L, 2, "queue_size",
+            ZKLUA_WINDOW_DEFAULT_QUEUE_SIZE);
+    if (min < 1 || max < min || initial < min || initial > max
+            || target <= 0 || queue_size < 0) {
+        return luaL_error(L, "invalid arguments: window sizes must satisfy "
+                "1 <= min <= initial <= max, target_latency > 0.");
+    }
+    if (handle->window == NULL) {
+        window = (zklua_window_t *)calloc(1, sizeof(zklua_window_t));
+        if (window == NULL) {
+            return luaL_error(L, "out of memory when zklua trys to "
+                    "alloc an internal object.");
+        }
+        pthread_mutex_init(&window->lock, NULL);
+        pthread_cond_init(&window->cond, NULL);
+    } else {
+        window = handle->window;
+    }
+    pthread_mutex_lock(&window->lock);
+    window->mode = mode;
+    window->limit = initial;
+    window->min = min;
+    window->max = max;
+    window->target_us = (uint64_t)(target * 1000);
+    window->queue_size = (int)queue_size;
+    pthread_cond_broadcast(&window->cond);
+    pthread_mutex_unlock(&window->lock);
+    handle->window = window;
+    lua_pushinteger(L, ZOK);
+    return 1;
+}
+
+static int zklua_inflight_stats(lua_State *L)
+{
+    zklua_window_t *window = NULL;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    window = handle->window;
+    if (window == NULL || window->mode == ZKLUA_WINDOW_OFF) {
+        lua_pushnil(L);
+        return 1;
+    }
+    pthread_mutex_lock(&window->lock);
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)window->limit);
+    lua_setfield(L, -2, "window");
+    lua_pushinteger(L, window->inflight);
+    lua_setfield(L, -2, "inflight");
+    lua_pushinteger(L, window->queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushnumber(L, (lua_Number)window->latency_us / 1000);
+    lua_setfield(L, -2, "latency");
+    lua_pushnumber(L, (lua_Number)window->throttled);
+    lua_setfield(L, -2, "throttled");
+    pthread_mutex_unlock(&window->lock);
+    return 1;
+}
+
+static int zklua_set_read_coalescing(lua_State *L)
+{
+    int enabled = 0;
+    zklua_flights_t *flights = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    enabled = lua_toboolean(L, 2);
+    if (handle->flights == NULL) {
+        if (!enabled) {
+            lua_pushinteger(L, ZOK);
+            return 1;
+        }
+        flights = (zklua_flights_t *)calloc(1, sizeof(zklua_flights_t));
+        if (flights == NULL) {
+            return luaL_error(L, "out of memory when zklua trys to "
+                    "alloc an internal object.");
+        }
+        pthread_mutex_init(&flights->lock, NULL);
+        handle->flights = flights;
+    }
+    /* flights in the air keep landing after coalescing is turned off. */
+    pthread_mutex_lock(&handle->flights->lock);
+    handle->flights->enabled = enabled;
+    pthread_mutex_unlock(&handle->flights->lock);
+    lua_pushinteger(L, ZOK);
+    return 1;
+}
+
+static int zklua_set_write_combining(lua_State *L)
+{
+    lua_Number window = 0, max_batch = 0;
+    pthread_condattr_t attr;
+    zklua_combiner_t *combiner = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+    window = _zklua_opt_number_field(L, 2, "window",
+            ZKLUA_COMBINE_DEFAULT_WINDOW);
+    max_batch = _zklua_opt_number_field(L, 2, "max_batch",
+            ZKLUA_COMBINE_DEFAULT_MAX_BATCH);
+    if (window < 0 || max_batch < 1) {
+        return luaL_error(L, "invalid arguments: window must be >= 0 "
+                "and max_batch >= 1.");
+    }
+    /* the pending writes are sent before the settings change. */
+    _zklua_combiner_fini(handle);
+    if (lua_isnoneornil(L, 2)) {
+        lua_pushinteger(L, ZOK);
+        return 1;
+    }
+    combiner = (zklua_combiner_t *)calloc(1, sizeof(zklua_combiner_t));
+    if (combiner == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    combiner->zh = handle->zh;
+    combiner->window_us = (uint64_t)(window * 1000);
+    combiner->max_batch = (int)max_batch;
+    pthread_mutex_init(&combiner->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&combiner->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&combiner->thread, NULL,
+                _zklua_combiner_run, combiner) != 0) {
+        pthread_cond_destroy(&combiner->cond);
+        pthread_mutex_destroy(&combiner->lock);
+        free(combiner);
+        lua_pushinteger(L, ZSYSTEMERROR);
+        return 1;
+    }
+    handle->combiner = combiner;
+    lua_pushinteger(L, ZOK);
+    return 1;
+}
+
+static int zklua_set_watch_coalescing(lua_State *L)
+{
+    lua_Number window = 0;
+    pthread_condattr_t attr;
+    zklua_watch_coalescer_t *coalescer = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+    window = _zklua_opt_number_field(L, 2, "window",
+            ZKLUA_WATCH_COALESCE_DEFAULT_WINDOW);
+    if (window < 0) {
+        return luaL_error(L, "invalid arguments: window must be >= 0.");
+    }
+    /* the events held are delivered before the settings change. */
+    _zklua_watch_coalescer_fini(handle);
+    if (lua_isnoneornil(L, 2)) {
+        lua_pushinteger(L, ZOK);
+        return 1;
+    }
+    coalescer = (zklua_watch_coalescer_t *)calloc(1,
+            sizeof(zklua_watch_coalescer_t));
+    if (coalescer == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    coalescer->refs = 1;
+    coalescer->zh = handle->zh;
+    coalescer->close = handle->close;
+    coalescer->window_us = (uint64_t)(window * 1000);
+    pthread_mutex_init(&coalescer->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&coalescer->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&coalescer->thread, NULL,
+                _zklua_watch_coalescer_run, coalescer) != 0) {
+        pthread_cond_destroy(&coalescer->cond);
+        pthread_mutex_destroy(&coalescer->lock);
+        free(coalescer);
+        lua_pushinteger(L, ZSYSTEMERROR);
+        return 1;
+    }
+    handle->watch_coalescer = coalescer;
+    lua_pushinteger(L, ZOK);
+    return 1;
+}
+
+static int zklua_set_timeout(lua_State *L)
+{
+    int timeout = 0;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        timeout = luaL_optint(L, 2, 0);
+        if (timeout < 0) {
+            return luaL_error(L, "invalid arguments: timeout must be >= 0.");
+        }
+        handle->timeout = timeout;
+        lua_pushinteger(L, ZOK);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_error(lua_State *L)
+{
+    int code = luaL_checkint(L, -1);
+    const char *errstr = NULL;
+    switch (code) {
+        case ZKLUA_THROTTLED:
+            errstr = "request throttled by the in-flight window";
+            break;
+        case ZKLUA_TIMEDOUT:
+            errstr = "operation timed out";
+            break;
+        case ZKLUA_CANCELLED:
+            errstr = "operation cancelled";
+            break;
+        default:
+            errstr = zerror(code);
+            break;
+    }
+    lua_pushstring(L, errstr);
+    return 1;
+}
+
+static int zklua_add_auth(lua_State *L)
+{
+    size_t cert_len = 0;
+    const char *scheme = NULL;
+    const char *cert = NULL;
+    zklua_completion_data_t *cdata = NULL;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        scheme = luaL_checkstring(L, 2);
+        cert = luaL_checklstring(L, 3, &cert_len);
+        cdata = _zklua_completion_data_init(L, 4, 5);
+        cdata->close = handle->close;
+        ret = zoo_add_auth(handle->zh, scheme, cert, cert_len,
+                void_completion_dispatch, cdata);
+        if (ret != ZOK) {
+            _zklua_completion_abort(cdata, ret);
+            _zklua_completion_data_fini(cdata);
+        }
+        return _zklua_push_submitted(L, ret);
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_is_unrecoverable(lua_State *L)
+{
+    int ret = 0;
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (handle->zh != NULL) {
+        ret = is_unrecoverable(handle->zh);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_set_debug_level(lua_State *L)
+{
+    int level = luaL_checkint(L, -1);
+    switch(level) {
+        case ZOO_LOG_LEVEL_ERROR:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+            break;
+        case ZOO_LOG_LEVEL_WARN:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+            break;
+        case ZOO_LOG_LEVEL_INFO:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
+            break;
+        case ZOO_LOG_LEVEL_DEBUG:
+            zoo_set_debug_level(ZOO_LOG_LEVEL_DEBUG);
+            break;
+        default:
+            return luaL_error(L, "invalid arguments: "
+                    "unsupported log level specified.");
+    }
+    return 0;
+}
+
+static int zklua_set_log_stream(lua_State *L)
+{
+    size_t stream_len = 0;
+    const char *stream = luaL_checklstring(L, -1, &stream_len);
+    zklua_log_stream = fopen(stream, "w+");
+    if (zklua_log_stream == NULL) return luaL_error(L,
+            "unable to open the specified file %s.", stream);
+    zoo_set_log_stream(zklua_log_stream);
+    return 0;
+}
+
+static int zklua_deterministic_conn_order(lua_State *L)
+{
+    size_t yesorno_len = 0;
+    const char *yesorno = luaL_checklstring(L, 1, &yesorno_len);
+    if (strcasecmp(yesorno, "yes") || strcasecmp(yesorno, "true")) {
+        zoo_deterministic_conn_order(1);
+    } else if (strcasecmp(yesorno, "no") || strcasecmp(yesorno, "false")) {
+        zoo_deterministic_conn_order(0);
+    } else {
+        return luaL_error(L, "invalid argument: please choose "
+                "(yes, no) or (true, false).");
+    }
+    return 0;
+}
+
+static int zklua_create(lua_State *L)
+{
+    size_t path_len = 0, value_len=0;
+    const char *path = NULL;
+    const char *value = NULL;
+    const char *data = NULL;
+    char path_buffer[ZKLUA_MAX_PATH_BUFFER_SIZE] = {0};
+    struct ACL_vector acl;
+    const struct ACL_vector *acls = NULL;
+    int flags = 0;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        value = luaL_checklstring(L, 3, &value_len);
+        if ((acls = _zklua_check_acls(L, 4, &acl)) == NULL) {
+            return luaL_error(L, "invalid ACL format.");
+        }
+        flags = luaL_checkint(L, 5);
+        _zklua_flight_forget(handle, path);
+        ret = _zklua_call_create(handle, path, value, value_len, acls, flags,
+                path_buffer, ZKLUA_MAX_PATH_BUFFER_SIZE);
+        lua_pushinteger(L, ret);
+        lua_pushstring(L, path_buffer);
+        if (acls == &acl) _zklua_free_acls(&acl);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_delete(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    int version = 0;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        version = luaL_checkint(L, 3);
+        _zklua_flight_forget(handle, path);
+        ret = _zklua_call_delete(handle, path, version);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_exists(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    int watch = 0;
+    struct Stat stat;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        watch = luaL_checkint(L, 3);
+        ret = _zklua_call_exists(handle, path, watch, &stat);
+        lua_pushinteger(L, ret);
+        _zklua_build_stat(L, &stat);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_wexists(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    const char *path = NULL;
+    int watch = 0;
+    zklua_local_watcher_context_t *wrapper = NULL;
+    struct Stat stat;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        wrapper = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        ret = _zklua_call_wexists(handle, path, local_watcher_dispatch,
+                (void *)wrapper, &stat);
+        lua_pushinteger(L, ret);
+        _zklua_build_stat(L, &stat);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_get(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    char *buffer = malloc(2048);
+    int buffer_len = 2048;
+    int watch = 0;
+    struct Stat stat;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        watch = luaL_checkint(L, 3);
+        ret = _zklua_call_get(handle, path, watch, buffer, &buffer_len, &stat);
+        lua_pushinteger(L, ret);
+        lua_pushlstring(L, buffer, buffer_len);
+        free(buffer);
+        _zklua_build_stat(L, &stat);
+        return 3;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_wget(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    const char *path = NULL;
+    char *buffer = NULL;
+    int buffer_len = 0;
+    zklua_local_watcher_context_t *wrapper = NULL;
+    struct Stat stat;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        wrapper = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        ret = _zklua_call_wget(handle, path, local_watcher_dispatch,
+                (void *)wrapper, buffer, &buffer_len, &stat);
+        lua_pushinteger(L, ret);
+        lua_pushlstring(L, buffer, buffer_len);
+        _zklua_build_stat(L, &stat);
+        return 3;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_set(lua_State *L)
+{
+    size_t path_len = 0, buffer_len = 0;
+    const char *path = NULL;
+    const char *buffer = NULL;
+    int version = 0;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        buffer = luaL_checklstring(L, 3, &buffer_len);
+        version = luaL_checkint(L, 4);
+        _zklua_flight_forget(handle, path);
+        ret = _zklua_call_set(handle, path, buffer, buffer_len, version);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_set2(lua_State *L)
+{
+    size_t path_len = 0, buffer_len = 0;
+    const char *path = NULL;
+    const char *buffer = NULL;
+    int version = 0;
+    struct Stat stat;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        buffer = luaL_checklstring(L, 3, &buffer_len);
+        version = luaL_checkint(L, 4);
+        _zklua_flight_forget(handle, path);
+        ret = _zklua_call_set2(handle, path, buffer, buffer_len, version, &stat);
+        lua_pushinteger(L, ret);
+        _zklua_build_stat(L, &stat);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_get_children(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    char *buffer = NULL;
+    int buffer_len = 0;
+    int watch = 0;
+    zklua_children_options_t opts;
+    struct String_vector strings = {0, NULL};
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        watch = luaL_checkint(L, 3);
+        _zklua_check_children_options(L, 4, &opts);
+        ret = _zklua_call_get_children(handle, path, watch,  &strings);
+        lua_pushinteger(L, ret);
+        _zklua_build_children(L, &strings, &opts);
+        deallocate_String_vector(&strings);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_wget_children(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    const char *path = NULL;
+    zklua_local_watcher_context_t *wrapper = NULL;
+    zklua_children_options_t opts;
+    struct String_vector strings = {0, NULL};
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        _zklua_check_children_options(L, 5, &opts);
+        wrapper = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        ret = _zklua_call_wget_children(handle, path, local_watcher_dispatch,
+                (void *)wrapper, &strings);
+        lua_pushinteger(L, ret);
+        _zklua_build_children(L, &strings, &opts);
+        deallocate_String_vector(&strings);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_get_children2(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    char *buffer = NULL;
+    int buffer_len = 0;
+    int watch = 0;
+    zklua_children_options_t opts;
+    struct String_vector strings = {0, NULL};
+    struct Stat stat;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        watch = luaL_checkint(L, 3);
+        _zklua_check_children_options(L, 4, &opts);
+        ret = _zklua_call_get_children2(handle, path, watch, &strings, &stat);
+        lua_pushinteger(L, ret);
+        _zklua_build_children(L, &strings, &opts);
+        deallocate_String_vector(&strings);
+        _zklua_build_stat(L, &stat);
+        return 3;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_wget_children2(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *real_local_watcherctx = NULL;
+    const char *path = NULL;
+    zklua_local_watcher_context_t *wrapper = NULL;
+    zklua_children_options_t opts;
+    struct String_vector strings = {0, NULL};
+    struct Stat stat;
+    int ret = -1;
+    int zhref = 0;
+    int cbref = 0;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    zhref = _zklua_ref(L, 1);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        cbref = _zklua_ref(L, 3);
+        real_local_watcherctx = luaL_checkstring(L, 4);
+        _zklua_check_children_options(L, 5, &opts);
+        wrapper = _zklua_local_watcher_context_init(L,
+                (void *)real_local_watcherctx, zhref, cbref);
+        ret = _zklua_call_wget_children2(handle, path, local_watcher_dispatch,
+                (void *)wrapper, &strings, &stat);
+        lua_pushinteger(L, ret);
+        _zklua_build_children(L, &strings, &opts);
+        deallocate_String_vector(&strings);
+        _zklua_build_stat(L, &stat);
+        return 3;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_get_acl(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    struct ACL_vector acl;
+    struct Stat stat;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        ret = _zklua_call_get_acl(handle, path, &acl, &stat);
+        lua_pushinteger(L, ret);
+        _zklua_build_acls(L, &acl);
+        _zklua_build_stat(L, &stat);
+        return 3;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_set_acl(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    int version = 0;
+    struct ACL_vector acl;
+    const struct ACL_vector *acls = NULL;
+    struct Stat stat;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        version = luaL_checkint(L, 3);
+        if ((acls = _zklua_check_acls(L, 4, &acl)) == NULL) {
+            return luaL_error(L, "invalid ACL format.");
+        }
+        _zklua_flight_forget(handle, path);
+        ret = _zklua_call_set_acl(handle, path, version, acls);
+        lua_pushinteger(L, ret);
+        if (acls == &acl) _zklua_free_acls(&acl);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * parse a put_large manifest, return 1 if @value@ is a manifest.
+ **/
+static int _zklua_large_parse_manifest(const char *value, int value_len,
+        zklua_large_manifest_t *manifest)
+{
+    char header[256] = {0};
+    char magic[32] = {0};
+
+    if (value_len <= 0 || value_len >= (int)sizeof(header)) return 0;
+    memcpy(header, value, value_len);
+    if (sscanf(header, "%31s %63s %d %d %d", magic, manifest->token,
+                &manifest->nchunks, &manifest->chunk_size,
+                &manifest->total_len) != 5) return 0;
+    if (strcmp(magic, ZKLUA_LARGE_MAGIC) != 0) return 0;
+    if (manifest->nchunks < 0 || manifest->chunk_size <= 0
+            || manifest->total_len < 0
+            || (long long)manifest->nchunks * manifest->chunk_size
+                < manifest->total_len) return 0;
+    return 1;
+}
+
+static int _zklua_large_chunk_path(char *buffer, size_t buffer_len,
+        const char *path, const char *token, int index)
+{
+    int len = snprintf(buffer, buffer_len, "%s/%s-%06d", path, token, index);
+    return (len > 0 && (size_t)len < buffer_len);
+}
+
+static void _zklua_large_get_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_large_chunk_t *chunk = (zklua_large_chunk_t *)data;
+    if (rc == ZOK && value_len != chunk->expect_len) {
+        rc = ZRUNTIMEINCONSISTENCY;
+    }
+    if (rc == ZOK) memcpy(chunk->buffer, value, value_len);
+    chunk->rc = rc;
+    _zklua_batch_done(chunk->batch);
+}
+
+static void _zklua_large_create_completion(int rc, const char *value,
+        const void *data)
+{
+    zklua_large_chunk_t *chunk = (zklua_large_chunk_t *)data;
+    chunk->rc = rc;
+    _zklua_batch_done(chunk->batch);
+}
+
+static void _zklua_large_delete_completion(int rc, const void *data)
+{
+    zklua_large_chunk_t *chunk = (zklua_large_chunk_t *)data;
+    chunk->rc = rc;
+    _zklua_batch_done(chunk->batch);
+}
+
+/**
+ * delete the first @nchunks@ chunks of generation @token@ with pipelined
+ * zoo_adelete, used to clean up after a failed put_large.
+ **/
+static void _zklua_large_delete_chunks(zhandle_t *zh, const char *path,
+        const char *token, int nchunks)
+{
+    char chunk_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_batch_t batch;
+    zklua_large_chunk_t *chunks = NULL;
+    int i;
+
+    if (nchunks <= 0) return;
+    chunks = (zklua_large_chunk_t *)calloc(nchunks, sizeof(zklua_large_chunk_t));
+    if (chunks == NULL) return;
+    _zklua_batch_init(&batch);
+    for (i = 0; i < nchunks; ++i) {
+        chunks[i].batch = &batch;
+        _zklua_large_chunk_path(chunk_path, sizeof(chunk_path), path, token, i);
+        _zklua_batch_add(&batch, 1);
+        if (zoo_adelete(zh, chunk_path, -1,
+                    _zklua_large_delete_completion, &chunks[i]) != ZOK) {
+            _zklua_batch_done(&batch);
+        }
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+    free(chunks);
+}
+
+/**
+ * read the manifest of @path@ again after its switch to generation
+ * @token@ got no reply: 1 if the switch was applied, 0 if it was not,
+ * -1 if the manifest can not be read.
+ **/
+static int _zklua_large_committed(zhandle_t *zh, const char *path,
+        const char *token)
+{
+    zklua_large_manifest_t manifest;
+    struct Stat stat;
+    char *value = NULL;
+    int value_len = 0;
+    int ret = -1, retries = 0;
+
+    do {
+        ret = _zklua_get_alloc(zh, path, &value, &value_len, &stat);
+    } while ((ret == ZCONNECTIONLOSS || ret == ZOPERATIONTIMEOUT)
+            && ++retries < ZKLUA_LARGE_MAX_RETRIES);
+    if (ret == ZNONODE) return 0;
+    if (ret != ZOK) return -1;
+    ret = _zklua_large_parse_manifest(value, value_len, &manifest)
+        && strcmp(manifest.token, token) == 0;
+    free(value);
+    return ret;
+}
+
+/**
+ * write @value@ as chunk children of @path@ and switch the manifest to the
+ * new generation, see zklua_put_large.
+ **/
+static int _zklua_large_put(zhandle_t *zh, const char *path,
+        const char *value, int value_len, const struct ACL_vector *acl,
+        int chunk_size)
+{
+    char chunk_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    char manifest_buffer[256];
+    char *old_value = NULL;
+    int old_value_len = 0;
+    int manifest_len = 0;
+    int old_nchunks = 0;
+    int nchunks = 0;
+    int i = 0;
+    int ret = -1;
+    struct Stat stat;
+    zklua_large_manifest_t old_manifest;
+    zklua_large_manifest_t manifest;
+    zklua_large_chunk_t *chunks = NULL;
+    zklua_batch_t batch;
+
+    ret = _zklua_get_alloc(zh, path, &old_value, &old_value_len, &stat);
+    if (ret == ZNONODE) {
+        ret = zoo_create(zh, path, NULL, -1, acl, 0, NULL, 0);
+        if (ret != ZOK && ret != ZNODEEXISTS) return ret;
+        ret = _zklua_get_alloc(zh, path, &old_value, &old_value_len, &stat);
+    }
+    if (ret != ZOK) return ret;
+    if (_zklua_large_parse_manifest(old_value, old_value_len, &old_manifest)) {
+        old_nchunks = old_manifest.nchunks;
+    }
+    free(old_value);
+
+    /* chunk names are unique per (session, manifest version), so the new
+     * generation is invisible to readers until the manifest is switched. */
+    memset(&manifest, 0, sizeof(manifest));
+    snprintf(manifest.token, sizeof(manifest.token), "%llx-%d",
+            (unsigned long long)zoo_client_id(zh)->client_id, stat.version + 1);
+    nchunks = (value_len + chunk_size - 1) / chunk_size;
+    manifest.nchunks = nchunks;
+    manifest.chunk_size = chunk_size;
+    manifest.total_len = value_len;
+    manifest_len = snprintf(manifest_buffer, sizeof(manifest_buffer),
+            "%s %s %d %d %d\n", ZKLUA_LARGE_MAGIC, manifest.token,
+            manifest.nchunks, manifest.chunk_size, manifest.total_len);
+
+    if (nchunks > 0) {
+        chunks = (zklua_large_chunk_t *)calloc(nchunks, sizeof(zklua_large_chunk_t));
+        if (chunks == NULL) return ZSYSTEMERROR;
+    }
+    _zklua_batch_init(&batch);
+    for (i = 0; i < nchunks; ++i) {
+        int offset = i * chunk_size;
+        int len = (value_len - offset < chunk_size) ? value_len - offset : chunk_size;
+        chunks[i].batch = &batch;
+        chunks[i].rc = ZOK;
+        if (!_zklua_large_chunk_path(chunk_path, sizeof(chunk_path),
+                    path, manifest.token, i)) {
+            chunks[i].rc = ZBADARGUMENTS;
+            continue;
+        }
+        _zklua_batch_add(&batch, 1);
+        chunks[i].rc = zoo_acreate(zh, chunk_path, value + offset, len, acl, 0,
+                _zklua_large_create_completion, &chunks[i]);
+        if (chunks[i].rc != ZOK) _zklua_batch_done(&batch);
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+    ret = ZOK;
+    for (i = 0; i < nchunks; ++i) {
+        if (chunks[i].rc != ZOK) {
+            ret = chunks[i].rc;
+            break;
+        }
+    }
+    free(chunks);
+    if (ret != ZOK) {
+        _zklua_large_delete_chunks(zh, path, manifest.token, nchunks);
+        return ret;
+    }
+
+    /* commit: switch the manifest, checked against the version read. */
+    ret = zoo_set(zh, path, manifest_buffer, manifest_len, stat.version);
+    if (ret == ZCONNECTIONLOSS || ret == ZOPERATIONTIMEOUT) {
+        /* the set may have been applied: the new chunks are live then. */
+        switch (_zklua_large_committed(zh, path, manifest.token)) {
+            case 1:
+                ret = ZOK;
+                break;
+            case 0:
+                _zklua_large_delete_chunks(zh, path, manifest.token, nchunks);
+                break;
+            default:
+                /* unknown, keep the chunks rather than break the value. */
+                break;
+        }
+    } else if (ret != ZOK) {
+        _zklua_large_delete_chunks(zh, path, manifest.token, nchunks);
+    }
+    /* the previous generation is unreachable now, drop what is left of
+     * it. a chunk already gone or left behind breaks nothing. */
+    if (ret == ZOK) {
+        _zklua_large_delete_chunks(zh, path, old_manifest.token, old_nchunks);
+    }
+    return ret;
+}
+
+/**
+ * read the generation described by @manifest@ with pipelined zoo_aget into
+ * @buffer@, which must hold manifest->total_len bytes.
+ **/
+static int _zklua_large_fetch(zhandle_t *zh, const char *path,
+        const zklua_large_manifest_t *manifest, char *buffer)
+{
+    char chunk_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_large_chunk_t *chunks = NULL;
+    zklua_batch_t batch;
+    int ret = ZOK;
+    int i;
+
+    if (manifest->nchunks == 0) return ZOK;
+    chunks = (zklua_large_chunk_t *)calloc(manifest->nchunks,
+            sizeof(zklua_large_chunk_t));
+    if (chunks == NULL) return ZSYSTEMERROR;
+    _zklua_batch_init(&batch);
+    for (i = 0; i < manifest->nchunks; ++i) {
+        int offset = i * manifest->chunk_size;
+        chunks[i].batch = &batch;
+        chunks[i].buffer = buffer + offset;
+        chunks[i].expect_len = (manifest->total_len - offset < manifest->chunk_size) ?
+            manifest->total_len - offset : manifest->chunk_size;
+        if (chunks[i].expect_len <= 0
+                || !_zklua_large_chunk_path(chunk_path, sizeof(chunk_path),
+                    path, manifest->token, i)) {
+            chunks[i].rc = ZRUNTIMEINCONSISTENCY;
+            continue;
+        }
+        _zklua_batch_add(&batch, 1);
+        chunks[i].rc = zoo_aget(zh, chunk_path, 0,
+                _zklua_large_get_completion, &chunks[i]);
+        if (chunks[i].rc != ZOK) _zklua_batch_done(&batch);
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+    for (i = 0; i < manifest->nchunks; ++i) {
+        if (chunks[i].rc != ZOK) {
+            ret = chunks[i].rc;
+            break;
+        }
+    }
+    free(chunks);
+    return ret;
+}
+
+/**
+ * stores a value of any size as chunk children of path, the new generation
+ * is committed atomically by switching the manifest stored in path.
+ **/
+static int zklua_put_large(lua_State *L)
+{
+    size_t path_len = 0, value_len = 0;
+    const char *path = NULL;
+    const char *value = NULL;
+    struct ACL_vector acl;
+    const struct ACL_vector *acls = NULL;
+    int chunk_size = ZKLUA_LARGE_DEFAULT_CHUNK_SIZE;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        value = luaL_checklstring(L, 3, &value_len);
+        chunk_size = luaL_optint(L, 5, ZKLUA_LARGE_DEFAULT_CHUNK_SIZE);
+        if (chunk_size <= 0 || chunk_size > ZKLUA_LARGE_MAX_CHUNK_SIZE) {
+            return luaL_error(L, "invalid arguments: chunk size must be "
+                    "between 1 and %d.", ZKLUA_LARGE_MAX_CHUNK_SIZE);
+        }
+        if ((acls = _zklua_check_acls(L, 4, &acl)) == NULL) {
+            return luaL_error(L, "invalid ACL format.");
+        }
+        ret = _zklua_large_put(handle->zh, path, value, value_len, acls,
+                chunk_size);
+        if (acls == &acl) _zklua_free_acls(&acl);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * reads a value written by put_large, nodes written by set are returned as is.
+ **/
+static int zklua_get_large(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    char *value = NULL;
+    char *buffer = NULL;
+    int value_len = 0;
+    int retries = 0;
+    struct Stat stat;
+    zklua_large_manifest_t manifest;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        memset(&stat, 0, sizeof(stat));
+        for (retries = 0; retries < ZKLUA_LARGE_MAX_RETRIES; ++retries) {
+            ret = _zklua_get_alloc(handle->zh, path, &value, &value_len, &stat);
+            if (ret != ZOK) break;
+            if (!_zklua_large_parse_manifest(value, value_len, &manifest)) {
+                /* not a chunked value. */
+                buffer = value;
+                break;
+            }
+            free(value);
+            buffer = (char *)malloc(manifest.total_len + 1);
+            if (buffer == NULL) {
+                ret = ZSYSTEMERROR;
+                break;
+            }
+            /* chunks of a generation are immutable, a missing chunk means
+             * a newer generation was committed meanwhile, so start over. */
+            ret = _zklua_large_fetch(handle->zh, path, &manifest, buffer);
+            if (ret == ZOK) {
+                value_len = manifest.total_len;
+                stat.dataLength = manifest.total_len;
+                break;
+            }
+            free(buffer);
+            buffer = NULL;
+            if (ret != ZNONODE) break;
+        }
+        lua_pushinteger(L, ret);
+        if (ret == ZOK) {
+            lua_pushlstring(L, buffer, value_len);
+        } else {
+            lua_pushnil(L);
+        }
+        free(buffer);
+        _zklua_build_stat(L, &stat);
+        return 3;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * join a parent path and a child name into @buffer@.
+ **/
+static int _zklua_join_path(char *buffer, size_t buffer_len,
+        const char *parent, const char *child)
+{
+    int len = 0;
+    if (strcmp(parent, "/") == 0) {
+        len = snprintf(buffer, buffer_len, "/%s", child);
+    } else {
+        len = snprintf(buffer, buffer_len, "%s/%s", parent, child);
+    }
+    return (len > 0 && (size_t)len < buffer_len);
+}
+
+static void _zklua_tree_stat_pack(zklua_tree_stat_t *dst, const struct Stat *src)
+{
+    memset(dst, 0, sizeof(*dst));
+    dst->czxid = src->czxid;
+    dst->mzxid = src->mzxid;
+    dst->ctime = src->ctime;
+    dst->mtime = src->mtime;
+    dst->ephemeral_owner = src->ephemeralOwner;
+    dst->pzxid = src->pzxid;
+    dst->version = src->version;
+    dst->cversion = src->cversion;
+    dst->aversion = src->aversion;
+    dst->data_length = src->dataLength;
+    dst->num_children = src->numChildren;
+}
+
+static void _zklua_tree_stat_unpack(struct Stat *dst, const zklua_tree_stat_t *src)
+{
+    dst->czxid = src->czxid;
+    dst->mzxid = src->mzxid;
+    dst->ctime = src->ctime;
+    dst->mtime = src->mtime;
+    dst->ephemeralOwner = src->ephemeral_owner;
+    dst->pzxid = src->pzxid;
+    dst->version = src->version;
+    dst->cversion = src->cversion;
+    dst->aversion = src->aversion;
+    dst->dataLength = src->data_length;
+    dst->numChildren = src->num_children;
+}
+
+static void _zklua_tree_node_data_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_tree_node_t *node = (zklua_tree_node_t *)data;
+    node->data_rc = rc;
+    if (rc == ZOK) {
+        node->stat = *stat;
+        node->data_len = value_len;
+        if (value_len > 0) {
+            node->data = (char *)malloc(value_len);
+            if (node->data == NULL) {
+                node->data_rc = ZSYSTEMERROR;
+            } else {
+                memcpy(node->data, value, value_len);
+            }
+        }
+    }
+    _zklua_batch_done(node->batch);
+}
+
+static void _zklua_tree_node_children_completion(int rc,
+        const struct String_vector *strings, const void *data)
+{
+    zklua_tree_node_t *node = (zklua_tree_node_t *)data;
+    node->children_rc = rc;
+    if (rc == ZOK && !_zklua_copy_string_vector(&node->children, strings)) {
+        node->children_rc = ZSYSTEMERROR;
+    }
+    _zklua_batch_done(node->batch);
+}
+
+static void _zklua_tree_nodes_free(zklua_tree_node_t *nodes, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i) {
+        free(nodes[i].path);
+        free(nodes[i].data);
+        deallocate_String_vector(&nodes[i].children);
+    }
+    free(nodes);
+}
+
+static int _zklua_tree_node_compare(const void *a, const void *b)
+{
+    return strcmp(((const zklua_tree_node_t *)a)->path,
+            ((const zklua_tree_node_t *)b)->path);
+}
+
+/**
+ * fetch every node under @root@ level by level, each level is one round
+ * of pipelined zoo_aget/zoo_aget_children requests.
+ **/
+static int _zklua_tree_fetch(zhandle_t *zh, const char *root,
+        zklua_tree_node_t **out_nodes, int *out_count)
+{
+    char child_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_tree_node_t *nodes = NULL;
+    int count = 0, capacity = 0;
+    int level_begin = 0, level_end = 0;
+    int ret = ZOK;
+    int i, j;
+    zklua_batch_t batch;
+
+    capacity = 64;
+    nodes = (zklua_tree_node_t *)calloc(capacity, sizeof(zklua_tree_node_t));
+    if (nodes == NULL) return ZSYSTEMERROR;
+    nodes[0].path = strdup(root);
+    if (nodes[0].path == NULL) {
+        free(nodes);
+        return ZSYSTEMERROR;
+    }
+    count = 1;
+    _zklua_batch_init(&batch);
+    while (ret == ZOK && level_begin < count) {
+        level_end = count;
+        for (i = level_begin; i < level_end; ++i) {
+            nodes[i].batch = &batch;
+            _zklua_batch_add(&batch, 2);
+            nodes[i].data_rc = zoo_aget(zh, nodes[i].path, 0,
+                    _zklua_tree_node_data_completion, &nodes[i]);
+            if (nodes[i].data_rc != ZOK) _zklua_batch_done(&batch);
+            nodes[i].children_rc = zoo_aget_children(zh, nodes[i].path, 0,
+                    _zklua_tree_node_children_completion, &nodes[i]);
+            if (nodes[i].children_rc != ZOK) _zklua_batch_done(&batch);
+        }
+        _zklua_batch_wait(&batch);
+        for (i = level_begin; i < level_end && ret == ZOK; ++i) {
+            /* nodes deleted while walking are simply left out. */
+            if (nodes[i].data_rc == ZNONODE || nodes[i].children_rc == ZNONODE) {
+                continue;
+            }
+            if (nodes[i].data_rc != ZOK) ret = nodes[i].data_rc;
+            else if (nodes[i].children_rc != ZOK) ret = nodes[i].children_rc;
+            for (j = 0; ret == ZOK && j < nodes[i].children.count; ++j) {
+                if (!_zklua_join_path(child_path, sizeof(child_path),
+                            nodes[i].path, nodes[i].children.data[j])) {
+                    ret = ZBADARGUMENTS;
+                    break;
+                }
+                if (count == capacity) {
+                    zklua_tree_node_t *tmp = (zklua_tree_node_t *)realloc(nodes,
+                            2 * capacity * sizeof(zklua_tree_node_t));
+                    if (tmp == NULL) {
+                        ret = ZSYSTEMERROR;
+                        break;
+                    }
+                    nodes = tmp;
+                    memset(nodes + capacity, 0, capacity * sizeof(zklua_tree_node_t));
+                    capacity *= 2;
+                }
+                nodes[count].path = strdup(child_path);
+                if (nodes[count].path == NULL) {
+                    ret = ZSYSTEMERROR;
+                    break;
+                }
+                count++;
+            }
+        }
+        level_begin = level_end;
+    }
+    _zklua_batch_fini(&batch);
+    if (ret != ZOK) {
+        _zklua_tree_nodes_free(nodes, count);
+        return ret;
+    }
+    *out_nodes = nodes;
+    *out_count = count;
+    return ZOK;
+}
+
+/**
+ * write the fetched nodes to @filename@ in the export_tree format.
+ **/
+static int _zklua_tree_write(const char *filename,
+        zklua_tree_node_t *nodes, int count)
+{
+    char tmpname[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_tree_header_t header;
+    zklua_tree_entry_t entry;
+    uint64_t offset = 0;
+    int written = 0;
+    int ret = ZOK;
+    int i;
+    FILE *fp = NULL;
+
+    /* nodes that vanished while walking have no stat, drop them. */
+    for (i = 0; i < count; ++i) {
+        if (nodes[i].data_rc == ZOK && nodes[i].children_rc == ZOK) {
+            nodes[written++] = nodes[i];
+        } else {
+            free(nodes[i].path);
+            free(nodes[i].data);
+            deallocate_String_vector(&nodes[i].children);
+        }
+    }
+    count = written;
+    qsort(nodes, count, sizeof(zklua_tree_node_t), _zklua_tree_node_compare);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZKLUA_TREE_MAGIC, sizeof(ZKLUA_TREE_MAGIC));
+    header.version = ZKLUA_TREE_VERSION;
+    header.byte_order = ZKLUA_TREE_BYTE_ORDER;
+    header.count = count;
+    header.index_offset = sizeof(header);
+    offset = header.index_offset + (uint64_t)count * sizeof(zklua_tree_entry_t);
+    for (i = 0; i < count; ++i) {
+        offset += strlen(nodes[i].path) + 1;
+        if (nodes[i].data_len > 0) offset += nodes[i].data_len;
+    }
+    header.file_size = offset;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    fp = fopen(tmpname, "wb");
+    if (fp == NULL) {
+        _zklua_tree_nodes_free(nodes, count);
+        return ZSYSTEMERROR;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) ret = ZSYSTEMERROR;
+    offset = header.index_offset + (uint64_t)count * sizeof(zklua_tree_entry_t);
+    for (i = 0; ret == ZOK && i < count; ++i) {
+        memset(&entry, 0, sizeof(entry));
+        entry.path_len = strlen(nodes[i].path);
+        entry.path_offset = offset;
+        offset += entry.path_len + 1;
+        entry.data_len = nodes[i].data_len;
+        entry.data_offset = offset;
+        if (nodes[i].data_len > 0) offset += nodes[i].data_len;
+        _zklua_tree_stat_pack(&entry.stat, &nodes[i].stat);
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1) ret = ZSYSTEMERROR;
+    }
+    for (i = 0; ret == ZOK && i < count; ++i) {
+        if (fwrite(nodes[i].path, strlen(nodes[i].path) + 1, 1, fp) != 1
+                || (nodes[i].data_len > 0
+                    && fwrite(nodes[i].data, nodes[i].data_len, 1, fp) != 1)) {
+            ret = ZSYSTEMERROR;
+        }
+    }
+    if (fclose(fp) != 0) ret = ZSYSTEMERROR;
+    if (ret == ZOK && rename(tmpname, filename) != 0) ret = ZSYSTEMERROR;
+    if (ret != ZOK) remove(tmpname);
+    _zklua_tree_nodes_free(nodes, count);
+    return ret;
+}
+
+static const char *_zklua_tree_entry_path(const zklua_tree_t *tree,
+        const zklua_tree_entry_t *entry)
+{
+    return tree->map + entry->path_offset;
+}
+
+/**
+ * binary search the index, return the position of the first entry whose
+ * path is not less than @path@.
+ **/
+static uint32_t _zklua_tree_lower_bound(const zklua_tree_t *tree, const char *path)
+{
+    uint32_t lo = 0, hi = tree->header->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(_zklua_tree_entry_path(tree, &tree->entries[mid]), path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static const zklua_tree_entry_t *_zklua_tree_find(const zklua_tree_t *tree,
+        const char *path)
+{
+    uint32_t pos = _zklua_tree_lower_bound(tree, path);
+    if (pos < tree->header->count
+            && strcmp(_zklua_tree_entry_path(tree, &tree->entries[pos]), path) == 0) {
+        return &tree->entries[pos];
+    }
+    return NULL;
+}
+
+/**
+ * find the overlay entry of @path@, the caller holds tree->lock.
+ **/
+static zklua_tree_overlay_t *_zklua_tree_overlay_find(zklua_tree_t *tree,
+        const char *path)
+{
+    zklua_tree_overlay_t *overlay =
+        tree->overlay[_zklua_hash_string(path) % ZKLUA_TREE_OVERLAY_BUCKETS];
+    while (overlay != NULL && strcmp(overlay->path, path) != 0) {
+        overlay = overlay->next;
+    }
+    return overlay;
+}
+
+/**
+ * record the current server state of @path@ in the overlay,
+ * @stat@ NULL means the node has been deleted.
+ **/
+static void _zklua_tree_overlay_put(zklua_tree_t *tree, const char *path,
+        const char *value, int value_len, const struct Stat *stat, int added)
+{
+    zklua_tree_overlay_t *overlay = NULL;
+    unsigned int bucket = _zklua_hash_string(path) % ZKLUA_TREE_OVERLAY_BUCKETS;
+    char *data = NULL;
+
+    if (stat != NULL && value_len > 0) {
+        data = (char *)malloc(value_len);
+        if (data == NULL) return;
+        memcpy(data, value, value_len);
+    }
+    pthread_mutex_lock(&tree->lock);
+    overlay = _zklua_tree_overlay_find(tree, path);
+    if (overlay == NULL) {
+        overlay = (zklua_tree_overlay_t *)calloc(1, sizeof(zklua_tree_overlay_t));
+        if (overlay == NULL || (overlay->path = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&tree->lock);
+            free(overlay);
+            free(data);
+            return;
+        }
+        overlay->added = added;
+        overlay->next = tree->overlay[bucket];
+        tree->overlay[bucket] = overlay;
+    }
+    free(overlay->data);
+    overlay->data = data;
+    overlay->data_len = value_len;
+    overlay->deleted = (stat == NULL);
+    if (stat != NULL) overlay->stat = *stat;
+    pthread_mutex_unlock(&tree->lock);
+}
+
+static void _zklua_tree_exists_completion(int rc, const struct Stat *stat,
+        const void *data);
+static void _zklua_tree_get_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data);
+static void _zklua_tree_children_completion(int rc,
+        const struct String_vector *strings, const void *data);
+
+/**
+ * issue one catch-up request of type @op@ (ZKLUA_TREE_SYNC_*) for @path@.
+ **/
+static void _zklua_tree_sync_submit(zklua_tree_t *tree, int op,
+        const char *path, const zklua_tree_entry_t *entry)
+{
+    int ret = -1;
+    zklua_tree_sync_t *ctx = (zklua_tree_sync_t *)malloc(sizeof(zklua_tree_sync_t));
+    if (ctx == NULL) return;
+    ctx->tree = tree;
+    ctx->entry = entry;
+    ctx->path = strdup(path);
+    if (ctx->path == NULL) {
+        free(ctx);
+        return;
+    }
+    _zklua_batch_add(&tree->sync, 1);
+    switch (op) {
+        case ZKLUA_TREE_SYNC_EXISTS:
+            ret = zoo_aexists(tree->zh, path, 0,
+                    _zklua_tree_exists_completion, ctx);
+            break;
+        case ZKLUA_TREE_SYNC_GET:
+            ret = zoo_aget(tree->zh, path, 0,
+                    _zklua_tree_get_completion, ctx);
+            break;
+        case ZKLUA_TREE_SYNC_CHILDREN:
+            ret = zoo_aget_children(tree->zh, path, 0,
+                    _zklua_tree_children_completion, ctx);
+            break;
+    }
+    if (ret != ZOK) {
+        free(ctx->path);
+        free(ctx);
+        _zklua_batch_done(&tree->sync);
+    }
+}
+
+static void _zklua_tree_sync_done(zklua_tree_sync_t *ctx)
+{
+    zklua_tree_t *tree = ctx->tree;
+    free(ctx->path);
+    free(ctx);
+    _zklua_batch_done(&tree->sync);
+}
+
+static void _zklua_tree_exists_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_tree_sync_t *ctx = (zklua_tree_sync_t *)data;
+    zklua_tree_t *tree = ctx->tree;
+    zklua_tree_overlay_t *overlay = NULL;
+    int64_t mzxid = ctx->entry->stat.mzxid;
+    int64_t pzxid = ctx->entry->stat.pzxid;
+
+    if (rc == ZNONODE) {
+        _zklua_tree_overlay_put(tree, ctx->path, NULL, 0, NULL, 0);
+    } else if (rc == ZOK) {
+        /* compare with what a previous round learnt, not with the file. */
+        pthread_mutex_lock(&tree->lock);
+        overlay = _zklua_tree_overlay_find(tree, ctx->path);
+        if (overlay != NULL) {
+            mzxid = overlay->deleted ? -1 : overlay->stat.mzxid;
+            pzxid = overlay->deleted ? -1 : overlay->stat.pzxid;
+        }
+        pthread_mutex_unlock(&tree->lock);
+        if (stat->mzxid != mzxid) {
+            _zklua_tree_sync_submit(tree, ZKLUA_TREE_SYNC_GET,
+                    ctx->path, ctx->entry);
+        }
+        if (stat->pzxid != pzxid) {
+            _zklua_tree_sync_submit(tree, ZKLUA_TREE_SYNC_CHILDREN,
+                    ctx->path, ctx->entry);
+        }
+    }
+    _zklua_tree_sync_done(ctx);
+}
+
+static void _zklua_tree_get_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_tree_sync_t *ctx = (zklua_tree_sync_t *)data;
+    zklua_tree_t *tree = ctx->tree;
+    if (rc == ZNONODE) {
+        _zklua_tree_overlay_put(tree, ctx->path, NULL, 0, NULL, 0);
+    } else if (rc == ZOK) {
+        _zklua_tree_overlay_put(tree, ctx->path, value, value_len, stat,
+                ctx->entry == NULL);
+        /* a node created after the export, walk its subtree too. */
+        if (ctx->entry == NULL && stat->numChildren > 0) {
+            _zklua_tree_sync_submit(tree, ZKLUA_TREE_SYNC_CHILDREN,
+                    ctx->path, NULL);
+        }
+    }
+    _zklua_tree_sync_done(ctx);
+}
+
+static void _zklua_tree_children_completion(int rc,
+        const struct String_vector *strings, const void *data)
+{
+    char child_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_tree_sync_t *ctx = (zklua_tree_sync_t *)data;
+    zklua_tree_t *tree = ctx->tree;
+    zklua_tree_overlay_t *overlay = NULL;
+    int known = 0;
+    int i;
+
+    if (rc == ZOK && strings != NULL) {
+        for (i = 0; i < strings->count; ++i) {
+            if (!_zklua_join_path(child_path, sizeof(child_path),
+                        ctx->path, strings->data[i])) continue;
+            /* the overlay wins: a child deleted then re-created is new. */
+            pthread_mutex_lock(&tree->lock);
+            overlay = _zklua_tree_overlay_find(tree, child_path);
+            if (overlay != NULL) {
+                known = !overlay->deleted;
+            } else {
+                known = (_zklua_tree_find(tree, child_path) != NULL);
+            }
+            pthread_mutex_unlock(&tree->lock);
+            if (!known) {
+                _zklua_tree_sync_submit(tree, ZKLUA_TREE_SYNC_GET,
+                        child_path, NULL);
+            }
+        }
+    }
+    _zklua_tree_sync_done(ctx);
+}
+
+/**
+ * check that the snapshot mapped at @map@ stays inside its @map_len@
+ * bytes: the index, every path (NUL terminated, in sorted order) and
+ * every data. returns 0 if the file is malformed.
+ **/
+static int _zklua_tree_validate(const char *map, size_t map_len)
+{
+    const zklua_tree_header_t *header = (const zklua_tree_header_t *)map;
+    const zklua_tree_entry_t *entries = NULL;
+    const zklua_tree_entry_t *entry = NULL;
+    const char *prev = NULL;
+    const char *path = NULL;
+    uint32_t i;
+
+    if (memcmp(header->magic, ZKLUA_TREE_MAGIC, sizeof(ZKLUA_TREE_MAGIC)) != 0
+            || header->version != ZKLUA_TREE_VERSION
+            || header->byte_order != ZKLUA_TREE_BYTE_ORDER
+            || header->file_size != (uint64_t)map_len
+            || header->index_offset < sizeof(zklua_tree_header_t)
+            || header->index_offset % sizeof(uint64_t) != 0
+            || header->index_offset > map_len
+            || (uint64_t)header->count * sizeof(zklua_tree_entry_t)
+                > map_len - header->index_offset) {
+        return 0;
+    }
+    entries = (const zklua_tree_entry_t *)(map + header->index_offset);
+    for (i = 0; i < header->count; ++i) {
+        entry = &entries[i];
+        if (entry->path_offset >= map_len
+                || entry->path_len >= map_len - entry->path_offset) {
+            return 0;
+        }
+        path = map + entry->path_offset;
+        if (path[entry->path_len] != '\0'
+                || memchr(path, '\0', entry->path_len) != NULL) {
+            return 0;
+        }
+        if (entry->data_len < -1 || entry->data_offset > map_len
+                || (entry->data_len > 0 && (uint64_t)entry->data_len
+                    > map_len - entry->data_offset)) {
+            return 0;
+        }
+        /* lookups binary search the index. */
+        if (prev != NULL && strcmp(prev, path) >= 0) return 0;
+        prev = path;
+    }
+    return 1;
+}
+
+static zklua_tree_t *_zklua_tree_check(lua_State *L, int index)
+{
+    zklua_tree_t *tree = luaL_checkudata(L, index, ZKLUA_TREE_METATABLE_NAME);
+    if (tree->map == NULL) luaL_error(L, "tree snapshot already closed.");
+    return tree;
+}
+
+/**
+ * exports the subtree under root into a snapshot file that import_tree can map.
+ **/
+static int zklua_export_tree(lua_State *L)
+{
+    size_t path_len = 0, filename_len = 0;
+    const char *root = NULL;
+    const char *filename = NULL;
+    zklua_tree_node_t *nodes = NULL;
+    int count = 0;
+    int ret = -1;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        root = luaL_checklstring(L, 2, &path_len);
+        filename = luaL_checklstring(L, 3, &filename_len);
+        ret = _zklua_tree_fetch(handle->zh, root, &nodes, &count);
+        if (ret == ZOK) ret = _zklua_tree_write(filename, nodes, count);
+        lua_pushinteger(L, ret);
+        lua_pushinteger(L, (ret == ZOK) ? count : 0);
+        return 2;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * maps a snapshot written by export_tree, reads are served from the file.
+ **/
+static int zklua_import_tree(lua_State *L)
+{
+    size_t filename_len = 0;
+    const char *filename = luaL_checklstring(L, 1, &filename_len);
+    struct stat st;
+    const zklua_tree_header_t *header = NULL;
+    void *map = NULL;
+    int fd = -1;
+    zklua_tree_t *tree = NULL;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to open the specified file %s.", filename);
+        return 2;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(zklua_tree_header_t)) {
+        close(fd);
+        lua_pushnil(L);
+        lua_pushfstring(L, "invalid tree snapshot %s.", filename);
+        return 2;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to map the specified file %s.", filename);
+        return 2;
+    }
+    header = (const zklua_tree_header_t *)map;
+    if (!_zklua_tree_validate((const char *)map, st.st_size)) {
+        munmap(map, st.st_size);
+        lua_pushnil(L);
+        lua_pushfstring(L, "invalid tree snapshot %s.", filename);
+        return 2;
+    }
+
+    tree = (zklua_tree_t *)lua_newuserdata(L, sizeof(zklua_tree_t));
+    memset(tree, 0, sizeof(zklua_tree_t));
+    tree->map = (char *)map;
+    tree->map_len = st.st_size;
+    tree->header = header;
+    tree->entries = (const zklua_tree_entry_t *)(tree->map + header->index_offset);
+    _zklua_batch_init(&tree->sync);
+    pthread_mutex_init(&tree->lock, NULL);
+    luaL_getmetatable(L, ZKLUA_TREE_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/**
+ * tree:get(path), same results as get.
+ **/
+static int zklua_tree_get(lua_State *L)
+{
+    const char *path = NULL;
+    const zklua_tree_entry_t *entry = NULL;
+    zklua_tree_overlay_t *overlay = NULL;
+    struct Stat stat;
+    zklua_tree_t *tree = _zklua_tree_check(L, 1);
+
+    path = luaL_checkstring(L, 2);
+    pthread_mutex_lock(&tree->lock);
+    overlay = _zklua_tree_overlay_find(tree, path);
+    if (overlay != NULL) {
+        lua_pushinteger(L, overlay->deleted ? ZNONODE : ZOK);
+        if (overlay->deleted || overlay->data == NULL) {
+            lua_pushlstring(L, "", 0);
+        } else {
+            lua_pushlstring(L, overlay->data, overlay->data_len);
+        }
+        _zklua_build_stat(L, overlay->deleted ? NULL : &overlay->stat);
+        pthread_mutex_unlock(&tree->lock);
+        return 3;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    entry = _zklua_tree_find(tree, path);
+    if (entry == NULL) {
+        lua_pushinteger(L, ZNONODE);
+        lua_pushlstring(L, "", 0);
+        _zklua_build_stat(L, NULL);
+        return 3;
+    }
+    _zklua_tree_stat_unpack(&stat, &entry->stat);
+    lua_pushinteger(L, ZOK);
+    lua_pushlstring(L, tree->map + entry->data_offset,
+            entry->data_len > 0 ? entry->data_len : 0);
+    _zklua_build_stat(L, &stat);
+    return 3;
+}
+
+/**
+ * tree:exists(path), same results as exists.
+ **/
+static int zklua_tree_exists(lua_State *L)
+{
+    lua_settop(L, 2);
+    zklua_tree_get(L);
+    lua_remove(L, -2);
+    return 2;
+}
+
+/**
+ * tree:get_children(path), same results as get_children.
+ **/
+static int zklua_tree_get_children(lua_State *L)
+{
+    char prefix[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    const char *path = NULL;
+    const char *child = NULL;
+    zklua_tree_overlay_t *overlay = NULL;
+    size_t prefix_len = 0;
+    uint32_t pos = 0;
+    int found = 0;
+    int n = 0;
+    int i;
+    zklua_tree_t *tree = _zklua_tree_check(L, 1);
+
+    path = luaL_checkstring(L, 2);
+    pthread_mutex_lock(&tree->lock);
+    overlay = _zklua_tree_overlay_find(tree, path);
+    found = (overlay != NULL) ? !overlay->deleted : (_zklua_tree_find(tree, path) != NULL);
+    if (!found) {
+        pthread_mutex_unlock(&tree->lock);
+        lua_pushinteger(L, ZNONODE);
+        lua_newtable(L);
+        return 2;
+    }
+    lua_pushinteger(L, ZOK);
+    lua_newtable(L);
+    if (strcmp(path, "/") == 0) {
+        snprintf(prefix, sizeof(prefix), "/");
+    } else {
+        snprintf(prefix, sizeof(prefix), "%s/", path);
+    }
+    prefix_len = strlen(prefix);
+    /* descendants of path are contiguous in the sorted index. */
+    for (pos = _zklua_tree_lower_bound(tree, prefix); pos < tree->header->count; ++pos) {
+        child = _zklua_tree_entry_path(tree, &tree->entries[pos]);
+        if (strncmp(child, prefix, prefix_len) != 0) break;
+        if (child[prefix_len] == '\0' || strchr(child + prefix_len, '/') != NULL) continue;
+        overlay = _zklua_tree_overlay_find(tree, child);
+        if (overlay != NULL && overlay->deleted) continue;
+        lua_pushstring(L, child + prefix_len);
+        lua_rawseti(L, -2, ++n);
+    }
+    for (i = 0; i < ZKLUA_TREE_OVERLAY_BUCKETS; ++i) {
+        for (overlay = tree->overlay[i]; overlay != NULL; overlay = overlay->next) {
+            if (!overlay->added || overlay->deleted) continue;
+            if (strncmp(overlay->path, prefix, prefix_len) != 0) continue;
+            child = overlay->path + prefix_len;
+            if (*child == '\0' || strchr(child, '/') != NULL) continue;
+            lua_pushstring(L, child);
+            lua_rawseti(L, -2, ++n);
+        }
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return 2;
+}
+
+/**
+ * tree:sync(zh), catch up with the server in the background. Every node of
+ * the snapshot is checked with pipelined exists requests, nodes whose mzxid
+ * differs are fetched again, and nodes whose pzxid differs have their
+ * children listed to find nodes created after the export.
+ **/
+static int zklua_tree_sync(lua_State *L)
+{
+    zklua_tree_t *tree = _zklua_tree_check(L, 1);
+    zklua_handle_t *handle = luaL_checkudata(L, 2, ZKLUA_METATABLE_NAME);
+    uint32_t i;
+
+    if (_zklua_check_handle(L, handle)) {
+        /* wait for a previous round, it may still use the old handle. */
+        _zklua_batch_wait(&tree->sync);
+        tree->zh = handle->zh;
+        for (i = 0; i < tree->header->count; ++i) {
+            _zklua_tree_sync_submit(tree, ZKLUA_TREE_SYNC_EXISTS,
+                    _zklua_tree_entry_path(tree, &tree->entries[i]),
+                    &tree->entries[i]);
+        }
+        lua_pushinteger(L, ZOK);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * tree:pending(), number of catch-up requests still in flight.
+ **/
+static int zklua_tree_pending(lua_State *L)
+{
+    int pending = 0;
+    zklua_tree_t *tree = _zklua_tree_check(L, 1);
+    pthread_mutex_lock(&tree->sync.lock);
+    pending = tree->sync.pending;
+    pthread_mutex_unlock(&tree->sync.lock);
+    lua_pushinteger(L, pending);
+    return 1;
+}
+
+/**
+ * tree:count(), number of nodes in the snapshot file.
+ **/
+static int zklua_tree_count(lua_State *L)
+{
+    zklua_tree_t *tree = _zklua_tree_check(L, 1);
+    lua_pushinteger(L, tree->header->count);
+    return 1;
+}
+
+/**
+ * tree:close(), waits for the catch-up requests and unmaps the file.
+ **/
+static int zklua_tree_close(lua_State *L)
+{
+    zklua_tree_overlay_t *overlay = NULL, *next = NULL;
+    int i;
+    zklua_tree_t *tree = luaL_checkudata(L, 1, ZKLUA_TREE_METATABLE_NAME);
+
+    if (tree->map == NULL) return 0;
+    _zklua_batch_wait(&tree->sync);
+    for (i = 0; i < ZKLUA_TREE_OVERLAY_BUCKETS; ++i) {
+        for (overlay = tree->overlay[i]; overlay != NULL; overlay = next) {
+            next = overlay->next;
+            free(overlay->path);
+            free(overlay->data);
+            free(overlay);
+        }
+        tree->overlay[i] = NULL;
+    }
+    munmap(tree->map, tree->map_len);
+    tree->map = NULL;
+    _zklua_batch_fini(&tree->sync);
+    pthread_mutex_destroy(&tree->lock);
+    return 0;
+}
+
+static const luaL_Reg zklua_tree[] =
+{
+    {"get", zklua_tree_get},
+    {"exists", zklua_tree_exists},
+    {"get_children", zklua_tree_get_children},
+    {"sync", zklua_tree_sync},
+    {"pending", zklua_tree_pending},
+    {"count", zklua_tree_count},
+    {"close", zklua_tree_close},
+    {"__gc", zklua_tree_close},
+    {NULL, NULL}
+};
+
+static zklua_shm_slot_t *_zklua_shm_slot(const zklua_shm_t *shm, uint32_t index)
+{
+    return (zklua_shm_slot_t *)(shm->map + sizeof(zklua_shm_header_t)
+            + (size_t)index * shm->stride);
+}
+
+static void _zklua_shm_release(zklua_shm_t *shm)
+{
+    int refs = 0;
+    pthread_mutex_lock(&shm->lock);
+    refs = --shm->refs;
+    pthread_mutex_unlock(&shm->lock);
+    if (refs > 0) return;
+    munmap(shm->map, shm->map_len);
+    pthread_mutex_destroy(&shm->lock);
+    free(shm->scratch);
+    free(shm);
+}
+
+/**
+ * publish @value@ for @path@, @value@ NULL marks the path deleted.
+ * only the owner calls this, writers are serialized by shm->lock.
+ **/
+static int _zklua_shm_publish(zklua_shm_t *shm, const char *path,
+        const char *value, int value_len, int64_t version)
+{
+    zklua_shm_slot_t *slot = NULL;
+    size_t path_len = strlen(path);
+    uint32_t nslots = shm->header->nslots;
+    uint32_t index = _zklua_hash_string(path) % nslots;
+    uint32_t seq = 0;
+    uint32_t i;
+
+    if (path_len >= ZKLUA_SHM_MAX_PATH) return ZBADARGUMENTS;
+    if (value_len < 0) value_len = 0;
+    if ((uint32_t)value_len > shm->header->slot_size) return ZBADARGUMENTS;
+    pthread_mutex_lock(&shm->lock);
+    for (i = 0; i < nslots; ++i) {
+        slot = _zklua_shm_slot(shm, (index + i) % nslots);
+        if (slot->state == ZKLUA_SHM_SLOT_EMPTY) break;
+        if (slot->path_len == path_len
+                && memcmp(slot->path, path, path_len) == 0) break;
+    }
+    if (i == nslots) {
+        pthread_mutex_unlock(&shm->lock);
+        return ZSYSTEMERROR;
+    }
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (slot->state == ZKLUA_SHM_SLOT_EMPTY) {
+        memcpy(slot->path, path, path_len + 1);
+        slot->path_len = path_len;
+    }
+    slot->version = version;
+    if (value != NULL) {
+        memcpy((char *)(slot + 1), value, value_len);
+        slot->data_len = value_len;
+        slot->state = ZKLUA_SHM_SLOT_LIVE;
+    } else {
+        slot->data_len = 0;
+        slot->state = ZKLUA_SHM_SLOT_DELETED;
+    }
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shm->header->generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shm->lock);
+    return ZOK;
+}
+
+/**
+ * lock-free lookup of @path@, copies the value into shm->scratch.
+ * return 1 if found, 0 otherwise.
+ **/
+static int _zklua_shm_lookup(zklua_shm_t *shm, const char *path,
+        uint32_t *data_len, int64_t *version)
+{
+    zklua_shm_slot_t *slot = NULL;
+    size_t path_len = strlen(path);
+    uint32_t nslots = shm->header->nslots;
+    uint32_t index = _zklua_hash_string(path) % nslots;
+    uint32_t seq1 = 0, seq2 = 0;
+    uint32_t state = 0, len = 0;
+    int64_t ver = 0;
+    int match = 0;
+    uint32_t i;
+
+    if (path_len >= ZKLUA_SHM_MAX_PATH) return 0;
+    for (i = 0; i < nslots; ++i) {
+        slot = _zklua_shm_slot(shm, (index + i) % nslots);
+        do {
+            seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq1 & 1) continue;
+            state = slot->state;
+            match = (state != ZKLUA_SHM_SLOT_EMPTY && slot->path_len == path_len
+                    && memcmp(slot->path, path, path_len) == 0);
+            if (match && state == ZKLUA_SHM_SLOT_LIVE) {
+                len = slot->data_len;
+                if (len > shm->header->slot_size) len = shm->header->slot_size;
+                ver = slot->version;
+                memcpy(shm->scratch, (const char *)(slot + 1), len);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        } while ((seq1 & 1) || seq1 != seq2);
+        if (state == ZKLUA_SHM_SLOT_EMPTY) return 0;
+        if (match) {
+            if (state != ZKLUA_SHM_SLOT_LIVE) return 0;
+            *data_len = len;
+            *version = ver;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void _zklua_shm_watcher(zhandle_t *zh, int type, int state,
+        const char *path, void *watcherctx);
+
+static int _zklua_shm_watch_arm(zklua_shm_watch_t *watch);
+
+static void _zklua_shm_watch_free(zklua_shm_watch_t *watch)
+{
+    _zklua_shm_release(watch->shm);
+    free(watch->path);
+    free(watch);
+}
+
+static int _zklua_shm_watch_closed(zklua_shm_watch_t *watch)
+{
+    int closed = 0;
+    pthread_mutex_lock(&watch->shm->lock);
+    closed = watch->shm->closed;
+    pthread_mutex_unlock(&watch->shm->lock);
+    return closed;
+}
+
+/**
+ * stop keeping the path of @watch@ published. unless the cache has been
+ * closed the path is marked deleted, readers then miss instead of being
+ * served a value that nothing refreshes anymore.
+ **/
+static void _zklua_shm_watch_stop(zklua_shm_watch_t *watch)
+{
+    if (!_zklua_shm_watch_closed(watch)) {
+        _zklua_shm_publish(watch->shm, watch->path, NULL, 0, 0);
+    }
+    _zklua_shm_watch_free(watch);
+}
+
+/**
+ * a request of @watch@ failed with @rc@: read the node again after a
+ * connection loss or a timeout (the client holds the request until it
+ * reconnects), stop on anything else, session expiry included.
+ **/
+static void _zklua_shm_watch_retry(zklua_shm_watch_t *watch, int rc)
+{
+    if ((rc != ZCONNECTIONLOSS && rc != ZOPERATIONTIMEOUT)
+            || _zklua_shm_watch_closed(watch)
+            || _zklua_shm_watch_arm(watch) != ZOK) {
+        _zklua_shm_watch_stop(watch);
+    }
+}
+
+static void _zklua_shm_watch_exists_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_shm_watch_t *watch = (zklua_shm_watch_t *)data;
+    /* the node was created in between, the exists watch will fire. */
+    if (rc != ZOK && rc != ZNONODE) _zklua_shm_watch_retry(watch, rc);
+}
+
+static void _zklua_shm_watch_get_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_shm_watch_t *watch = (zklua_shm_watch_t *)data;
+    if (rc == ZOK) {
+        _zklua_shm_publish(watch->shm, watch->path, value, value_len, stat->mzxid);
+    } else if (rc == ZNONODE) {
+        _zklua_shm_publish(watch->shm, watch->path, NULL, 0, 0);
+        /* watch for the node to come back. */
+        if (zoo_awexists(watch->zh, watch->path, _zklua_shm_watcher, watch,
+                    _zklua_shm_watch_exists_completion, watch) != ZOK) {
+            _zklua_shm_watch_stop(watch);
+        }
+    } else {
+        _zklua_shm_watch_retry(watch, rc);
+    }
+}
+
+static int _zklua_shm_watch_arm(zklua_shm_watch_t *watch)
+{
+    return zoo_awget(watch->zh, watch->path, _zklua_shm_watcher, watch,
+            _zklua_shm_watch_get_completion, watch);
+}
+
+static void _zklua_shm_watcher(zhandle_t *zh, int type, int state,
+        const char *path, void *watcherctx)
+{
+    zklua_shm_watch_t *watch = (zklua_shm_watch_t *)watcherctx;
+    /* session events do not consume the watch, but it never fires again
+     * once the session has expired. */
+    if (type == ZOO_SESSION_EVENT) {
+        if (state == ZOO_EXPIRED_SESSION_STATE) _zklua_shm_watch_stop(watch);
+        return;
+    }
+    if (_zklua_shm_watch_closed(watch) || _zklua_shm_watch_arm(watch) != ZOK) {
+        _zklua_shm_watch_stop(watch);
+    }
+}
+
+static zklua_shm_t *_zklua_shm_check(lua_State *L, int index)
+{
+    zklua_shm_handle_t *handle = luaL_checkudata(L, index, ZKLUA_SHM_METATABLE_NAME);
+    if (handle->shm == NULL) luaL_error(L, "shared memory cache already closed.");
+    return handle->shm;
+}
+
+static int _zklua_shm_new(lua_State *L, char *map, size_t map_len, int owner)
+{
+    zklua_shm_handle_t *handle = NULL;
+    zklua_shm_t *shm = (zklua_shm_t *)calloc(1, sizeof(zklua_shm_t));
+    if (shm == NULL) {
+        munmap(map, map_len);
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    shm->map = map;
+    shm->map_len = map_len;
+    shm->header = (zklua_shm_header_t *)map;
+    shm->stride = (sizeof(zklua_shm_slot_t) + shm->header->slot_size + 7) & ~(size_t)7;
+    shm->owner = owner;
+    shm->refs = 1;
+    shm->scratch = (char *)malloc(shm->header->slot_size + 1);
+    pthread_mutex_init(&shm->lock, NULL);
+    if (shm->scratch == NULL) {
+        _zklua_shm_release(shm);
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    handle = (zklua_shm_handle_t *)lua_newuserdata(L, sizeof(zklua_shm_handle_t));
+    handle->shm = shm;
+    luaL_getmetatable(L, ZKLUA_SHM_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/**
+ * creates the named shared-memory cache, or takes over one left by a
+ * previous owner with the same layout, its values stay readable. the
+ * calling process becomes its owner and the only writer.
+ **/
+static int zklua_shm_create(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    int nslots = luaL_optint(L, 2, ZKLUA_SHM_DEFAULT_SLOTS);
+    int slot_size = luaL_optint(L, 3, ZKLUA_SHM_DEFAULT_SLOT_SIZE);
+    zklua_shm_header_t *header = NULL;
+    zklua_shm_header_t existing;
+    zklua_shm_slot_t *slot = NULL;
+    struct stat st;
+    uint32_t seq = 0;
+    uint32_t i;
+    size_t stride = 0, map_len = 0;
+    void *map = NULL;
+    int fd = -1;
+    int init = 1;
+
+    if (nslots <= 0 || slot_size <= 0) {
+        return luaL_error(L, "invalid arguments: slots and slot size "
+                "must be positive.");
+    }
+    stride = (sizeof(zklua_shm_slot_t) + slot_size + 7) & ~(size_t)7;
+    map_len = sizeof(zklua_shm_header_t) + (size_t)nslots * stride;
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        /* readers may be attached, only a region without a valid header
+         * (its creator died before writing the magic) is initialized. */
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd >= 0 && fstat(fd, &st) == 0
+                && st.st_size >= (off_t)sizeof(zklua_shm_header_t)
+                && pread(fd, &existing, sizeof(existing), 0)
+                    == (ssize_t)sizeof(existing)
+                && memcmp(existing.magic, ZKLUA_SHM_MAGIC,
+                    sizeof(ZKLUA_SHM_MAGIC)) == 0) {
+            if (existing.version != ZKLUA_SHM_VERSION
+                    || existing.nslots != (uint32_t)nslots
+                    || existing.slot_size != (uint32_t)slot_size
+                    || st.st_size < (off_t)map_len) {
+                close(fd);
+                lua_pushnil(L);
+                lua_pushfstring(L, "shared memory %s exists with "
+                        "another layout.", name);
+                return 2;
+            }
+            init = 0;
+        }
+    }
+    if (fd < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to open shared memory %s.", name);
+        return 2;
+    }
+    if (init && ftruncate(fd, map_len) != 0) {
+        close(fd);
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to size shared memory %s.", name);
+        return 2;
+    }
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to map shared memory %s.", name);
+        return 2;
+    }
+    if (!init) {
+        /* a slot left odd by a previous owner that died while writing it
+         * would hold readers forever, drop its value. */
+        for (i = 0; i < (uint32_t)nslots; ++i) {
+            slot = (zklua_shm_slot_t *)((char *)map
+                    + sizeof(zklua_shm_header_t) + (size_t)i * stride);
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if ((seq & 1) == 0) continue;
+            slot->data_len = 0;
+            slot->state = ZKLUA_SHM_SLOT_DELETED;
+            __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+        }
+        return _zklua_shm_new(L, (char *)map, map_len, 1);
+    }
+    memset(map, 0, map_len);
+    header = (zklua_shm_header_t *)map;
+    header->version = ZKLUA_SHM_VERSION;
+    header->nslots = nslots;
+    header->slot_size = slot_size;
+    /* the magic goes last, readers attaching meanwhile bail out. */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, ZKLUA_SHM_MAGIC, sizeof(ZKLUA_SHM_MAGIC));
+    return _zklua_shm_new(L, (char *)map, map_len, 1);
+}
+
+/**
+ * attaches read-only to a shared-memory cache created by shm_create.
+ **/
+static int zklua_shm_attach(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    zklua_shm_header_t *header = NULL;
+    struct stat st;
+    void *map = NULL;
+    size_t stride = 0;
+    int fd = -1;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to open shared memory %s.", name);
+        return 2;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(zklua_shm_header_t)) {
+        close(fd);
+        lua_pushnil(L);
+        lua_pushfstring(L, "invalid shared memory %s.", name);
+        return 2;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to map shared memory %s.", name);
+        return 2;
+    }
+    header = (zklua_shm_header_t *)map;
+    stride = (sizeof(zklua_shm_slot_t) + header->slot_size + 7) & ~(size_t)7;
+    if (memcmp(header->magic, ZKLUA_SHM_MAGIC, sizeof(ZKLUA_SHM_MAGIC)) != 0
+            || header->version != ZKLUA_SHM_VERSION || header->nslots == 0
+            || sizeof(zklua_shm_header_t) + (size_t)header->nslots * stride
+                > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        lua_pushnil(L);
+        lua_pushfstring(L, "invalid shared memory %s.", name);
+        return 2;
+    }
+    return _zklua_shm_new(L, (char *)map, st.st_size, 0);
+}
+
+/**
+ * shm:get(path), return the value and its version (mzxid), or nil.
+ **/
+static int zklua_shm_get(lua_State *L)
+{
+    zklua_shm_t *shm = _zklua_shm_check(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    uint32_t data_len = 0;
+    int64_t version = 0;
+
+    if (!_zklua_shm_lookup(shm, path, &data_len, &version)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushlstring(L, shm->scratch, data_len);
+    lua_pushnumber(L, version);
+    return 2;
+}
+
+/**
+ * shm:generation(), bumped on every publish.
+ **/
+static int zklua_shm_generation(lua_State *L)
+{
+    zklua_shm_t *shm = _zklua_shm_check(L, 1);
+    lua_pushnumber(L, __atomic_load_n(&shm->header->generation, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+/**
+ * shm:publish(path, value [, version]), owner only.
+ **/
+static int zklua_shm_publish(lua_State *L)
+{
+    zklua_shm_t *shm = _zklua_shm_check(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    size_t value_len = 0;
+    const char *value = NULL;
+    int64_t version = (int64_t)luaL_optnumber(L, 4, 0);
+
+    if (!shm->owner) return luaL_error(L, "only the owner can publish.");
+    if (!lua_isnil(L, 3)) value = luaL_checklstring(L, 3, &value_len);
+    lua_pushinteger(L, _zklua_shm_publish(shm, path, value, value_len, version));
+    return 1;
+}
+
+/**
+ * shm:watch(zh, path), owner only. keeps path published: the node is read
+ * with a watch and every change re-reads and republishes it, without
+ * calling back into lua.
+ **/
+static int zklua_shm_watch(lua_State *L)
+{
+    zklua_shm_t *shm = _zklua_shm_check(L, 1);
+    zklua_handle_t *handle = luaL_checkudata(L, 2, ZKLUA_METATABLE_NAME);
+    const char *path = luaL_checkstring(L, 3);
+    zklua_shm_watch_t *watch = NULL;
+    int ret = -1;
+
+    if (!shm->owner) return luaL_error(L, "only the owner can watch.");
+    if (_zklua_check_handle(L, handle)) {
+        watch = (zklua_shm_watch_t *)malloc(sizeof(zklua_shm_watch_t));
+        if (watch == NULL || (watch->path = strdup(path)) == NULL) {
+            free(watch);
+            return luaL_error(L, "out of memory when zklua trys to "
+                    "alloc an internal object.");
+        }
+        watch->shm = shm;
+        watch->zh = handle->zh;
+        pthread_mutex_lock(&shm->lock);
+        shm->refs++;
+        pthread_mutex_unlock(&shm->lock);
+        ret = _zklua_shm_watch_arm(watch);
+        if (ret != ZOK) _zklua_shm_watch_free(watch);
+        lua_pushinteger(L, ret);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * shm:close(), watches stop at their next event.
+ **/
+static int zklua_shm_close(lua_State *L)
+{
+    zklua_shm_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_SHM_METATABLE_NAME);
+    if (handle->shm == NULL) return 0;
+    pthread_mutex_lock(&handle->shm->lock);
+    handle->shm->closed = 1;
+    pthread_mutex_unlock(&handle->shm->lock);
+    _zklua_shm_release(handle->shm);
+    handle->shm = NULL;
+    return 0;
+}
+
+static const luaL_Reg zklua_shm[] =
+{
+    {"get", zklua_shm_get},
+    {"generation", zklua_shm_generation},
+    {"publish", zklua_shm_publish},
+    {"watch", zklua_shm_watch},
+    {"close", zklua_shm_close},
+    {"__gc", zklua_shm_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg zklua_closer[] =
+{
+    {"done", zklua_closer_done},
+    {"wait", zklua_closer_wait},
+    {"__gc", zklua_closer_gc},
+    {NULL, NULL}
+};
+
+/**
+ * create the persistent nodes leading to @path@ and @path@ itself,
+ * existing nodes are left alone.
+ **/
+static int _zklua_ensure_path(zhandle_t *zh, const char *path)
+{
+    char buffer[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    char *slash = NULL;
+    int ret = ZOK;
+
+    if (strlen(path) >= sizeof(buffer)) return ZBADARGUMENTS;
+    strcpy(buffer, path);
+    slash = buffer;
+    while (slash != NULL) {
+        slash = strchr(slash + 1, '/');
+        if (slash != NULL) *slash = '\0';
+        ret = zoo_create(zh, buffer, NULL, -1, &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+        if (ret == ZNODEEXISTS) ret = ZOK;
+        if (ret != ZOK) return ret;
+        if (slash != NULL) *slash = '/';
+    }
+    return ret;
+}
+
+/**
+ * serial of the recipe nodes created by this process, see
+ * _zklua_node_tag.
+ **/
+static uint32_t zklua_node_serial = 0;
+
+/**
+ * name @prefix@<session id><serial>- into @tag@, the prefix of a
+ * sequential node that no other create of the session shares.
+ **/
+static int _zklua_node_tag(zhandle_t *zh, const char *prefix, char *tag,
+        size_t size)
+{
+    const clientid_t *clientid = zoo_client_id(zh);
+    uint32_t serial = __atomic_add_fetch(&zklua_node_serial, 1,
+            __ATOMIC_RELAXED);
+    int len = snprintf(tag, size, "%s%016llx%08x-", prefix,
+            (unsigned long long)(clientid != NULL ? clientid->client_id : 0),
+            (unsigned int)(serial ^ ((uint32_t)getpid() << 16)));
+    return len > 0 && (size_t)len < size;
+}
+
+static int _zklua_transient_error(zhandle_t *zh, int rc)
+{
+    int state = zoo_state(zh);
+    return (rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT)
+        && state != ZOO_EXPIRED_SESSION_STATE && state != ZOO_AUTH_FAILED_STATE;
+}
+
+/**
+ * deadline of a recipe call waiting @timeout@ milliseconds, forever if
+ * negative.
+ **/
+static uint64_t _zklua_lock_deadline(int timeout)
+{
+    if (timeout < 0) return UINT64_MAX;
+    return _zklua_now_us() + (uint64_t)timeout * 1000;
+}
+
+/**
+ * deadline of a single request sent before @deadline@: even a try gets
+ * one round trip.
+ **/
+static uint64_t _zklua_lock_request_deadline(uint64_t deadline)
+{
+    uint64_t min = _zklua_now_us() + ZKLUA_LOCK_POLL_INTERVAL * 1000;
+    return (deadline < min) ? min : deadline;
+}
+
+/**
+ * whether to send again a request that failed with *@rc@: transient
+ * errors are retried every ZKLUA_LOCK_RETRY_INTERVAL until @deadline@,
+ * when *@rc@ becomes ZKLUA_TIMEDOUT.
+ **/
+static int _zklua_lock_retry(zhandle_t *zh, int *rc, uint64_t deadline)
+{
+    uint64_t now = 0, pause = ZKLUA_LOCK_RETRY_INTERVAL * 1000;
+
+    if (*rc == ZKLUA_TIMEDOUT && zoo_state(zh) != ZOO_EXPIRED_SESSION_STATE) {
+        /* the request itself ran out of time: a retry is due too. */
+    } else if (!_zklua_transient_error(zh, *rc)) {
+        return 0;
+    }
+    now = _zklua_now_us();
+    if (now >= deadline) {
+        *rc = ZKLUA_TIMEDOUT;
+        return 0;
+    }
+    if (deadline - now < pause) pause = deadline - now;
+    usleep(pause);
+    return 1;
+}
+
+/**
+ * list @dir@, watched through @waits@ unless NULL.
+ **/
+static int _zklua_lock_get_children(zhandle_t *zh, const char *dir,
+        zklua_waits_t *waits, struct String_vector *strings, uint64_t deadline)
+{
+    zklua_call_t *call = NULL;
+    int ret = -1;
+
+    strings->count = 0;
+    strings->data = NULL;
+    if ((call = _zklua_call_new()) == NULL) {
+        return (waits != NULL)
+            ? zoo_wget_children(zh, dir, _zklua_waits_watcher, waits, strings)
+            : zoo_get_children(zh, dir, 0, strings);
+    }
+    if (waits != NULL) {
+        ret = zoo_awget_children(zh, dir, _zklua_waits_watcher, waits,
+                _zklua_call_strings_completion, call);
+    } else {
+        ret = zoo_aget_children(zh, dir, 0, _zklua_call_strings_completion,
+                call);
+    }
+    ret = _zklua_call_wait_until(&call, ret,
+            _zklua_lock_request_deadline(deadline));
+    return _zklua_call_strings_result(call, ret, strings, NULL);
+}
+
+static int _zklua_lock_wexists(zhandle_t *zh, const char *path,
+        zklua_waits_t *waits, uint64_t deadline)
+{
+    zklua_call_t *call = NULL;
+    int ret = -1;
+
+    if ((call = _zklua_call_new()) == NULL) {
+        return zoo_wexists(zh, path, _zklua_waits_watcher, waits, NULL);
+    }
+    ret = _zklua_call_wait_until(&call, zoo_awexists(zh, path,
+                _zklua_waits_watcher, waits, _zklua_call_stat_completion,
+                call), _zklua_lock_request_deadline(deadline));
+    return _zklua_call_stat_result(call, ret, NULL);
+}
+
+static int _zklua_lock_delete(zhandle_t *zh, const char *node,
+        uint64_t deadline)
+{
+    zklua_call_t *call = NULL;
+    int ret = -1;
+
+    if ((call = _zklua_call_new()) == NULL) return zoo_delete(zh, node, -1);
+    ret = _zklua_call_wait_until(&call, zoo_adelete(zh, node, -1,
+                _zklua_call_void_completion, call),
+            _zklua_lock_request_deadline(deadline));
+    if (call != NULL) _zklua_call_free(call);
+    return ret;
+}
+
+/**
+ * remember that the children of @dir@ starting with @prefix@ may be ours
+ * and must go, see zklua_lost_node_t.
+ **/
+static void _zklua_lost_add(zklua_waits_t *waits, const char *dir,
+        size_t dir_len, const char *prefix)
+{
+    zklua_lost_node_t *lost = NULL;
+
+    if (waits == NULL) return;
+    lost = (zklua_lost_node_t *)calloc(1, sizeof(zklua_lost_node_t));
+    if (lost == NULL || (lost->dir = strndup(dir, dir_len)) == NULL
+            || (lost->prefix = strdup(prefix)) == NULL) {
+        if (lost != NULL) free(lost->dir);
+        free(lost);
+        return;
+    }
+    pthread_mutex_lock(&waits->lock);
+    lost->next = waits->lost;
+    waits->lost = lost;
+    pthread_mutex_unlock(&waits->lock);
+}
+
+/**
+ * delete the lost nodes of the session, once connected. the ones that
+ * can not be settled yet are kept for the next sweep; all of them are
+ * gone with an expired session.
+ **/
+static void _zklua_lost_sweep(zklua_handle_t *handle, uint64_t deadline)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    struct String_vector strings;
+    zklua_lost_node_t *lost = NULL, *next = NULL, *kept = NULL;
+    zklua_waits_t *waits = handle->waits;
+    zhandle_t *zh = handle->zh;
+    size_t len = 0;
+    int ret = -1, i;
+
+    if (waits == NULL || __atomic_load_n(&waits->lost, __ATOMIC_ACQUIRE) == NULL
+            || zoo_state(zh) != ZOO_CONNECTED_STATE) {
+        return;
+    }
+    pthread_mutex_lock(&waits->lock);
+    lost = waits->lost;
+    waits->lost = NULL;
+    pthread_mutex_unlock(&waits->lock);
+    for (; lost != NULL; lost = next) {
+        next = lost->next;
+        ret = _zklua_lock_get_children(zh, lost->dir, NULL, &strings, deadline);
+        len = strlen(lost->prefix);
+        for (i = 0; ret == ZOK && i < strings.count; ++i) {
+            if (strncmp(strings.data[i], lost->prefix, len) != 0) continue;
+            if (_zklua_join_path(path, sizeof(path), lost->dir, strings.data[i])) {
+                ret = _zklua_lock_delete(zh, path, deadline);
+                if (ret == ZNONODE) ret = ZOK;
+            }
+        }
+        deallocate_String_vector(&strings);
+        if (_zklua_transient_error(zh, ret) || ret == ZKLUA_TIMEDOUT) {
+            lost->next = kept;
+            kept = lost;
+        } else {
+            lost->next = NULL;
+            _zklua_lost_free(lost);
+        }
+    }
+    if (kept == NULL) return;
+    for (lost = kept; lost->next != NULL; lost = lost->next);
+    pthread_mutex_lock(&waits->lock);
+    lost->next = waits->lost;
+    waits->lost = kept;
+    pthread_mutex_unlock(&waits->lock);
+}
+
+/**
+ * find the node of @dir@ whose name starts with @tag@ after a create lost
+ * with the connection. on ZOK *@node@ is its path and, unless NULL,
+ * @children@ the listing it was found in; ZNONODE means it was never
+ * created. past @deadline@ the node is left to the lost node sweep and
+ * ZKLUA_TIMEDOUT returned.
+ **/
+static int _zklua_node_recover(zklua_handle_t *handle, const char *dir,
+        const char *tag, char **node, struct String_vector *children,
+        uint64_t deadline)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    struct String_vector strings;
+    size_t tag_len = strlen(tag);
+    int ret = -1, i;
+
+    *node = NULL;
+    do {
+        ret = _zklua_lock_get_children(handle->zh, dir, NULL, &strings,
+                deadline);
+    } while (_zklua_lock_retry(handle->zh, &ret, deadline));
+    if (ret == ZKLUA_TIMEDOUT) {
+        _zklua_lost_add(handle->waits, dir, strlen(dir), tag);
+    }
+    if (ret != ZOK) return ret;
+    ret = ZNONODE;
+    for (i = 0; i < strings.count; ++i) {
+        if (strncmp(strings.data[i], tag, tag_len) != 0) continue;
+        if (!_zklua_join_path(path, sizeof(path), dir, strings.data[i])) {
+            ret = ZBADARGUMENTS;
+        } else if ((*node = strdup(path)) == NULL) {
+            ret = ZSYSTEMERROR;
+        } else {
+            ret = ZOK;
+        }
+        break;
+    }
+    if (ret == ZOK && children != NULL) {
+        *children = strings;
+    } else {
+        deallocate_String_vector(&strings);
+    }
+    return ret;
+}
+
+/**
+ * delete our recipe node @node@, retrying through connection losses until
+ * @deadline@: a node left behind would stay ahead of everyone for the
+ * whole session, so past it the node is left to the lost node sweep.
+ **/
+static int _zklua_node_remove(zklua_handle_t *handle, const char *node,
+        uint64_t deadline)
+{
+    const char *name = strrchr(node, '/') + 1;
+    int ret = -1;
+
+    do {
+        ret = _zklua_lock_delete(handle->zh, node, deadline);
+    } while (_zklua_lock_retry(handle->zh, &ret, deadline));
+    /* an ephemeral node goes away with its session. */
+    if (ret == ZNONODE || ret == ZSESSIONEXPIRED || ret == ZINVALIDSTATE) {
+        ret = ZOK;
+    } else if (ret == ZKLUA_TIMEDOUT) {
+        _zklua_lost_add(handle->waits, node, name - 1 - node, name);
+    }
+    return ret;
+}
+
+static void _zklua_lock_create_completion(int rc, const char *value,
+        const void *data)
+{
+    zklua_lock_step_t *step = (zklua_lock_step_t *)data;
+    step->create_rc = rc;
+    if (rc == ZOK && (step->node = strdup(value)) == NULL) {
+        step->create_rc = ZSYSTEMERROR;
+    }
+    _zklua_batch_done(step->batch);
+}
+
+static void _zklua_lock_children_completion(int rc,
+        const struct String_vector *strings, const void *data)
+{
+    zklua_lock_step_t *step = (zklua_lock_step_t *)data;
+    step->children_rc = rc;
+    if (rc == ZOK && !_zklua_copy_string_vector(&step->children, strings)) {
+        step->children_rc = ZSYSTEMERROR;
+    }
+    _zklua_batch_done(step->batch);
+}
+
+/**
+ * create an ephemeral sequential node @dir@/@prefix@<tag> and list @dir@.
+ * both requests are pipelined, the server answers them in order so the
+ * list includes the new node: an uncontended acquire takes one round
+ * trip. a create lost with the connection is looked up by its tag, and
+ * sent again until @deadline@. with @watch@ the list sets a children watch
+ * through the waits of @handle@.
+ **/
+static int _zklua_lock_enter(zklua_handle_t *handle, const char *dir,
+        const char *prefix, zklua_lock_step_t *step, uint64_t deadline,
+        int watch)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    char tag[ZKLUA_LOCK_TAG_SIZE];
+    zklua_batch_t batch;
+    zhandle_t *zh = handle->zh;
+    int ensured = 0, ret = -1;
+
+    _zklua_lost_sweep(handle, deadline);
+    for (;;) {
+        /* the session id is only known once connected. */
+        if (!_zklua_node_tag(zh, prefix, tag, sizeof(tag))
+                || !_zklua_join_path(path, sizeof(path), dir, tag)) {
+            return ZBADARGUMENTS;
+        }
+        memset(step, 0, sizeof(zklua_lock_step_t));
+        step->batch = &batch;
+        _zklua_batch_init(&batch);
+        _zklua_batch_add(&batch, 2);
+        ret = zoo_acreate(zh, path, NULL, -1, &ZOO_OPEN_ACL_UNSAFE,
+                ZOO_EPHEMERAL | ZOO_SEQUENCE, _zklua_lock_create_completion, step);
+        if (ret != ZOK) {
+            step->create_rc = ret;
+            _zklua_batch_done(&batch);
+        }
+        if (watch) {
+            ret = zoo_awget_children(zh, dir, _zklua_waits_watcher,
+                    handle->waits, _zklua_lock_children_completion, step);
+        } else {
+            ret = zoo_aget_children(zh, dir, 0, _zklua_lock_children_completion,
+                    step);
+        }
+        if (ret != ZOK) {
+            step->children_rc = ret;
+            _zklua_batch_done(&batch);
+        }
+        _zklua_batch_wait(&batch);
+        _zklua_batch_fini(&batch);
+        if (_zklua_transient_error(zh, step->create_rc)) {
+            deallocate_String_vector(&step->children);
+            ret = _zklua_node_recover(handle, dir, tag, &step->node,
+                    &step->children, deadline);
+            if (ret == ZNONODE && _zklua_lock_retry(zh, &step->create_rc,
+                        deadline)) {
+                continue;
+            }
+            if (ret != ZNONODE) step->create_rc = ret;
+            step->children_rc = step->create_rc;
+            break;
+        }
+        if (step->create_rc != ZNONODE || ensured) break;
+        /* first use of @dir@. */
+        deallocate_String_vector(&step->children);
+        if ((ret = _zklua_ensure_path(zh, dir)) != ZOK) return ret;
+        ensured = 1;
+    }
+    if (step->create_rc != ZOK) deallocate_String_vector(&step->children);
+    return step->create_rc;
+}
+
+/**
+ * block until @wait@ fires, the session expires or @deadline@ passes.
+ **/
+static int _zklua_lock_block(zhandle_t *zh, zklua_waits_t *waits,
+        zklua_lock_wait_t *wait, int timeout, uint64_t deadline)
+{
+    struct timespec ts;
+    uint64_t until = 0, now = 0;
+    int ret = ZOK;
+
+    pthread_mutex_lock(&waits->lock);
+    while (!wait->fired) {
+        now = _zklua_now_us();
+        if (timeout >= 0 && now >= deadline) {
+            ret = ZKLUA_TIMEDOUT;
+            break;
+        }
+        if (zoo_state(zh) == ZOO_EXPIRED_SESSION_STATE) {
+            ret = ZSESSIONEXPIRED;
+            break;
+        }
+        until = now + ZKLUA_LOCK_POLL_INTERVAL * 1000;
+        if (timeout >= 0 && until > deadline) until = deadline;
+        ts.tv_sec = until / 1000000;
+        ts.tv_nsec = (until % 1000000) * 1000;
+        pthread_cond_timedwait(&waits->cond, &waits->lock, &ts);
+    }
+    pthread_mutex_unlock(&waits->lock);
+    return ret;
+}
+
+/**
+ * wait until the node @node@ created under @dir@ is chosen by @pred@,
+ * watching only its predecessor. @children@ is the list fetched with the
+ * node and is freed.
+ **/
+static int _zklua_lock_wait_turn(zklua_handle_t *handle, const char *dir,
+        const char *node, struct String_vector *children, int children_rc,
+        zklua_lock_pred_t pred, int timeout, uint64_t deadline)
+{
+    char pred_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    const char *own = strrchr(node, '/') + 1;
+    zklua_lock_wait_t wait;
+    zklua_waits_t *waits = handle->waits;
+    int self = -1, p = -1, i;
+    int refetched = 0;
+    int ret = ZOK;
+
+    for (;;) {
+        if ((ret = children_rc) != ZOK) break;
+        qsort(children->data, children->count, sizeof(char *), _zklua_sequence_cmp);
+        for (self = -1, i = 0; i < children->count; ++i) {
+            if (strcmp(children->data[i], own) == 0) self = i;
+        }
+        if (self < 0) {
+            /* our node is gone, with the session. */
+            if (refetched) {
+                ret = ZSESSIONEXPIRED;
+                break;
+            }
+        } else if ((p = pred(children->data, children->count, self)) < 0) {
+            ret = ZOK;
+            break;
+        } else if (timeout == 0) {
+            ret = ZKLUA_TIMEDOUT;
+            break;
+        } else {
+            if (!_zklua_join_path(pred_path, sizeof(pred_path), dir,
+                        children->data[p])) {
+                ret = ZBADARGUMENTS;
+                break;
+            }
+            _zklua_waits_add(waits, &wait, pred_path);
+            do {
+                ret = _zklua_lock_wexists(handle->zh, pred_path, waits,
+                        deadline);
+            } while (_zklua_lock_retry(handle->zh, &ret, deadline));
+            if (ret == ZOK) {
+                ret = _zklua_lock_block(handle->zh, waits, &wait,
+                        timeout, deadline);
+            } else if (ret == ZNONODE) {
+                ret = ZOK;
+            }
+            _zklua_waits_remove(waits, &wait);
+            if (ret != ZOK) break;
+        }
+        deallocate_String_vector(children);
+        do {
+            children_rc = _zklua_lock_get_children(handle->zh, dir, NULL,
+                    children, deadline);
+        } while (_zklua_lock_retry(handle->zh, &children_rc, deadline));
+        refetched = 1;
+    }
+    deallocate_String_vector(children);
+    return ret;
+}
+
+/**
+ * acquire a lock recipe node under @dir@: on success *@node@ is the path
+ * of the node, to be deleted to release it. @timeout@ is in milliseconds,
+ * 0 only tries and -1 waits forever.
+ **/
+static int _zklua_lock_acquire(zklua_handle_t *handle, const char *dir,
+        const char *prefix, zklua_lock_pred_t pred, int timeout, char **node)
+{
+    zklua_lock_step_t step;
+    uint64_t deadline = _zklua_lock_deadline(timeout);
+    int ret = -1;
+
+    *node = NULL;
+    if (handle->waits == NULL && (handle->waits = _zklua_waits_new()) == NULL) {
+        return ZSYSTEMERROR;
+    }
+    ret = _zklua_lock_enter(handle, dir, prefix, &step, deadline, 0);
+    if (ret != ZOK) return ret;
+    ret = _zklua_lock_wait_turn(handle, dir, step.node, &step.children,
+            step.children_rc, pred, timeout, deadline);
+    if (ret != ZOK) {
+        _zklua_node_remove(handle, step.node,
+                _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT));
+        free(step.node);
+        return ret;
+    }
+    *node = step.node;
+    return ZOK;
+}
+
+/**
+ * exclusive lock: wait for the node right before ours.
+ **/
+static int _zklua_lock_pred_exclusive(char **children, int count, int self)
+{
+    return self - 1;
+}
+
+/**
+ * shared lock: wait for the nearest exclusive node before ours, readers
+ * ahead of us do not matter.
+ **/
+static int _zklua_lock_pred_shared(char **children, int count, int self)
+{
+    size_t len = sizeof(ZKLUA_LOCK_READ_PREFIX) - 1;
+    int i;
+    for (i = self - 1; i >= 0; --i) {
+        if (strncmp(children[i], ZKLUA_LOCK_READ_PREFIX, len) != 0) return i;
+    }
+    return -1;
+}
+
+static zklua_lockmgr_t *_zklua_check_lockmgr(lua_State *L, int index)
+{
+    zklua_lockmgr_t *mgr = (zklua_lockmgr_t *)luaL_checkudata(L, index,
+            ZKLUA_LOCKS_METATABLE_NAME);
+    if (mgr->root == NULL) luaL_error(L, "invalid lock manager.");
+    if (!_zklua_check_handle(L, mgr->handle)) {
+        luaL_error(L, "invalid zookeeper handle.");
+    }
+    return mgr;
+}
+
+static zklua_lock_t **_zklua_lockmgr_find(zklua_lockmgr_t *mgr,
+        const char *name, unsigned int hash)
+{
+    zklua_lock_t **link = &mgr->buckets[hash % ZKLUA_LOCK_BUCKETS];
+    while (*link != NULL && ((*link)->hash != hash
+                || strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static int zklua_lock_manager(lua_State *L)
+{
+    size_t root_len = 0;
+    const char *root = NULL;
+    zklua_lockmgr_t *mgr = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        root = luaL_checklstring(L, 2, &root_len);
+        if (root_len == 0 || root[0] != '/'
+                || root_len >= ZKLUA_MAX_PATH_BUFFER_SIZE / 2) {
+            return luaL_error(L, "invalid arguments: root must be an "
+                    "absolute path.");
+        }
+        mgr = (zklua_lockmgr_t *)lua_newuserdata(L, sizeof(zklua_lockmgr_t));
+        memset(mgr, 0, sizeof(zklua_lockmgr_t));
+        luaL_getmetatable(L, ZKLUA_LOCKS_METATABLE_NAME);
+        lua_setmetatable(L, -2);
+        if ((mgr->root = strdup(root)) == NULL) {
+            return luaL_error(L, "out of memory when zklua trys to "
+                    "alloc an internal object.");
+        }
+        mgr->handle = handle;
+        lua_pushvalue(L, 1);
+        mgr->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * take the lock named by argument 2 with the node @prefix@ and the wait
+ * rule @pred@, argument 3 is the timeout.
+ **/
+static int _zklua_locks_acquire(lua_State *L, const char *prefix,
+        zklua_lock_pred_t pred)
+{
+    char dir[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    const char *name = NULL;
+    unsigned int hash = 0;
+    int timeout = -1;
+    int ret = -1;
+    zklua_lock_t *lock = NULL, **link = NULL;
+    zklua_lockmgr_t *mgr = _zklua_check_lockmgr(L, 1);
+
+    name = luaL_checkstring(L, 2);
+    timeout = luaL_optint(L, 3, -1);
+    if (name[0] == '\0' || strchr(name, '/') != NULL
+            || !_zklua_join_path(dir, sizeof(dir), mgr->root, name)) {
+        return luaL_error(L, "invalid arguments: invalid lock name.");
+    }
+    hash = _zklua_hash_string(name);
+    link = _zklua_lockmgr_find(mgr, name, hash);
+    if (*link != NULL) {
+        lua_pushinteger(L, ZNODEEXISTS);
+        return 1;
+    }
+    lock = (zklua_lock_t *)calloc(1, sizeof(zklua_lock_t));
+    if (lock == NULL || (lock->name = strdup(name)) == NULL) {
+        free(lock);
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    ret = _zklua_lock_acquire(mgr->handle, dir, prefix, pred, timeout,
+            &lock->node);
+    if (ret == ZOK) {
+        lock->hash = hash;
+        *link = lock;
+        mgr->count++;
+    } else {
+        free(lock->name);
+        free(lock);
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_locks_lock(lua_State *L)
+{
+    return _zklua_locks_acquire(L, ZKLUA_LOCK_PREFIX,
+            _zklua_lock_pred_exclusive);
+}
+
+static int zklua_locks_trylock(lua_State *L)
+{
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);
+    return zklua_locks_lock(L);
+}
+
+static int zklua_locks_rlock(lua_State *L)
+{
+    return _zklua_locks_acquire(L, ZKLUA_LOCK_READ_PREFIX,
+            _zklua_lock_pred_shared);
+}
+
+static int zklua_locks_wlock(lua_State *L)
+{
+    return _zklua_locks_acquire(L, ZKLUA_LOCK_WRITE_PREFIX,
+            _zklua_lock_pred_exclusive);
+}
+
+static int zklua_locks_unlock(lua_State *L)
+{
+    const char *name = NULL;
+    zklua_lock_t *lock = NULL, **link = NULL;
+    uint64_t deadline = 0;
+    int ret = -1;
+    zklua_lockmgr_t *mgr = _zklua_check_lockmgr(L, 1);
+
+    name = luaL_checkstring(L, 2);
+    link = _zklua_lockmgr_find(mgr, name, _zklua_hash_string(name));
+    if ((lock = *link) == NULL) {
+        lua_pushinteger(L, ZNONODE);
+        return 1;
+    }
+    deadline = _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT);
+    do {
+        ret = _zklua_lock_delete(mgr->handle->zh, lock->node, deadline);
+    } while (_zklua_lock_retry(mgr->handle->zh, &ret, deadline));
+    /* a node lost with the session is released all the same. */
+    if (ret == ZOK || ret == ZNONODE || ret == ZSESSIONEXPIRED) {
+        *link = lock->next;
+        mgr->count--;
+        free(lock->node);
+        free(lock->name);
+        free(lock);
+        ret = ZOK;
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_locks_held(lua_State *L)
+{
+    const char *name = NULL;
+    zklua_lockmgr_t *mgr = _zklua_check_lockmgr(L, 1);
+    name = luaL_checkstring(L, 2);
+    lua_pushboolean(L, *_zklua_lockmgr_find(mgr, name,
+                _zklua_hash_string(name)) != NULL);
+    return 1;
+}
+
+static int zklua_locks_count(lua_State *L)
+{
+    zklua_lockmgr_t *mgr = _zklua_check_lockmgr(L, 1);
+    lua_pushinteger(L, mgr->count);
+    return 1;
+}
+
+/**
+ * release every lock held by the manager, also its __gc.
+ **/
+static int zklua_locks_close(lua_State *L)
+{
+    int i;
+    zklua_lock_t *lock = NULL, *next = NULL;
+    zklua_lockmgr_t *mgr = (zklua_lockmgr_t *)luaL_checkudata(L, 1,
+            ZKLUA_LOCKS_METATABLE_NAME);
+
+    if (mgr->root == NULL) return 0;
+    for (i = 0; i < ZKLUA_LOCK_BUCKETS; ++i) {
+        for (lock = mgr->buckets[i]; lock != NULL; lock = next) {
+            next = lock->next;
+            if (mgr->handle->zh != NULL) {
+                _zklua_node_remove(mgr->handle, lock->node,
+                        _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT));
+            }
+            free(lock->node);
+            free(lock->name);
+            free(lock);
+        }
+        mgr->buckets[i] = NULL;
+    }
+    mgr->count = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, mgr->handleref);
+    free(mgr->root);
+    mgr->root = NULL;
+    return 0;
+}
+
+static const luaL_Reg zklua_locks[] =
+{
+    {"lock", zklua_locks_lock},
+    {"trylock", zklua_locks_trylock},
+    {"rlock", zklua_locks_rlock},
+    {"wlock", zklua_locks_wlock},
+    {"unlock", zklua_locks_unlock},
+    {"held", zklua_locks_held},
+    {"count", zklua_locks_count},
+    {"close", zklua_locks_close},
+    {"__gc", zklua_locks_close},
+    {NULL, NULL}
+};
+
+static void _zklua_election_release(zklua_sub_t *sub)
+{
+    zklua_election_t *e = (zklua_election_t *)sub;
+    pthread_mutex_destroy(&e->lock);
+    free(e->path);
+    free(e->prefix);
+    free(e->data);
+    free(e->node);
+    free(e->watched);
+    free(e);
+}
+
+static int _zklua_election_closed(zklua_election_t *e)
+{
+    return __atomic_load_n(&e->closed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * record the leadership state and call on_gain or on_loss when it changes.
+ **/
+static void _zklua_election_set_leader(zklua_election_t *e, int leader)
+{
+    int changed = 0;
+    int ref = LUA_NOREF;
+
+    pthread_mutex_lock(&e->lock);
+    changed = (e->leader != leader);
+    __atomic_store_n(&e->leader, leader, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&e->lock);
+    if (!changed || _zklua_election_closed(e)) return;
+    ref = leader ? e->gainref : e->lossref;
+    if (ref == LUA_NOREF) return;
+    lua_rawgeti(e->L, LUA_REGISTRYINDEX, ref);
+    lua_pushstring(e->L, e->path);
+    lua_call(e->L, 1, 0);
+}
+
+static void _zklua_election_check(zklua_election_t *e);
+
+static void _zklua_election_ignore_completion(int rc, const void *data)
+{
+}
+
+static void _zklua_election_create_completion(int rc, const char *value,
+        const void *data)
+{
+    zklua_election_t *e = (zklua_election_t *)data;
+    int entering = 0;
+
+    if (!_zklua_election_closed(e)) {
+        pthread_mutex_lock(&e->lock);
+        entering = (e->state == ZKLUA_ELECTION_ENTERING);
+        if (rc == ZOK && entering) {
+            free(e->node);
+            e->node = strdup(value);
+        } else if (rc != ZOK && rc != ZCONNECTIONLOSS
+                && rc != ZOPERATIONTIMEOUT) {
+            e->state = (rc == ZSESSIONEXPIRED) ? ZKLUA_ELECTION_EXPIRED
+                : ZKLUA_ELECTION_IDLE;
+            entering = 0;
+        }
+        pthread_mutex_unlock(&e->lock);
+        if (entering) {
+            /* after a lost create, the check looks for our node by name. */
+            _zklua_election_check(e);
+        } else if (rc == ZOK) {
+            /* left while the create was in flight. */
+            zoo_adelete(e->zh, value, -1,
+                    _zklua_election_ignore_completion, NULL);
+        }
+    }
+    _zklua_sub_release(&e->sub);
+}
+
+/**
+ * create our candidate node under the election path.
+ **/
+static int _zklua_election_create(zklua_election_t *e)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    int ret = -1;
+
+    if (!_zklua_join_path(path, sizeof(path), e->path, e->prefix)) {
+        return ZBADARGUMENTS;
+    }
+    pthread_mutex_lock(&e->lock);
+    e->state = ZKLUA_ELECTION_ENTERING;
+    free(e->node);
+    e->node = NULL;
+    free(e->watched);
+    e->watched = NULL;
+    pthread_mutex_unlock(&e->lock);
+    _zklua_sub_retain(&e->sub);
+    ret = zoo_acreate(e->zh, path, e->data, e->data_len, &ZOO_OPEN_ACL_UNSAFE,
+            ZOO_EPHEMERAL | ZOO_SEQUENCE, _zklua_election_create_completion, e);
+    if (ret != ZOK) {
+        pthread_mutex_lock(&e->lock);
+        e->state = ZKLUA_ELECTION_IDLE;
+        pthread_mutex_unlock(&e->lock);
+        _zklua_sub_release(&e->sub);
+    }
+    return ret;
+}
+
+static void _zklua_election_exists_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_election_t *e = (zklua_election_t *)data;
+    /* the watched node is already gone: look again. */
+    if (!_zklua_election_closed(e) && rc != ZOK) _zklua_election_check(e);
+    _zklua_sub_release(&e->sub);
+}
+
+static void _zklua_election_children_completion(int rc,
+        const struct String_vector *strings, const void *data)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_election_t *e = (zklua_election_t *)data;
+    struct String_vector children;
+    const char *own = NULL;
+    char *watched = NULL;
+    int self = -1, i, n = 0;
+    int active = 0;
+    size_t prefix_len = strlen(e->prefix);
+
+    children.count = 0;
+    children.data = NULL;
+    if (_zklua_election_closed(e)) goto out;
+    if (rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT) {
+        _zklua_election_check(e);
+        goto out;
+    }
+    if (rc != ZOK) {
+        pthread_mutex_lock(&e->lock);
+        e->state = (rc == ZSESSIONEXPIRED) ? ZKLUA_ELECTION_EXPIRED
+            : ZKLUA_ELECTION_IDLE;
+        pthread_mutex_unlock(&e->lock);
+        _zklua_election_set_leader(e, 0);
+        goto out;
+    }
+    if (!_zklua_copy_string_vector(&children, strings)) {
+        _zklua_election_check(e);
+        goto out;
+    }
+    /* only the candidates take part, in sequence order. */
+    for (i = 0; i < children.count; ++i) {
+        if (strncmp(children.data[i], ZKLUA_ELECTION_PREFIX,
+                    strlen(ZKLUA_ELECTION_PREFIX)) == 0) {
+            children.data[n++] = children.data[i];
+        } else {
+            free(children.data[i]);
+        }
+    }
+    children.count = n;
+    qsort(children.data, children.count, sizeof(char *), _zklua_sequence_cmp);
+
+    pthread_mutex_lock(&e->lock);
+    active = (e->state == ZKLUA_ELECTION_ENTERING
+            || e->state == ZKLUA_ELECTION_FOLLOWER
+            || e->state == ZKLUA_ELECTION_LEADER);
+    own = (e->node != NULL) ? strrchr(e->node, '/') + 1 : NULL;
+    for (i = 0; active && i < children.count && self < 0; ++i) {
+        if ((own != NULL && strcmp(children.data[i], own) == 0)
+                || (own == NULL && strncmp(children.data[i], e->prefix,
+                        prefix_len) == 0)) {
+            self = i;
+        }
+    }
+    if (active && self >= 0) {
+        if (own == NULL && _zklua_join_path(path, sizeof(path), e->path,
+                    children.data[self])) {
+            e->node = strdup(path);
+        }
+        /* the leader watches its own node, the others their predecessor. */
+        if (_zklua_join_path(path, sizeof(path), e->path,
+                    children.data[self > 0 ? self - 1 : 0])) {
+            free(e->watched);
+            e->watched = strdup(path);
+            watched = (e->watched != NULL) ? strdup(e->watched) : NULL;
+        }
+        e->state = (self == 0) ? ZKLUA_ELECTION_LEADER : ZKLUA_ELECTION_FOLLOWER;
+    }
+    pthread_mutex_unlock(&e->lock);
+    if (!active) goto out;
+    if (self < 0) {
+        /* our node is gone, enter again. */
+        _zklua_election_set_leader(e, 0);
+        _zklua_election_create(e);
+        goto out;
+    }
+    _zklua_election_set_leader(e, self == 0);
+    if (watched != NULL) {
+        _zklua_sub_retain(&e->sub);
+        if (zoo_awexists(e->zh, watched, _zklua_waits_watcher, e->waits,
+                    _zklua_election_exists_completion, e) != ZOK) {
+            _zklua_sub_release(&e->sub);
+        }
+    }
+out:
+    free(watched);
+    deallocate_String_vector(&children);
+    _zklua_sub_release(&e->sub);
+}
+
+static void _zklua_election_check(zklua_election_t *e)
+{
+    _zklua_sub_retain(&e->sub);
+    if (zoo_aget_children(e->zh, e->path, 0,
+                _zklua_election_children_completion, e) != ZOK) {
+        _zklua_sub_release(&e->sub);
+    }
+}
+
+static void _zklua_election_notify(zklua_sub_t *sub, int type, int state,
+        const char *path)
+{
+    zklua_election_t *e = (zklua_election_t *)sub;
+    int match = 0;
+
+    if (_zklua_election_closed(e)) return;
+    if (type == ZOO_SESSION_EVENT) {
+        if (state != ZOO_EXPIRED_SESSION_STATE) return;
+        pthread_mutex_lock(&e->lock);
+        e->state = ZKLUA_ELECTION_EXPIRED;
+        free(e->node);
+        e->node = NULL;
+        free(e->watched);
+        e->watched = NULL;
+        pthread_mutex_unlock(&e->lock);
+        _zklua_election_set_leader(e, 0);
+        return;
+    }
+    pthread_mutex_lock(&e->lock);
+    match = (e->watched != NULL && path != NULL
+            && strcmp(e->watched, path) == 0
+            && (e->state == ZKLUA_ELECTION_FOLLOWER
+                || e->state == ZKLUA_ELECTION_LEADER));
+    pthread_mutex_unlock(&e->lock);
+    if (match) _zklua_election_check(e);
+}
+
+/**
+ * attach @e@ to the session of @handle@, the handle userdata is at @index@.
+ **/
+static int _zklua_election_attach(lua_State *L, zklua_election_t *e,
+        zklua_handle_t *handle, int index)
+{
+    char prefix[ZKLUA_LOCK_TAG_SIZE];
+
+    if (handle->waits == NULL && (handle->waits = _zklua_waits_new()) == NULL) {
+        return ZSYSTEMERROR;
+    }
+    /* the serial keeps two elections of one session under a path apart. */
+    if (!_zklua_node_tag(handle->zh, ZKLUA_ELECTION_PREFIX, prefix,
+                sizeof(prefix))) {
+        return ZSYSTEMERROR;
+    }
+    free(e->prefix);
+    if ((e->prefix = strdup(prefix)) == NULL) return ZSYSTEMERROR;
+    if (e->handle != NULL && e->handle->waits == e->waits) {
+        _zklua_waits_unsubscribe(e->waits, &e->sub);
+    }
+    if (e->handleref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, e->handleref);
+    lua_pushvalue(L, index);
+    e->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+    e->handle = handle;
+    e->zh = handle->zh;
+    e->waits = handle->waits;
+    _zklua_waits_subscribe(e->waits, &e->sub);
+    return ZOK;
+}
+
+static zklua_election_t *_zklua_check_election(lua_State *L, int index)
+{
+    zklua_election_handle_t *eh = (zklua_election_handle_t *)luaL_checkudata(L,
+            index, ZKLUA_ELECTION_METATABLE_NAME);
+    if (eh->election == NULL) luaL_error(L, "invalid election.");
+    return eh->election;
+}
+
+static int _zklua_opt_function_ref(lua_State *L, int index, const char *name)
+{
+    int ref = LUA_NOREF;
+    if (!lua_istable(L, index)) return ref;
+    lua_getfield(L, index, name);
+    if (lua_isfunction(L, -1)) {
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        if (!lua_isnil(L, -1)) {
+            luaL_error(L, "invalid arguments: %s must be a function.", name);
+        }
+        lua_pop(L, 1);
+    }
+    return ref;
+}
+
+static int zklua_election(lua_State *L)
+{
+    size_t path_len = 0, data_len = 0;
+    const char *path = NULL;
+    const char *data = NULL;
+    int ret = -1;
+    zklua_election_t *e = NULL;
+    zklua_election_handle_t *eh = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    path = luaL_checklstring(L, 2, &path_len);
+    if (path_len == 0 || path[0] != '/'
+            || path_len >= ZKLUA_MAX_PATH_BUFFER_SIZE / 2) {
+        return luaL_error(L, "invalid arguments: path must be an "
+                "absolute path.");
+    }
+    if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+    data = _zklua_opt_string_field(L, 3, "data", "");
+    data_len = strlen(data);
+    if ((ret = _zklua_ensure_path(handle->zh, path)) != ZOK) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ret);
+        return 2;
+    }
+    eh = (zklua_election_handle_t *)lua_newuserdata(L,
+            sizeof(zklua_election_handle_t));
+    eh->election = NULL;
+    luaL_getmetatable(L, ZKLUA_ELECTION_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    e = (zklua_election_t *)calloc(1, sizeof(zklua_election_t));
+    if (e == NULL || (e->path = strdup(path)) == NULL
+            || (e->data = (char *)malloc(data_len + 1)) == NULL) {
+        if (e != NULL) free(e->path);
+        free(e);
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    memcpy(e->data, data, data_len + 1);
+    e->data_len = (int)data_len;
+    e->sub.refs = 1;
+    e->sub.notify = _zklua_election_notify;
+    e->sub.release = _zklua_election_release;
+    pthread_mutex_init(&e->lock, NULL);
+    e->handleref = LUA_NOREF;
+    e->gainref = _zklua_opt_function_ref(L, 3, "on_gain");
+    e->lossref = _zklua_opt_function_ref(L, 3, "on_loss");
+    e->L = lua_newthread(L);
+    e->threadref = luaL_ref(L, LUA_REGISTRYINDEX);
+    eh->election = e;
+    if ((ret = _zklua_election_attach(L, e, handle, 1)) != ZOK) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    return 1;
+}
+
+static int zklua_election_enter(lua_State *L)
+{
+    int ret = -1;
+    int state = ZKLUA_ELECTION_IDLE;
+    zklua_handle_t *handle = NULL;
+    zklua_election_t *e = _zklua_check_election(L, 1);
+
+    pthread_mutex_lock(&e->lock);
+    state = e->state;
+    pthread_mutex_unlock(&e->lock);
+    if (state != ZKLUA_ELECTION_IDLE && state != ZKLUA_ELECTION_EXPIRED) {
+        lua_pushinteger(L, ZOK);
+        return 1;
+    }
+    if (!lua_isnoneornil(L, 2)) {
+        handle = luaL_checkudata(L, 2, ZKLUA_METATABLE_NAME);
+        if (!_zklua_check_handle(L, handle)) {
+            return luaL_error(L, "invalid zookeeper handle.");
+        }
+        ret = _zklua_election_attach(L, e, handle, 2);
+    } else if (!_zklua_check_handle(L, e->handle) || e->handle->zh != e->zh) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    } else {
+        /* the session id is only known once connected. */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, e->handleref);
+        ret = _zklua_election_attach(L, e, e->handle, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    if (ret == ZOK) ret = _zklua_election_create(e);
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_election_is_leader(lua_State *L)
+{
+    zklua_election_t *e = _zklua_check_election(L, 1);
+    lua_pushboolean(L, __atomic_load_n(&e->leader, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+static int zklua_election_node(lua_State *L)
+{
+    zklua_election_t *e = _zklua_check_election(L, 1);
+    pthread_mutex_lock(&e->lock);
+    if (e->node != NULL) {
+        lua_pushstring(L, e->node);
+    } else {
+        lua_pushnil(L);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return 1;
+}
+
+/**
+ * withdraw @e@: delete its node if the session still has one.
+ **/
+static int _zklua_election_leave(zklua_election_t *e)
+{
+    char *node = NULL;
+    int ret = ZOK;
+
+    pthread_mutex_lock(&e->lock);
+    if (e->state != ZKLUA_ELECTION_EXPIRED) e->state = ZKLUA_ELECTION_IDLE;
+    node = e->node;
+    e->node = NULL;
+    free(e->watched);
+    e->watched = NULL;
+    pthread_mutex_unlock(&e->lock);
+    if (node != NULL && e->handle->zh == e->zh) {
+        ret = _zklua_call_delete(e->handle, node, -1);
+        if (ret == ZNONODE) ret = ZOK;
+    }
+    free(node);
+    return ret;
+}
+
+static int zklua_election_leave(lua_State *L)
+{
+    int ret = -1;
+    zklua_election_t *e = _zklua_check_election(L, 1);
+    ret = _zklua_election_leave(e);
+    _zklua_election_set_leader(e, 0);
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_election_gc(lua_State *L)
+{
+    zklua_election_handle_t *eh = (zklua_election_handle_t *)luaL_checkudata(L,
+            1, ZKLUA_ELECTION_METATABLE_NAME);
+    zklua_election_t *e = eh->election;
+
+    if (e == NULL) return 0;
+    eh->election = NULL;
+    __atomic_store_n(&e->closed, 1, __ATOMIC_RELEASE);
+    _zklua_election_leave(e);
+    /* a closed handle has dropped the subscription already. */
+    if (e->handle->waits == e->waits) {
+        _zklua_waits_unsubscribe(e->waits, &e->sub);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, e->gainref);
+    luaL_unref(L, LUA_REGISTRYINDEX, e->lossref);
+    luaL_unref(L, LUA_REGISTRYINDEX, e->threadref);
+    luaL_unref(L, LUA_REGISTRYINDEX, e->handleref);
+    _zklua_sub_release(&e->sub);
+    return 0;
+}
+
+static const luaL_Reg zklua_election_methods[] =
+{
+    {"enter", zklua_election_enter},
+    {"leave", zklua_election_leave},
+    {"is_leader", zklua_election_is_leader},
+    {"node", zklua_election_node},
+    {"__gc", zklua_election_gc},
+    {NULL, NULL}
+};
+
+static void _zklua_queue_release(zklua_sub_t *sub)
+{
+    zklua_queue_t *q = (zklua_queue_t *)sub;
+    deallocate_String_vector(&q->items);
+    free(q->path);
+    free(q);
+}
+
+static void _zklua_queue_notify(zklua_sub_t *sub, int type, int state,
+        const char *path)
+{
+    zklua_queue_t *q = (zklua_queue_t *)sub;
+    if (type == ZOO_SESSION_EVENT || (path != NULL && strcmp(path, q->path) == 0)) {
+        __atomic_store_n(&q->dirty, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static zklua_queue_t *_zklua_check_queue(lua_State *L, int index)
+{
+    zklua_queue_handle_t *qh = (zklua_queue_handle_t *)luaL_checkudata(L,
+            index, ZKLUA_QUEUE_METATABLE_NAME);
+    if (qh->queue == NULL) luaL_error(L, "invalid queue.");
+    if (!_zklua_check_handle(L, qh->queue->handle)
+            || qh->queue->handle->waits != qh->queue->waits) {
+        luaL_error(L, "invalid zookeeper handle.");
+    }
+    return qh->queue;
+}
+
+/**
+ * list the items again and watch the list, the cache stays valid
+ * until the watch fires.
+ **/
+static int _zklua_queue_refresh(zklua_queue_t *q)
+{
+    struct String_vector children;
+    int ret = -1;
+
+    __atomic_store_n(&q->dirty, 0, __ATOMIC_RELEASE);
+    ret = zoo_wget_children(q->handle->zh, q->path, _zklua_waits_watcher,
+            q->waits, &children);
+    if (ret != ZOK) {
+        __atomic_store_n(&q->dirty, 1, __ATOMIC_RELEASE);
+        return ret;
+    }
+    deallocate_String_vector(&q->items);
+    qsort(children.data, children.count, sizeof(char *), _zklua_sequence_cmp);
+    q->items = children;
+    q->next = 0;
+    return ZOK;
+}
+
+static void _zklua_queue_create_completion(int rc, const char *value,
+        const void *data)
+{
+    zklua_queue_item_t *item = (zklua_queue_item_t *)data;
+    item->rc = rc;
+    if (rc == ZOK) item->value = strdup(value);
+    _zklua_batch_done(item->batch);
+}
+
+static void _zklua_queue_get_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_queue_item_t *item = (zklua_queue_item_t *)data;
+    item->rc = rc;
+    if (rc == ZOK && value != NULL && value_len > 0) {
+        item->value = (char *)malloc(value_len);
+        if (item->value != NULL) {
+            memcpy(item->value, value, value_len);
+            item->value_len = value_len;
+        } else {
+            item->rc = ZSYSTEMERROR;
+        }
+    }
+    _zklua_batch_done(item->batch);
+}
+
+static void _zklua_queue_delete_completion(int rc, const void *data)
+{
+    zklua_queue_item_t *item = (zklua_queue_item_t *)data;
+    item->delete_rc = rc;
+    _zklua_batch_done(item->batch);
+}
+
+static int zklua_queue(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    int ret = -1;
+    zklua_queue_t *q = NULL;
+    zklua_queue_handle_t *qh = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    path = luaL_checklstring(L, 2, &path_len);
+    if (path_len == 0 || path[0] != '/'
+            || path_len >= ZKLUA_MAX_PATH_BUFFER_SIZE / 2) {
+        return luaL_error(L, "invalid arguments: path must be an "
+                "absolute path.");
+    }
+    if ((ret = _zklua_ensure_path(handle->zh, path)) != ZOK) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ret);
+        return 2;
+    }
+    if (handle->waits == NULL && (handle->waits = _zklua_waits_new()) == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    qh = (zklua_queue_handle_t *)lua_newuserdata(L, sizeof(zklua_queue_handle_t));
+    qh->queue = NULL;
+    luaL_getmetatable(L, ZKLUA_QUEUE_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    q = (zklua_queue_t *)calloc(1, sizeof(zklua_queue_t));
+    if (q == NULL || (q->path = strdup(path)) == NULL) {
+        free(q);
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    q->sub.refs = 1;
+    q->sub.notify = _zklua_queue_notify;
+    q->sub.release = _zklua_queue_release;
+    q->dirty = 1;
+    q->handle = handle;
+    q->waits = handle->waits;
+    lua_pushvalue(L, 1);
+    q->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+    _zklua_waits_subscribe(q->waits, &q->sub);
+    qh->queue = q;
+    return 1;
+}
+
+static int zklua_queue_offer_many(lua_State *L)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    size_t value_len = 0;
+    const char *value = NULL;
+    zklua_batch_t batch;
+    zklua_queue_item_t *items = NULL;
+    int i, n, ret = ZOK;
+    zklua_queue_t *q = _zklua_check_queue(L, 1);
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = (int)lua_objlen(L, 2);
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 2, i);
+        if (!lua_isstring(L, -1)) {
+            return luaL_error(L, "invalid arguments: items must be strings.");
+        }
+        lua_pop(L, 1);
+    }
+    _zklua_join_path(path, sizeof(path), q->path, ZKLUA_QUEUE_PREFIX);
+    items = (zklua_queue_item_t *)lua_newuserdata(L,
+            (n > 0 ? n : 1) * sizeof(zklua_queue_item_t));
+    memset(items, 0, (n > 0 ? n : 1) * sizeof(zklua_queue_item_t));
+    _zklua_batch_init(&batch);
+    for (i = 0; i < n; ++i) {
+        lua_rawgeti(L, 2, i + 1);
+        value = lua_tolstring(L, -1, &value_len);
+        items[i].batch = &batch;
+        _zklua_batch_add(&batch, 1);
+        items[i].rc = zoo_acreate(q->handle->zh, path, value, (int)value_len,
+                &ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE,
+                _zklua_queue_create_completion, &items[i]);
+        if (items[i].rc != ZOK) _zklua_batch_done(&batch);
+        lua_pop(L, 1);
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; ++i) {
+        if (items[i].rc == ZOK && items[i].value != NULL) {
+            lua_pushstring(L, items[i].value);
+        } else {
+            if (ret == ZOK) ret = (items[i].rc != ZOK) ? items[i].rc : ZSYSTEMERROR;
+            lua_pushboolean(L, 0);
+        }
+        free(items[i].value);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, ret);
+    lua_insert(L, -2);
+    return 2;
+}
+
+static int zklua_queue_offer(lua_State *L)
+{
+    luaL_checkstring(L, 2);
+    lua_settop(L, 2);
+    lua_createtable(L, 1, 0);
+    lua_insert(L, 2);
+    lua_rawseti(L, 2, 1);
+    zklua_queue_offer_many(L);
+    lua_rawgeti(L, -1, 1);
+    lua_remove(L, -2);
+    return 2;
+}
+
+/**
+ * claim up to @n@ cached items: each one is read and deleted with two
+ * pipelined requests, it is ours if the delete succeeds. items taken by
+ * another consumer meanwhile are skipped. the payloads are pushed in a
+ * table, in queue order.
+ **/
+static int _zklua_queue_take(lua_State *L, zklua_queue_t *q, int n, int *taken)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_batch_t batch;
+    zklua_queue_item_t *items = NULL;
+    int i, count = 0, ret = ZOK;
+
+    count = q->items.count - q->next;
+    if (count > n - *taken) count = n - *taken;
+    if (count <= 0) return ZOK;
+    items = (zklua_queue_item_t *)calloc(count, sizeof(zklua_queue_item_t));
+    if (items == NULL) return ZSYSTEMERROR;
+    _zklua_batch_init(&batch);
+    for (i = 0; i < count; ++i) {
+        items[i].batch = &batch;
+        items[i].rc = ZSYSTEMERROR;
+        items[i].delete_rc = ZSYSTEMERROR;
+        if (!_zklua_join_path(path, sizeof(path), q->path,
+                    q->items.data[q->next + i])) {
+            continue;
+        }
+        _zklua_batch_add(&batch, 2);
+        if ((items[i].rc = zoo_aget(q->handle->zh, path, 0,
+                        _zklua_queue_get_completion, &items[i])) != ZOK) {
+            _zklua_batch_done(&batch);
+        }
+        if ((items[i].delete_rc = zoo_adelete(q->handle->zh, path, -1,
+                        _zklua_queue_delete_completion, &items[i])) != ZOK) {
+            _zklua_batch_done(&batch);
+        }
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+    for (i = 0; i < count; ++i) {
+        if (items[i].delete_rc == ZOK && items[i].rc == ZOK) {
+            lua_pushlstring(L, items[i].value != NULL ? items[i].value : "",
+                    items[i].value_len);
+            lua_rawseti(L, -2, ++(*taken));
+        } else if (items[i].delete_rc != ZNONODE && ret == ZOK) {
+            /* ZNONODE: another consumer got it first. */
+            ret = (items[i].delete_rc != ZOK) ? items[i].delete_rc : items[i].rc;
+        }
+        free(items[i].value);
+    }
+    q->next += count;
+    free(items);
+    return ret;
+}
+
+static int zklua_queue_take_batch(lua_State *L)
+{
+    int n = 0, timeout = 0, taken = 0;
+    int ret = ZOK;
+    uint64_t deadline = 0;
+    zklua_lock_wait_t wait;
+    zklua_queue_t *q = _zklua_check_queue(L, 1);
+
+    n = luaL_optint(L, 2, 1);
+    timeout = luaL_optint(L, 3, 0);
+    deadline = _zklua_now_us() + (uint64_t)(timeout > 0 ? timeout : 0) * 1000;
+    lua_newtable(L);
+    for (;;) {
+        if (q->items.count - q->next <= 0) {
+            if (__atomic_load_n(&q->dirty, __ATOMIC_ACQUIRE)) {
+                if ((ret = _zklua_queue_refresh(q)) != ZOK) break;
+            }
+        }
+        if (q->items.count - q->next > 0) {
+            if ((ret = _zklua_queue_take(L, q, n, &taken)) != ZOK) break;
+            if (taken >= n) break;
+            continue;
+        }
+        /* empty and watched: nothing to ask the server until the watch fires. */
+        if (taken > 0 || timeout == 0) break;
+        _zklua_waits_add(q->waits, &wait, q->path);
+        if (!__atomic_load_n(&q->dirty, __ATOMIC_ACQUIRE)) {
+            ret = _zklua_lock_block(q->handle->zh, q->waits, &wait,
+                    timeout, deadline);
+        }
+        _zklua_waits_remove(q->waits, &wait);
+        if (ret == ZKLUA_TIMEDOUT) {
+            ret = ZOK;
+            break;
+        }
+        if (ret != ZOK) break;
+    }
+    lua_pushinteger(L, ret);
+    lua_insert(L, -2);
+    return 2;
+}
+
+static int zklua_queue_size(lua_State *L)
+{
+    zklua_queue_t *q = _zklua_check_queue(L, 1);
+    if (__atomic_load_n(&q->dirty, __ATOMIC_ACQUIRE)) _zklua_queue_refresh(q);
+    lua_pushinteger(L, q->items.count - q->next);
+    return 1;
+}
+
+static int zklua_queue_gc(lua_State *L)
+{
+    zklua_queue_handle_t *qh = (zklua_queue_handle_t *)luaL_checkudata(L,
+            1, ZKLUA_QUEUE_METATABLE_NAME);
+    zklua_queue_t *q = qh->queue;
+
+    if (q == NULL) return 0;
+    qh->queue = NULL;
+    /* a closed handle has dropped the subscription already. */
+    if (q->handle->waits == q->waits) {
+        _zklua_waits_unsubscribe(q->waits, &q->sub);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, q->handleref);
+    _zklua_sub_release(&q->sub);
+    return 0;
+}
+
+static const luaL_Reg zklua_queue_methods[] =
+{
+    {"offer", zklua_queue_offer},
+    {"offer_many", zklua_queue_offer_many},
+    {"take_batch", zklua_queue_take_batch},
+    {"size", zklua_queue_size},
+    {"__gc", zklua_queue_gc},
+    {NULL, NULL}
+};
+
+/**
+ * make sure @handle@ has the shared waits table, raise a lua error if
+ * it can not be allocated.
+ **/
+static zklua_waits_t *_zklua_check_waits(lua_State *L, zklua_handle_t *handle)
+{
+    if (handle->waits == NULL && (handle->waits = _zklua_waits_new()) == NULL) {
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    return handle->waits;
+}
+
+static zklua_barrier_t *_zklua_check_barrier(lua_State *L, int index)
+{
+    zklua_barrier_t *b = (zklua_barrier_t *)luaL_checkudata(L, index,
+            ZKLUA_BARRIER_METATABLE_NAME);
+    if (b->path == NULL) luaL_error(L, "invalid barrier.");
+    if (!_zklua_check_handle(L, b->handle)) {
+        luaL_error(L, "invalid zookeeper handle.");
+    }
+    return b;
+}
+
+static int zklua_barrier(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    zklua_barrier_t *b = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
+        path = luaL_checklstring(L, 2, &path_len);
+        if (path_len == 0 || path[0] != '/') {
+            return luaL_error(L, "invalid arguments: path must be an "
+                    "absolute path.");
+        }
+        b = (zklua_barrier_t *)lua_newuserdata(L, sizeof(zklua_barrier_t));
+        memset(b, 0, sizeof(zklua_barrier_t));
+        luaL_getmetatable(L, ZKLUA_BARRIER_METATABLE_NAME);
+        lua_setmetatable(L, -2);
+        if ((b->path = strdup(path)) == NULL) {
+            return luaL_error(L, "out of memory when zklua trys to "
+                    "alloc an internal object.");
+        }
+        b->handle = handle;
+        lua_pushvalue(L, 1);
+        b->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+static int zklua_barrier_hold(lua_State *L)
+{
+    int ret = -1;
+    zklua_barrier_t *b = _zklua_check_barrier(L, 1);
+    ret = _zklua_call_create(b->handle, b->path, NULL, -1,
+            &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+    if (ret == ZNONODE) {
+        ret = _zklua_ensure_path(b->handle->zh, b->path);
+    } else if (ret == ZNODEEXISTS) {
+        ret = ZOK;
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_barrier_release(lua_State *L)
+{
+    int ret = -1;
+    zklua_barrier_t *b = _zklua_check_barrier(L, 1);
+    ret = _zklua_call_delete(b->handle, b->path, -1);
+    lua_pushinteger(L, (ret == ZNONODE) ? ZOK : ret);
+    return 1;
+}
+
+/**
+ * wait until the barrier node is gone: one exists request with a
+ * watch, then the deletion event.
+ **/
+static int zklua_barrier_wait(lua_State *L)
+{
+    int timeout = -1;
+    int ret = -1;
+    uint64_t deadline = 0;
+    struct Stat stat;
+    zklua_lock_wait_t wait;
+    zklua_waits_t *waits = NULL;
+    zklua_barrier_t *b = _zklua_check_barrier(L, 1);
+
+    timeout = luaL_optint(L, 2, -1);
+    deadline = _zklua_now_us() + (uint64_t)(timeout > 0 ? timeout : 0) * 1000;
+    waits = _zklua_check_waits(L, b->handle);
+    for (;;) {
+        _zklua_waits_add(waits, &wait, b->path);
+        ret = zoo_wexists(b->handle->zh, b->path, _zklua_waits_watcher,
+                waits, &stat);
+        if (ret == ZOK) {
+            ret = (timeout == 0) ? ZKLUA_TIMEDOUT : _zklua_lock_block(
+                    b->handle->zh, waits, &wait, timeout, deadline);
+            /* woken up: deleted, or another event on the node. */
+            if (ret == ZOK) ret = ZNODEEXISTS;
+        }
+        _zklua_waits_remove(waits, &wait);
+        if (ret == ZNONODE) {
+            ret = ZOK;
+            break;
+        }
+        if (ret != ZNODEEXISTS) break;
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_barrier_gc(lua_State *L)
+{
+    zklua_barrier_t *b = (zklua_barrier_t *)luaL_checkudata(L, 1,
+            ZKLUA_BARRIER_METATABLE_NAME);
+    if (b->path != NULL) {
+        luaL_unref(L, LUA_REGISTRYINDEX, b->handleref);
+        free(b->path);
+        b->path = NULL;
+    }
+    return 0;
+}
+
+static const luaL_Reg zklua_barrier_methods[] =
+{
+    {"hold", zklua_barrier_hold},
+    {"release", zklua_barrier_release},
+    {"wait", zklua_barrier_wait},
+    {"__gc", zklua_barrier_gc},
+    {NULL, NULL}
+};
+
+static void _zklua_dbarrier_node_completion(int rc, const char *value,
+        const void *data)
+{
+    zklua_dbarrier_step_t *step = (zklua_dbarrier_step_t *)data;
+    step->node_rc = rc;
+    if (rc == ZOK && (step->node = strdup(value)) == NULL) {
+        step->node_rc = ZSYSTEMERROR;
+    }
+    _zklua_batch_done(step->batch);
+}
+
+static void _zklua_dbarrier_delete_completion(int rc, const void *data)
+{
+    zklua_dbarrier_step_t *step = (zklua_dbarrier_step_t *)data;
+    step->node_rc = rc;
+    _zklua_batch_done(step->batch);
+}
+
+static void _zklua_dbarrier_stat_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_dbarrier_step_t *step = (zklua_dbarrier_step_t *)data;
+    step->stat_rc = rc;
+    if (stat != NULL) step->stat = *stat;
+    _zklua_batch_done(step->batch);
+}
+
+static void _zklua_dbarrier_ready_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+    zklua_dbarrier_step_t *step = (zklua_dbarrier_step_t *)data;
+    step->ready_rc = rc;
+    _zklua_batch_done(step->batch);
+}
+
+/**
+ * create our participant node @tag@ (@enter@ 1), delete it (0) or leave
+ * it alone (-1), then read the number of children of the barrier and
+ * watch the ready node. the requests are pipelined: one round trip
+ * whatever the number of participants.
+ **/
+static int _zklua_dbarrier_step(zklua_dbarrier_t *db, zklua_waits_t *waits,
+        int enter, const char *tag, zklua_dbarrier_step_t *step)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    zklua_batch_t batch;
+    zhandle_t *zh = db->handle->zh;
+
+    memset(step, 0, sizeof(zklua_dbarrier_step_t));
+    step->batch = &batch;
+    if (enter == 1 && !_zklua_join_path(path, sizeof(path), db->path, tag)) {
+        return ZBADARGUMENTS;
+    }
+    _zklua_batch_init(&batch);
+    _zklua_batch_add(&batch, 3);
+    if (enter == 1) {
+        step->node_rc = zoo_acreate(zh, path, NULL, -1, &ZOO_OPEN_ACL_UNSAFE,
+                ZOO_EPHEMERAL | ZOO_SEQUENCE, _zklua_dbarrier_node_completion,
+                step);
+    } else if (enter == 0) {
+        step->node_rc = zoo_adelete(zh, db->node, -1,
+                _zklua_dbarrier_delete_completion, step);
+    } else {
+        step->node_rc = ZOK;
+    }
+    if (enter < 0 || step->node_rc != ZOK) _zklua_batch_done(&batch);
+    if ((step->stat_rc = zoo_aexists(zh, db->path, 0,
+                    _zklua_dbarrier_stat_completion, step)) != ZOK) {
+        _zklua_batch_done(&batch);
+    }
+    if ((step->ready_rc = zoo_awexists(zh, db->ready, _zklua_waits_watcher,
+                    waits, _zklua_dbarrier_ready_completion, step)) != ZOK) {
+        _zklua_batch_done(&batch);
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+    if (step->node_rc != ZOK) return step->node_rc;
+    if (step->stat_rc != ZOK) return step->stat_rc;
+    if (step->ready_rc != ZOK && step->ready_rc != ZNONODE) return step->ready_rc;
+    return ZOK;
+}
+
+static zklua_dbarrier_t *_zklua_check_dbarrier(lua_State *L, int index)
+{
+    zklua_dbarrier_t *db = (zklua_dbarrier_t *)luaL_checkudata(L, index,
+            ZKLUA_DBARRIER_METATABLE_NAME);
+    if (db->path == NULL) luaL_error(L, "invalid double barrier.");
+    if (!_zklua_check_handle(L, db->handle)) {
+        luaL_error(L, "invalid zookeeper handle.");
+    }
+    return db;
+}
+
+static int zklua_double_barrier(lua_State *L)
+{
+    char ready[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    size_t path_len = 0;
+    const char *path = NULL;
+    int size = 0;
+    int ret = -1;
+    zklua_dbarrier_t *db = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    path = luaL_checklstring(L, 2, &path_len);
+    size = luaL_checkint(L, 3);
+    if (path_len == 0 || path[0] != '/' || size < 1
+            || !_zklua_join_path(ready, sizeof(ready), path, ZKLUA_BARRIER_READY)) {
+        return luaL_error(L, "invalid arguments: path must be an absolute "
+                "path and size a positive number.");
+    }
+    if ((ret = _zklua_ensure_path(handle->zh, path)) != ZOK) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ret);
+        return 2;
+    }
+    _zklua_check_waits(L, handle);
+    db = (zklua_dbarrier_t *)lua_newuserdata(L, sizeof(zklua_dbarrier_t));
+    memset(db, 0, sizeof(zklua_dbarrier_t));
+    luaL_getmetatable(L, ZKLUA_DBARRIER_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    if ((db->path = strdup(path)) == NULL || (db->ready = strdup(ready)) == NULL) {
+        free(db->path);
+        db->path = NULL;
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    db->size = size;
+    db->handle = handle;
+    lua_pushvalue(L, 1);
+    db->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+/**
+ * enter the double barrier and wait until size participants are in.
+ * the last one in creates the ready node, the others wait for it.
+ **/
+static int zklua_dbarrier_enter(lua_State *L)
+{
+    char tag[ZKLUA_LOCK_TAG_SIZE];
+    char *node = NULL;
+    int timeout = -1;
+    int ret = -1;
+    uint64_t deadline = 0;
+    zklua_lock_wait_t wait;
+    zklua_dbarrier_step_t step;
+    zklua_waits_t *waits = NULL;
+    zklua_dbarrier_t *db = _zklua_check_dbarrier(L, 1);
+
+    if (db->node != NULL) {
+        lua_pushinteger(L, ZNODEEXISTS);
+        return 1;
+    }
+    timeout = luaL_optint(L, 2, -1);
+    deadline = _zklua_now_us() + (uint64_t)(timeout > 0 ? timeout : 0) * 1000;
+    waits = _zklua_check_waits(L, db->handle);
+    _zklua_waits_add(waits, &wait, db->ready);
+    if (!_zklua_node_tag(db->handle->zh, ZKLUA_BARRIER_PREFIX, tag, sizeof(tag))) {
+        memset(&step, 0, sizeof(step));
+        ret = ZBADARGUMENTS;
+    } else {
+        ret = _zklua_dbarrier_step(db, waits, 1, tag, &step);
+    }
+    if (_zklua_transient_error(db->handle->zh, step.node_rc)) {
+        /* the create may have gone through: find our node, then read
+         * the barrier again. */
+        ret = _zklua_node_recover(db->handle, db->path, tag, &node, NULL,
+                (timeout < 0) ? UINT64_MAX : deadline);
+        if (ret == ZOK) {
+            ret = _zklua_dbarrier_step(db, waits, -1, NULL, &step);
+            step.node = node;
+        } else if (ret == ZNONODE) {
+            ret = ZCONNECTIONLOSS;
+        }
+    }
+    db->node = step.node;
+    if (ret == ZOK && step.ready_rc == ZNONODE
+            && step.stat.numChildren >= db->size) {
+        ret = _zklua_call_create(db->handle, db->ready, NULL, -1,
+                &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+        if (ret == ZNODEEXISTS) ret = ZOK;
+    } else if (ret == ZOK && step.ready_rc == ZNONODE) {
+        ret = ZNONODE;
+        while (ret == ZNONODE) {
+            if (timeout == 0) {
+                ret = ZKLUA_TIMEDOUT;
+                break;
+            }
+            ret = _zklua_lock_block(db->handle->zh, waits, &wait, timeout,
+                    deadline);
+            if (ret != ZOK) break;
+            /* a session event wakes us up too: re-arm and look again. */
+            _zklua_waits_remove(waits, &wait);
+            _zklua_waits_add(waits, &wait, db->ready);
+            ret = zoo_wexists(db->handle->zh, db->ready, _zklua_waits_watcher,
+                    waits, NULL);
+            /* disconnected: the reconnection wakes us up again. */
+            if (_zklua_transient_error(db->handle->zh, ret)) ret = ZNONODE;
+        }
+    }
+    _zklua_waits_remove(waits, &wait);
+    if (ret != ZOK && db->node != NULL) {
+        _zklua_node_remove(db->handle, db->node,
+                _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT));
+        free(db->node);
+        db->node = NULL;
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+/**
+ * leave the double barrier and wait until every participant is out.
+ * the last one out deletes the ready node, the others wait for that. a
+ * participant that died without leaving is noticed by re-reading the
+ * barrier stat every ZKLUA_LOCK_POLL_INTERVAL.
+ **/
+static int zklua_dbarrier_leave(lua_State *L)
+{
+    int timeout = -1;
+    int ret = -1;
+    int left = 0;
+    uint64_t deadline = 0, until = 0;
+    struct Stat stat;
+    zklua_lock_wait_t wait;
+    zklua_dbarrier_step_t step;
+    zklua_waits_t *waits = NULL;
+    zklua_dbarrier_t *db = _zklua_check_dbarrier(L, 1);
+
+    if (db->node == NULL) {
+        lua_pushinteger(L, ZNONODE);
+        return 1;
+    }
+    timeout = luaL_optint(L, 2, -1);
+    deadline = _zklua_now_us() + (uint64_t)(timeout > 0 ? timeout : 0) * 1000;
+    waits = _zklua_check_waits(L, db->handle);
+    _zklua_waits_add(waits, &wait, db->ready);
+    ret = _zklua_dbarrier_step(db, waits, 0, NULL, &step);
+    if (ret == ZOK || step.node_rc == ZNONODE) {
+        free(db->node);
+        db->node = NULL;
+    }
+    if (ret == ZNONODE) ret = ZOK;
+    stat = step.stat;
+    while (ret == ZOK && step.ready_rc == ZOK && !left) {
+        /* the ready node is a child too. */
+        if (stat.numChildren <= 1) {
+            ret = _zklua_call_delete(db->handle, db->ready, -1);
+            if (ret == ZNONODE) ret = ZOK;
+            break;
+        }
+        if (timeout == 0) {
+            ret = ZKLUA_TIMEDOUT;
+            break;
+        }
+        until = _zklua_now_us() + ZKLUA_LOCK_POLL_INTERVAL * 1000;
+        if (timeout > 0 && until > deadline) until = deadline;
+        ret = _zklua_lock_block(db->handle->zh, waits, &wait, 1,
+                until);
+        if (ret == ZOK) {
+            /* a session event wakes us up too: re-arm and look again. */
+            _zklua_waits_remove(waits, &wait);
+            _zklua_waits_add(waits, &wait, db->ready);
+            ret = zoo_wexists(db->handle->zh, db->ready, _zklua_waits_watcher,
+                    waits, &stat);
+            if (ret == ZNONODE) {
+                ret = ZOK;
+                left = 1;
+            } else if (ret == ZOK) {
+                ret = _zklua_call_exists(db->handle, db->path, 0, &stat);
+            }
+        } else if (ret == ZKLUA_TIMEDOUT && (timeout < 0
+                    || _zklua_now_us() < deadline)) {
+            ret = _zklua_call_exists(db->handle, db->path, 0, &stat);
+        }
+    }
+    _zklua_waits_remove(waits, &wait);
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_dbarrier_gc(lua_State *L)
+{
+    zklua_dbarrier_t *db = (zklua_dbarrier_t *)luaL_checkudata(L, 1,
+            ZKLUA_DBARRIER_METATABLE_NAME);
+    if (db->path == NULL) return 0;
+    if (db->node != NULL && db->handle->zh != NULL) {
+        _zklua_node_remove(db->handle, db->node,
+                _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT));
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, db->handleref);
+    free(db->node);
+    free(db->ready);
+    free(db->path);
+    db->path = NULL;
+    return 0;
+}
+
+static const luaL_Reg zklua_dbarrier_methods[] =
+{
+    {"enter", zklua_dbarrier_enter},
+    {"leave", zklua_dbarrier_leave},
+    {"__gc", zklua_dbarrier_gc},
+    {NULL, NULL}
+};
+
+static void _zklua_semaphore_reap_completion(int rc, const void *data)
+{
+}
+
+/**
+ * expiry of the lease node @name@, 0 if it never expires.
+ **/
+static uint64_t _zklua_lease_expiry(const char *name)
+{
+    size_t len = sizeof(ZKLUA_SEMAPHORE_PREFIX) - 1;
+    char *end = NULL;
+    uint64_t expiry = 0;
+
+    if (strncmp(name, ZKLUA_SEMAPHORE_PREFIX, len) != 0) return 0;
+    expiry = strtoull(name + len, &end, 10);
+    return (end != NULL && *end == '-') ? expiry : 0;
+}
+
+static void _zklua_semaphore_mark_completion(int rc, const struct Stat *stat,
+        const void *data)
+{
+}
+
+/**
+ * rank the lease @own@ among the live leases of @children@, sorting them.
+ * returns the number of live leases before ours, or -1 if ours is gone;
+ * *@pred@ is the index of the live lease right before ours, -1 if none,
+ * and *@next_expiry@ the first expiry among the live leases before ours.
+ **/
+static int _zklua_semaphore_rank(struct String_vector *children,
+        const char *own, int *pred, uint64_t *next_expiry)
+{
+    uint64_t now = _zklua_wall_ms(), expiry = 0;
+    int rank = 0, i;
+
+    *pred = -1;
+    *next_expiry = 0;
+    qsort(children->data, children->count, sizeof(char *), _zklua_sequence_cmp);
+    for (i = 0; i < children->count; ++i) {
+        if (strcmp(children->data[i], own) == 0) return rank;
+        expiry = _zklua_lease_expiry(children->data[i]);
+        if (expiry != 0 && expiry <= now) continue;
+        if (expiry != 0 && (*next_expiry == 0 || expiry < *next_expiry)) {
+            *next_expiry = expiry;
+        }
+        *pred = i;
+        rank++;
+    }
+    return -1;
+}
+
+/**
+ * delete the expired leases right before @own@ in the sorted @children@,
+ * or with @all@ every expired lease before it. each expired lease is
+ * reaped by one waiter only: the first one behind it, or the first
+ * waiter for those among the holders.
+ **/
+static void _zklua_semaphore_reap(zklua_semaphore_t *sem,
+        struct String_vector *children, const char *own, int all)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    uint64_t now = _zklua_wall_ms(), expiry = 0;
+    int i = 0;
+
+    while (i < children->count && strcmp(children->data[i], own) != 0) ++i;
+    for (--i; i >= 0; --i) {
+        expiry = _zklua_lease_expiry(children->data[i]);
+        if (expiry == 0 || expiry > now) {
+            if (!all) break;
+            continue;
+        }
+        if (_zklua_join_path(path, sizeof(path), sem->path, children->data[i])) {
+            zoo_adelete(sem->handle->zh, path, -1,
+                    _zklua_semaphore_reap_completion, NULL);
+        }
+    }
+}
+
+/**
+ * read the lease @path@ with a data watch through @waits@: *@held@ tells
+ * whether its owner got its permit already.
+ **/
+static int _zklua_semaphore_watch_lease(zhandle_t *zh, const char *path,
+        zklua_waits_t *waits, uint64_t deadline, int *held)
+{
+    size_t len = sizeof(ZKLUA_SEMAPHORE_HELD) - 1;
+    zklua_call_t *call = NULL;
+    int ret = -1;
+
+    *held = 0;
+    if ((call = _zklua_call_new()) == NULL) return ZSYSTEMERROR;
+    ret = _zklua_call_wait_until(&call, zoo_awget(zh, path,
+                _zklua_waits_watcher, waits, _zklua_call_data_completion,
+                call), _zklua_lock_request_deadline(deadline));
+    if (call == NULL) return ret;
+    *held = (ret == ZOK && call->value_len == (int)len
+            && memcmp(call->value, ZKLUA_SEMAPHORE_HELD, len) == 0);
+    _zklua_call_free(call);
+    return ret;
+}
+
+/**
+ * monotonic time at which the wall clock time @expiry@ (ms) comes, or
+ * @until@ if that is sooner or there is no expiry.
+ **/
+static uint64_t _zklua_semaphore_until(uint64_t expiry, uint64_t until)
+{
+    uint64_t wall = 0, at = 0;
+    if (expiry == 0) return until;
+    wall = _zklua_wall_ms();
+    at = _zklua_now_us() + ((expiry > wall) ? expiry - wall : 0) * 1000;
+    return (at < until) ? at : until;
+}
+
+/**
+ * wait until the lease @node@ is among the first @permits@ live leases.
+ * only the first waiter watches the children of the semaphore, with the
+ * listing it comes with (@dir_wait@ is registered on the semaphore path);
+ * every other waiter watches the lease right before its own, which wakes
+ * it when that lease goes away or gets its permit. a release thus wakes
+ * one waiter, which lists the semaphore once.
+ **/
+static int _zklua_semaphore_wait(zklua_semaphore_t *sem, const char *node,
+        struct String_vector *children, int timeout, uint64_t deadline,
+        zklua_lock_wait_t *dir_wait)
+{
+    char pred_path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    const char *own = strrchr(node, '/') + 1;
+    uint64_t next_expiry = 0, until = 0;
+    zklua_lock_wait_t wait;
+    zklua_waits_t *waits = sem->handle->waits;
+    zhandle_t *zh = sem->handle->zh;
+    int watched = 1, waited = 0, held = 0, nudged = 0;
+    int rank = 0, pred = -1;
+    int ret = ZOK;
+
+    for (;;) {
+        if ((rank = _zklua_semaphore_rank(children, own, &pred,
+                        &next_expiry)) < 0) {
+            ret = ZNONODE;
+            break;
+        }
+        _zklua_semaphore_reap(sem, children, own, rank == sem->permits);
+        if (rank < sem->permits) {
+            ret = ZOK;
+            break;
+        }
+        if (timeout == 0 || _zklua_now_us() >= deadline) {
+            ret = ZKLUA_TIMEDOUT;
+            break;
+        }
+        waited = 1;
+        if (rank == sem->permits && !watched) {
+            /* we just became the first waiter: list again, watched. */
+            ret = ZOK;
+        } else if (rank == sem->permits) {
+            until = _zklua_semaphore_until(next_expiry, deadline);
+            ret = _zklua_lock_block(zh, waits, dir_wait,
+                    (until != UINT64_MAX) ? 1 : -1, until);
+        } else if (!_zklua_join_path(pred_path, sizeof(pred_path), sem->path,
+                    children->data[pred])) {
+            ret = ZBADARGUMENTS;
+        } else {
+            _zklua_waits_add(waits, &wait, pred_path);
+            do {
+                ret = _zklua_semaphore_watch_lease(zh, pred_path, waits,
+                        deadline, &held);
+            } while (_zklua_lock_retry(zh, &ret, deadline));
+            if (ret == ZOK && held && !nudged) {
+                /* our predecessor got its permit, we may be first now. */
+                nudged = 1;
+            } else if (ret == ZOK) {
+                /* held already: clocks disagree on an expiry, wait for it. */
+                nudged = 0;
+                until = _zklua_semaphore_until(_zklua_lease_expiry(
+                            children->data[pred]), deadline);
+                ret = _zklua_lock_block(zh, waits, &wait,
+                        (until != UINT64_MAX) ? 1 : -1, until);
+            } else if (ret == ZNONODE) {
+                ret = ZOK;
+            }
+            _zklua_waits_remove(waits, &wait);
+        }
+        if (ret == ZKLUA_TIMEDOUT && _zklua_now_us() < deadline) {
+            /* a lease ahead expired. */
+            ret = ZOK;
+        }
+        if (ret != ZOK) break;
+        /* the first waiter keeps its children watch armed. */
+        watched = (rank <= sem->permits + 1);
+        if (watched) {
+            _zklua_waits_remove(waits, dir_wait);
+            _zklua_waits_add(waits, dir_wait, sem->path);
+        }
+        deallocate_String_vector(children);
+        do {
+            ret = _zklua_lock_get_children(zh, sem->path,
+                    watched ? waits : NULL, children, deadline);
+        } while (_zklua_lock_retry(zh, &ret, deadline));
+        if (ret != ZOK) break;
+    }
+    deallocate_String_vector(children);
+    if (ret == ZOK && waited) {
+        /* wake the waiter behind us, it may be the first one now. */
+        zoo_aset(zh, node, ZKLUA_SEMAPHORE_HELD,
+                sizeof(ZKLUA_SEMAPHORE_HELD) - 1, -1,
+                _zklua_semaphore_mark_completion, NULL);
+    }
+    return ret;
+}
+
+static zklua_semaphore_t *_zklua_check_semaphore(lua_State *L, int index)
+{
+    zklua_semaphore_t *sem = (zklua_semaphore_t *)luaL_checkudata(L, index,
+            ZKLUA_SEMAPHORE_METATABLE_NAME);
+    if (sem->path == NULL) luaL_error(L, "invalid semaphore.");
+    if (!_zklua_check_handle(L, sem->handle)) {
+        luaL_error(L, "invalid zookeeper handle.");
+    }
+    return sem;
+}
+
+static int zklua_semaphore(lua_State *L)
+{
+    size_t path_len = 0;
+    const char *path = NULL;
+    int permits = 0;
+    zklua_semaphore_t *sem = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (_zklua_check_handle(L, handle)) {
         path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        ret = zoo_wexists(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, &stat);
+        permits = luaL_checkint(L, 3);
+        if (path_len == 0 || path[0] != '/' || permits < 1
+                || path_len >= ZKLUA_MAX_PATH_BUFFER_SIZE / 2) {
+            return luaL_error(L, "invalid arguments: path must be an "
+                    "absolute path and permits a positive number.");
+        }
+        _zklua_check_waits(L, handle);
+        sem = (zklua_semaphore_t *)lua_newuserdata(L, sizeof(zklua_semaphore_t));
+        memset(sem, 0, sizeof(zklua_semaphore_t));
+        luaL_getmetatable(L, ZKLUA_SEMAPHORE_METATABLE_NAME);
+        lua_setmetatable(L, -2);
+        if ((sem->path = strdup(path)) == NULL) {
+            return luaL_error(L, "out of memory when zklua trys to "
+                    "alloc an internal object.");
+        }
+        sem->permits = permits;
+        sem->handle = handle;
+        lua_pushvalue(L, 1);
+        sem->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+        return 1;
+    } else {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+}
+
+/**
+ * take a permit: create our lease and list the leases in one round trip,
+ * then wait for a permit if all of them are taken.
+ **/
+static int zklua_semaphore_acquire(lua_State *L)
+{
+    char prefix[64];
+    int timeout = -1;
+    int ttl = 0;
+    int ret = -1;
+    uint64_t deadline = 0;
+    zklua_lock_wait_t dir_wait;
+    zklua_lock_step_t step;
+    zklua_lock_t *lease = NULL;
+    zklua_semaphore_t *sem = _zklua_check_semaphore(L, 1);
+
+    timeout = luaL_optint(L, 2, -1);
+    ttl = luaL_optint(L, 3, 0);
+    snprintf(prefix, sizeof(prefix), ZKLUA_SEMAPHORE_PREFIX "%llu-",
+            (unsigned long long)((ttl > 0) ? _zklua_wall_ms() + ttl : 0));
+    lease = (zklua_lock_t *)calloc(1, sizeof(zklua_lock_t));
+    if (lease == NULL) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    deadline = _zklua_lock_deadline(timeout);
+    /* registered before the watched listing of enter. */
+    _zklua_waits_add(sem->handle->waits, &dir_wait, sem->path);
+    ret = _zklua_lock_enter(sem->handle, sem->path, prefix, &step, deadline, 1);
+    if (ret == ZOK) {
+        if (step.children_rc == ZOK) {
+            ret = _zklua_semaphore_wait(sem, step.node, &step.children,
+                    timeout, deadline, &dir_wait);
+        } else {
+            ret = step.children_rc;
+        }
+    }
+    _zklua_waits_remove(sem->handle->waits, &dir_wait);
+    if (ret == ZOK) {
+        if (ret != ZOK) {
+            _zklua_node_remove(sem->handle, step.node,
+                    _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT));
+            free(step.node);
+        }
+    }
+    if (ret != ZOK) {
+        free(lease);
         lua_pushinteger(L, ret);
+        return 1;
+    }
+    lease->node = step.node;
+    lease->name = strrchr(step.node, '/') + 1;
+    lease->next = sem->leases;
+    sem->leases = lease;
+    sem->count++;
+    lua_pushinteger(L, ret);
+    lua_pushstring(L, lease->name);
+    return 2;
+}
+
+static int zklua_semaphore_release(lua_State *L)
+{
+    const char *name = NULL;
+    zklua_lock_t *lease = NULL, **link = NULL;
+    int ret = -1;
+    zklua_semaphore_t *sem = _zklua_check_semaphore(L, 1);
+
+    name = luaL_checkstring(L, 2);
+    for (link = &sem->leases; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) break;
+    }
+    if ((lease = *link) == NULL) {
+        lua_pushinteger(L, ZBADARGUMENTS);
+        return 1;
+    }
+    ret = _zklua_call_delete(sem->handle, lease->node, -1);
+    /* ZNONODE: the lease expired and was reaped, or the session died. */
+    if (ret == ZOK || ret == ZNONODE || ret == ZSESSIONEXPIRED) {
+        *link = lease->next;
+        sem->count--;
+        free(lease->node);
+        free(lease);
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+static int zklua_semaphore_held(lua_State *L)
+{
+    zklua_semaphore_t *sem = _zklua_check_semaphore(L, 1);
+    lua_pushinteger(L, sem->count);
+    return 1;
+}
+
+/**
+ * release every lease held, also the __gc of the semaphore.
+ **/
+static int zklua_semaphore_close(lua_State *L)
+{
+    zklua_lock_t *lease = NULL, *next = NULL;
+    zklua_semaphore_t *sem = (zklua_semaphore_t *)luaL_checkudata(L, 1,
+            ZKLUA_SEMAPHORE_METATABLE_NAME);
+
+    if (sem->path == NULL) return 0;
+    for (lease = sem->leases; lease != NULL; lease = next) {
+        next = lease->next;
+        if (sem->handle->zh != NULL) {
+            _zklua_node_remove(sem->handle, lease->node,
+                    _zklua_lock_deadline(ZKLUA_LOCK_RELEASE_TIMEOUT));
+        }
+        free(lease->node);
+        free(lease);
+    }
+    sem->leases = NULL;
+    sem->count = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, sem->handleref);
+    free(sem->path);
+    sem->path = NULL;
+    return 0;
+}
+
+static const luaL_Reg zklua_semaphore_methods[] =
+{
+    {"acquire", zklua_semaphore_acquire},
+    {"release", zklua_semaphore_release},
+    {"held", zklua_semaphore_held},
+    {"close", zklua_semaphore_close},
+    {"__gc", zklua_semaphore_close},
+    {NULL, NULL}
+};
+
+static void _zklua_endpoint_events_free(zklua_endpoint_event_t *ev)
+{
+    zklua_endpoint_event_t *next = NULL;
+    for (; ev != NULL; ev = next) {
+        next = ev->next;
+        free(ev->name);
+        free(ev);
+    }
+}
+
+static void _zklua_service_free(zklua_service_t *svc)
+{
+    int i;
+    _zklua_endpoint_events_free(svc->events);
+    for (i = 0; i < svc->count; ++i) {
+        free(svc->endpoints[i].name);
+        free(svc->endpoints[i].value);
+    }
+    free(svc->endpoints);
+    free(svc->name);
+    free(svc->path);
+    free(svc);
+}
+
+static void _zklua_discovery_release(zklua_sub_t *sub)
+{
+    zklua_discovery_t *d = (zklua_discovery_t *)sub;
+    zklua_service_t *svc = NULL, *next = NULL;
+    for (svc = d->services; svc != NULL; svc = next) {
+        next = svc->next_service;
+        _zklua_service_free(svc);
+    }
+    free(d->root);
+    free(d);
+}
+
+/**
+ * push the endpoint @name@ of @svc@ for the lua thread to fetch again.
+ **/
+static void _zklua_endpoint_event_push(zklua_service_t *svc, const char *name)
+{
+    zklua_endpoint_event_t *ev = NULL;
+    ev = (zklua_endpoint_event_t *)malloc(sizeof(zklua_endpoint_event_t));
+    if (ev == NULL || (ev->name = strdup(name)) == NULL) {
+        free(ev);
+        /* out of memory: fetch everything again rather than miss it. */
+        __atomic_store_n(&svc->all_dirty, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    ev->next = __atomic_load_n(&svc->events, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&svc->events, &ev->next, ev, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void _zklua_discovery_notify(zklua_sub_t *sub, int type, int state,
+        const char *path)
+{
+    zklua_discovery_t *d = (zklua_discovery_t *)sub;
+    zklua_service_t *svc = NULL;
+    size_t len = 0;
+
+    for (svc = __atomic_load_n(&d->services, __ATOMIC_ACQUIRE); svc != NULL;
+            svc = svc->next_service) {
+        if (type == ZOO_SESSION_EVENT) {
+            __atomic_store_n(&svc->list_dirty, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&svc->all_dirty, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (path == NULL) continue;
+        len = strlen(svc->path);
+        if (strcmp(path, svc->path) == 0) {
+            __atomic_store_n(&svc->list_dirty, 1, __ATOMIC_RELEASE);
+        } else if (strncmp(path, svc->path, len) == 0 && path[len] == '/'
+                && strchr(path + len + 1, '/') == NULL) {
+            _zklua_endpoint_event_push(svc, path + len + 1);
+        }
+    }
+}
+
+/**
+ * whether the cache of @svc@ has to be refreshed before use.
+ **/
+static int _zklua_service_dirty(zklua_service_t *svc)
+{
+    return __atomic_load_n(&svc->list_dirty, __ATOMIC_ACQUIRE)
+        || __atomic_load_n(&svc->all_dirty, __ATOMIC_ACQUIRE)
+        || __atomic_load_n(&svc->events, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/**
+ * the endpoint named @name@ of @svc@, whose endpoints are sorted by name.
+ **/
+static zklua_endpoint_t *_zklua_service_endpoint(zklua_service_t *svc,
+        const char *name)
+{
+    int lo = 0, hi = svc->count - 1, mid = 0, c = 0;
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        c = strcmp(svc->endpoints[mid].name, name);
+        if (c == 0) return &svc->endpoints[mid];
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+static zklua_discovery_t *_zklua_check_discovery(lua_State *L, int index)
+{
+    zklua_discovery_handle_t *dh = (zklua_discovery_handle_t *)luaL_checkudata(
+            L, index, ZKLUA_DISCOVERY_METATABLE_NAME);
+    if (dh->discovery == NULL) luaL_error(L, "invalid discovery.");
+    if (!_zklua_check_handle(L, dh->discovery->handle)
+            || dh->discovery->handle->waits != dh->discovery->waits) {
+        luaL_error(L, "invalid zookeeper handle.");
+    }
+    return dh->discovery;
+}
+
+static void _zklua_endpoint_get_completion(int rc, const char *value,
+        int value_len, const struct Stat *stat, const void *data)
+{
+    zklua_endpoint_t *ep = (zklua_endpoint_t *)data;
+    ep->rc = rc;
+    if (rc == ZOK && value != NULL && value_len > 0) {
+        if ((ep->value = (char *)malloc(value_len)) != NULL) {
+            memcpy(ep->value, value, value_len);
+            ep->value_len = value_len;
+        } else {
+            ep->rc = ZSYSTEMERROR;
+        }
+    }
+    _zklua_batch_done(ep->batch);
+}
+
+/**
+ * replace the payload of @ep@ by the data just fetched, split into
+ * "<weight>\n" and the payload. data without the weight line has weight 1.
+ **/
+static void _zklua_endpoint_load(lua_State *L, zklua_endpoint_t *ep)
+{
+    const char *payload = ep->value;
+    int len = ep->value_len, weight = 0, i;
+
+    for (i = 0; i < len && ep->value[i] >= '0' && ep->value[i] <= '9'; ++i) {
+        weight = weight * 10 + (ep->value[i] - '0');
+    }
+    if (i > 0 && i < len && ep->value[i] == '\n') {
+        payload = ep->value + i + 1;
+        len -= i + 1;
+    } else {
+        weight = 1;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, ep->ref);
+    lua_pushlstring(L, (payload != NULL) ? payload : "", len);
+    ep->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ep->weight = weight;
+    free(ep->value);
+    ep->value = NULL;
+    ep->value_len = 0;
+}
+
+/**
+ * bring the cache of @svc@ up to date after a watch fired: list the
+ * endpoints again if the list changed, keeping the ones already known,
+ * and fetch the data of the new ones and of those whose own watch fired
+ * with pipelined gets, one round trip for the whole service. on error
+ * the old cache is kept and the refresh retried on next use.
+ **/
+static int _zklua_discovery_refresh(lua_State *L, zklua_discovery_t *d,
+        zklua_service_t *svc)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    struct String_vector children;
+    struct Stat stat;
+    zklua_batch_t batch;
+    zklua_endpoint_t *eps = NULL, *ep = NULL;
+    zklua_endpoint_event_t *events = NULL, *ev = NULL;
+    zhandle_t *zh = d->handle->zh;
+    int list = 0, all = 0, count = 0;
+    int ret = ZOK, rc = ZOK;
+    int i, j, k, c;
+
+    if (!_zklua_service_dirty(svc)) return ZOK;
+    list = __atomic_exchange_n(&svc->list_dirty, 0, __ATOMIC_ACQ_REL);
+    eps = svc->endpoints;
+    count = svc->count;
+    if (list) {
+        children.count = 0;
+        children.data = NULL;
+        ret = zoo_wget_children(zh, svc->path, _zklua_waits_watcher,
+                d->waits, &children);
+        if (ret == ZNONODE) {
+            /* no endpoint yet, watch for the service to appear. */
+            ret = zoo_wexists(zh, svc->path, _zklua_waits_watcher,
+                    d->waits, &stat);
+            if (ret == ZOK) __atomic_store_n(&svc->list_dirty, 1, __ATOMIC_RELEASE);
+            if (ret == ZOK || ret == ZNONODE) ret = ZOK;
+        }
+        if (ret != ZOK) {
+            __atomic_store_n(&svc->list_dirty, 1, __ATOMIC_RELEASE);
+            return ret;
+        }
+        /* merge the sorted listing with the sorted cache. */
+        qsort(children.data, children.count, sizeof(char *), _zklua_string_cmp);
+        eps = (zklua_endpoint_t *)calloc(children.count > 0 ? children.count : 1,
+                sizeof(zklua_endpoint_t));
+        if (eps == NULL) {
+            deallocate_String_vector(&children);
+            __atomic_store_n(&svc->list_dirty, 1, __ATOMIC_RELEASE);
+            return ZSYSTEMERROR;
+        }
+        for (i = 0, j = 0; i < children.count; ++i) {
+            while (j < svc->count && (c = strcmp(svc->endpoints[j].name,
+                            children.data[i])) < 0) {
+                luaL_unref(L, LUA_REGISTRYINDEX, svc->endpoints[j].ref);
+                free(svc->endpoints[j++].name);
+            }
+            if (j < svc->count && c == 0) {
+                eps[i] = svc->endpoints[j++];
+            } else {
+                eps[i].ref = LUA_NOREF;
+                eps[i].name = children.data[i];
+                children.data[i] = NULL;
+            }
+        }
+        for (; j < svc->count; ++j) {
+            luaL_unref(L, LUA_REGISTRYINDEX, svc->endpoints[j].ref);
+            free(svc->endpoints[j].name);
+        }
+        free(svc->endpoints);
+        count = children.count;
+        deallocate_String_vector(&children);
+        svc->endpoints = eps;
+        svc->count = count;
+    }
+
+    /* events of endpoints gone from the list are dropped. */
+    all = __atomic_exchange_n(&svc->all_dirty, 0, __ATOMIC_ACQ_REL);
+    events = __atomic_exchange_n(&svc->events, NULL, __ATOMIC_ACQ_REL);
+    for (ev = events; ev != NULL; ev = ev->next) {
+        if ((ep = _zklua_service_endpoint(svc, ev->name)) != NULL) ep->dirty = 1;
+    }
+    _zklua_endpoint_events_free(events);
+
+    _zklua_batch_init(&batch);
+    for (i = 0; i < count; ++i) {
+        eps[i].rc = ZOK;
+        if (!all && !eps[i].dirty && eps[i].ref != LUA_NOREF) continue;
+        eps[i].dirty = 0;
+        eps[i].batch = &batch;
+        eps[i].rc = ZCONNECTIONLOSS;
+        if (!_zklua_join_path(path, sizeof(path), svc->path, eps[i].name)) {
+            eps[i].rc = ZBADARGUMENTS;
+            continue;
+        }
+        _zklua_batch_add(&batch, 1);
+        if ((rc = zoo_awget(zh, path, _zklua_waits_watcher, d->waits,
+                        _zklua_endpoint_get_completion, &eps[i])) != ZOK) {
+            eps[i].rc = rc;
+            _zklua_batch_done(&batch);
+        }
+    }
+    _zklua_batch_wait(&batch);
+    _zklua_batch_fini(&batch);
+
+    svc->total_weight = 0;
+    for (i = 0, k = 0; i < count; ++i) {
+        if (eps[i].rc == ZOK && eps[i].batch != NULL) {
+            _zklua_endpoint_load(L, &eps[i]);
+        } else if (eps[i].rc != ZOK && eps[i].rc != ZNONODE) {
+            /* keep what we had, list and fetch it again next time. */
+            __atomic_store_n(&svc->list_dirty, 1, __ATOMIC_RELEASE);
+            eps[i].dirty = 1;
+            ret = eps[i].rc;
+        }
+        eps[i].batch = NULL;
+        if (eps[i].rc == ZNONODE || eps[i].ref == LUA_NOREF) {
+            luaL_unref(L, LUA_REGISTRYINDEX, eps[i].ref);
+            free(eps[i].name);
+            free(eps[i].value);
+            continue;
+        }
+        svc->total_weight += eps[i].weight;
+        eps[k++] = eps[i];
+    }
+    svc->count = k;
+    return ret;
+}
+
+static zklua_service_t *_zklua_discovery_service(lua_State *L,
+        zklua_discovery_t *d, const char *name)
+{
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    unsigned int hash = _zklua_hash_string(name);
+    zklua_service_t *svc = NULL;
+
+    for (svc = d->services; svc != NULL; svc = svc->next_service) {
+        if (svc->hash == hash && strcmp(svc->name, name) == 0) return svc;
+    }
+    if (name[0] == '\0' || strchr(name, '/') != NULL
+            || !_zklua_join_path(path, sizeof(path), d->root, name)) {
+        luaL_error(L, "invalid arguments: invalid service name.");
+    }
+    svc = (zklua_service_t *)calloc(1, sizeof(zklua_service_t));
+    if (svc == NULL || (svc->name = strdup(name)) == NULL
+            || (svc->path = strdup(path)) == NULL) {
+        if (svc != NULL) free(svc->name);
+        free(svc);
+        luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    svc->hash = hash;
+    svc->list_dirty = 1;
+    svc->next_service = d->services;
+    __atomic_store_n(&d->services, svc, __ATOMIC_RELEASE);
+    return svc;
+}
+
+static int zklua_discovery(lua_State *L)
+{
+    size_t root_len = 0;
+    const char *root = NULL;
+    zklua_discovery_t *d = NULL;
+    zklua_discovery_handle_t *dh = NULL;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    root = luaL_checklstring(L, 2, &root_len);
+    if (root_len == 0 || root[0] != '/'
+            || root_len >= ZKLUA_MAX_PATH_BUFFER_SIZE / 2) {
+        return luaL_error(L, "invalid arguments: root must be an "
+                "absolute path.");
+    }
+    _zklua_check_waits(L, handle);
+    dh = (zklua_discovery_handle_t *)lua_newuserdata(L,
+            sizeof(zklua_discovery_handle_t));
+    dh->discovery = NULL;
+    luaL_getmetatable(L, ZKLUA_DISCOVERY_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    d = (zklua_discovery_t *)calloc(1, sizeof(zklua_discovery_t));
+    if (d == NULL || (d->root = strdup(root)) == NULL) {
+        free(d);
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    d->sub.refs = 1;
+    d->sub.notify = _zklua_discovery_notify;
+    d->sub.release = _zklua_discovery_release;
+    d->seed = (unsigned int)_zklua_now_us();
+    d->handle = handle;
+    d->waits = handle->waits;
+    lua_pushvalue(L, 1);
+    d->handleref = luaL_ref(L, LUA_REGISTRYINDEX);
+    _zklua_waits_subscribe(d->waits, &d->sub);
+    dh->discovery = d;
+    return 1;
+}
+
+/**
+ * register an endpoint of service @name@, removed with the session.
+ **/
+static int zklua_discovery_register(lua_State *L)
+{
+    char dir[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    char path[ZKLUA_MAX_PATH_BUFFER_SIZE];
+    char created[ZKLUA_MAX_PATH_BUFFER_SIZE] = {0};
+    size_t payload_len = 0;
+    const char *name = NULL;
+    const char *payload = NULL;
+    int weight = 1;
+    int ret = -1;
+    zklua_discovery_t *d = _zklua_check_discovery(L, 1);
+
+    name = luaL_checkstring(L, 2);
+    payload = luaL_checklstring(L, 3, &payload_len);
+    weight = luaL_optint(L, 4, 1);
+    if (weight < 0 || name[0] == '\0' || strchr(name, '/') != NULL
+            || !_zklua_join_path(dir, sizeof(dir), d->root, name)
+            || !_zklua_join_path(path, sizeof(path), dir, ZKLUA_DISCOVERY_PREFIX)) {
+        return luaL_error(L, "invalid arguments: invalid service name "
+                "or weight.");
+    }
+    lua_pushfstring(L, "%d\n", weight);
+    lua_pushvalue(L, 3);
+    lua_concat(L, 2);
+    payload = lua_tolstring(L, -1, &payload_len);
+    ret = _zklua_call_create(d->handle, path, payload, (int)payload_len,
+            &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL | ZOO_SEQUENCE,
+            created, sizeof(created));
+    if (ret == ZNONODE && (ret = _zklua_ensure_path(d->handle->zh, dir)) == ZOK) {
+        ret = _zklua_call_create(d->handle, path, payload, (int)payload_len,
+                &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL | ZOO_SEQUENCE,
+                created, sizeof(created));
+    }
+    lua_pop(L, 1);
+    lua_pushinteger(L, ret);
+    if (ret != ZOK) return 1;
+    lua_pushstring(L, created);
+    return 2;
+}
+
+static int zklua_discovery_unregister(lua_State *L)
+{
+    const char *node = NULL;
+    zklua_discovery_t *d = _zklua_check_discovery(L, 1);
+    node = luaL_checkstring(L, 2);
+    lua_pushinteger(L, _zklua_call_delete(d->handle, node, -1));
+    return 1;
+}
+
+/**
+ * choose an endpoint of the cached list, without any allocation.
+ **/
+static zklua_endpoint_t *_zklua_discovery_choose(zklua_discovery_t *d,
+        zklua_service_t *svc, int strategy)
+{
+    zklua_endpoint_t *ep = NULL;
+    int r = 0, i;
+
+    if (svc->count == 0) return NULL;
+    if (strategy == ZKLUA_DISCOVERY_WEIGHTED && svc->total_weight > 0) {
+        r = rand_r(&d->seed) % svc->total_weight;
+        for (i = 0; i < svc->count; ++i) {
+            if ((r -= svc->endpoints[i].weight) < 0) break;
+        }
+        ep = &svc->endpoints[i < svc->count ? i : svc->count - 1];
+    } else if (strategy == ZKLUA_DISCOVERY_LRU) {
+        ep = &svc->endpoints[0];
+        for (i = 1; i < svc->count; ++i) {
+            if (svc->endpoints[i].used < ep->used) ep = &svc->endpoints[i];
+        }
+    } else {
+        ep = &svc->endpoints[svc->next++ % svc->count];
+    }
+    ep->used = ++d->tick;
+    return ep;
+}
+
+static int zklua_discovery_pick(lua_State *L)
+{
+    static const char *const strategies[] = {
+        "round_robin", "weighted", "lru", NULL
+    };
+    const char *name = NULL;
+    int strategy = ZKLUA_DISCOVERY_ROUND_ROBIN;
+    zklua_service_t *svc = NULL;
+    zklua_endpoint_t *ep = NULL;
+    zklua_discovery_t *d = _zklua_check_discovery(L, 1);
+
+    name = luaL_checkstring(L, 2);
+    strategy = luaL_checkoption(L, 3, "round_robin", strategies);
+    svc = _zklua_discovery_service(L, d, name);
+    if (_zklua_service_dirty(svc)) {
+        _zklua_discovery_refresh(L, d, svc);
+    }
+    if ((ep = _zklua_discovery_choose(d, svc, strategy)) == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ep->ref);
+    return 1;
+}
+
+static int zklua_discovery_endpoints(lua_State *L)
+{
+    const char *name = NULL;
+    zklua_service_t *svc = NULL;
+    int ret = ZOK, i;
+    zklua_discovery_t *d = _zklua_check_discovery(L, 1);
+
+    name = luaL_checkstring(L, 2);
+    svc = _zklua_discovery_service(L, d, name);
+    if (_zklua_service_dirty(svc)) {
+        ret = _zklua_discovery_refresh(L, d, svc);
+    }
+    lua_pushinteger(L, ret);
+    lua_createtable(L, svc->count, 0);
+    for (i = 0; i < svc->count; ++i) {
+        lua_createtable(L, 0, 3);
+        lua_pushstring(L, svc->endpoints[i].name);
+        lua_setfield(L, -2, "node");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, svc->endpoints[i].ref);
+        lua_setfield(L, -2, "payload");
+        lua_pushinteger(L, svc->endpoints[i].weight);
+        lua_setfield(L, -2, "weight");
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 2;
+}
+
+static int zklua_discovery_gc(lua_State *L)
+{
+    zklua_discovery_handle_t *dh = (zklua_discovery_handle_t *)luaL_checkudata(
+            L, 1, ZKLUA_DISCOVERY_METATABLE_NAME);
+    zklua_discovery_t *d = dh->discovery;
+    zklua_service_t *svc = NULL;
+    int i;
+
+    if (d == NULL) return 0;
+    dh->discovery = NULL;
+    /* a closed handle has dropped the subscription already. */
+    if (d->handle->waits == d->waits) {
+        _zklua_waits_unsubscribe(d->waits, &d->sub);
+    }
+    for (svc = d->services; svc != NULL; svc = svc->next_service) {
+        for (i = 0; i < svc->count; ++i) {
+            luaL_unref(L, LUA_REGISTRYINDEX, svc->endpoints[i].ref);
+        }
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, d->handleref);
+    _zklua_sub_release(&d->sub);
+    return 0;
+}
+
+static const luaL_Reg zklua_discovery_methods[] =
+{
+    {"register", zklua_discovery_register},
+    {"unregister", zklua_discovery_unregister},
+    {"pick", zklua_discovery_pick},
+    {"endpoints", zklua_discovery_endpoints},
+    {"__gc", zklua_discovery_gc},
+    {NULL, NULL}
+};
+
+/**
+ * sleep a random time of at most @base@ * 2^@attempt@ milliseconds,
+ * capped at @cap@, so contending writers spread out.
+ **/
+static void _zklua_backoff(int attempt, int base, int cap, unsigned int *seed)
+{
+    uint64_t bound = (uint64_t)base;
+    while (attempt-- > 0 && bound < (uint64_t)cap) bound <<= 1;
+    if (bound > (uint64_t)cap) bound = cap;
+    if (bound > 0) {
+        usleep((useconds_t)((rand_r(seed) % (bound * 1000 + 1))));
+    }
+}
+
+/**
+ * compute the new value of a node for update: either add the counter
+ * @delta@ to the decimal value, or call the lua transform at @fnindex@
+ * with the value and stat (nil, nil for a missing node). the new value is
+ * left on the stack, nil if the transform returned nil.
+ **/
+static int _zklua_update_apply(lua_State *L, int fnindex, int counter,
+        long long delta, const char *value, int value_len,
+        const struct Stat *stat)
+{
+    char num[32];
+    char *end = NULL;
+    long long current = 0;
+
+    if (counter) {
+        if (value != NULL && value_len > 0) {
+            if (value_len >= (int)sizeof(num)) return ZBADARGUMENTS;
+            memcpy(num, value, value_len);
+            num[value_len] = '\0';
+            current = strtoll(num, &end, 10);
+            if (end == num || *end != '\0') return ZBADARGUMENTS;
+        }
+        snprintf(num, sizeof(num), "%lld", current + delta);
+        lua_pushstring(L, num);
+        return ZOK;
+    }
+    lua_pushvalue(L, fnindex);
+    if (value != NULL) {
+        lua_pushlstring(L, value, value_len);
+        _zklua_build_stat(L, stat);
+    } else {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+    lua_call(L, 2, 1);
+    if (!lua_isnil(L, -1) && !lua_isstring(L, -1)) {
+        return luaL_error(L, "update: the transform must return a "
+                "string or nil.");
+    }
+    return ZOK;
+}
+
+/**
+ * read-modify-write @path@ guarded by its version. on a conflict the node
+ * is read again and the transform re-run after a jittered backoff. the
+ * version of the first attempt may be given by the caller (opts.value and
+ * opts.version, e.g. from the stat returned by a previous update), which
+ * saves the initial read.
+ **/
+static int zklua_update(lua_State *L)
+{
+    size_t path_len = 0, new_len = 0;
+    const char *path = NULL;
+    const char *known = NULL;
+    const char *update = NULL;
+    char *value = NULL;
+    int value_len = 0;
+    int counter = 0, create = 0;
+    int retries = 0, backoff = 0, max_backoff = 0;
+    int version = -1;
+    int attempt = 0;
+    int ret = -1;
+    int top = 0;
+    long long delta = 0;
+    unsigned int seed = 0;
+    struct Stat stat;
+
+    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
+    if (!_zklua_check_handle(L, handle)) {
+        return luaL_error(L, "invalid zookeeper handle.");
+    }
+    path = luaL_checklstring(L, 2, &path_len);
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        counter = 1;
+        delta = (long long)lua_tonumber(L, 3);
+    } else {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+    }
+    retries = (int)_zklua_opt_number_field(L, 4, "retries", ZKLUA_UPDATE_RETRIES);
+    backoff = (int)_zklua_opt_number_field(L, 4, "backoff", ZKLUA_UPDATE_BACKOFF);
+    max_backoff = (int)_zklua_opt_number_field(L, 4, "max_backoff",
+            ZKLUA_UPDATE_MAX_BACKOFF);
+    version = (int)_zklua_opt_number_field(L, 4, "version", -1);
+    known = _zklua_opt_string_field(L, 4, "value", NULL);
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "create");
+        create = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    memset(&stat, 0, sizeof(stat));
+    seed = (unsigned int)_zklua_now_us() ^ (unsigned int)(uintptr_t)&seed;
+    _zklua_flight_forget(handle, path);
+    top = lua_gettop(L);
+
+    for (attempt = 0;; ++attempt) {
+        lua_settop(L, top);
+        if (attempt == 0 && known != NULL && version >= 0) {
+            /* the caller already knows the value, skip the read. */
+            stat.version = version;
+            ret = _zklua_update_apply(L, 3, counter, delta, known,
+                    (int)strlen(known), &stat);
+        } else {
+            ret = _zklua_get_alloc(handle->zh, path, &value, &value_len, &stat);
+            if (ret == ZNONODE && create) {
+                ret = _zklua_update_apply(L, 3, counter, delta, NULL, 0, NULL);
+                if (ret != ZOK) break;
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    ret = ZNONODE;
+                    break;
+                }
+                update = lua_tolstring(L, -1, &new_len);
+                ret = _zklua_call_create(handle, path, update, (int)new_len,
+                        &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+                if (ret == ZOK) {
+                    memset(&stat, 0, sizeof(stat));
+                    stat.dataLength = (int32_t)new_len;
+                    break;
+                }
+                /* created meanwhile by someone else: retry as a conflict. */
+                if (ret != ZNODEEXISTS) break;
+                ret = ZBADVERSION;
+                goto conflict;
+            }
+            if (ret != ZOK) break;
+            /* copy to lua first, the transform may raise an error. */
+            lua_pushlstring(L, value, value_len);
+            free(value);
+            value = NULL;
+            ret = _zklua_update_apply(L, 3, counter, delta,
+                    lua_tostring(L, -1), (int)lua_objlen(L, -1), &stat);
+        }
+        if (ret != ZOK) break;
+        if (lua_isnil(L, -1)) {
+            /* nothing to write, report the value read. */
+            lua_pop(L, 1);
+            break;
+        }
+        update = lua_tolstring(L, -1, &new_len);
+        ret = _zklua_call_set2(handle, path, update, (int)new_len,
+                stat.version, &stat);
+        if (ret != ZBADVERSION) break;
+conflict:
+        if (retries >= 0 && attempt >= retries) break;
+        _zklua_backoff(attempt, backoff, max_backoff, &seed);
+    }
+
+    lua_pushinteger(L, ret);
+    if (ret == ZOK && lua_gettop(L) > top) {
+        lua_pushvalue(L, -2);
+        if (counter) lua_pushnumber(L, lua_tonumber(L, -1));
+        else lua_pushvalue(L, -1);
+        lua_remove(L, -2);
         _zklua_build_stat(L, &stat);
-        return 2;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+        return 3;
     }
+    return 1;
 }
 
-static int zklua_get(lua_State *L)
+static const char *const zklua_jute_op_names[] = {
+    "create", "delete", "exists", "get", "set", "get_children",
+    "get_children2", "sync", "check", "multi", "ping", "close", "connect",
+    NULL
+};
+
+static const int zklua_jute_op_codes[] = {
+    ZKLUA_JUTE_CREATE_OP, ZKLUA_JUTE_DELETE_OP, ZKLUA_JUTE_EXISTS_OP,
+    ZKLUA_JUTE_GETDATA_OP, ZKLUA_JUTE_SETDATA_OP, ZKLUA_JUTE_GETCHILDREN_OP,
+    ZKLUA_JUTE_GETCHILDREN2_OP, ZKLUA_JUTE_SYNC_OP, ZKLUA_JUTE_CHECK_OP,
+    ZKLUA_JUTE_MULTI_OP, ZKLUA_JUTE_PING_OP, ZKLUA_JUTE_CLOSE_OP,
+    ZKLUA_JUTE_CONNECT_OP
+};
+
+static void _zklua_jute_put(zklua_jute_writer_t *w, const void *data,
+        size_t len)
 {
-    size_t path_len = 0;
+    char *buffer = NULL;
+    size_t size = 0;
+
+    if (w->failed) return;
+    if (w->len + len > w->size) {
+        size = w->size * 2 + len + 64;
+        buffer = (char *)realloc(w->buffer, size);
+        if (buffer == NULL) {
+            w->failed = 1;
+            return;
+        }
+        w->buffer = buffer;
+        w->size = size;
+    }
+    memcpy(w->buffer + w->len, data, len);
+    w->len += len;
+}
+
+static void _zklua_jute_put_int(zklua_jute_writer_t *w, int32_t value)
+{
+    unsigned char buffer[4];
+    buffer[0] = (unsigned char)(((uint32_t)value >> 24) & 0xff);
+    buffer[1] = (unsigned char)(((uint32_t)value >> 16) & 0xff);
+    buffer[2] = (unsigned char)(((uint32_t)value >> 8) & 0xff);
+    buffer[3] = (unsigned char)((uint32_t)value & 0xff);
+    _zklua_jute_put(w, buffer, 4);
+}
+
+static void _zklua_jute_put_long(zklua_jute_writer_t *w, int64_t value)
+{
+    unsigned char buffer[8];
+    _zklua_put_uint64(buffer, (uint64_t)value);
+    _zklua_jute_put(w, buffer, 8);
+}
+
+static void _zklua_jute_put_bool(zklua_jute_writer_t *w, int value)
+{
+    unsigned char byte = value ? 1 : 0;
+    _zklua_jute_put(w, &byte, 1);
+}
+
+/**
+ * a jute buffer or string: its length, -1 for NULL, then its bytes.
+ **/
+static void _zklua_jute_put_buffer(zklua_jute_writer_t *w, const char *data,
+        int32_t len)
+{
+    _zklua_jute_put_int(w, (data == NULL) ? -1 : len);
+    if (data != NULL && len > 0) _zklua_jute_put(w, data, len);
+}
+
+static void _zklua_jute_put_acls(zklua_jute_writer_t *w,
+        const struct ACL_vector *acls)
+{
+    int i;
+    _zklua_jute_put_int(w, acls->count);
+    for (i = 0; i < acls->count; ++i) {
+        _zklua_jute_put_int(w, acls->data[i].perms);
+        _zklua_jute_put_buffer(w, acls->data[i].id.scheme,
+                (int32_t)strlen(acls->data[i].id.scheme));
+        _zklua_jute_put_buffer(w, acls->data[i].id.id,
+                (int32_t)strlen(acls->data[i].id.id));
+    }
+}
+
+/**
+ * push a packet writer, the first 4 bytes are left for the length.
+ **/
+static zklua_jute_writer_t *_zklua_jute_writer(lua_State *L)
+{
+    zklua_jute_writer_t *w = (zklua_jute_writer_t *)lua_newuserdata(L,
+            sizeof(zklua_jute_writer_t));
+    memset(w, 0, sizeof(zklua_jute_writer_t));
+    luaL_getmetatable(L, ZKLUA_JUTE_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    _zklua_jute_put_int(w, 0);
+    return w;
+}
+
+/**
+ * push the packet of @w@ as a string, its length in front.
+ **/
+static int _zklua_jute_push(lua_State *L, zklua_jute_writer_t *w)
+{
+    uint32_t len = (uint32_t)(w->len - 4);
+
+    if (w->failed) {
+        return luaL_error(L, "out of memory when zklua trys to "
+                "alloc an internal object.");
+    }
+    w->buffer[0] = (char)((len >> 24) & 0xff);
+    w->buffer[1] = (char)((len >> 16) & 0xff);
+    w->buffer[2] = (char)((len >> 8) & 0xff);
+    w->buffer[3] = (char)(len & 0xff);
+    lua_pushlstring(L, w->buffer, w->len);
+    free(w->buffer);
+    w->buffer = NULL;
+    return 1;
+}
+
+static int zklua_jute_writer_gc(lua_State *L)
+{
+    zklua_jute_writer_t *w = (zklua_jute_writer_t *)luaL_checkudata(L, 1,
+            ZKLUA_JUTE_METATABLE_NAME);
+    free(w->buffer);
+    w->buffer = NULL;
+    return 0;
+}
+
+/**
+ * a watch flag, a boolean or a number as taken by zklua.aexists.
+ **/
+static int _zklua_jute_watch(lua_State *L, int index)
+{
+    if (lua_type(L, index) == LUA_TNUMBER) return lua_tointeger(L, index) != 0;
+    return lua_toboolean(L, index);
+}
+
+static void _zklua_jute_put_multi(lua_State *L, zklua_jute_writer_t *w,
+        int index);
+
+/**
+ * encode the body of the request @op@ from the arguments at @index@,
+ * in the order of the synchronous call of the same name.
+ **/
+static void _zklua_jute_put_request(lua_State *L, zklua_jute_writer_t *w,
+        int op, int index)
+{
+    struct ACL_vector buffer;
+    const struct ACL_vector *acls = NULL;
     const char *path = NULL;
-    char *buffer = malloc(2048);
-    int buffer_len = 2048;
-    int watch = 0;
+    const char *value = NULL;
+    size_t path_len = 0;
+    size_t value_len = 0;
+    int flags = 0;
+    int version = -1;
+
+    if (op == ZKLUA_JUTE_PING_OP || op == ZKLUA_JUTE_CLOSE_OP) {
+        return;
+    } else if (op == ZKLUA_JUTE_MULTI_OP) {
+        _zklua_jute_put_multi(L, w, index);
+        return;
+    }
+    path = luaL_checklstring(L, index, &path_len);
+    switch (op) {
+        case ZKLUA_JUTE_CREATE_OP:
+            value = luaL_optlstring(L, index + 1, NULL, &value_len);
+            flags = luaL_optint(L, index + 3, 0);
+            if ((acls = _zklua_check_acls(L, index + 2, &buffer)) == NULL) {
+                luaL_error(L, "invalid ACL format.");
+            }
+            _zklua_jute_put_buffer(w, path, (int32_t)path_len);
+            _zklua_jute_put_buffer(w, value, (int32_t)value_len);
+            _zklua_jute_put_acls(w, acls);
+            _zklua_jute_put_int(w, flags);
+            if (acls == &buffer) _zklua_free_acls(&buffer);
+            break;
+        case ZKLUA_JUTE_DELETE_OP:
+        case ZKLUA_JUTE_CHECK_OP:
+            version = luaL_optint(L, index + 1, -1);
+            _zklua_jute_put_buffer(w, path, (int32_t)path_len);
+            _zklua_jute_put_int(w, version);
+            break;
+        case ZKLUA_JUTE_SETDATA_OP:
+            value = luaL_optlstring(L, index + 1, NULL, &value_len);
+            version = luaL_optint(L, index + 2, -1);
+            _zklua_jute_put_buffer(w, path, (int32_t)path_len);
+            _zklua_jute_put_buffer(w, value, (int32_t)value_len);
+            _zklua_jute_put_int(w, version);
+            break;
+        case ZKLUA_JUTE_SYNC_OP:
+            _zklua_jute_put_buffer(w, path, (int32_t)path_len);
+            break;
+        default:
+            /* exists, get, get_children and get_children2 */
+            _zklua_jute_put_buffer(w, path, (int32_t)path_len);
+            _zklua_jute_put_bool(w, _zklua_jute_watch(L, index + 1));
+            break;
+    }
+}
+
+/**
+ * encode the list of operations at @index@, each one a list of the op
+ * name ("create", "delete", "set" or "check") and its arguments.
+ **/
+static void _zklua_jute_put_multi(lua_State *L, zklua_jute_writer_t *w,
+        int index)
+{
+    int count = 0;
+    int top = 0;
+    int op = 0;
+    int i, j;
+
+    luaL_checktype(L, index, LUA_TTABLE);
+    count = lua_objlen(L, index);
+    for (i = 1; i <= count; ++i) {
+        lua_rawgeti(L, index, i);
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "invalid multi operation #%d.", i);
+        }
+        top = lua_gettop(L);
+        for (j = 1; j <= 5; ++j) lua_rawgeti(L, top, j);
+        op = zklua_jute_op_codes[luaL_checkoption(L, top + 1, NULL,
+                zklua_jute_op_names)];
+        if (op != ZKLUA_JUTE_CREATE_OP && op != ZKLUA_JUTE_DELETE_OP
+                && op != ZKLUA_JUTE_SETDATA_OP && op != ZKLUA_JUTE_CHECK_OP) {
+            luaL_error(L, "invalid multi operation #%d.", i);
+        }
+        _zklua_jute_put_int(w, op);
+        _zklua_jute_put_bool(w, 0);
+        _zklua_jute_put_int(w, -1);
+        _zklua_jute_put_request(L, w, op, top + 2);
+        lua_settop(L, top - 1);
+    }
+    _zklua_jute_put_int(w, -1);
+    _zklua_jute_put_bool(w, 1);
+    _zklua_jute_put_int(w, -1);
+}
+
+/**
+ * zklua.jute.request(op, xid, ...), encode a request packet. the
+ * arguments after @xid@ are those of the synchronous call of the same
+ * name, without the handle; ping defaults to the ping xid.
+ **/
+static int zklua_jute_request(lua_State *L)
+{
+    zklua_jute_writer_t *w = NULL;
+    int op = zklua_jute_op_codes[luaL_checkoption(L, 1, NULL,
+            zklua_jute_op_names)];
+    int xid = 0;
+
+    if (op == ZKLUA_JUTE_CONNECT_OP) {
+        return luaL_argerror(L, 1, "use zklua.jute.connect");
+    }
+    if (op == ZKLUA_JUTE_PING_OP && lua_isnoneornil(L, 2)) {
+        xid = ZKLUA_JUTE_PING_XID;
+    } else {
+        xid = luaL_checkint(L, 2);
+    }
+    w = _zklua_jute_writer(L);
+    _zklua_jute_put_int(w, xid);
+    _zklua_jute_put_int(w, op);
+    _zklua_jute_put_request(L, w, op, 3);
+    return _zklua_jute_push(L, w);
+}
+
+/**
+ * zklua.jute.connect([opts]), encode the handshake that opens or resumes
+ * a session: protocol_version, last_zxid, timeout, session_id, passwd
+ * and read_only.
+ **/
+static int zklua_jute_connect(lua_State *L)
+{
+    static const char zero[ZKLUA_JUTE_PASSWD_LEN] = {0};
+    zklua_jute_writer_t *w = NULL;
+    const char *passwd = zero;
+    size_t passwd_len = ZKLUA_JUTE_PASSWD_LEN;
+    int64_t session_id = 0;
+    int read_only = 0;
+
+    if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TTABLE);
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "session_id");
+        if (!lua_isnil(L, -1)) session_id = _zklua_check_session_id(L, -1);
+        lua_getfield(L, 1, "passwd");
+        if (!lua_isnil(L, -1)) {
+            if (!lua_isstring(L, -1)) {
+                return luaL_error(L, "invalid arguments: passwd must be a string.");
+            }
+            passwd = lua_tolstring(L, -1, &passwd_len);
+        }
+        lua_getfield(L, 1, "read_only");
+        read_only = lua_toboolean(L, -1);
+    }
+    w = _zklua_jute_writer(L);
+    _zklua_jute_put_int(w, (int32_t)_zklua_opt_number_field(L, 1,
+                "protocol_version", 0));
+    _zklua_jute_put_long(w, (int64_t)_zklua_opt_number_field(L, 1,
+                "last_zxid", 0));
+    _zklua_jute_put_int(w, (int32_t)_zklua_opt_number_field(L, 1,
+                "timeout", 10000));
+    _zklua_jute_put_long(w, session_id);
+    _zklua_jute_put_buffer(w, passwd, (int32_t)passwd_len);
+    _zklua_jute_put_bool(w, read_only);
+    return _zklua_jute_push(L, w);
+}
+
+/**
+ * zklua.jute.frame(buffer, [pos]), the packet starting at @pos@ in a
+ * stream buffer and the position after it, or nil while it is incomplete.
+ **/
+static int zklua_jute_frame(lua_State *L)
+{
+    size_t len = 0;
+    const unsigned char *buffer = (const unsigned char *)luaL_checklstring(L,
+            1, &len);
+    int pos = luaL_optint(L, 2, 1);
+    size_t start = 0;
+    uint32_t packet_len = 0;
+
+    luaL_argcheck(L, pos >= 1, 2, "position out of range");
+    start = (size_t)pos - 1;
+    if (start > len || len - start < 4) {
+        lua_pushnil(L);
+        return 1;
+    }
+    packet_len = ((uint32_t)buffer[start] << 24) | ((uint32_t)buffer[start + 1] << 16)
+        | ((uint32_t)buffer[start + 2] << 8) | (uint32_t)buffer[start + 3];
+    if (packet_len > ZKLUA_JUTE_MAX_PACKET) {
+        lua_pushnil(L);
+        lua_pushinteger(L, ZMARSHALLINGERROR);
+        return 2;
+    }
+    if (len - start - 4 < packet_len) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushlstring(L, (const char *)buffer + start + 4, packet_len);
+    lua_pushinteger(L, (lua_Integer)(start + 4 + packet_len + 1));
+    return 2;
+}
+
+static int _zklua_jute_need(zklua_jute_reader_t *r, size_t len)
+{
+    if (r->failed || r->len - r->pos < len) {
+        r->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int32_t _zklua_jute_get_int(zklua_jute_reader_t *r)
+{
+    const unsigned char *p = NULL;
+    if (!_zklua_jute_need(r, 4)) return 0;
+    p = r->data + r->pos;
+    r->pos += 4;
+    return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static int64_t _zklua_jute_get_long(zklua_jute_reader_t *r)
+{
+    const unsigned char *p = NULL;
+    if (!_zklua_jute_need(r, 8)) return 0;
+    p = r->data + r->pos;
+    r->pos += 8;
+    return (int64_t)_zklua_get_uint64(p);
+}
+
+static int _zklua_jute_get_bool(zklua_jute_reader_t *r)
+{
+    if (!_zklua_jute_need(r, 1)) return 0;
+    return r->data[r->pos++] != 0;
+}
+
+/**
+ * the bytes of a jute buffer or string, NULL for a NULL one.
+ **/
+static const char *_zklua_jute_get_buffer(zklua_jute_reader_t *r,
+        int32_t *len)
+{
+    const char *data = NULL;
+
+    *len = _zklua_jute_get_int(r);
+    if (*len < 0 || !_zklua_jute_need(r, (size_t)*len)) {
+        *len = 0;
+        return NULL;
+    }
+    data = (const char *)r->data + r->pos;
+    r->pos += *len;
+    return data;
+}
+
+/**
+ * push a jute buffer or string, "" for a NULL one.
+ **/
+static void _zklua_jute_push_buffer(lua_State *L, zklua_jute_reader_t *r)
+{
+    int32_t len = 0;
+    const char *data = _zklua_jute_get_buffer(r, &len);
+    lua_pushlstring(L, (data != NULL) ? data : "", len);
+}
+
+static void _zklua_jute_push_stat(lua_State *L, zklua_jute_reader_t *r)
+{
     struct Stat stat;
-    int ret = -1;
+    stat.czxid = _zklua_jute_get_long(r);
+    stat.mzxid = _zklua_jute_get_long(r);
+    stat.ctime = _zklua_jute_get_long(r);
+    stat.mtime = _zklua_jute_get_long(r);
+    stat.version = _zklua_jute_get_int(r);
+    stat.cversion = _zklua_jute_get_int(r);
+    stat.aversion = _zklua_jute_get_int(r);
+    stat.ephemeralOwner = _zklua_jute_get_long(r);
+    stat.dataLength = _zklua_jute_get_int(r);
+    stat.numChildren = _zklua_jute_get_int(r);
+    stat.pzxid = _zklua_jute_get_long(r);
+    _zklua_build_stat(L, &stat);
+}
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        ret = zoo_get(handle->zh, path, watch, buffer, &buffer_len, &stat);
-        lua_pushinteger(L, ret);
-        lua_pushlstring(L, buffer, buffer_len);
-        free(buffer);
-        _zklua_build_stat(L, &stat);
-        return 3;
+/**
+ * push a jute vector of strings as _zklua_build_string_vector does.
+ **/
+static void _zklua_jute_push_strings(lua_State *L, zklua_jute_reader_t *r)
+{
+    int32_t count = _zklua_jute_get_int(r);
+    int32_t i;
+
+    /* every string takes at least its length. */
+    if (count < 0 || (size_t)count > (r->len - r->pos) / 4) {
+        if (count > 0) r->failed = 1;
+        count = 0;
+    }
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; ++i) {
+        _zklua_jute_push_buffer(L, r);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/**
+ * push the results of a multi reply, a list of {rc = , path = } for
+ * create and {rc = , stat = } for set.
+ **/
+static void _zklua_jute_push_multi(lua_State *L, zklua_jute_reader_t *r)
+{
+    int type = 0;
+    int done = 0;
+    int err = 0;
+    int i;
+
+    lua_newtable(L);
+    for (i = 1; ; ++i) {
+        type = _zklua_jute_get_int(r);
+        done = _zklua_jute_get_bool(r);
+        err = _zklua_jute_get_int(r);
+        if (r->failed || done) break;
+        lua_newtable(L);
+        if (type == ZKLUA_JUTE_ERROR_OP) err = _zklua_jute_get_int(r);
+        lua_pushinteger(L, err);
+        lua_setfield(L, -2, "rc");
+        if (type == ZKLUA_JUTE_CREATE_OP) {
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "path");
+        } else if (type == ZKLUA_JUTE_SETDATA_OP) {
+            _zklua_jute_push_stat(L, r);
+            lua_setfield(L, -2, "stat");
+        }
+        lua_rawseti(L, -2, i);
+    }
+}
+
+/**
+ * zklua.jute.decode(packet, op), decode a packet framed by
+ * zklua.jute.frame: the reply to the request @op@ or, with "connect",
+ * the handshake reply. returns nil and ZMARSHALLINGERROR for a packet
+ * too short.
+ **/
+static int zklua_jute_decode(lua_State *L)
+{
+    zklua_jute_reader_t r;
+    int op = 0;
+    int xid = 0;
+    int err = 0;
+    int top = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.data = (const unsigned char *)luaL_checklstring(L, 1, &r.len);
+    op = zklua_jute_op_codes[luaL_checkoption(L, 2, NULL, zklua_jute_op_names)];
+    top = lua_gettop(L);
+    if (op == ZKLUA_JUTE_CONNECT_OP) {
+        lua_pushinteger(L, _zklua_jute_get_int(&r));
+        lua_pushinteger(L, _zklua_jute_get_int(&r));
+        _zklua_push_session_id(L, _zklua_jute_get_long(&r));
+        _zklua_jute_push_buffer(L, &r);
+        /* older servers do not send it. */
+        lua_pushboolean(L, (r.pos < r.len) ? _zklua_jute_get_bool(&r) : 0);
     } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+        xid = _zklua_jute_get_int(&r);
+        lua_pushinteger(L, xid);
+        lua_pushnumber(L, (lua_Number)_zklua_jute_get_long(&r));
+        err = _zklua_jute_get_int(&r);
+        lua_pushinteger(L, err);
+        if (xid == ZKLUA_JUTE_WATCHER_XID) {
+            /* a watcher event: type, state and path. */
+            lua_pushinteger(L, _zklua_jute_get_int(&r));
+            lua_pushinteger(L, _zklua_jute_get_int(&r));
+            _zklua_jute_push_buffer(L, &r);
+        } else if (xid == ZKLUA_JUTE_PING_XID) {
+            /* nothing but the header. */
+        } else if (err == ZOK || (op == ZKLUA_JUTE_MULTI_OP && r.pos < r.len)) {
+            switch (op) {
+                case ZKLUA_JUTE_CREATE_OP:
+                case ZKLUA_JUTE_SYNC_OP:
+                    _zklua_jute_push_buffer(L, &r);
+                    break;
+                case ZKLUA_JUTE_EXISTS_OP:
+                case ZKLUA_JUTE_SETDATA_OP:
+                    _zklua_jute_push_stat(L, &r);
+                    break;
+                case ZKLUA_JUTE_GETDATA_OP:
+                    _zklua_jute_push_buffer(L, &r);
+                    _zklua_jute_push_stat(L, &r);
+                    break;
+                case ZKLUA_JUTE_GETCHILDREN_OP:
+                    _zklua_jute_push_strings(L, &r);
+                    break;
+                case ZKLUA_JUTE_GETCHILDREN2_OP:
+                    _zklua_jute_push_strings(L, &r);
+                    _zklua_jute_push_stat(L, &r);
+                    break;
+                case ZKLUA_JUTE_MULTI_OP:
+                    _zklua_jute_push_multi(L, &r);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    if (r.failed) {
+        lua_settop(L, top);
+        lua_pushnil(L);
+        lua_pushinteger(L, ZMARSHALLINGERROR);
+        return 2;
+    }
+    return lua_gettop(L) - top;
+}
+
+static const luaL_Reg zklua_jute_writer[] =
+{
+    {"__gc", zklua_jute_writer_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg zklua_jute[] =
+{
+    {"connect", zklua_jute_connect},
+    {"request", zklua_jute_request},
+    {"frame", zklua_jute_frame},
+    {"decode", zklua_jute_decode},
+    {NULL, NULL}
+};
+
+/**
+ * Adler-32 of @data@, the checksum of txnlog records.
+ **/
+static uint32_t _zklua_adler32(const unsigned char *data, size_t len)
+{
+    uint32_t a = 1, b = 0;
+    size_t n = 0;
+
+    while (len > 0) {
+        /* the largest run that can not overflow b. */
+        n = (len < 5552) ? len : 5552;
+        len -= n;
+        while (n-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * read a jute vector of ACLs into @acls@, freed by _zklua_free_acls
+ * even when the read fails.
+ **/
+static void _zklua_jute_get_acls(zklua_jute_reader_t *r, struct ACL_vector *acls)
+{
+    const char *scheme = NULL;
+    const char *id = NULL;
+    int32_t scheme_len = 0;
+    int32_t id_len = 0;
+    int32_t count = 0;
+    int32_t i;
+
+    acls->count = 0;
+    acls->data = NULL;
+    count = _zklua_jute_get_int(r);
+    if (count <= 0) return;
+    /* an ACL takes at least 12 bytes. */
+    if ((size_t)count > (r->len - r->pos) / 12) {
+        r->failed = 1;
+        return;
+    }
+    acls->data = (struct ACL *)calloc(count, sizeof(struct ACL));
+    if (acls->data == NULL) {
+        r->failed = 1;
+        return;
+    }
+    for (i = 0; i < count && !r->failed; ++i) {
+        acls->count = i + 1;
+        acls->data[i].perms = _zklua_jute_get_int(r);
+        scheme = _zklua_jute_get_buffer(r, &scheme_len);
+        id = _zklua_jute_get_buffer(r, &id_len);
+        acls->data[i].id.scheme = strndup((scheme != NULL) ? scheme : "", scheme_len);
+        acls->data[i].id.id = strndup((id != NULL) ? id : "", id_len);
+        if (acls->data[i].id.scheme == NULL || acls->data[i].id.id == NULL) {
+            r->failed = 1;
+        }
+    }
+}
+
+static int _zklua_reader_acl_cmp(const void *a, const void *b)
+{
+    int64_t x = ((const zklua_reader_acl_t *)a)->id;
+    int64_t y = ((const zklua_reader_acl_t *)b)->id;
+    return (x < y) ? -1 : (x > y);
+}
+
+/**
+ * the ACL that @id@ refers to in the ACL cache of a snapshot.
+ **/
+static const struct ACL_vector *_zklua_reader_acls(zklua_reader_t *reader,
+        int64_t id)
+{
+    zklua_reader_acl_t key;
+    zklua_reader_acl_t *acl = NULL;
+
+    if (id == ZKLUA_OPEN_ACL_ID) return &ZOO_OPEN_ACL_UNSAFE;
+    if (reader->nacls == 0) return NULL;
+    key.id = id;
+    acl = (zklua_reader_acl_t *)bsearch(&key, reader->acls, reader->nacls,
+            sizeof(zklua_reader_acl_t), _zklua_reader_acl_cmp);
+    return (acl != NULL) ? &acl->acls : NULL;
+}
+
+static zklua_reader_t *_zklua_reader_check(lua_State *L, int index)
+{
+    zklua_reader_t *reader = luaL_checkudata(L, index, ZKLUA_READER_METATABLE_NAME);
+    if (reader->map == NULL) luaL_error(L, "zookeeper file already closed.");
+    return reader;
+}
+
+/**
+ * map @filename@ and read its FileHeader. on failure an error message
+ * is pushed and NULL returned.
+ **/
+static zklua_reader_t *_zklua_reader_open(lua_State *L, const char *filename,
+        int32_t magic)
+{
+    struct stat st;
+    void *map = NULL;
+    int fd = -1;
+    zklua_reader_t *reader = NULL;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        lua_pushfstring(L, "unable to open the specified file %s.", filename);
+        return NULL;
+    }
+    /* magic, version and dbid. */
+    if (fstat(fd, &st) != 0 || st.st_size < 16) {
+        close(fd);
+        lua_pushfstring(L, "invalid zookeeper file %s.", filename);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lua_pushfstring(L, "unable to map the specified file %s.", filename);
+        return NULL;
+    }
+    /* records are read once, front to back. */
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    reader = (zklua_reader_t *)lua_newuserdata(L, sizeof(zklua_reader_t));
+    memset(reader, 0, sizeof(zklua_reader_t));
+    reader->map = (char *)map;
+    reader->map_len = st.st_size;
+    luaL_getmetatable(L, ZKLUA_READER_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    reader->r.data = (const unsigned char *)map;
+    reader->r.len = st.st_size;
+    reader->magic = _zklua_jute_get_int(&reader->r);
+    reader->version = _zklua_jute_get_int(&reader->r);
+    reader->dbid = _zklua_jute_get_long(&reader->r);
+    if (reader->magic != magic) {
+        lua_pushfstring(L, "invalid zookeeper file %s.", filename);
+        return NULL;
+    }
+    return reader;
+}
+
+/**
+ * opens a snapshot.* file of a zookeeper data dir, nodes are read by
+ * reader:next.
+ **/
+static int zklua_read_snapshot(lua_State *L)
+{
+    const char *filename = luaL_checkstring(L, 1);
+    zklua_reader_t *reader = NULL;
+    zklua_jute_reader_t *r = NULL;
+    int32_t count = 0;
+    int32_t i;
+
+    reader = _zklua_reader_open(L, filename, ZKLUA_SNAPSHOT_MAGIC);
+    if (reader == NULL) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+    r = &reader->r;
+    /* sessions: id and timeout, 12 bytes each. */
+    reader->sessions_pos = r->pos;
+    count = _zklua_jute_get_int(r);
+    if (count < 0 || (size_t)count > (r->len - r->pos) / 12) {
+        r->failed = 1;
+    } else {
+        r->pos += (size_t)count * 12;
+    }
+    /* the ACL cache. */
+    count = _zklua_jute_get_int(r);
+    if (count > 0 && !r->failed) {
+        if ((size_t)count > (r->len - r->pos) / 12) {
+            r->failed = 1;
+        } else {
+            reader->acls = (zklua_reader_acl_t *)calloc(count,
+                    sizeof(zklua_reader_acl_t));
+            if (reader->acls == NULL) {
+                return luaL_error(L, "out of memory when zklua trys to "
+                        "alloc an internal object.");
+            }
+        }
+        for (i = 0; i < count && !r->failed; ++i) {
+            reader->nacls = i + 1;
+            reader->acls[i].id = _zklua_jute_get_long(r);
+            _zklua_jute_get_acls(r, &reader->acls[i].acls);
+        }
+        qsort(reader->acls, reader->nacls, sizeof(zklua_reader_acl_t),
+                _zklua_reader_acl_cmp);
     }
+    if (r->failed) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "invalid snapshot file %s.", filename);
+        return 2;
+    }
+    return 1;
 }
 
-static int zklua_wget(lua_State *L)
+/**
+ * opens a log.* file of a zookeeper data dir, transactions are read by
+ * reader:next.
+ **/
+static int zklua_read_txnlog(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    char *buffer = NULL;
-    int buffer_len = 0;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    struct Stat stat;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
+    const char *filename = luaL_checkstring(L, 1);
+    zklua_reader_t *reader = _zklua_reader_open(L, filename, ZKLUA_TXNLOG_MAGIC);
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        ret = zoo_wget(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, buffer, &buffer_len, &stat);
-        lua_pushinteger(L, ret);
-        lua_pushlstring(L, buffer, buffer_len);
-        _zklua_build_stat(L, &stat);
-        return 3;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    if (reader == NULL) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
     }
+    return 1;
 }
 
-static int zklua_set(lua_State *L)
+/**
+ * push the next node of a snapshot: path, data, stat and ACL. the
+ * snapshot ends with the path "/", the root itself is stored as "".
+ **/
+static int _zklua_reader_next_node(lua_State *L, zklua_reader_t *reader)
 {
-    size_t path_len = 0, buffer_len = 0;
+    zklua_jute_reader_t *r = &reader->r;
+    struct Stat stat;
     const char *path = NULL;
-    const char *buffer = NULL;
-    int version = 0;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        buffer = luaL_checklstring(L, 3, &buffer_len);
-        version = luaL_checkint(L, 4);
-        ret = zoo_set(handle->zh, path, buffer, buffer_len, version);
-        lua_pushinteger(L, ret);
+    const char *data = NULL;
+    int32_t path_len = 0;
+    int32_t data_len = 0;
+    int64_t acl = 0;
+
+    path = _zklua_jute_get_buffer(r, &path_len);
+    if (path != NULL && path_len == 1 && path[0] == '/') {
+        reader->done = 1;
+        lua_pushnil(L);
         return 1;
+    }
+    data = _zklua_jute_get_buffer(r, &data_len);
+    acl = _zklua_jute_get_long(r);
+    /* StatPersisted, without dataLength and numChildren. */
+    stat.czxid = _zklua_jute_get_long(r);
+    stat.mzxid = _zklua_jute_get_long(r);
+    stat.ctime = _zklua_jute_get_long(r);
+    stat.mtime = _zklua_jute_get_long(r);
+    stat.version = _zklua_jute_get_int(r);
+    stat.cversion = _zklua_jute_get_int(r);
+    stat.aversion = _zklua_jute_get_int(r);
+    stat.ephemeralOwner = _zklua_jute_get_long(r);
+    stat.pzxid = _zklua_jute_get_long(r);
+    stat.dataLength = data_len;
+    stat.numChildren = 0;
+    if (r->failed) {
+        reader->done = 1;
+        lua_pushnil(L);
+        lua_pushliteral(L, "truncated snapshot.");
+        return 2;
+    }
+    if (path_len == 0) {
+        lua_pushliteral(L, "/");
     } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+        lua_pushlstring(L, path, path_len);
     }
+    lua_pushlstring(L, (data != NULL) ? data : "", data_len);
+    _zklua_build_stat(L, &stat);
+    /* children follow their parent, so their count is not known yet. */
+    lua_pushnil(L);
+    lua_setfield(L, -2, "numChildren");
+    _zklua_build_acls(L, _zklua_reader_acls(reader, acl));
+    return 4;
 }
 
-static int zklua_set2(lua_State *L)
+/**
+ * set the fields of the transaction of @type@ read from @r@ on the table
+ * on top of the stack.
+ **/
+static void _zklua_reader_push_txn(lua_State *L, zklua_jute_reader_t *r,
+        int type)
 {
-    size_t path_len = 0, buffer_len = 0;
-    const char *path = NULL;
-    const char *buffer = NULL;
-    int version = 0;
-    struct Stat stat;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        buffer = luaL_checklstring(L, 3, &buffer_len);
-        version = luaL_checkint(L, 4);
-        ret = zoo_set2(handle->zh, path, buffer, buffer_len, version, &stat);
-        lua_pushinteger(L, ret);
-        _zklua_build_stat(L, &stat);
-        return 2;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    struct ACL_vector acls;
+    zklua_jute_reader_t op;
+    const char *data = NULL;
+    int32_t len = 0;
+    int32_t count = 0;
+    int32_t i;
+
+    switch (type) {
+        case ZKLUA_JUTE_CREATE_OP:
+        case ZKLUA_JUTE_CREATE2_OP:
+        case ZKLUA_JUTE_CREATE_CONTAINER_OP:
+        case ZKLUA_JUTE_CREATE_TTL_OP:
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "path");
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "data");
+            _zklua_jute_get_acls(r, &acls);
+            _zklua_build_acls(L, &acls);
+            lua_setfield(L, -2, "acl");
+            _zklua_free_acls(&acls);
+            /* CreateContainerTxn and CreateTTLTxn have no ephemeral flag. */
+            if (type == ZKLUA_JUTE_CREATE_OP || type == ZKLUA_JUTE_CREATE2_OP) {
+                lua_pushboolean(L, _zklua_jute_get_bool(r));
+                lua_setfield(L, -2, "ephemeral");
+            }
+            lua_pushinteger(L, _zklua_jute_get_int(r));
+            lua_setfield(L, -2, "parent_cversion");
+            if (type == ZKLUA_JUTE_CREATE_TTL_OP) {
+                lua_pushnumber(L, (lua_Number)_zklua_jute_get_long(r));
+                lua_setfield(L, -2, "ttl");
+            }
+            break;
+        case ZKLUA_JUTE_DELETE_OP:
+        case ZKLUA_JUTE_DELETE_CONTAINER_OP:
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "path");
+            break;
+        case ZKLUA_JUTE_SETDATA_OP:
+        case ZKLUA_JUTE_RECONFIG_OP:
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "path");
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "data");
+            lua_pushinteger(L, _zklua_jute_get_int(r));
+            lua_setfield(L, -2, "version");
+            break;
+        case ZKLUA_JUTE_SETACL_OP:
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "path");
+            _zklua_jute_get_acls(r, &acls);
+            _zklua_build_acls(L, &acls);
+            lua_setfield(L, -2, "acl");
+            _zklua_free_acls(&acls);
+            lua_pushinteger(L, _zklua_jute_get_int(r));
+            lua_setfield(L, -2, "version");
+            break;
+        case ZKLUA_JUTE_CHECK_OP:
+            _zklua_jute_push_buffer(L, r);
+            lua_setfield(L, -2, "path");
+            lua_pushinteger(L, _zklua_jute_get_int(r));
+            lua_setfield(L, -2, "version");
+            break;
+        case ZKLUA_JUTE_CREATE_SESSION_OP:
+            lua_pushinteger(L, _zklua_jute_get_int(r));
+            lua_setfield(L, -2, "timeout");
+            break;
+        case ZKLUA_JUTE_ERROR_OP:
+            lua_pushinteger(L, _zklua_jute_get_int(r));
+            lua_setfield(L, -2, "err");
+            break;
+        case ZKLUA_JUTE_MULTI_OP:
+            /* a vector of {type, serialized transaction}. */
+            count = _zklua_jute_get_int(r);
+            lua_createtable(L, (count > 0) ? count : 0, 0);
+            for (i = 0; i < count && !r->failed; ++i) {
+                type = _zklua_jute_get_int(r);
+                data = _zklua_jute_get_buffer(r, &len);
+                memset(&op, 0, sizeof(op));
+                op.data = (const unsigned char *)data;
+                op.len = len;
+                lua_newtable(L);
+                lua_pushinteger(L, type);
+                lua_setfield(L, -2, "type");
+                _zklua_reader_push_txn(L, &op, type);
+                if (op.failed) r->failed = 1;
+                lua_rawseti(L, -2, i + 1);
+            }
+            lua_setfield(L, -2, "ops");
+            break;
+        default:
+            break;
     }
 }
 
-static int zklua_get_children(lua_State *L)
+/**
+ * push the next transaction of a txnlog as a table. a record is its
+ * Adler-32, its length, the TxnHeader and transaction, and
+ * ZKLUA_TXNLOG_EOR; a short or zero length record ends the log.
+ **/
+static int _zklua_reader_next_txn(lua_State *L, zklua_reader_t *reader)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    char *buffer = NULL;
-    int buffer_len = 0;
-    int watch = 0;
-    struct String_vector strings;
-    int ret = -1;
+    zklua_jute_reader_t *r = &reader->r;
+    zklua_jute_reader_t txn;
+    int64_t crc = 0;
+    int32_t len = 0;
+    int type = 0;
+    int top = lua_gettop(L);
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        ret = zoo_get_children(handle->zh, path, watch,  &strings);
-        lua_pushinteger(L, ret);
-        _zklua_build_string_vector(L, &strings);
+    if (r->len - r->pos < 12) {
+        reader->done = 1;
+        lua_pushnil(L);
+        return 1;
+    }
+    crc = _zklua_jute_get_long(r);
+    len = _zklua_jute_get_int(r);
+    if (len <= 0 || (size_t)len >= r->len - r->pos) {
+        /* preallocated zeros, or a record cut by a crash. */
+        reader->done = 1;
+        lua_pushnil(L);
+        return 1;
+    }
+    memset(&txn, 0, sizeof(txn));
+    txn.data = r->data + r->pos;
+    txn.len = len;
+    r->pos += len;
+    if (r->data[r->pos++] != ZKLUA_TXNLOG_EOR
+            || (uint64_t)crc != _zklua_adler32(txn.data, txn.len)) {
+        reader->done = 1;
+        lua_pushnil(L);
+        lua_pushliteral(L, "corrupt txnlog record.");
+        return 2;
+    }
+    lua_newtable(L);
+    _zklua_push_session_id(L, _zklua_jute_get_long(&txn));
+    lua_setfield(L, -2, "session_id");
+    lua_pushinteger(L, _zklua_jute_get_int(&txn));
+    lua_setfield(L, -2, "cxid");
+    lua_pushnumber(L, (lua_Number)_zklua_jute_get_long(&txn));
+    lua_setfield(L, -2, "zxid");
+    lua_pushnumber(L, (lua_Number)_zklua_jute_get_long(&txn));
+    lua_setfield(L, -2, "time");
+    type = _zklua_jute_get_int(&txn);
+    lua_pushinteger(L, type);
+    lua_setfield(L, -2, "type");
+    _zklua_reader_push_txn(L, &txn, type);
+    if (txn.failed) {
+        reader->done = 1;
+        lua_settop(L, top);
+        lua_pushnil(L);
+        lua_pushliteral(L, "corrupt txnlog record.");
         return 2;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
     }
+    return 1;
 }
 
-static int zklua_wget_children(lua_State *L)
+/**
+ * reader:next(), the next node of a snapshot (path, data, stat and ACL;
+ * stat has no numChildren) or the next transaction of a txnlog, nil at
+ * the end of the file, or nil and an error message.
+ **/
+static int zklua_reader_next(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    struct String_vector strings;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
+    zklua_reader_t *reader = _zklua_reader_check(L, 1);
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        ret = zoo_wget_children(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, &strings);
-        lua_pushinteger(L, ret);
-        _zklua_build_string_vector(L, &strings);
-        return 2;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    if (reader->done) {
+        lua_pushnil(L);
+        return 1;
     }
+    if (reader->magic == ZKLUA_SNAPSHOT_MAGIC) {
+        return _zklua_reader_next_node(L, reader);
+    }
+    return _zklua_reader_next_txn(L, reader);
 }
 
-static int zklua_get_children2(lua_State *L)
+/**
+ * reader:iter(), for use in a generic for.
+ **/
+static int zklua_reader_iter(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    char *buffer = NULL;
-    int buffer_len = 0;
-    int watch = 0;
-    struct String_vector strings;
-    struct Stat stat;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        watch = luaL_checkint(L, 3);
-        ret = zoo_get_children2(handle->zh, path, watch, &strings, &stat);
-        lua_pushinteger(L, ret);
-        _zklua_build_string_vector(L, &strings);
-        _zklua_build_stat(L, &stat);
-        return 3;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
-    }
+    _zklua_reader_check(L, 1);
+    lua_pushcfunction(L, zklua_reader_next);
+    lua_pushvalue(L, 1);
+    return 2;
 }
 
-static int zklua_wget_children2(lua_State *L)
+/**
+ * reader:header(), the kind of file ("snapshot" or "txnlog"), its
+ * version and its dbid.
+ **/
+static int zklua_reader_header(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *real_local_watcherctx = NULL;
-    const char *path = NULL;
-    zklua_local_watcher_context_t *wrapper = NULL;
-    struct String_vector strings;
-    struct Stat stat;
-    int ret = -1;
-    int zhref = 0;
-    int cbref = 0;
+    zklua_reader_t *reader = _zklua_reader_check(L, 1);
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    zhref = _zklua_ref(L, 1);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        cbref = _zklua_ref(L, 3);
-        real_local_watcherctx = luaL_checkstring(L, 4);
-        wrapper = _zklua_local_watcher_context_init(L,
-                (void *)real_local_watcherctx, zhref, cbref);
-        ret = zoo_wget_children2(handle->zh, path, local_watcher_dispatch,
-                (void *)wrapper, &strings, &stat);
-        lua_pushinteger(L, ret);
-        _zklua_build_string_vector(L, &strings);
-        _zklua_build_stat(L, &stat);
-        return 3;
+    if (reader->magic == ZKLUA_SNAPSHOT_MAGIC) {
+        lua_pushliteral(L, "snapshot");
     } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+        lua_pushliteral(L, "txnlog");
     }
+    lua_pushinteger(L, reader->version);
+    lua_pushnumber(L, (lua_Number)reader->dbid);
+    return 3;
 }
 
-static int zklua_get_acl(lua_State *L)
+/**
+ * reader:sessions(), the sessions of a snapshot as a table of session
+ * id to timeout.
+ **/
+static int zklua_reader_sessions(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    struct ACL_vector acl;
-    struct Stat stat;
-    int ret = -1;
-
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        ret = zoo_get_acl(handle->zh, path, &acl, &stat);
-        lua_pushinteger(L, ret);
-        _zklua_build_acls(L, &acl);
-        _zklua_build_stat(L, &stat);
-        return 3;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
+    zklua_reader_t *reader = _zklua_reader_check(L, 1);
+    zklua_jute_reader_t r;
+    int64_t session_id = 0;
+    int32_t timeout = 0;
+    int32_t count = 0;
+    int32_t i;
+
+    if (reader->magic != ZKLUA_SNAPSHOT_MAGIC) {
+        return luaL_error(L, "sessions are only stored in snapshots.");
+    }
+    r = reader->r;
+    r.pos = reader->sessions_pos;
+    r.failed = 0;
+    count = _zklua_jute_get_int(&r);
+    lua_createtable(L, 0, (count > 0) ? count : 0);
+    for (i = 0; i < count; ++i) {
+        session_id = _zklua_jute_get_long(&r);
+        timeout = _zklua_jute_get_int(&r);
+        if (r.failed) break;
+        _zklua_push_session_id(L, session_id);
+        lua_pushinteger(L, timeout);
+        lua_settable(L, -3);
     }
+    return 1;
 }
 
-static int zklua_set_acl(lua_State *L)
+/**
+ * reader:close(), unmaps the file.
+ **/
+static int zklua_reader_close(lua_State *L)
 {
-    size_t path_len = 0;
-    const char *path = NULL;
-    int version = 0;
-    struct ACL_vector acl;
-    struct Stat stat;
-    int ret = -1;
+    zklua_reader_t *reader = luaL_checkudata(L, 1, ZKLUA_READER_METATABLE_NAME);
+    int i;
 
-    zklua_handle_t *handle = luaL_checkudata(L, 1, ZKLUA_METATABLE_NAME);
-    if (_zklua_check_handle(L, handle)) {
-        path = luaL_checklstring(L, 2, &path_len);
-        version = luaL_checkint(L, 3);
-        _zklua_parse_acls(L, 4, &acl);
-        ret = zoo_set_acl(handle->zh, path, version, &acl);
-        lua_pushinteger(L, ret);
-        _zklua_free_acls(&acl);
-        return 1;
-    } else {
-        return luaL_error(L, "invalid zookeeper handle.");
-    }
+    if (reader->map == NULL) return 0;
+    for (i = 0; i < reader->nacls; ++i) _zklua_free_acls(&reader->acls[i].acls);
+    free(reader->acls);
+    reader->acls = NULL;
+    reader->nacls = 0;
+    munmap(reader->map, reader->map_len);
+    reader->map = NULL;
+    return 0;
 }
 
+static const luaL_Reg zklua_reader[] =
+{
+    {"next", zklua_reader_next},
+    {"iter", zklua_reader_iter},
+    {"header", zklua_reader_header},
+    {"sessions", zklua_reader_sessions},
+    {"close", zklua_reader_close},
+    {"__gc", zklua_reader_close},
+    {NULL, NULL}
+};
+
 static const luaL_Reg zklua[] =
 {
     {"init", zklua_init},
     {"close", zklua_close},
     {"client_id", zklua_client_id},
+    {"save_session", zklua_save_session},
+    {"load_session", zklua_load_session},
     {"recv_timeout", zklua_recv_timeout},
     {"get_context", zklua_get_context},
     {"set_watcher", zklua_set_watcher},
@@ -1705,6 +11188,34 @@ static const luaL_Reg zklua[] =
     {"get_children2", zklua_get_children2},
     {"get_acl", zklua_get_acl},
     {"set_acl", zklua_set_acl},
+    {"put_large", zklua_put_large},
+    {"get_large", zklua_get_large},
+    {"export_tree", zklua_export_tree},
+    {"import_tree", zklua_import_tree},
+    {"shm_create", zklua_shm_create},
+    {"shm_attach", zklua_shm_attach},
+    {"set_inflight_window", zklua_set_inflight_window},
+    {"inflight_stats", zklua_inflight_stats},
+    {"set_read_coalescing", zklua_set_read_coalescing},
+    {"set_write_combining", zklua_set_write_combining},
+    {"set_watch_coalescing", zklua_set_watch_coalescing},
+    {"set_timeout", zklua_set_timeout},
+    {"aclose", zklua_aclose},
+    {"close_all", zklua_close_all},
+    {"lock_manager", zklua_lock_manager},
+    {"election", zklua_election},
+    {"queue", zklua_queue},
+    {"barrier", zklua_barrier},
+    {"double_barrier", zklua_double_barrier},
+    {"update", zklua_update},
+    {"semaphore", zklua_semaphore},
+    {"discovery", zklua_discovery},
+    {"children_snapshot", zklua_children_snapshot},
+    {"acl", zklua_acl},
+    {"wait_all", zklua_wait_all},
+    {"wait_any", zklua_wait_any},
+    {"read_snapshot", zklua_read_snapshot},
+    {"read_txnlog", zklua_read_txnlog},
     {NULL, NULL}
 };
 
@@ -1712,8 +11223,49 @@ static const luaL_Reg zklua[] =
     lua_pushinteger(L, s);\
     lua_setfield(L, -2, #s);
 
+/**
+ * create the metatable @name@ whose methods are @methods@.
+ **/
+static void _zklua_register_class(lua_State *L, const char *name,
+        const luaL_Reg *methods)
+{
+    luaL_newmetatable(L, name);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM == 502
+    luaL_setfuncs(L, methods, 0);
+#else
+    luaL_register(L, NULL, methods);
+#endif
+    lua_pop(L, 1);
+}
+
 int luaopen_zklua(lua_State *L)
 {
+    _zklua_register_class(L, ZKLUA_TREE_METATABLE_NAME, zklua_tree);
+    _zklua_register_class(L, ZKLUA_SHM_METATABLE_NAME, zklua_shm);
+    _zklua_register_class(L, ZKLUA_CHILDREN_METATABLE_NAME,
+            zklua_children_methods);
+    _zklua_register_class(L, ZKLUA_SNAPSHOT_METATABLE_NAME,
+            zklua_snapshot_methods);
+    _zklua_register_class(L, ZKLUA_ACL_METATABLE_NAME, zklua_acl_methods);
+    _zklua_register_class(L, ZKLUA_CLOSER_METATABLE_NAME, zklua_closer);
+    _zklua_register_class(L, ZKLUA_LOCKS_METATABLE_NAME, zklua_locks);
+    _zklua_register_class(L, ZKLUA_ELECTION_METATABLE_NAME,
+            zklua_election_methods);
+    _zklua_register_class(L, ZKLUA_QUEUE_METATABLE_NAME, zklua_queue_methods);
+    _zklua_register_class(L, ZKLUA_BARRIER_METATABLE_NAME, zklua_barrier_methods);
+    _zklua_register_class(L, ZKLUA_DBARRIER_METATABLE_NAME,
+            zklua_dbarrier_methods);
+    _zklua_register_class(L, ZKLUA_SEMAPHORE_METATABLE_NAME,
+            zklua_semaphore_methods);
+    _zklua_register_class(L, ZKLUA_DISCOVERY_METATABLE_NAME,
+            zklua_discovery_methods);
+    _zklua_register_class(L, ZKLUA_FUTURE_METATABLE_NAME,
+            zklua_future_methods);
+    _zklua_register_class(L, ZKLUA_JUTE_METATABLE_NAME, zklua_jute_writer);
+    _zklua_register_class(L, ZKLUA_READER_METATABLE_NAME, zklua_reader);
+    pthread_once(&zklua_future_once, _zklua_future_init);
     luaL_newmetatable(L, ZKLUA_METATABLE_NAME);
 #if LUA_VERSION_NUM == 502
     luaL_newlib(L, zklua);
@@ -1727,6 +11279,14 @@ int luaopen_zklua(lua_State *L)
     lua_pushliteral (L, "0.1.2");
     lua_setfield(L, -2, "_VERSION");
 
+    lua_newtable(L);
+#if LUA_VERSION_NUM == 502
+    luaL_setfuncs(L, zklua_jute, 0);
+#else
+    luaL_register(L, NULL, zklua_jute);
+#endif
+    lua_setfield(L, -2, "jute");
+
     /**
      * register zookeeper constants in lua.
      **/
@@ -1769,6 +11329,13 @@ int luaopen_zklua(lua_State *L)
     zklua_register_constant(ZNOTHING);
     zklua_register_constant(ZSESSIONMOVED);
 
+    /**
+     * zklua errors.
+     **/
+    zklua_register_constant(ZKLUA_THROTTLED);
+    zklua_register_constant(ZKLUA_TIMEDOUT);
+    zklua_register_constant(ZKLUA_CANCELLED);
+
     /**
      * ACL Constants.
      **/
@@ -1798,6 +11365,16 @@ int luaopen_zklua(lua_State *L)
     zklua_register_constant(ZOO_EPHEMERAL);
     zklua_register_constant(ZOO_SEQUENCE);
 
+    /**
+     * ACL Constants, as parsed ACLs.
+     **/
+    _zklua_push_acl(L, &ZOO_OPEN_ACL_UNSAFE, 0);
+    lua_setfield(L, -2, "ZOO_OPEN_ACL_UNSAFE");
+    _zklua_push_acl(L, &ZOO_READ_ACL_UNSAFE, 0);
+    lua_setfield(L, -2, "ZOO_READ_ACL_UNSAFE");
+    _zklua_push_acl(L, &ZOO_CREATOR_ALL_ACL, 0);
+    lua_setfield(L, -2, "ZOO_CREATOR_ALL_ACL");
+
     /**
      * State Constants.
      **/
@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -28,15 +30,345 @@
 #include <zookeeper/zookeeper.h>
 
 #define ZKLUA_METATABLE_NAME "ZKLUA_HANDLE"
+#define ZKLUA_TREE_METATABLE_NAME "ZKLUA_TREE"
+#define ZKLUA_SHM_METATABLE_NAME "ZKLUA_SHM"
+#define ZKLUA_CHILDREN_METATABLE_NAME "ZKLUA_CHILDREN"
+#define ZKLUA_SNAPSHOT_METATABLE_NAME "ZKLUA_SNAPSHOT"
+#define ZKLUA_ACL_METATABLE_NAME "ZKLUA_ACL"
+#define ZKLUA_CLOSER_METATABLE_NAME "ZKLUA_CLOSER"
+#define ZKLUA_LOCKS_METATABLE_NAME "ZKLUA_LOCKS"
+#define ZKLUA_ELECTION_METATABLE_NAME "ZKLUA_ELECTION"
+#define ZKLUA_QUEUE_METATABLE_NAME "ZKLUA_QUEUE"
+#define ZKLUA_BARRIER_METATABLE_NAME "ZKLUA_BARRIER"
+#define ZKLUA_DBARRIER_METATABLE_NAME "ZKLUA_DBARRIER"
+#define ZKLUA_SEMAPHORE_METATABLE_NAME "ZKLUA_SEMAPHORE"
+#define ZKLUA_DISCOVERY_METATABLE_NAME "ZKLUA_DISCOVERY"
+#define ZKLUA_FUTURE_METATABLE_NAME "ZKLUA_FUTURE"
+#define ZKLUA_JUTE_METATABLE_NAME "ZKLUA_JUTE"
+#define ZKLUA_READER_METATABLE_NAME "ZKLUA_READER"
 #define ZKLUA_MAX_PATH_BUFFER_SIZE 1024
+#define ZKLUA_DEFAULT_BUFFER_SIZE 4096
+
+/**
+ * get_children slices of at most ZKLUA_CHILDREN_PARTIAL_SORT children
+ * are selected in one pass instead of sorting the whole listing.
+ **/
+#define ZKLUA_CHILDREN_PARTIAL_SORT 64
+
+/**
+ * chunked storage for values larger than the znode limit, see put_large.
+ **/
+#define ZKLUA_LARGE_MAGIC "zklua-large/1"
+#define ZKLUA_LARGE_DEFAULT_CHUNK_SIZE (512 * 1024)
+#define ZKLUA_LARGE_MAX_CHUNK_SIZE (1024 * 1024 - 1024)
+#define ZKLUA_LARGE_MAX_TOKEN_SIZE 64
+#define ZKLUA_LARGE_MAX_RETRIES 8
+
+/**
+ * session file written by save_session: magic, version, 3 reserved bytes,
+ * the big-endian 64-bit session id and the 16-byte password.
+ **/
+#define ZKLUA_SESSION_FILE_MAGIC "ZKLS"
+#define ZKLUA_SESSION_FILE_VERSION 1
+#define ZKLUA_SESSION_FILE_SIZE 32
+
+/**
+ * subtree snapshot written by export_tree: a zklua_tree_header_t, the
+ * zklua_tree_entry_t index sorted by path, then the paths (NUL terminated)
+ * and data. integers are stored in host byte order and byte_order tells
+ * a reader whether the file can be mapped as is.
+ **/
+#define ZKLUA_TREE_MAGIC "ZKLTREE"
+#define ZKLUA_TREE_VERSION 1
+#define ZKLUA_TREE_BYTE_ORDER 0x01020304
+#define ZKLUA_TREE_OVERLAY_BUCKETS 1024
+#define ZKLUA_TREE_SYNC_EXISTS 0
+#define ZKLUA_TREE_SYNC_GET 1
+#define ZKLUA_TREE_SYNC_CHILDREN 2
+
+/**
+ * shared-memory cache: a zklua_shm_header_t followed by nslots fixed-size
+ * slots (a zklua_shm_slot_t and slot_size bytes of data), found by open
+ * addressing on the path. only the owner writes, readers use the seqlock
+ * in each slot and never block the writer.
+ **/
+#define ZKLUA_SHM_MAGIC "ZKLSHM"
+#define ZKLUA_SHM_VERSION 1
+#define ZKLUA_SHM_MAX_PATH 256
+#define ZKLUA_SHM_DEFAULT_SLOTS 1024
+#define ZKLUA_SHM_DEFAULT_SLOT_SIZE 4096
+#define ZKLUA_SHM_SLOT_EMPTY 0
+#define ZKLUA_SHM_SLOT_LIVE 1
+#define ZKLUA_SHM_SLOT_DELETED 2
+
+/**
+ * adaptive in-flight window for async requests, see set_inflight_window.
+ **/
+#define ZKLUA_WINDOW_OFF 0
+#define ZKLUA_WINDOW_WAIT 1
+#define ZKLUA_WINDOW_FAIL 2
+#define ZKLUA_WINDOW_QUEUE 3
+#define ZKLUA_WINDOW_DEFAULT_INITIAL 64
+#define ZKLUA_WINDOW_DEFAULT_MIN 4
+#define ZKLUA_WINDOW_DEFAULT_MAX 1024
+#define ZKLUA_WINDOW_DEFAULT_TARGET_LATENCY 100
+#define ZKLUA_WINDOW_DEFAULT_QUEUE_SIZE 1024
+
+/**
+ * in-flight reads shared by identical async requests, see
+ * set_read_coalescing.
+ **/
+#define ZKLUA_FLIGHT_BUCKETS 256
+
+/**
+ * write combiner merging aset calls into multi-op batches, see
+ * set_write_combining.
+ **/
+#define ZKLUA_COMBINE_BUCKETS 256
+#define ZKLUA_COMBINE_DEFAULT_WINDOW 5
+#define ZKLUA_COMBINE_DEFAULT_MAX_BATCH 128
+
+/**
+ * watch event coalescing, see set_watch_coalescing. the window is in
+ * milliseconds.
+ **/
+#define ZKLUA_WATCH_COALESCE_BUCKETS 256
+#define ZKLUA_WATCH_COALESCE_DEFAULT_WINDOW 50
+
+/**
+ * lock manager, see lock_manager. lock nodes are ephemeral sequential
+ * children of root/name, shared holders use ZKLUA_LOCK_READ_PREFIX and
+ * every other node is exclusive. the wait for the predecessor is re-checked
+ * every ZKLUA_LOCK_POLL_INTERVAL milliseconds for session expiry.
+ *
+ * the recipe nodes (locks, semaphore leases, double barrier participants)
+ * are named <prefix><session id><serial>-<sequence> so that a create whose
+ * reply was lost can be found again. requests failing on a connection
+ * loss are retried every ZKLUA_LOCK_RETRY_INTERVAL milliseconds until the
+ * deadline of the caller, ZKLUA_LOCK_RELEASE_TIMEOUT milliseconds for a
+ * release on close or collection.
+ **/
+#define ZKLUA_LOCK_BUCKETS 1024
+#define ZKLUA_LOCK_PREFIX "lock-"
+#define ZKLUA_LOCK_READ_PREFIX "read-"
+#define ZKLUA_LOCK_WRITE_PREFIX "write-"
+#define ZKLUA_LOCK_POLL_INTERVAL 1000
+#define ZKLUA_LOCK_RETRY_INTERVAL 100
+#define ZKLUA_LOCK_RELEASE_TIMEOUT 1000
+#define ZKLUA_LOCK_TAG_SIZE 128
+
+/**
+ * leader election, see election. candidates are ephemeral sequential
+ * nodes named ZKLUA_ELECTION_PREFIX<session id><serial>- so that a
+ * candidate can find its node again after a create lost with the
+ * connection.
+ **/
+#define ZKLUA_ELECTION_PREFIX "n_"
+#define ZKLUA_ELECTION_IDLE 0
+#define ZKLUA_ELECTION_ENTERING 1
+#define ZKLUA_ELECTION_FOLLOWER 2
+#define ZKLUA_ELECTION_LEADER 3
+#define ZKLUA_ELECTION_EXPIRED 4
+
+/**
+ * distributed queue, see queue. items are persistent sequential children
+ * named ZKLUA_QUEUE_PREFIX<sequence>.
+ **/
+#define ZKLUA_QUEUE_PREFIX "qn-"
+
+/**
+ * double barrier, see double_barrier. participants are ephemeral
+ * sequential children named ZKLUA_BARRIER_PREFIX<sequence>, the last one
+ * in creates ZKLUA_BARRIER_READY and the last one out deletes it.
+ **/
+#define ZKLUA_BARRIER_PREFIX "p-"
+#define ZKLUA_BARRIER_READY "ready"
+
+/**
+ * counting semaphore, see semaphore. leases are ephemeral sequential
+ * children named ZKLUA_SEMAPHORE_PREFIX<expiry>-<sequence>, expiry being
+ * the wall clock time in milliseconds the lease ends at, 0 for none. a
+ * waiter that gets its permit stores ZKLUA_SEMAPHORE_HELD in its lease,
+ * which wakes the waiter right behind it.
+ **/
+#define ZKLUA_SEMAPHORE_PREFIX "lease-"
+#define ZKLUA_SEMAPHORE_HELD "held"
+
+/**
+ * service discovery, see discovery. endpoints are ephemeral sequential
+ * children of root/service named ZKLUA_DISCOVERY_PREFIX<sequence>, their
+ * data is "<weight>\n<payload>".
+ **/
+#define ZKLUA_DISCOVERY_PREFIX "ep-"
+#define ZKLUA_DISCOVERY_ROUND_ROBIN 0
+#define ZKLUA_DISCOVERY_WEIGHTED 1
+#define ZKLUA_DISCOVERY_LRU 2
+
+/**
+ * future states, see zklua_future_t.
+ **/
+#define ZKLUA_FUTURE_PENDING 0
+#define ZKLUA_FUTURE_DONE 1
+#define ZKLUA_FUTURE_CANCELLED 2
+
+/**
+ * jute wire protocol, see zklua.jute. opcodes and reserved xids of the
+ * zookeeper client protocol, every packet is framed by its length as a
+ * 4-byte big-endian integer.
+ **/
+#define ZKLUA_JUTE_ERROR_OP -1
+#define ZKLUA_JUTE_CREATE_OP 1
+#define ZKLUA_JUTE_DELETE_OP 2
+#define ZKLUA_JUTE_EXISTS_OP 3
+#define ZKLUA_JUTE_GETDATA_OP 4
+#define ZKLUA_JUTE_SETDATA_OP 5
+#define ZKLUA_JUTE_GETCHILDREN_OP 8
+#define ZKLUA_JUTE_SYNC_OP 9
+#define ZKLUA_JUTE_PING_OP 11
+#define ZKLUA_JUTE_GETCHILDREN2_OP 12
+#define ZKLUA_JUTE_CHECK_OP 13
+#define ZKLUA_JUTE_MULTI_OP 14
+#define ZKLUA_JUTE_CLOSE_OP -11
+#define ZKLUA_JUTE_SETACL_OP 7
+#define ZKLUA_JUTE_CREATE2_OP 15
+#define ZKLUA_JUTE_RECONFIG_OP 16
+#define ZKLUA_JUTE_CREATE_CONTAINER_OP 19
+#define ZKLUA_JUTE_DELETE_CONTAINER_OP 20
+#define ZKLUA_JUTE_CREATE_TTL_OP 21
+#define ZKLUA_JUTE_CREATE_SESSION_OP -10
+#define ZKLUA_JUTE_CONNECT_OP -100 /* not on the wire, the handshake */
+#define ZKLUA_JUTE_WATCHER_XID -1
+#define ZKLUA_JUTE_PING_XID -2
+#define ZKLUA_JUTE_PASSWD_LEN 16
+#define ZKLUA_JUTE_MAX_PACKET (4 * 1024 * 1024)
+
+/**
+ * files of a zookeeper data dir, see read_snapshot and read_txnlog. both
+ * start with a jute FileHeader: magic, version and dbid. txnlog records
+ * end with ZKLUA_TXNLOG_EOR, the zeros preallocated after the last one
+ * end the log.
+ **/
+#define ZKLUA_SNAPSHOT_MAGIC 0x5a4b534e /* "ZKSN" */
+#define ZKLUA_TXNLOG_MAGIC 0x5a4b4c47 /* "ZKLG" */
+#define ZKLUA_TXNLOG_EOR 0x42
+#define ZKLUA_OPEN_ACL_ID -1 /* acl cache id of the open unsafe ACL */
+
+/**
+ * optimistic updates, see update. conflicts are retried up to
+ * ZKLUA_UPDATE_RETRIES times after a random sleep of at most
+ * ZKLUA_UPDATE_BACKOFF * 2^attempt milliseconds, capped at
+ * ZKLUA_UPDATE_MAX_BACKOFF.
+ **/
+#define ZKLUA_UPDATE_RETRIES 16
+#define ZKLUA_UPDATE_BACKOFF 5
+#define ZKLUA_UPDATE_MAX_BACKOFF 500
+
+/**
+ * async request kinds, see zklua_request_t.
+ **/
+#define ZKLUA_OP_CREATE 0
+#define ZKLUA_OP_DELETE 1
+#define ZKLUA_OP_EXISTS 2
+#define ZKLUA_OP_WEXISTS 3
+#define ZKLUA_OP_GET 4
+#define ZKLUA_OP_WGET 5
+#define ZKLUA_OP_SET 6
+#define ZKLUA_OP_GET_CHILDREN 7
+#define ZKLUA_OP_WGET_CHILDREN 8
+#define ZKLUA_OP_GET_CHILDREN2 9
+#define ZKLUA_OP_WGET_CHILDREN2 10
+#define ZKLUA_OP_SYNC 11
+#define ZKLUA_OP_GET_ACL 12
+#define ZKLUA_OP_SET_ACL 13
+
+/**
+ * zklua specific error codes, kept clear of the ZOO_ERRORS range.
+ **/
+enum ZKLUA_ERRORS {
+    ZKLUA_THROTTLED = -1001, /*!< request rejected by the in-flight window */
+    ZKLUA_TIMEDOUT = -1002, /*!< no reply before the handle deadline */
+    ZKLUA_CANCELLED = -1003 /*!< future cancelled before its result */
+};
 
 typedef struct zklua_handle_s zklua_handle_t;
 typedef struct zklua_global_watcher_context_s zklua_global_watcher_context_t;
 typedef struct zklua_local_watcher_context_s zklua_local_watcher_context_t;
 typedef struct zklua_completion_data_s zklua_completion_data_t;
+typedef struct zklua_batch_s zklua_batch_t;
+typedef struct zklua_children_s zklua_children_t;
+typedef struct zklua_children_options_s zklua_children_options_t;
+typedef struct zklua_acl_s zklua_acl_t;
+typedef struct zklua_future_s zklua_future_t;
+typedef struct zklua_then_s zklua_then_t;
+typedef struct zklua_jute_writer_s zklua_jute_writer_t;
+typedef struct zklua_jute_reader_s zklua_jute_reader_t;
+typedef struct zklua_reader_acl_s zklua_reader_acl_t;
+typedef struct zklua_reader_s zklua_reader_t;
+typedef struct zklua_snapshot_entry_s zklua_snapshot_entry_t;
+typedef struct zklua_snapshot_s zklua_snapshot_t;
+typedef struct zklua_large_manifest_s zklua_large_manifest_t;
+typedef struct zklua_large_chunk_s zklua_large_chunk_t;
+typedef struct zklua_tree_header_s zklua_tree_header_t;
+typedef struct zklua_tree_stat_s zklua_tree_stat_t;
+typedef struct zklua_tree_entry_s zklua_tree_entry_t;
+typedef struct zklua_tree_node_s zklua_tree_node_t;
+typedef struct zklua_tree_overlay_s zklua_tree_overlay_t;
+typedef struct zklua_tree_sync_s zklua_tree_sync_t;
+typedef struct zklua_tree_s zklua_tree_t;
+typedef struct zklua_shm_header_s zklua_shm_header_t;
+typedef struct zklua_shm_slot_s zklua_shm_slot_t;
+typedef struct zklua_shm_s zklua_shm_t;
+typedef struct zklua_shm_handle_s zklua_shm_handle_t;
+typedef struct zklua_shm_watch_s zklua_shm_watch_t;
+typedef struct zklua_request_s zklua_request_t;
+typedef struct zklua_window_s zklua_window_t;
+typedef struct zklua_flight_s zklua_flight_t;
+typedef struct zklua_flights_s zklua_flights_t;
+typedef struct zklua_combine_entry_s zklua_combine_entry_t;
+typedef struct zklua_combine_batch_s zklua_combine_batch_t;
+typedef struct zklua_combiner_s zklua_combiner_t;
+typedef struct zklua_watch_event_s zklua_watch_event_t;
+typedef struct zklua_watch_coalescer_s zklua_watch_coalescer_t;
+typedef struct zklua_call_s zklua_call_t;
+typedef struct zklua_close_s zklua_close_t;
+typedef struct zklua_closer_s zklua_closer_t;
+typedef struct zklua_lock_s zklua_lock_t;
+typedef struct zklua_lock_wait_s zklua_lock_wait_t;
+typedef struct zklua_lockmgr_s zklua_lockmgr_t;
+typedef struct zklua_lock_step_s zklua_lock_step_t;
+typedef struct zklua_waits_s zklua_waits_t;
+typedef struct zklua_lost_node_s zklua_lost_node_t;
+typedef struct zklua_sub_s zklua_sub_t;
+typedef struct zklua_election_s zklua_election_t;
+typedef struct zklua_election_handle_s zklua_election_handle_t;
+typedef struct zklua_queue_s zklua_queue_t;
+typedef struct zklua_queue_handle_s zklua_queue_handle_t;
+typedef struct zklua_queue_item_s zklua_queue_item_t;
+typedef struct zklua_barrier_s zklua_barrier_t;
+typedef struct zklua_dbarrier_s zklua_dbarrier_t;
+typedef struct zklua_dbarrier_step_s zklua_dbarrier_step_t;
+typedef struct zklua_semaphore_s zklua_semaphore_t;
+typedef struct zklua_endpoint_s zklua_endpoint_t;
+typedef struct zklua_service_s zklua_service_t;
+typedef struct zklua_endpoint_event_s zklua_endpoint_event_t;
+typedef struct zklua_discovery_s zklua_discovery_t;
+typedef struct zklua_discovery_handle_s zklua_discovery_handle_t;
+
+/**
+ * picks the node a lock node at @self@ in @children@ (sorted by sequence)
+ * has to wait for, or returns -1 if it holds the lock.
+ **/
+typedef int (*zklua_lock_pred_t)(char **children, int count, int self);
 
 struct zklua_handle_s {
     zhandle_t *zh;
+    zklua_window_t *window;
+    zklua_flights_t *flights;
+    zklua_combiner_t *combiner;
+    int timeout; /* deadline of sync calls in milliseconds, 0 for none */
+    zklua_close_t *close;
+    zklua_waits_t *waits;
+    zklua_watch_coalescer_t *watch_coalescer;
 };
 
 struct zklua_global_watcher_context_s {
@@ -49,11 +381,736 @@ struct zklua_local_watcher_context_s {
     void *context;
     int zhref;
     int cbref;
+    const void *fn; /* the lua watcher, events are merged by it */
+    zklua_watch_coalescer_t *coalescer; /* set if coalescing was on */
+    zklua_local_watcher_context_t *next; /* merged into the same event */
+};
+
+/**
+ * a children listing handed to lua as is, see the lazy option of
+ * get_children.
+ **/
+struct zklua_children_s {
+    struct String_vector strings;
+};
+
+/**
+ * the options of get_children, checked before the request is sent. the
+ * strings belong to the option table.
+ **/
+struct zklua_children_options_s {
+    const char *prefix;
+    const char *pattern;
+    int (*cmp)(const void *, const void *);
+    int offset;
+    int limit;
+    int lazy;
+};
+
+/**
+ * an ACL parsed once, see acl. the built-in ones wrap the vectors of the
+ * zookeeper client and do not own them.
+ **/
+struct zklua_acl_s {
+    struct ACL_vector acls;
+    int owned;
+};
+
+/**
+ * result of an async call. the results stay on the stack of L, a lua
+ * thread anchored by threadref while the future userdata lives; state,
+ * thens and the stack slots are guarded by one lock shared by all
+ * futures. refs counts the userdata, the pending completion and the then
+ * entry that settles it.
+ **/
+struct zklua_future_s {
+    int refs;
+    int state;
+    lua_State *L; /* NULL once the userdata is collected */
+    int threadref;
+    int base; /* results are L[base .. base + nresults - 1] */
+    int nresults;
+    zklua_then_t *thens;
+};
+
+/**
+ * callback registered by future:then, it settles @future@.
+ **/
+struct zklua_then_s {
+    int fnref;
+    zklua_future_t *future;
+    zklua_then_t *next;
+};
+
+/**
+ * a packet being encoded, a userdata so that its buffer is freed when a
+ * lua error interrupts the encoding.
+ **/
+struct zklua_jute_writer_s {
+    char *buffer;
+    size_t len;
+    size_t size;
+    int failed; /* out of memory */
+};
+
+/**
+ * a packet being decoded, failed is set once a read goes past its end.
+ **/
+struct zklua_jute_reader_s {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    int failed;
+};
+
+/**
+ * an entry of the ACL cache of a snapshot, nodes refer to it by id.
+ **/
+struct zklua_reader_acl_s {
+    int64_t id;
+    struct ACL_vector acls;
+};
+
+/**
+ * a mapped snapshot or txnlog file, read one record at a time by
+ * reader:next; r is positioned on the next record.
+ **/
+struct zklua_reader_s {
+    char *map;
+    size_t map_len;
+    int32_t magic;
+    int32_t version;
+    int64_t dbid;
+    zklua_jute_reader_t r;
+    size_t sessions_pos; /* snapshot sessions, see reader:sessions */
+    zklua_reader_acl_t *acls; /* sorted by id */
+    int nacls;
+    int done;
+};
+
+struct zklua_snapshot_entry_s {
+    char *name; /* NULL for a free slot */
+    unsigned int hash;
+    int seen;
+};
+
+/**
+ * a children listing kept as an open addressing hash set, see
+ * children_snapshot.
+ **/
+struct zklua_snapshot_s {
+    zklua_snapshot_entry_t *entries;
+    int capacity; /* a power of 2 */
+    int count;
 };
 
 struct zklua_completion_data_s {
     lua_State *L;
-    const void *data;
+    char *data;
+    int threadref; /* keeps L alive until the completion is called */
+    zklua_handle_t *handle; /* set while the request holds a window slot */
+    uint64_t start_us;
+    zklua_flight_t *flight; /* set on the request that carries a flight */
+    zklua_completion_data_t *next; /* requests served by the same reply */
+    zklua_close_t *close; /* close state of the handle that sent it */
+    zklua_snapshot_t *snapshot; /* diffed by the reply, anchored on L */
+    zklua_future_t *future; /* settled with the completion arguments */
+};
+
+/**
+ * an async request as seen by the in-flight window. requests built by
+ * the zklua.a* functions borrow path, value and acl from the lua stack,
+ * queued copies own them.
+ **/
+struct zklua_request_s {
+    int op;
+    const char *path;
+    const char *value;
+    int value_len;
+    int version;
+    int watch;
+    int flags;
+    const struct ACL_vector *acl;
+    void *watcherctx;
+    zklua_completion_data_t *cdata;
+    zklua_request_t *next;
+};
+
+/**
+ * a read in flight, identical reads issued meanwhile are chained on
+ * waiters and get the reply of the first one. a write to the path
+ * detaches the flight so that later reads go to the server again.
+ **/
+struct zklua_flight_s {
+    int op;
+    int watch;
+    char *path;
+    uint32_t hash;
+    int detached;
+    zklua_flights_t *flights;
+    zklua_completion_data_t *waiters;
+    zklua_completion_data_t *waiters_tail;
+    zklua_flight_t *next;
+};
+
+struct zklua_flights_s {
+    pthread_mutex_t lock;
+    int enabled;
+    uint64_t coalesced;
+    zklua_flight_t *buckets[ZKLUA_FLIGHT_BUCKETS];
+};
+
+/**
+ * the last value written to a path during the flush window, every
+ * caller that wrote the path meanwhile is chained on waiters.
+ **/
+struct zklua_combine_entry_s {
+    char *path;
+    unsigned int hash;
+    char *value;
+    int value_len;
+    zhandle_t *zh;
+    int rc; /* why the client refused it, on the failed list */
+    zklua_completion_data_t *waiters;
+    zklua_completion_data_t *waiters_tail;
+    zklua_combine_entry_t *next; /* bucket chain */
+    zklua_combine_entry_t *dirty_next; /* flush order, or failed list */
+};
+
+/**
+ * entries flushed together by one zoo_amulti, kept until it completes.
+ **/
+struct zklua_combine_batch_s {
+    int count;
+    zklua_combine_entry_t **entries;
+    zoo_op_t *ops;
+    zoo_op_result_t *results;
+    struct Stat *stats;
+};
+
+/**
+ * watch events of the same path, type and lua watcher merged within the
+ * window that started with the first of them. the first watcher context
+ * delivers the event with count, the others are only released.
+ **/
+struct zklua_watch_event_s {
+    char *path;
+    unsigned int hash;
+    int type;
+    int state; /* of the last event */
+    int count;
+    uint64_t first_us;
+    zklua_local_watcher_context_t *wrappers;
+    zklua_local_watcher_context_t *wrappers_tail;
+    zklua_watch_event_t *next; /* in its bucket while pending */
+    zklua_watch_event_t *order_next; /* in the pending or due list */
+};
+
+/**
+ * the flusher thread moves the events whose window ended to the due list
+ * and sends an aexists whose completion, on the completion thread,
+ * delivers them: lua is only called where watchers are. refs counts the
+ * handle, the watcher contexts bound to it and the kick in flight.
+ **/
+struct zklua_watch_coalescer_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int refs;
+    int stop;
+    int kicking;
+    zhandle_t *zh;
+    zklua_close_t *close;
+    uint64_t window_us;
+    zklua_watch_event_t *pending_head;
+    zklua_watch_event_t *pending_tail;
+    zklua_watch_event_t *due_head;
+    zklua_watch_event_t *due_tail;
+    zklua_watch_event_t *buckets[ZKLUA_WATCH_COALESCE_BUCKETS];
+};
+
+/**
+ * the flusher sends under lock, so a request on a path issued after its
+ * pending write has been flushed can not overtake it. writes the client
+ * refused wait on the failed list: lua is never called from the flusher,
+ * an aexists completion reports them on the completion thread.
+ **/
+struct zklua_combiner_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    zhandle_t *zh;
+    uint64_t window_us;
+    int max_batch;
+    uint64_t first_dirty_us;
+    uint64_t retry_us; /* next attempt to report the failed list */
+    zklua_combine_entry_t *dirty_head;
+    zklua_combine_entry_t *dirty_tail;
+    zklua_combine_entry_t *failed_head;
+    zklua_combine_entry_t *failed_tail;
+    zklua_combine_entry_t *buckets[ZKLUA_COMBINE_BUCKETS];
+};
+
+/**
+ * a sync call made through the async API so that it can give up at a
+ * deadline. the caller and the completion share it: whichever is last
+ * frees it, a call abandoned by the caller drops the late reply.
+ **/
+struct zklua_call_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int abandoned;
+    int rc;
+    char *value;
+    int value_len;
+    struct Stat stat;
+    struct String_vector strings;
+    struct ACL_vector acl;
+};
+
+/**
+ * close state of a handle, allocated with it. once aclose sets closing,
+ * completions no longer call into lua: they are dropped from the closing
+ * thread and the lua threads they anchor are released later, on the lua
+ * side, from orphans.
+ **/
+struct zklua_close_s {
+    pthread_mutex_t lock;
+    int closing;
+    int started;
+    int done;
+    int rc;
+    pthread_t thread;
+    zhandle_t *zh;
+    zklua_window_t *window;
+    zklua_flights_t *flights;
+    zklua_waits_t *waits;
+    int *orphans;
+    int norphans;
+    int orphans_size;
+};
+
+/**
+ * userdata returned by aclose.
+ **/
+struct zklua_closer_s {
+    zklua_close_t *close;
+};
+
+/**
+ * a named lock held through a lock manager.
+ **/
+struct zklua_lock_s {
+    char *name;
+    unsigned int hash;
+    char *node; /* full path of the lock node */
+    zklua_lock_t *next;
+};
+
+/**
+ * a node watched on behalf of a waiter.
+ **/
+struct zklua_lock_wait_s {
+    const char *path;
+    int fired;
+    zklua_lock_wait_t *next;
+};
+
+/**
+ * recipe nodes of the session whose create or delete could not be
+ * settled before the deadline: the children of dir starting with prefix
+ * are deleted before the next acquire.
+ **/
+struct zklua_lost_node_s {
+    char *dir;
+    char *prefix;
+    zklua_lost_node_t *next;
+};
+
+/**
+ * waits of a session. every lock node watch of the session uses the same
+ * watcher function and this table as context, which lives as long as the
+ * session so that a late event never finds it freed.
+ **/
+struct zklua_waits_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    zklua_lock_wait_t *head;
+    zklua_sub_t *subs;
+    zklua_lost_node_t *lost;
+};
+
+/**
+ * a recipe object told about every event of the shared watcher, embedded
+ * first in the object. it is refcounted: the subscription, each request
+ * in flight and each notify in progress hold a reference, release frees
+ * the object when the last one goes away.
+ **/
+struct zklua_sub_s {
+    int refs;
+    void (*notify)(zklua_sub_t *sub, int type, int state, const char *path);
+    void (*release)(zklua_sub_t *sub);
+    zklua_sub_t *next;
+};
+
+struct zklua_lockmgr_s {
+    zklua_handle_t *handle;
+    int handleref;
+    char *root;
+    int count;
+    zklua_lock_t *buckets[ZKLUA_LOCK_BUCKETS];
+};
+
+/**
+ * replies of the create and get_children requests pipelined by an
+ * acquire attempt.
+ **/
+struct zklua_lock_step_s {
+    zklua_batch_t *batch;
+    int create_rc;
+    char *node;
+    int children_rc;
+    struct String_vector children;
+};
+
+/**
+ * state of an election candidate. lua callbacks are only called while
+ * the userdata is alive (closed unset), from the completion thread.
+ **/
+struct zklua_election_s {
+    zklua_sub_t sub;
+    pthread_mutex_t lock;
+    lua_State *L;
+    int threadref;
+    int gainref;
+    int lossref;
+    int handleref;
+    zklua_handle_t *handle;
+    zhandle_t *zh;
+    zklua_waits_t *waits;
+    char *path;
+    char *prefix;
+    char *data;
+    int data_len;
+    char *node; /* full path of our candidate node */
+    char *watched; /* node whose deletion triggers a new check */
+    int state;
+    int leader;
+    int closed;
+};
+
+struct zklua_election_handle_s {
+    zklua_election_t *election;
+};
+
+/**
+ * a queue and its cached item list, kept until the children watch
+ * set with it fires (dirty).
+ **/
+struct zklua_queue_s {
+    zklua_sub_t sub;
+    zklua_handle_t *handle;
+    int handleref;
+    zklua_waits_t *waits;
+    char *path;
+    int dirty;
+    struct String_vector items; /* sorted by sequence */
+    int next; /* first item not taken yet */
+};
+
+struct zklua_queue_handle_s {
+    zklua_queue_t *queue;
+};
+
+/**
+ * one item of a pipelined offer or take.
+ **/
+struct zklua_queue_item_s {
+    zklua_batch_t *batch;
+    int rc;
+    char *value;
+    int value_len;
+    int delete_rc;
+};
+
+struct zklua_barrier_s {
+    zklua_handle_t *handle;
+    int handleref;
+    char *path;
+};
+
+struct zklua_dbarrier_s {
+    zklua_handle_t *handle;
+    int handleref;
+    char *path;
+    char *ready;
+    int size;
+    char *node; /* our participant node, between enter and leave */
+};
+
+/**
+ * replies of the three requests pipelined by double barrier enter and
+ * leave: our node, the barrier stat and the ready node (watched).
+ **/
+struct zklua_dbarrier_step_s {
+    zklua_batch_t *batch;
+    int node_rc;
+    char *node;
+    int stat_rc;
+    struct Stat stat;
+    int ready_rc;
+};
+
+/**
+ * a semaphore of @permits@ permits. the leases it holds are kept as
+ * zklua_lock_t, named by their node.
+ **/
+struct zklua_semaphore_s {
+    zklua_handle_t *handle;
+    int handleref;
+    char *path;
+    int permits;
+    int count;
+    zklua_lock_t *leases;
+};
+
+/**
+ * a cached endpoint, its payload is a lua string anchored in
+ * LUA_REGISTRYINDEX so that picking it allocates nothing.
+ **/
+struct zklua_endpoint_s {
+    char *name;
+    int ref;
+    int weight;
+    uint64_t used; /* tick of the last pick, for lru */
+    int dirty; /* its data watch fired */
+    /* reply of the pipelined get refreshing the endpoint */
+    int rc;
+    char *value;
+    int value_len;
+    zklua_batch_t *batch;
+};
+
+/**
+ * an endpoint whose data watch fired, pushed by the watcher thread, which
+ * never touches the endpoint array, and marked dirty by the lua thread.
+ **/
+struct zklua_endpoint_event_s {
+    char *name;
+    zklua_endpoint_event_t *next;
+};
+
+/**
+ * endpoints of a service. services are only added, at the head of the
+ * list, so the watcher thread can walk it without a lock; it only sets
+ * the dirty flags and pushes endpoint events, the cache is refreshed by
+ * the lua thread on next use. all_dirty, set on session events, refetches
+ * every endpoint.
+ **/
+struct zklua_service_s {
+    char *name;
+    char *path;
+    unsigned int hash;
+    int list_dirty;
+    int all_dirty;
+    zklua_endpoint_event_t *events;
+    zklua_endpoint_t *endpoints;
+    int count;
+    int total_weight;
+    unsigned int next; /* round robin cursor */
+    zklua_service_t *next_service;
+};
+
+struct zklua_discovery_s {
+    zklua_sub_t sub;
+    zklua_handle_t *handle;
+    int handleref;
+    zklua_waits_t *waits;
+    char *root;
+    zklua_service_t *services;
+    unsigned int seed;
+    uint64_t tick;
+};
+
+struct zklua_discovery_handle_s {
+    zklua_discovery_t *discovery;
+};
+
+/**
+ * AIMD window bounding the async requests in flight on a handle: it grows
+ * by one per window of completions and halves, at most once per round
+ * trip, when the smoothed latency goes over target or the connection
+ * is lost.
+ **/
+struct zklua_window_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int mode;
+    double limit;
+    double min;
+    double max;
+    uint64_t target_us;
+    int inflight;
+    zklua_request_t *queue_head;
+    zklua_request_t *queue_tail;
+    int queued;
+    int queue_size;
+    uint64_t latency_us; /* EWMA of the completion latency */
+    uint64_t last_decrease_us;
+    uint64_t throttled;
+    pthread_t completion_thread;
+    int has_completion_thread;
+};
+
+/**
+ * wait group used to block on a batch of pipelined async requests
+ * whose completions are handled in C.
+ **/
+struct zklua_batch_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+};
+
+struct zklua_large_manifest_s {
+    char token[ZKLUA_LARGE_MAX_TOKEN_SIZE];
+    int nchunks;
+    int chunk_size;
+    int total_len;
+};
+
+struct zklua_large_chunk_s {
+    zklua_batch_t *batch;
+    char *buffer;
+    int expect_len;
+    int rc;
+};
+
+struct zklua_tree_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t file_size;
+};
+
+struct zklua_tree_stat_s {
+    int64_t czxid;
+    int64_t mzxid;
+    int64_t ctime;
+    int64_t mtime;
+    int64_t ephemeral_owner;
+    int64_t pzxid;
+    int32_t version;
+    int32_t cversion;
+    int32_t aversion;
+    int32_t data_length;
+    int32_t num_children;
+    int32_t reserved;
+};
+
+struct zklua_tree_entry_s {
+    uint64_t path_offset;
+    uint64_t data_offset;
+    uint32_t path_len;
+    int32_t data_len;   /* -1 if the node has no data. */
+    zklua_tree_stat_t stat;
+};
+
+/**
+ * a node fetched by export_tree.
+ **/
+struct zklua_tree_node_s {
+    zklua_batch_t *batch;
+    char *path;
+    char *data;
+    int data_len;
+    struct Stat stat;
+    int data_rc;
+    int children_rc;
+    struct String_vector children;
+};
+
+/**
+ * a node that changed on the server since the snapshot was exported.
+ **/
+struct zklua_tree_overlay_s {
+    char *path;
+    char *data;
+    int data_len;
+    struct Stat stat;
+    int deleted;
+    int added;
+    zklua_tree_overlay_t *next;
+};
+
+/**
+ * context of a background catch-up request issued by tree:sync().
+ **/
+struct zklua_tree_sync_s {
+    zklua_tree_t *tree;
+    const zklua_tree_entry_t *entry;    /* NULL for nodes not in the file. */
+    char *path;
+};
+
+struct zklua_tree_s {
+    char *map;
+    size_t map_len;
+    const zklua_tree_header_t *header;
+    const zklua_tree_entry_t *entries;
+    zhandle_t *zh;
+    zklua_batch_t sync;
+    pthread_mutex_t lock;
+    zklua_tree_overlay_t *overlay[ZKLUA_TREE_OVERLAY_BUCKETS];
+};
+
+struct zklua_shm_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_size;
+    uint32_t reserved;
+    uint64_t generation;    /* bumped on every publish. */
+};
+
+struct zklua_shm_slot_s {
+    uint32_t seq;           /* odd while the owner writes the slot. */
+    uint32_t state;
+    int64_t version;
+    uint32_t path_len;
+    uint32_t data_len;
+    char path[ZKLUA_SHM_MAX_PATH];
+    /* slot_size bytes of data follow. */
+};
+
+/**
+ * a mapped cache region, shared by the lua object and the watches of the
+ * owner, freed when the last of them lets it go.
+ **/
+struct zklua_shm_s {
+    char *map;
+    size_t map_len;
+    zklua_shm_header_t *header;
+    size_t stride;
+    int owner;
+    int closed;
+    int refs;
+    char *scratch;          /* reader copy of a slot, slot_size bytes. */
+    pthread_mutex_t lock;
+};
+
+struct zklua_shm_handle_s {
+    zklua_shm_t *shm;
+};
+
+struct zklua_shm_watch_s {
+    zklua_shm_t *shm;
+    zhandle_t *zh;
+    char *path;
 };
 
 void watcher_dispatch(zhandle_t *zh, int type, int state,